@@ -0,0 +1,138 @@
+#!/bin/bash
+
+# Throughput benchmark: runs the analyzer over synthetic inputs for every
+# combination of line length distribution, mode, queue size, chain length and
+# plugin mix, and prints one CSV row per run (progress goes to stderr):
+#   ./bench.sh > bench_output.txt
+#
+# The matrix is set with environment variables (the defaults in brackets):
+#   BENCH_LINES          Lines per input [200000]
+#   BENCH_DISTS          Line length distributions, see gen_input [fixed:64 uniform:1:512 exp:128]
+#   BENCH_MODES          threads (a thread per plugin) and/or pool (--pool) [threads pool]
+#   BENCH_QUEUE_SIZES    Queue sizes [1 16 256]
+#   BENCH_CHAIN_LENGTHS  Number of plugins in the chain, the last one is always logger [1 4 8]
+#   BENCH_MIXES          name=plugin,plugin,... the plugins before logger are taken
+#                        from the list in turn [pure=uppercaser,rotator,flipper mixed=uppercaser,expander,flipper]
+#   BENCH_RUNS           Runs of every combination [3]
+#   BENCH_INPUT          stdin (piped through the reader thread) or file (--input) [stdin]
+#   BENCH_PLACEMENTS     none (the kernel places the threads), auto or a CPU list (--cpus) [none]
+#
+# Columns: lines_per_s and mb_per_s are input lines and bytes per wall clock
+# second, cpu_util is user+sys CPU time over wall time (2.0 = two cores busy).
+# e2e_p50_us and e2e_p99_us are the end to end latency from the --stats report,
+# latency_tracking_ns is what the latency tracking costs per line and plugin
+# (measured by the analyzer in the same run), so its share of a run is about
+# latency_tracking_ns * lines * chain_length / (user_s + sys_s)
+
+set -e
+
+# Colors for output
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+NC='\033[0m' # No Color
+
+print_status()
+{
+    echo -e "${GREEN}[BENCH]${NC} $1" >&2
+}
+print_error()
+{
+    echo -e "${RED}[ERROR]${NC} $1" >&2
+}
+
+lines="${BENCH_LINES:-200000}"
+dists="${BENCH_DISTS:-fixed:64 uniform:1:512 exp:128}"
+modes="${BENCH_MODES:-threads pool}"
+queueSizes="${BENCH_QUEUE_SIZES:-1 16 256}"
+chainLengths="${BENCH_CHAIN_LENGTHS:-1 4 8}"
+mixes="${BENCH_MIXES:-pure=uppercaser,rotator,flipper mixed=uppercaser,expander,flipper}"
+runs="${BENCH_RUNS:-3}"
+inputMode="${BENCH_INPUT:-stdin}"
+placements="${BENCH_PLACEMENTS:-none}"
+
+if ! ./build.sh bench >&2; then
+    print_error "Build failed"
+    exit 1
+fi
+
+workDir=$(mktemp -d)
+trap 'rm -rf "$workDir"' EXIT
+
+# The chain for a mix and a length: length-1 plugins from the mix in turn, then logger
+buildChain() {
+    local mixPlugins="$1"
+    local length="$2"
+    local list
+    IFS=',' read -r -a list <<< "$mixPlugins"
+    local chain=""
+    for ((i=0; i<length-1; i++)); do
+        chain="$chain ${list[$((i % ${#list[@]}))]}"
+    done
+    chain="$chain logger"
+    echo "${chain# }"
+}
+
+echo "dist,lines,bytes,mode,placement,queue_size,chain_length,mix,chain,run,wall_s,user_s,sys_s,lines_per_s,mb_per_s,cpu_util,e2e_p50_us,e2e_p99_us,latency_tracking_ns"
+
+TIMEFORMAT='%R %U %S'
+for dist in $dists; do
+    inputFile="$workDir/input.txt"
+    ./output/gen_input --lines "$lines" --dist "$dist" --seed 1 > "$inputFile"
+
+    # Payload bytes, without the newlines and <END>
+    bytes=$(( $(wc -c < "$inputFile") - lines - 6 ))
+    print_status "Input $dist: $lines lines, $bytes bytes"
+
+    for combination in $(for m in $modes; do for p in $placements; do echo "$m/$p"; done; done); do
+        mode="${combination%%/*}"
+        placement="${combination#*/}"
+        modeOption=""
+        if [ "$mode" = "pool" ]; then
+            modeOption="--pool"
+        fi
+        if [ "$placement" != "none" ]; then
+            modeOption="$modeOption --cpus=$placement"
+        fi
+        inputOption=""
+        if [ "$inputMode" = "file" ]; then
+            inputOption="--input $inputFile"
+        fi
+
+        for queueSize in $queueSizes; do
+            for chainLength in $chainLengths; do
+                for mix in $mixes; do
+                    mixName="${mix%%=*}"
+                    chain=$(buildChain "${mix#*=}" "$chainLength")
+
+                    for ((run=1; run<=runs; run++)); do
+                        statsFile="$workDir/stats.txt"
+                        timeFile="$workDir/time.txt"
+                        exitCode=0
+                        { time ./output/analyzer $modeOption $inputOption --stats "$queueSize" $chain \
+                            < "$inputFile" > /dev/null 2> "$statsFile" ; } 2> "$timeFile" || exitCode=$?
+                        if [ $exitCode -ne 0 ]; then
+                            print_error "$mode q=$queueSize chain=\"$chain\" failed with exit code $exitCode"
+                            continue
+                        fi
+
+                        read -r wall user sys < "$timeFile"
+                        overhead=$(sed -n 's/.*tracking costs about \([0-9]*\)ns.*/\1/p' "$statsFile")
+                        read -r p50 p99 <<< "$(awk '$2 == "pipeline" && $3 == "end_to_end" { print $5, $7 }' "$statsFile")"
+
+                        awk -v dist="$dist" -v lines="$lines" -v bytes="$bytes" -v mode="$mode" -v placement="$placement" \
+                            -v queueSize="$queueSize" -v chainLength="$chainLength" -v mix="$mixName" \
+                            -v chain="${chain// /+}" -v run="$run" -v wall="$wall" -v user="$user" -v sys="$sys" \
+                            -v p50="$p50" -v p99="$p99" -v overhead="$overhead" 'BEGIN {
+                            if (wall <= 0) { wall = 0.001 }
+                            printf "%s,%d,%d,%s,%s,%d,%d,%s,%s,%d,%.3f,%.3f,%.3f,%.0f,%.2f,%.2f,%s,%s,%s\n",
+                                dist, lines, bytes, mode, placement, queueSize, chainLength, mix, chain, run,
+                                wall, user, sys, lines / wall, bytes / wall / 1e6, (user + sys) / wall,
+                                p50, p99, overhead
+                        }'
+                    done
+                    print_status "$dist $mode $placement q=$queueSize $chain: done"
+                done
+            done
+        done
+    done
+done
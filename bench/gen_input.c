@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+// Writes a synthetic input for the analyzer: random lowercase lines (so no
+// line can ever be <END>) with lengths from a given distribution, then <END>
+//
+// Usage: gen_input [--lines N | --bytes N] [--dist SPEC] [--seed N]
+//   --lines N    Number of lines (default 100000)
+//   --bytes N    Write lines until about N bytes were written instead
+//   --dist SPEC  Line lengths: fixed:L, uniform:MIN:MAX or exp:MEAN
+//                (exponential, capped at 64 times the mean). Default fixed:64
+//   --seed N     Seed of the random generator, the same seed gives the same input
+
+// Distributions of the line lengths
+#define DistFixed 0
+#define DistUniform 1
+#define DistExponential 2
+
+static int dist = DistFixed;
+static long distA = 64;
+static long distB = 0;
+
+// Small and fast, good enough for test data (xorshift64*)
+static uint64_t randomState = 88172645463325252ull;
+
+static uint64_t NextRandom (void) {
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return randomState * 2685821657736338717ull;
+}
+
+// Uniform in [0, 1)
+static double NextUnit (void) {
+    return (NextRandom() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static long NextLength (void) {
+    if (dist == DistUniform) {
+        return distA + (long)(NextRandom() % (uint64_t)(distB - distA + 1));
+    }
+    if (dist == DistExponential) {
+        long length = (long)(-log(1.0 - NextUnit()) * (double)distA);
+        return length < 64 * distA ? length : 64 * distA;
+    }
+    return distA;
+}
+
+static int ParseDist (const char* spec) {
+    char* end;
+    if (strncmp(spec, "fixed:", 6) == 0) {
+        dist = DistFixed;
+        distA = strtol(spec + 6, &end, 10);
+        return (spec[6] == '\0' || *end != '\0' || distA < 0) ? -1 : 0;
+    }
+    if (strncmp(spec, "uniform:", 8) == 0) {
+        dist = DistUniform;
+        distA = strtol(spec + 8, &end, 10);
+        if (spec[8] == '\0' || *end != ':' || distA < 0) {
+            return -1;
+        }
+        const char* max = end + 1;
+        distB = strtol(max, &end, 10);
+        return (*max == '\0' || *end != '\0' || distB < distA) ? -1 : 0;
+    }
+    if (strncmp(spec, "exp:", 4) == 0) {
+        dist = DistExponential;
+        distA = strtol(spec + 4, &end, 10);
+        return (spec[4] == '\0' || *end != '\0' || distA <= 0) ? -1 : 0;
+    }
+    return -1;
+}
+
+static void PrintUsage (void) {
+    fprintf(stderr, "Usage: gen_input [--lines N | --bytes N] [--dist fixed:L|uniform:MIN:MAX|exp:MEAN] [--seed N]\n");
+}
+
+int main (int argc, char* argv[]) {
+    long long lines = 100000;
+    long long bytes = -1;
+
+    for (int i=1; i<argc; i++) {
+        if (i + 1 >= argc) {
+            PrintUsage();
+            return 1;
+        }
+        if (strcmp(argv[i], "--lines") == 0) {
+            lines = atoll(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--bytes") == 0) {
+            bytes = atoll(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--dist") == 0) {
+            if (ParseDist(argv[++i]) != 0) {
+                fprintf(stderr, "Error, invalid distribution %s\n", argv[i]);
+                PrintUsage();
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--seed") == 0) {
+            randomState ^= strtoull(argv[++i], NULL, 10) * 0x9E3779B97F4A7C15ull;
+            if (randomState == 0) {
+                randomState = 1;
+            }
+        }
+        else {
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    // Lines are built in one buffer and written with big fwrites
+    size_t maxLength = dist == DistExponential ? 64 * (size_t)distA : (size_t)(dist == DistUniform ? distB : distA);
+    char* line = malloc(maxLength + 1);
+    if (line == NULL) {
+        fprintf(stderr, "Error, couldnt allocate the line buffer\n");
+        return 1;
+    }
+    static char outputBuffer[1 << 20];
+    setvbuf(stdout, outputBuffer, _IOFBF, sizeof(outputBuffer));
+
+    long long written = 0;
+    for (long long i=0; bytes >= 0 ? written < bytes : i < lines; i++) {
+        long length = NextLength();
+        for (long j=0; j<length; j++) {
+            line[j] = 'a' + (char)(NextRandom() % 26);
+        }
+        line[length] = '\n';
+        fwrite(line, 1, (size_t)length + 1, stdout);
+        written += length + 1;
+    }
+    fputs("<END>\n", stdout);
+
+    free(line);
+    return fflush(stdout) == 0 ? 0 : 1;
+}
@@ -29,7 +29,7 @@ mkdir -p output
 print_status "Output dir sucessfuly created"
 
 # Compile main app
-gcc -o output/analyzer main.c -ldl -lpthread || {
+gcc -o output/analyzer main.c plugins/sync/pool.c plugins/sync/monitor.c plugins/sync/print_order.c plugins/sync/scheduler.c plugins/text/text_kernels.c plugins/metrics/latency_histogram.c -ldl -lpthread || {
     print_error "Error, couldnt compile main app"
     exit 1
 }
@@ -58,6 +58,11 @@ for pluginName in $pluginList; do
         plugins/plugin_common.c \
         plugins/sync/monitor.c \
         plugins/sync/consumer_producer.c \
+        plugins/sync/pool.c \
+        plugins/sync/output_sink.c \
+        plugins/sync/print_order.c \
+        plugins/text/text_kernels.c \
+        plugins/metrics/latency_histogram.c \
         -ldl -lpthread || {
         print_error "Error, couldnt build the plugin: $pluginName"
         exit 1
@@ -66,4 +71,22 @@ for pluginName in $pluginList; do
     print_status "Sucessfully built plugin: $pluginName"
 done
 
+# ./build.sh bench also builds the tools of the benchmark (bench.sh)
+if [ "$1" = "bench" ]; then
+    gcc -O2 -o output/gen_input bench/gen_input.c -lm || {
+        print_error "Error, couldnt build the benchmark input generator"
+        exit 1
+    }
+    gcc -O2 -o output/monitor_bench plugins/sync/monitor_bench.c plugins/sync/monitor.c -lpthread || {
+        print_error "Error, couldnt build the monitor microbenchmarks"
+        exit 1
+    }
+    gcc -O2 -o output/consumer_producer_bench plugins/sync/consumer_producer_bench.c \
+        plugins/sync/consumer_producer.c plugins/sync/monitor.c -lpthread || {
+        print_error "Error, couldnt build the queue microbenchmarks"
+        exit 1
+    }
+    print_status "Sucessfully built the benchmark tools"
+fi
+
 print_status "Sucessfuly built the app :)"
\ No newline at end of file
@@ -1,23 +1,86 @@
 #define _GNU_SOURCE
 #include "plugins/plugin_sdk.h"
+#include "plugins/sync/pool.h"
+#include "plugins/sync/scheduler.h"
+#include "plugins/sync/output_sink.h"
+#include "plugins/text/text_kernels.h"
+#include "plugins/metrics/latency_histogram.h"
 #include <stdio.h>
 #include <dlfcn.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-// Assumption from assignment:
-// No input line exceeds 1024 characters
-// Thus: 1024 chars + 1 newline + 1 null terminator = 1026
-// this is for step 5: reading input
-#define MaximalLineLength 1026
+// Step 5: the input is read in chunks of this size (the buffer grows when a
+// single line doesnt fit), and handed to the first plugin this many lines at a time
+#define InputChunkSize (1 << 20)
+#define InputBatchSize 64
+
+// Pool mode: most messages a stage task takes from its inbox in one run
+#define StageBatchSize 64
 
 // Type definitions for the struct introduced in the assignment
 typedef const char* (*plugin_init_func_t)(int);
 typedef const char* (*plugin_fini_func_t)(void);
 typedef const char* (*plugin_place_work_func_t)(const char*);
 typedef void (*plugin_attach_func_t)(const char* (*)(const char*));
+typedef const char* (*plugin_place_work_owned_func_t)(char*, size_t, message_release_t);
+typedef const char* (*plugin_place_work_batch_func_t)(const message_t*, int);
+typedef void (*plugin_attach_batch_func_t)(plugin_place_work_batch_func_t);
 typedef const char* (*plugin_wait_finished_func_t)(void);
 typedef const char* (*plugin_get_name_func_t)(void);
+typedef void (*plugin_set_inline_func_t)(void);
+typedef void (*plugin_set_replicas_func_t)(int);
+typedef void (*plugin_set_flush_policy_func_t)(size_t, size_t, long);
+typedef void (*plugin_set_queue_budget_func_t)(consumer_producer_budget_t*);
+typedef void (*plugin_set_print_order_func_t)(print_order_t*, int);
+typedef const char* (*plugin_process_message_func_t)(message_t*, message_t*);
+typedef const char* (*plugin_attach_fused_func_t)(const plugin_process_message_func_t*, int);
+typedef const char* (*plugin_get_stats_func_t)(plugin_stats_t*);
+typedef const char* (*plugin_get_latency_func_t)(latency_histogram_t*, latency_histogram_t*, latency_histogram_t*);
+
+// SDK version 2, the same functions for one instance of a plugin (see plugins/plugin_instance.h)
+typedef plugin_instance_t* (*plugin_create_func_t)(void);
+typedef void (*plugin_destroy_func_t)(plugin_instance_t*);
+typedef const char* (*plugin_instance_init_func_t)(plugin_instance_t*, int);
+typedef const char* (*plugin_instance_fini_func_t)(plugin_instance_t*);
+typedef void (*plugin_instance_attach_batch_func_t)(plugin_instance_t*, plugin_instance_place_work_batch_t, plugin_instance_t*);
+typedef const char* (*plugin_instance_attach_fused_func_t)(plugin_instance_t*, const plugin_fused_stage_t*, int);
+typedef const char* (*plugin_instance_process_message_func_t)(plugin_instance_t*, message_t*, message_t*);
+typedef const char* (*plugin_instance_wait_finished_func_t)(plugin_instance_t*);
+typedef void (*plugin_instance_set_inline_func_t)(plugin_instance_t*);
+typedef void (*plugin_instance_set_replicas_func_t)(plugin_instance_t*, int);
+typedef void (*plugin_instance_set_queue_budget_func_t)(plugin_instance_t*, consumer_producer_budget_t*);
+typedef void (*plugin_instance_set_print_order_func_t)(plugin_instance_t*, print_order_t*, int);
+typedef const char* (*plugin_instance_get_stats_func_t)(plugin_instance_t*, plugin_stats_t*);
+typedef const char* (*plugin_instance_get_latency_func_t)(plugin_instance_t*, latency_histogram_t*, latency_histogram_t*,
+    latency_histogram_t*);
+
+// The instance functions of a plugin, all of them are there or none
+typedef struct {
+    plugin_destroy_func_t destroy;
+    plugin_instance_init_func_t init;
+    plugin_instance_fini_func_t fini;
+    plugin_instance_place_work_batch_t place_work_batch;
+    plugin_instance_attach_batch_func_t attach_batch;
+    plugin_instance_attach_fused_func_t attach_fused;
+    plugin_instance_process_message_func_t process_message;
+    plugin_instance_wait_finished_func_t wait_finished;
+    plugin_instance_set_inline_func_t set_inline;
+    plugin_instance_set_replicas_func_t set_replicas;
+    plugin_instance_set_queue_budget_func_t set_queue_budget;
+    plugin_instance_get_stats_func_t get_stats;
+    plugin_instance_get_latency_func_t get_latency;
+    plugin_instance_set_print_order_func_t set_print_order; // Optional, NULL if the plugin doesnt have it
+} plugin_instance_api_t;
 
 // Plugin data sruct from assignment
 typedef struct {
@@ -26,6 +89,35 @@ typedef struct {
     plugin_place_work_func_t place_work;
     plugin_attach_func_t attach;
     plugin_wait_finished_func_t wait_finished;
+    plugin_place_work_owned_func_t place_work_owned; // Optional, NULL if the plugin doesnt have it
+    plugin_place_work_batch_func_t place_work_batch; // Optional, NULL if the plugin doesnt have it
+    plugin_attach_batch_func_t attach_batch; // Optional, NULL if the plugin doesnt have it
+    plugin_set_inline_func_t set_inline; // Optional, NULL if the plugin doesnt have it
+    plugin_set_replicas_func_t set_replicas; // Optional, NULL if the plugin doesnt have it
+    plugin_set_flush_policy_func_t set_flush_policy; // Optional, NULL if the plugin doesnt have it
+    plugin_set_queue_budget_func_t set_queue_budget; // Optional, NULL if the plugin doesnt have it
+    plugin_set_print_order_func_t set_print_order; // Optional, NULL if the plugin doesnt have it
+    plugin_process_message_func_t process_message; // Optional, NULL if the plugin doesnt have it
+    plugin_attach_fused_func_t attach_fused; // Optional, NULL if the plugin doesnt have it
+    plugin_get_stats_func_t get_stats; // Optional, NULL if the plugin doesnt have it
+    plugin_get_latency_func_t get_latency; // Optional, NULL if the plugin doesnt have it
+    int pure; // The plugin exports plugin_pure_transform (no output, no state)
+    int orderedOutput; // The plugin exports plugin_ordered_output (prints through a print order)
+    int printsInOrder; // It got a print order, so it passes every line on before it prints the next
+    int fused; // Runs inline on the thread of the plugin before it (stage fusion)
+    int replicas; // Number of consumer threads (name@N on the command line), 1 by default
+    int queueSize; // Size of the plugin's queue (name:N on the command line), queue_size by default
+    plugin_instance_t* instance; // What the plugin runs as (SDK version 2), NULL for an old plugin
+    plugin_instance_api_t api; // The functions instance is used with
+    int* successors; // The stages that get this plugin's output (more than one is a fan-out)
+    int numSuccessors; // 0 for the end of the chain (or of a branch)
+    int predecessor; // The stage this plugin gets its messages from, if it is only one
+    int* predecessors; // The stages it gets its messages from (InputReaderStage for the reader)
+    int numPredecessors; // More than one is a fan-in, they take turns with mergeLock
+    pthread_mutex_t mergeLock; // Fan-in: the stages before it put their messages in one at a time
+    int mergeEnds; // Fan-in: how many of the stages before it sent <END> already
+    int* mergeBarriers; // Fan-in: barriers that came from each of predecessors
+    int mergeBarriersPassed; // Fan-in: barriers passed on, each once it came from all of them
     char* name;
     void* handle;
 } plugin_handle_t;
@@ -35,13 +127,183 @@ static plugin_handle_t* plugins = NULL;
 static int numPlugins = 0;
 static int sizeQueue = 0;
 
+// Stage fusion: consecutive pure plugins run on the thread of the plugin
+// before them instead of each getting a thread and a queue (on by default)
+static int fuseStages = 1;
+
+// Pool mode: instead of a thread per plugin, every plugin is a task on a pool
+// of worker threads. 0 = thread per plugin, -1 = one worker per CPU, N = N workers
+static int poolWorkers = 0;
+
+// --adaptive-queues[=N]: every plugin's queue starts at its size and grows or
+// shrinks on its own, all the queues together have at most N slots
+#define DefaultQueueBudget 65536
+static int adaptiveQueues = 0;
+static consumer_producer_budget_t queueBudget = { DefaultQueueBudget, 0 };
+
+// --cpus=auto|LIST: the threads are pinned to CPUs in chain order, the input reader
+// to the first one and every plugin thread to the next ones, so neighbouring stages
+// sit next to each other (auto fills one NUMA node before the next). A plugin is
+// initialized on its own CPU, so whatever it allocates there (queue ring, output
+// buffers) comes from that CPU's node (first touch) and its threads inherit the CPU
+static const char* placementSpec = NULL;
+static int* placementCpus = NULL;
+static int numPlacementCpus = 0;
+static int nextPlacementCpu = 0;
+
+// --flush=SPEC: when plugins with an output sink (logger) write their buffered output
+static int flushPolicyGiven = 0;
+static size_t flushMaxBytes = OUTPUT_SINK_DEFAULT_BYTES;
+static size_t flushMaxLines = OUTPUT_SINK_DEFAULT_LINES;
+static long flushMaxDelayMs = OUTPUT_SINK_DEFAULT_DELAY_MS;
+
+// The plugins that print (logger, typewriter) of one plain stretch of the chain
+// keep their output in order with a print order each, so it reads as if every
+// one of them printed a line before passing it on. A stretch ends at { , } and
+// at the shards, the stages on both sides of them dont see the same lines
+static print_order_t* printOrders = NULL;
+static int numPrintOrders = 0;
+
+// --shards=K and --shard-key=SPEC: K copies of the chain (without its last plugin,
+// which merges them) run side by side. Every line goes to the copy its key hashes
+// to, so the lines of one key keep their order. The key is the whole line, its
+// first N bytes (prefix:N) or its Nth field (field:N, split at spaces and tabs,
+// or at C with field:N:C)
+#define ShardKeyLine 0
+#define ShardKeyPrefix 1
+#define ShardKeyField 2
+static int shardCount = 1;
+static int shardKeyKind = ShardKeyLine;
+static size_t shardKeyArg = 0; // Length of the prefix, or number of the field (from 1)
+static char shardKeySeparator = '\0'; // Field separator, '\0' for spaces and tabs
+
+// --input FILE: the file is mapped into memory and the lines are passed on as
+// read only views into it, instead of reading stdin
+static const char* inputFileName = NULL;
+static char* inputMapping = NULL;
+static size_t inputMappingSize = 0;
+
+// A line that is exactly <END> ends the input (--no-end-line makes it a line like
+// any other, then only the end of the input does). It is turned into an end of
+// stream message right here, no stage ever looks at the payload for it
+static int endLineEnds = 1;
+
+// SIGUSR2 asks for a flush: the signal thread sets flushRequested and wakes the
+// input reader through readerWake, which sends a flush message after the lines so far
+static int flushRequested = 0;
+static int readerWake[2] = { -1, -1 };
+
+// --barrier-every=N: the input reader sends a barrier after every N lines (0 for none)
+static int barrierEvery = 0;
+static int linesSinceBarrier = 0; // Only the reader thread counts them
+
+// --stats[=FORMAT] and --stats-file=PATH: the per stage counters are printed on
+// SIGUSR1, and at shutdown when --stats is given. To stderr, or written to PATH
+// (through a temporary file and a rename, so a reader never sees half a report)
+#define StatsFormatTable 0
+#define StatsFormatPrometheus 1
+static int statsAtShutdown = 0;
+static int statsFormat = StatsFormatTable;
+static const char* statsFileName = NULL;
+static pthread_t statsThread;
+static int statsThreadStarted = 0;
+static int statsStopping = 0;
+
+// Topology ({ A , B } in the plugin list): the branches A and B get every
+// message of the stage before the { (fan-out, they share one read only buffer)
+// and the plugin after the } gets the messages of all of them (fan-in).
+// The input reader sends to readerSuccessors, each plugin to its successors,
+// a plain chain is plugin i to plugin i + 1
+#define InputReaderStage -1
+static int* readerSuccessors = NULL;
+static int numReaderSuccessors = 0;
+
+// While parsing: the stages whose output goes to the next plugin in the list
+typedef struct {
+    int* stages;
+    int count;
+} TopologyTails;
+
+// While parsing: an open {, with the tails every branch starts from, and the
+// ends of the branches so far (all of them feed the plugin after the })
+typedef struct {
+    TopologyTails entry;
+    TopologyTails ends;
+    int branchStart; // Number of plugins before the branch, so an empty branch is seen
+} TopologyGroup;
+static TopologyGroup* topologyGroups = NULL;
+static int numTopologyGroups = 0;
+
+// Pool mode: one stage per plugin, the inbox holds the messages waiting for it
+typedef struct {
+    scheduler_task_t task; // First, so the task pointer is the stage pointer
+    int index; // Which plugin this stage runs
+    pthread_mutex_t inboxLock; // Protects everything below
+    message_t* inbox; // Ring of waiting messages, grows when full
+    size_t inboxSize; // Slots in the ring
+    size_t inboxHead; // Oldest waiting message
+    size_t inboxCount; // Number of waiting messages
+    int scheduled; // The task was submitted and didnt finish yet, so it runs at most once at a time
+    size_t inboxHighWater; // Most messages that ever waited in the inbox at once (for the stats)
+    latency_histogram_t queueWait; // How long messages waited in the inbox (the plugin has no queue here)
+} PipelineStage;
+
+static PipelineStage* stages = NULL;
+static scheduler_t scheduler;
+
+// Pool mode: messages between the reader and the end of the chain.
+// The reader waits when there are too many, that bounds all the inboxes together
+static int inFlight = 0;
+static int inFlightLimit = 0;
+static monitor_t inFlightMonitor; // Signaled when a message leaves the chain
+static monitor_t pipelineDoneMonitor; // Signaled when <END> left the last stage
+static latency_histogram_t poolEndToEnd; // From the input reader to the end of the last stage
+
 // Print usage
 void PrintUsageMessage () {
-    printf("Usage: ./analyzer <queue_size> <plugin1> <plugin2> ... <pluginN>\n");
+    printf("Usage: ./analyzer [--no-fuse] [--pool[=N]] [--input FILE] [--no-end-line] [--flush=SPEC] [--barrier-every=N] [--stats[=FMT]] [--stats-file=PATH] [--adaptive-queues[=N]] [--cpus=auto|LIST] [--shards=K] [--shard-key=SPEC] <queue_size> <plugin1> <plugin2> ... <pluginN>\n");
     printf("\n");
     printf("Arguments:\n");
+    printf("  --no-fuse     Give every plugin its own thread (by default consecutive\n");
+    printf("                pure plugins run together on one thread)\n");
+    printf("  --pool[=N]    Run the plugins as tasks on N worker threads (default: one\n");
+    printf("                per CPU) instead of a thread per plugin\n");
+    printf("  --input FILE  Read the lines from FILE (mapped into memory, the lines are\n");
+    printf("                not copied) instead of stdin. The end of the file ends the input\n");
+    printf("  --no-end-line A line that reads <END> is a line like any other, only the end\n");
+    printf("                of the input ends it\n");
+    printf("  --flush=SPEC  When logger writes its buffered output: a comma separated list\n");
+    printf("                of bytes:N, lines:N and ms:N (0 turns one off). The default is\n");
+    printf("                bytes:65536,ms:10, lines:1 writes every line right away.\n");
+    printf("                SIGUSR2 writes out everything up to the last line read\n");
+    printf("  --barrier-every=N\n");
+    printf("                Send a barrier after every N lines: like a flush, but a plugin\n");
+    printf("                after a } passes it on only once it came from every branch\n");
+    printf("  --stats[=FMT] Print the counters of every plugin at shutdown (they are always\n");
+    printf("                printed on SIGUSR1). FMT is table (default) or prom (Prometheus)\n");
+    printf("  --stats-file=PATH\n");
+    printf("                Write the counters to PATH instead of stderr\n");
+    printf("  --adaptive-queues[=N]\n");
+    printf("                Let every queue grow while it keeps filling up and shrink back\n");
+    printf("                when it stays mostly empty, all of them together hold at most\n");
+    printf("                N items (default 65536)\n");
+    printf("  --cpus=auto|LIST\n");
+    printf("                Pin the input reader and then every plugin thread, in chain\n");
+    printf("                order, to the CPUs in LIST (like 0-3,8) or picked one NUMA node\n");
+    printf("                after the other (auto). With --pool the workers use those CPUs\n");
+    printf("  --shards=K    Run K copies of the chain, all but the last plugin, side by side\n");
+    printf("                and every line in the copy its key hashes to (the last plugin\n");
+    printf("                gets the lines of all of them). Lines with the same key keep\n");
+    printf("                their order\n");
+    printf("  --shard-key=SPEC\n");
+    printf("                The key of a line: line (default), prefix:N (the first N bytes)\n");
+    printf("                or field:N (the Nth field, split at spaces or at C with field:N:C)\n");
     printf("  queue_size    Maximum number of items in each plugin's queue\n");
     printf("  plugin1..N    Names of plugins to load (without .so extension)\n");
+    printf("                add @N to run N threads of a pure plugin (e.g. expander@4)\n");
+    printf("                add :N to give the plugin a queue of size N (e.g. logger:256)\n");
+    printf("                { A , B } sends every line to both branches A and B, the plugin\n");
+    printf("                after the } gets the lines of all of them (e.g. { rotator , flipper } logger)\n");
     printf("\n");
     printf("Available plugins:\n");
     printf("  logger        - Logs all strings that pass through\n");
@@ -58,8 +320,397 @@ void PrintUsageMessage () {
     printf("  echo '<END>' | ./analyzer 20 uppercaser rotator logger\n");
 }
 
+// Step 1 (--flush=SPEC): set the limits given in spec, returns 0 or -1 if it is not valid
+static int ParseFlushPolicy (const char* spec) {
+    while (*spec != '\0') {
+        const char* value = strchr(spec, ':');
+        if (value == NULL) {
+            return -1;
+        }
+        char* valueEnd;
+        long long number = strtoll(value + 1, &valueEnd, 10);
+        if (value[1] == '\0' || (*valueEnd != ',' && *valueEnd != '\0') || number < 0) {
+            return -1;
+        }
+
+        size_t nameLength = value - spec;
+        if (nameLength == 5 && strncmp(spec, "bytes", 5) == 0) {
+            flushMaxBytes = (size_t)number;
+        }
+        else if (nameLength == 5 && strncmp(spec, "lines", 5) == 0) {
+            flushMaxLines = (size_t)number;
+        }
+        else if (nameLength == 2 && strncmp(spec, "ms", 2) == 0) {
+            flushMaxDelayMs = (long)number;
+        }
+        else {
+            return -1;
+        }
+
+        spec = *valueEnd == ',' ? valueEnd + 1 : valueEnd;
+    }
+    return 0;
+}
+
+// Step 1 (--cpus=LIST, and the lists in sysfs): parse a CPU list like 0-3,8 into cpus,
+// returns how many there are or -1 if it is not valid
+static int ParseCpuList (const char* list, int* cpus, int maxCpus) {
+    int count = 0;
+    while (*list != '\0' && *list != '\n') {
+        char* end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            const char* lastStart = end + 1;
+            last = strtol(lastStart, &end, 10);
+            if (end == lastStart || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE || (*end != ',' && *end != '\0' && *end != '\n')) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (count == maxCpus) {
+                return -1;
+            }
+            cpus[count++] = (int)cpu;
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+// Step 1 (--shard-key=SPEC): line, prefix:N, field:N or field:N:C, returns 0 or -1 if it is not valid
+static int ParseShardKey (const char* spec) {
+    if (strcmp(spec, "line") == 0) {
+        shardKeyKind = ShardKeyLine;
+        return 0;
+    }
+    int kind;
+    const char* number;
+    if (strncmp(spec, "prefix:", 7) == 0) {
+        kind = ShardKeyPrefix;
+        number = spec + 7;
+    }
+    else if (strncmp(spec, "field:", 6) == 0) {
+        kind = ShardKeyField;
+        number = spec + 6;
+    }
+    else {
+        return -1;
+    }
+
+    char* numberEnd;
+    long long value = strtoll(number, &numberEnd, 10);
+    if (numberEnd == number || value <= 0) {
+        return -1;
+    }
+    char separator = '\0';
+    if (kind == ShardKeyField && numberEnd[0] == ':' && numberEnd[1] != '\0' && numberEnd[2] == '\0') {
+        separator = numberEnd[1];
+    }
+    else if (*numberEnd != '\0') {
+        return -1;
+    }
+    shardKeyKind = kind;
+    shardKeyArg = (size_t)value;
+    shardKeySeparator = separator;
+    return 0;
+}
+
+// Step 1 (topology): the { , } between the plugin names
+static int IsTopologyToken (const char* token) {
+    return strcmp(token, "{") == 0 || strcmp(token, ",") == 0 || strcmp(token, "}") == 0;
+}
+
+// Step 1 (topology): bad { , } in the plugin list
+static void TopologyError (const char* message) {
+    fprintf(stderr, "Error, %s ", message);
+
+    // Print usage
+    PrintUsageMessage();
+
+    // Exit code 1
+    exit(1);
+}
+
+// Step 1 (topology): add a stage to a list of stages (the lists have room for all of them)
+static void AddStage (int** stages, int* count, int stage) {
+    if (*stages == NULL) {
+        *stages = malloc(sizeof(int) * (numPlugins + 1));
+        if (*stages == NULL) {
+            TopologyError("couldnt allocate the topology");
+        }
+    }
+    (*stages)[(*count)++] = stage;
+}
+
+// Step 1 (topology): the plugin gets the output of every stage in tails
+static void AddTopologyEdges (const TopologyTails* tails, int plugin) {
+    for (int i=0; i<tails->count; i++) {
+        int from = tails->stages[i];
+        if (from == InputReaderStage) {
+            AddStage(&readerSuccessors, &numReaderSuccessors, plugin);
+        }
+        else {
+            AddStage(&plugins[from].successors, &plugins[from].numSuccessors, plugin);
+        }
+        plugins[plugin].predecessor = from;
+        AddStage(&plugins[plugin].predecessors, &plugins[plugin].numPredecessors, from);
+    }
+    if (plugins[plugin].numPredecessors > 1) {
+        plugins[plugin].mergeBarriers = calloc(plugins[plugin].numPredecessors, sizeof(int));
+        if (plugins[plugin].mergeBarriers == NULL) {
+            TopologyError("couldnt allocate the topology");
+        }
+        pthread_mutex_init(&plugins[plugin].mergeLock, NULL);
+    }
+}
+
+// Step 1 (topology): copy a list of stages (to one with room for all of them)
+static void CopyTails (TopologyTails* to, const TopologyTails* from) {
+    memcpy(to->stages, from->stages, sizeof(int) * from->count);
+    to->count = from->count;
+}
+
+// Step 1 (topology): a { opens a group, every , starts the next branch of it
+// from the same stages, and } closes it, the plugin after it gets the output
+// of all the branches. pluginCount is the number of plugins before the token
+static void ParseTopologyToken (const char* token, TopologyTails* tails, int pluginCount) {
+    if (strcmp(token, "{") == 0) {
+        TopologyGroup* group = &topologyGroups[numTopologyGroups++];
+        group->entry.stages = malloc(sizeof(int) * (numPlugins + 1));
+        group->ends.stages = malloc(sizeof(int) * (numPlugins + 1));
+        if (group->entry.stages == NULL || group->ends.stages == NULL) {
+            TopologyError("couldnt allocate the topology");
+        }
+        CopyTails(&group->entry, tails);
+        group->ends.count = 0;
+        group->branchStart = pluginCount;
+        return;
+    }
+
+    if (numTopologyGroups == 0) {
+        TopologyError("a , or } in the plugin list has no {");
+    }
+    TopologyGroup* group = &topologyGroups[numTopologyGroups - 1];
+    if (pluginCount == group->branchStart) {
+        TopologyError("a branch in the plugin list has no plugins");
+    }
+    for (int i=0; i<tails->count; i++) {
+        group->ends.stages[group->ends.count++] = tails->stages[i];
+    }
+
+    // The next branch starts where this one did
+    if (strcmp(token, ",") == 0) {
+        CopyTails(tails, &group->entry);
+        group->branchStart = pluginCount;
+        return;
+    }
+
+    // }
+    CopyTails(tails, &group->ends);
+    free(group->entry.stages);
+    free(group->ends.stages);
+    numTopologyGroups--;
+}
+
+// The topology is more than a plain chain
+static int IsTopologyBranched () {
+    if (numReaderSuccessors > 1) {
+        return 1;
+    }
+    for (int i=0; i<numPlugins; i++) {
+        if (plugins[i].numSuccessors > 1 || plugins[i].numPredecessors > 1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Step 1 (--shards=K): the plugin list as if it was written with the topology,
+// { chain , chain , ... } last with K copies of the chain, so the shards are the
+// branches of a fan-out and the last plugin merges them (the array is ours to free)
+static char** ShardPluginList (int* argc, char* argv[]) {
+    static char openToken[] = "{";
+    static char nextToken[] = ",";
+    static char closeToken[] = "}";
+
+    int chainLength = *argc - 3;
+    for (int i=2; i<*argc; i++) {
+        if (IsTopologyToken(argv[i])) {
+            TopologyError("--shards only runs a plain chain of plugins");
+        }
+    }
+    if (chainLength < 1) {
+        TopologyError("--shards needs at least two plugins (the last one merges the shards)");
+    }
+
+    int shardedArgc = 2 + shardCount * (chainLength + 1) + 2;
+    char** shardedArgs = malloc(sizeof(char*) * shardedArgc);
+    if (shardedArgs == NULL) {
+        TopologyError("couldnt allocate the shards");
+    }
+    int count = 0;
+    shardedArgs[count++] = argv[0];
+    shardedArgs[count++] = argv[1];
+    for (int shard=0; shard<shardCount; shard++) {
+        shardedArgs[count++] = shard == 0 ? openToken : nextToken;
+        for (int i=0; i<chainLength; i++) {
+            shardedArgs[count++] = argv[2 + i];
+        }
+    }
+    shardedArgs[count++] = closeToken;
+    shardedArgs[count++] = argv[*argc - 1];
+    *argc = count;
+    return shardedArgs;
+}
+
 // Step 1:
 void ParseCommandLineArgs (int argc, char* argv[]) {
+
+    // Options come before the queue size, skip over them
+    // (anything else that starts with -- is left for the queue size check to complain about)
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--no-fuse") == 0) {
+            fuseStages = 0;
+        }
+        else if (strcmp(argv[1], "--pool") == 0) {
+            poolWorkers = -1;
+        }
+        else if (strncmp(argv[1], "--pool=", 7) == 0) {
+            char* workersEnd;
+            long tempWorkers = strtol(argv[1] + 7, &workersEnd, 10);
+            if (argv[1][7] == '\0' || *workersEnd != '\0' || tempWorkers <= 0 || tempWorkers > 1024) {
+                fprintf(stderr, "Error, the number of pool workers must be between 1 and 1024 ");
+
+                // Print usage
+                PrintUsageMessage();
+
+                // Exit code 1
+                exit(1);
+            }
+            poolWorkers = (int)tempWorkers;
+        }
+        else if (strncmp(argv[1], "--flush=", 8) == 0) {
+            if (argv[1][8] == '\0' || ParseFlushPolicy(argv[1] + 8) != 0) {
+                fprintf(stderr, "Error, invalid flush policy ");
+
+                // Print usage
+                PrintUsageMessage();
+
+                // Exit code 1
+                exit(1);
+            }
+            flushPolicyGiven = 1;
+        }
+        else if (strcmp(argv[1], "--stats") == 0 || strcmp(argv[1], "--stats=table") == 0) {
+            statsAtShutdown = 1;
+            statsFormat = StatsFormatTable;
+        }
+        else if (strcmp(argv[1], "--stats=prom") == 0) {
+            statsAtShutdown = 1;
+            statsFormat = StatsFormatPrometheus;
+        }
+        else if (strncmp(argv[1], "--stats=", 8) == 0) {
+            fprintf(stderr, "Error, the stats format must be table or prom ");
+
+            // Print usage
+            PrintUsageMessage();
+
+            // Exit code 1
+            exit(1);
+        }
+        else if (strncmp(argv[1], "--stats-file=", 13) == 0 && argv[1][13] != '\0') {
+            statsFileName = argv[1] + 13;
+        }
+        else if (strncmp(argv[1], "--cpus=", 7) == 0 && argv[1][7] != '\0') {
+            placementSpec = argv[1] + 7;
+        }
+        else if (strcmp(argv[1], "--adaptive-queues") == 0) {
+            adaptiveQueues = 1;
+        }
+        else if (strncmp(argv[1], "--adaptive-queues=", 18) == 0) {
+            char* budgetEnd;
+            long long tempBudget = strtoll(argv[1] + 18, &budgetEnd, 10);
+            if (argv[1][18] == '\0' || *budgetEnd != '\0' || tempBudget <= 0) {
+                fprintf(stderr, "Error, the queue budget must be positive ");
+
+                // Print usage
+                PrintUsageMessage();
+
+                // Exit code 1
+                exit(1);
+            }
+            adaptiveQueues = 1;
+            queueBudget.limit = (size_t)tempBudget;
+        }
+        else if (strncmp(argv[1], "--shards=", 9) == 0) {
+            char* shardsEnd;
+            long tempShards = strtol(argv[1] + 9, &shardsEnd, 10);
+            if (argv[1][9] == '\0' || *shardsEnd != '\0' || tempShards <= 0 || tempShards > 256) {
+                fprintf(stderr, "Error, the number of shards must be between 1 and 256 ");
+
+                // Print usage
+                PrintUsageMessage();
+
+                // Exit code 1
+                exit(1);
+            }
+            shardCount = (int)tempShards;
+        }
+        else if (strncmp(argv[1], "--shard-key=", 12) == 0) {
+            if (ParseShardKey(argv[1] + 12) != 0) {
+                fprintf(stderr, "Error, invalid shard key %s ", argv[1] + 12);
+
+                // Print usage
+                PrintUsageMessage();
+
+                // Exit code 1
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[1], "--no-end-line") == 0) {
+            endLineEnds = 0;
+        }
+        else if (strncmp(argv[1], "--barrier-every=", 16) == 0) {
+            char* barrierEnd;
+            long tempBarrier = strtol(argv[1] + 16, &barrierEnd, 10);
+            if (argv[1][16] == '\0' || *barrierEnd != '\0' || tempBarrier <= 0 || tempBarrier > INT_MAX) {
+                fprintf(stderr, "Error, --barrier-every needs a positive number of lines ");
+
+                // Print usage
+                PrintUsageMessage();
+
+                // Exit code 1
+                exit(1);
+            }
+            barrierEvery = (int)tempBarrier;
+        }
+        else if (strcmp(argv[1], "--input") == 0) {
+            if (argc < 3) {
+                fprintf(stderr, "Error, --input needs a file name ");
+
+                // Print usage
+                PrintUsageMessage();
+
+                // Exit code 1
+                exit(1);
+            }
+            inputFileName = argv[2];
+            argv++;
+            argc--;
+        }
+        else {
+            break;
+        }
+        argv++;
+        argc--;
+    }
     
     // Check number of arguments in the input
     if (argc < 3) {
@@ -90,9 +741,20 @@ void ParseCommandLineArgs (int argc, char* argv[]) {
 
     sizeQueue = (int)tempSizeQueue;
     
+    // --shards: from here on the plugin list is the sharded one
+    char** shardedArgs = NULL;
+    if (shardCount > 1) {
+        shardedArgs = ShardPluginList(&argc, argv);
+        argv = shardedArgs;
+    }
+
     // Now we save the plugins names from the std input:
     // If the amount of pluginss exceeds the allowd amount, log an error
-    numPlugins = argc - 2;
+    // (the { , } of the topology are not plugins)
+    numPlugins = 0;
+    for (int i=2; i<argc; i++) {
+        numPlugins += !IsTopologyToken(argv[i]);
+    }
     plugins = calloc(numPlugins, sizeof(plugin_handle_t));
     if (!plugins) {
         fprintf(stderr, "Error: plugins, memory allocation failed for array");
@@ -104,9 +766,31 @@ void ParseCommandLineArgs (int argc, char* argv[]) {
         exit(1);
     }
 
+    // The stages the next plugin gets its messages from, at first the input reader
+    TopologyTails tails = { malloc(sizeof(int) * (numPlugins + 1)), 1 };
+    topologyGroups = malloc(sizeof(TopologyGroup) * argc);
+    if (numPlugins == 0 || !tails.stages || !topologyGroups) {
+        fprintf(stderr, "Error, no plugins ");
+
+        // Print usage
+        PrintUsageMessage();
+
+        // Exit code 1
+        exit(1);
+    }
+    tails.stages[0] = InputReaderStage;
+
     // Save the names into the array that we created in globels section
-    for (int i=0; i<numPlugins; i++) {
-        plugins[i].name = strdup(argv[i+2]);
+    for (int i=0, argIndex=2; argIndex<argc; argIndex++) {
+        if (IsTopologyToken(argv[argIndex])) {
+            ParseTopologyToken(argv[argIndex], &tails, i);
+            continue;
+        }
+        AddTopologyEdges(&tails, i);
+        tails.stages[0] = i;
+        tails.count = 1;
+
+        plugins[i].name = strdup(argv[argIndex]);
         if (!plugins[i].name) {
             fprintf(stderr, "Error: plugins, memory allocaton failed for name");
                     
@@ -116,7 +800,156 @@ void ParseCommandLineArgs (int argc, char* argv[]) {
             // Exit code 1
             exit(1);
         }
+
+        // name:N gives the plugin its own queue size, it comes last (name@N:N)
+        plugins[i].queueSize = sizeQueue;
+        char* sizeSuffix = strchr(plugins[i].name, ':');
+        if (sizeSuffix != NULL) {
+            long tempPluginQueue = strtol(sizeSuffix + 1, &endpointer, 10);
+            if (sizeSuffix[1] == '\0' || *endpointer != '\0' || tempPluginQueue <= 0 || tempPluginQueue > INT_MAX) {
+                fprintf(stderr, "Error, queue size cant be 0 or lower ");
+
+                // Print usage
+                PrintUsageMessage();
+
+                // Exit code 1
+                exit(1);
+            }
+            plugins[i].queueSize = (int)tempPluginQueue;
+            *sizeSuffix = '\0';
+        }
+
+        // name@N asks for N replicas of the plugin, the name itself is without it
+        plugins[i].replicas = 1;
+        char* replicaSuffix = strchr(plugins[i].name, '@');
+        if (replicaSuffix != NULL) {
+            long tempReplicas = strtol(replicaSuffix + 1, &endpointer, 10);
+            if (replicaSuffix[1] == '\0' || *endpointer != '\0' || tempReplicas <= 0 || tempReplicas > 256) {
+                fprintf(stderr, "Error, the number of replicas must be between 1 and 256 ");
+
+                // Print usage
+                PrintUsageMessage();
+
+                // Exit code 1
+                exit(1);
+            }
+            plugins[i].replicas = (int)tempReplicas;
+            *replicaSuffix = '\0';
+        }
+        i++;
+    }
+    if (numTopologyGroups != 0) {
+        fprintf(stderr, "Error, a { in the plugin list has no } ");
+
+        // Print usage
+        PrintUsageMessage();
+
+        // Exit code 1
+        exit(1);
+    }
+    free(tails.stages);
+    free(topologyGroups);
+    topologyGroups = NULL;
+    free(shardedArgs);
+}
+
+// Step 1 (--input): map the input file, before anything is started
+void MapInputFile () {
+    if (inputFileName == NULL) {
+        return;
+    }
+
+    int fd = open(inputFileName, O_RDONLY);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0) {
+        fprintf(stderr, "Error, couldnt open the input file %s: %s\n", inputFileName, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        // Exit code 1
+        exit(1);
+    }
+
+    // An empty file cant be mapped, it simply has no lines
+    inputMappingSize = (size_t)fileStat.st_size;
+    if (inputMappingSize > 0) {
+        void* mapping = mmap(NULL, inputMappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            fprintf(stderr, "Error, couldnt map the input file %s: %s\n", inputFileName, strerror(errno));
+            close(fd);
+
+            // Exit code 1
+            exit(1);
+        }
+        inputMapping = mapping;
+
+        // It is read once from start to end: read ahead more, and drop the pages behind us sooner
+        madvise(inputMapping, inputMappingSize, MADV_SEQUENTIAL);
+    }
+
+    // The mapping stays valid without the descriptor
+    close(fd);
+}
+
+// Step 2: another plugin of the chain already runs on the copy of the .so plugins[index].handle is
+static int IsPluginCopyTaken (int index) {
+    for (int i=0; i<index; i++) {
+        if (plugins[i].handle == plugins[index].handle) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Step 2: make an instance of the plugin from its loaded copy (SDK version 2)
+// NULL for an old plugin, or when the copy cant have another instance.
+// An old plugin can only pass messages to the plugin after it through that
+// plugin's version 1 functions, which work on the first instance of a copy.
+// So once there is an old plugin in the chain, the plugins after it dont share copies
+static plugin_instance_t* CreatePluginInstance (int index) {
+    void* handle = plugins[index].handle;
+    plugin_create_func_t create = (plugin_create_func_t)dlsym(handle, "plugin_create");
+    plugin_instance_api_t api = {
+        (plugin_destroy_func_t)dlsym(handle, "plugin_destroy"),
+        (plugin_instance_init_func_t)dlsym(handle, "plugin_instance_init"),
+        (plugin_instance_fini_func_t)dlsym(handle, "plugin_instance_fini"),
+        (plugin_instance_place_work_batch_t)dlsym(handle, "plugin_instance_place_work_batch"),
+        (plugin_instance_attach_batch_func_t)dlsym(handle, "plugin_instance_attach_batch"),
+        (plugin_instance_attach_fused_func_t)dlsym(handle, "plugin_instance_attach_fused"),
+        (plugin_instance_process_message_func_t)dlsym(handle, "plugin_instance_process_message"),
+        (plugin_instance_wait_finished_func_t)dlsym(handle, "plugin_instance_wait_finished"),
+        (plugin_instance_set_inline_func_t)dlsym(handle, "plugin_instance_set_inline"),
+        (plugin_instance_set_replicas_func_t)dlsym(handle, "plugin_instance_set_replicas"),
+        (plugin_instance_set_queue_budget_func_t)dlsym(handle, "plugin_instance_set_queue_budget"),
+        (plugin_instance_get_stats_func_t)dlsym(handle, "plugin_instance_get_stats"),
+        (plugin_instance_get_latency_func_t)dlsym(handle, "plugin_instance_get_latency"),
+        (plugin_instance_set_print_order_func_t)dlsym(handle, "plugin_instance_set_print_order")
+    };
+    dlerror();
+
+    // All or nothing, a plugin with only some of them is treated as an old one
+    if (!create || !api.destroy || !api.init || !api.fini || !api.place_work_batch || !api.attach_batch ||
+        !api.attach_fused || !api.process_message || !api.wait_finished || !api.set_inline ||
+        !api.set_replicas || !api.set_queue_budget || !api.get_stats || !api.get_latency) {
+        return NULL;
+    }
+
+    int oldPluginBefore = 0;
+    for (int i=0; i<index; i++) {
+        if (plugins[i].instance == NULL) {
+            oldPluginBefore = 1;
+        }
+    }
+    if (oldPluginBefore && IsPluginCopyTaken(index)) {
+        return NULL;
+    }
+
+    plugin_instance_t* instance = create();
+    if (instance != NULL) {
+        plugins[index].api = api;
     }
+    return instance;
 }
 
 // Step 2 (preprocess for step 2):
@@ -129,14 +962,41 @@ void LoadSinglePluginSO (int index) {
     snprintf(fileName, sizeof(fileName), "./output/%s.so", plugins[index].name);
 
     // Now we load the shared object:
-    // I used dlopen but that did not support multiple plugins of the same type, because
-    // the dynamic loader reused the same memory and all static/global variables are shared 
-    // for each .so file
-    // To solve that I changed to dlmopen with the flag LM_ID_NEWLM, which should load each instance
-    // into its own namespace, that should give independent static (global) variables.
+    // dlopen gives the same copy of a .so every time it is called for it (only a
+    // reference count goes up), so all the static/global variables are shared.
+    // A plugin that supports instances (SDK version 2) doesnt mind, every
+    // occurrence of it is an instance made by plugin_create from that one copy
+    plugins[index].handle = dlopen(fileName, RTLD_NOW | RTLD_LOCAL);
+    if (plugins[index].handle) {
+        plugins[index].instance = CreatePluginInstance(index);
+    }
+
+    // An old plugin, or a plugin that keeps state outside of its instances,
+    // cant share its copy, so if the copy is taken already it gets one of its own:
+    // dlmopen with the flag LM_ID_NEWLM loads it into its own namespace, that gives
+    // independent static (global) variables.
     // Using this flag is fine since it is not a compilation flag but a runtime flag,
     // (in the Piazza we were instructed not to add compilation flags).
-    plugins[index].handle = dlmopen(LM_ID_NEWLM, fileName, RTLD_NOW | RTLD_LOCAL);
+    if (plugins[index].handle && plugins[index].instance == NULL && IsPluginCopyTaken(index)) {
+        dlclose(plugins[index].handle);
+        plugins[index].handle = dlmopen(LM_ID_NEWLM, fileName, RTLD_NOW | RTLD_LOCAL);
+        if (plugins[index].handle) {
+            plugins[index].instance = CreatePluginInstance(index);
+        }
+
+        // glibc only has a handful of namespaces, a long chain (or many --shards)
+        // of such a plugin runs out of them
+        if (!plugins[index].handle) {
+            fprintf(stderr, "Error, couldnt load another copy of %s (a plugin without instances needs one "
+                "per stage, and only a few can be loaded) ", plugins[index].name);
+
+            // Print usage
+            PrintUsageMessage();
+
+            // Exit code 1
+            exit(1);
+        }
+    }
 
     // In case loading the shared object failed
     if (!plugins[index].handle) {
@@ -189,6 +1049,37 @@ void LoadSinglePluginSO (int index) {
         // Exit code 1
         exit(1);
     }
+
+    // Optional functions, older plugins may not have them so a NULL is fine
+    plugins[index].place_work_owned = (plugin_place_work_owned_func_t)dlsym(plugins[index].handle, "plugin_place_work_owned");
+    plugins[index].place_work_batch = (plugin_place_work_batch_func_t)dlsym(plugins[index].handle, "plugin_place_work_batch");
+    plugins[index].attach_batch = (plugin_attach_batch_func_t)dlsym(plugins[index].handle, "plugin_attach_batch");
+    plugins[index].set_inline = (plugin_set_inline_func_t)dlsym(plugins[index].handle, "plugin_set_inline");
+    plugins[index].set_replicas = (plugin_set_replicas_func_t)dlsym(plugins[index].handle, "plugin_set_replicas");
+    plugins[index].set_flush_policy = (plugin_set_flush_policy_func_t)dlsym(plugins[index].handle, "plugin_set_flush_policy");
+    plugins[index].set_queue_budget = (plugin_set_queue_budget_func_t)dlsym(plugins[index].handle, "plugin_set_queue_budget");
+    plugins[index].set_print_order = (plugin_set_print_order_func_t)dlsym(plugins[index].handle, "plugin_set_print_order");
+    plugins[index].process_message = (plugin_process_message_func_t)dlsym(plugins[index].handle, "plugin_process_message");
+    plugins[index].attach_fused = (plugin_attach_fused_func_t)dlsym(plugins[index].handle, "plugin_attach_fused");
+    plugins[index].get_stats = (plugin_get_stats_func_t)dlsym(plugins[index].handle, "plugin_get_stats");
+    plugins[index].get_latency = (plugin_get_latency_func_t)dlsym(plugins[index].handle, "plugin_get_latency");
+    plugins[index].pure = dlsym(plugins[index].handle, "plugin_pure_transform") != NULL;
+    plugins[index].orderedOutput = dlsym(plugins[index].handle, "plugin_ordered_output") != NULL;
+    dlerror();
+
+    // Replicas finish messages in any order and all share the plugin's state,
+    // which is only fine for a plugin that keeps no state and prints nothing
+    if (plugins[index].replicas > 1 && (!plugins[index].pure || !plugins[index].set_replicas)) {
+        fprintf(stderr, "Error, %s plugin cant run replicas (only pure plugins can)\n", plugins[index].name);
+
+        dlclose(plugins[index].handle);
+
+        // Print usage
+        PrintUsageMessage();
+
+        // Exit code 1
+        exit(1);
+    }
 }
 
 // Step 2 (the step itself)
@@ -200,69 +1091,1653 @@ void LoadPlugins () {
     }
 }
 
-// Step 3
-void InitializePlugins () {
+// Calls into a plugin: through its instance when it has one (SDK version 2),
+// otherwise the plain functions of the old plugin
+static void PluginSetInline (int index) {
+    if (plugins[index].instance != NULL) {
+        plugins[index].api.set_inline(plugins[index].instance);
+    }
+    else {
+        plugins[index].set_inline();
+    }
+}
 
-    // Iterate over all the plugins and initialize them
-    for (int i=0; i<numPlugins; i++) {
-        const char* error = plugins[i].init(sizeQueue);
-        if (error != NULL) {
-            
-            fprintf(stderr, "Error: cant initialize plugin %s: %s\n", plugins[i].name, error);
+static void PluginSetReplicas (int index, int count) {
+    if (plugins[index].instance != NULL) {
+        plugins[index].api.set_replicas(plugins[index].instance, count);
+    }
+    else {
+        plugins[index].set_replicas(count);
+    }
+}
 
-            // Exit code 2
-            exit(2);
-        }
+static void PluginSetQueueBudget (int index, consumer_producer_budget_t* budget) {
+    if (plugins[index].instance != NULL) {
+        plugins[index].api.set_queue_budget(plugins[index].instance, budget);
+    }
+    else {
+        plugins[index].set_queue_budget(budget);
     }
 }
 
-// Step 4
-void AttachPluginsTogether () {
+static void PluginSetPrintOrder (int index, print_order_t* order, int position) {
+    if (plugins[index].instance != NULL) {
+        plugins[index].api.set_print_order(plugins[index].instance, order, position);
+    }
+    else {
+        plugins[index].set_print_order(order, position);
+    }
+}
 
-    // Attach all plugins except the last one
-    for (int i=0; i<numPlugins-1; i++) {
-        plugins[i].attach(plugins[i+1].place_work);
+static const char* PluginInit (int index, int queueSize) {
+    if (plugins[index].instance != NULL) {
+        return plugins[index].api.init(plugins[index].instance, queueSize);
     }
-    
-    // Dont do anything for the last plugin
+    return plugins[index].init(queueSize);
 }
 
-// Step 5 
-void ReadInputFromSTDIn () {
+static const char* PluginProcessMessage (int index, message_t* input, message_t* output) {
+    if (plugins[index].instance != NULL) {
+        return plugins[index].api.process_message(plugins[index].instance, input, output);
+    }
+    return plugins[index].process_message(input, output);
+}
+
+static const char* PluginPlaceWorkBatch (int index, const message_t* messages, int count) {
+    if (plugins[index].instance != NULL) {
+        return plugins[index].api.place_work_batch(plugins[index].instance, messages, count);
+    }
+    return plugins[index].place_work_batch(messages, count);
+}
+
+static const char* PluginWaitFinished (int index) {
+    if (plugins[index].instance != NULL) {
+        return plugins[index].api.wait_finished(plugins[index].instance);
+    }
+    return plugins[index].wait_finished();
+}
+
+static const char* PluginGetStats (int index, plugin_stats_t* stats) {
+    if (plugins[index].instance != NULL) {
+        return plugins[index].api.get_stats(plugins[index].instance, stats);
+    }
+    return plugins[index].get_stats(stats);
+}
+
+static const char* PluginGetLatency (int index, latency_histogram_t* queueWait, latency_histogram_t* service,
+        latency_histogram_t* endToEnd) {
+    if (plugins[index].instance != NULL) {
+        return plugins[index].api.get_latency(plugins[index].instance, queueWait, service, endToEnd);
+    }
+    return plugins[index].get_latency(queueWait, service, endToEnd);
+}
+
+// An instance passes messages on to an old plugin through these two, with the
+// old plugin's handle in place of an instance (it is opaque to the instance)
+static const char* OldPluginPlaceWorkBatch (plugin_instance_t* next, const message_t* messages, int count) {
+    plugin_handle_t* plugin = (plugin_handle_t*)(void*)next;
+    if (plugin->place_work_batch) {
+        return plugin->place_work_batch(messages, count);
+    }
+
+    // Only C strings, the plugin makes its own copy (of a terminated copy here,
+    // a read only view has no NUL after it)
+    // A string has no kind, so only the end of the stream (as <END>) gets there
+    const char* error = NULL;
+    for (int i=0; i<count; i++) {
+        if (message_is_control(&messages[i]) && !message_is_end(&messages[i])) {
+            message_release(&messages[i]);
+            continue;
+        }
+        char* copy = error == NULL ? malloc(messages[i].length + 1) : NULL;
+        if (copy != NULL) {
+            memcpy(copy, messages[i].data, messages[i].length);
+            copy[messages[i].length] = '\0';
+            error = plugin->place_work(copy);
+            free(copy);
+        }
+        else if (error == NULL) {
+            error = "Error, failed memory allocation for string copy";
+        }
+        message_release(&messages[i]);
+    }
+    return error;
+}
+
+static const char* OldPluginProcessMessage (plugin_instance_t* stage, message_t* input, message_t* output) {
+    plugin_handle_t* plugin = (plugin_handle_t*)(void*)stage;
+    return plugin->process_message(input, output);
+}
+
+// Fan-in: a barrier came from the stage from. It goes on once every stage
+// before the fan-in sent one more barrier than were passed on so far
+static int MergeBarrier (plugin_handle_t* plugin, int from) {
+    for (int i=0; i<plugin->numPredecessors; i++) {
+        if (plugin->predecessors[i] == from) {
+            plugin->mergeBarriers[i]++;
+            break;
+        }
+    }
+    for (int i=0; i<plugin->numPredecessors; i++) {
+        if (plugin->mergeBarriers[i] <= plugin->mergeBarriersPassed) {
+            return 0;
+        }
+    }
+    plugin->mergeBarriersPassed++;
+    return 1;
+}
+
+// Put messages from the stage from into the queue of a plugin. A fan-in has more
+// than one stage putting into it, they take turns (so its single producer queue
+// sees one at a time), and only the last <END> of them goes in: the plugin ends
+// once all of the branches did. A barrier goes in once it came from every one of
+// them, while every flush goes in (the lines of a branch are written as soon as
+// that branch passed it on)
+static const char* DeliverToStage (int from, int index, const message_t* messages, int count) {
+    plugin_handle_t* plugin = &plugins[index];
+    if (plugin->numPredecessors <= 1) {
+        if (plugin->instance != NULL) {
+            return plugin->api.place_work_batch(plugin->instance, messages, count);
+        }
+        return OldPluginPlaceWorkBatch((plugin_instance_t*)(void*)plugin, messages, count);
+    }
+
+    pthread_mutex_lock(&plugin->mergeLock);
+    message_t batch[count];
+    int batchCount = 0;
+    for (int i=0; i<count; i++) {
+        int mergedAway = 0;
+        if (messages[i].kind == MESSAGE_END) {
+            mergedAway = ++plugin->mergeEnds < plugin->numPredecessors;
+        }
+        else if (messages[i].kind == MESSAGE_BARRIER) {
+            mergedAway = !MergeBarrier(plugin, from);
+        }
+        if (mergedAway) {
+            message_release(&messages[i]);
+            continue;
+        }
+        batch[batchCount++] = messages[i];
+    }
+    const char* error = NULL;
+    if (batchCount > 0) {
+        if (plugin->instance != NULL) {
+            error = plugin->api.place_work_batch(plugin->instance, batch, batchCount);
+        }
+        else {
+            error = OldPluginPlaceWorkBatch((plugin_instance_t*)(void*)plugin, batch, batchCount);
+        }
+    }
+    pthread_mutex_unlock(&plugin->mergeLock);
+    return error;
+}
+
+// A fan-out message: the original and the views the stages after it got
+typedef struct {
+    message_shared_t shared; // First, so the shared pointer is the holder pointer
+    message_t message;
+} SharedMessage;
+
+// The last view was released, the original goes back to its owner
+static void ReleaseSharedMessage (message_shared_t* shared) {
+    SharedMessage* holder = (SharedMessage*)(void*)shared;
+    message_release(&holder->message);
+    pool_free(holder);
+}
+
+// Release function of the views, the buffer goes back through the holder
+static void KeepSharedData (void* data) {
+    (void)data;
+}
+
+// Send messages from the stage from to every stage in successors. With more than
+// one, each of them gets a read only view of the same buffer instead of a copy
+// The messages are not ours anymore after this, also when it fails
+static const char* SendToSuccessors (int from, const int* successors, int numSuccessors, const message_t* messages, int count) {
+    if (numSuccessors == 1) {
+        return DeliverToStage(from, successors[0], messages, count);
+    }
+
+    // views[s * count + i] is message i for successor s
+    message_t* views = malloc(sizeof(message_t) * count * numSuccessors);
+    if (views == NULL) {
+        for (int i=0; i<count; i++) {
+            message_release(&messages[i]);
+        }
+        return "Error, failed to allocate the fan-out views";
+    }
+    const char* error = NULL;
+    int shared = 0;
+    for (; shared<count; shared++) {
+        SharedMessage* holder = pool_alloc(sizeof(SharedMessage));
+        if (holder == NULL) {
+            error = "Error, failed to share a message";
+            break;
+        }
+        holder->shared.references = numSuccessors;
+        holder->shared.release = ReleaseSharedMessage;
+        holder->message = messages[shared];
+        for (int s=0; s<numSuccessors; s++) {
+            message_t* view = &views[s * count + shared];
+            *view = messages[shared];
+            view->release = KeepSharedData;
+            view->read_only = 1;
+            view->shared = &holder->shared;
+        }
+    }
+
+    // Nothing is sent if one couldnt be shared
+    if (error != NULL) {
+        for (int i=0; i<shared; i++) {
+            for (int s=0; s<numSuccessors; s++) {
+                message_release(&views[s * count + i]);
+            }
+        }
+        for (int i=shared; i<count; i++) {
+            message_release(&messages[i]);
+        }
+        free(views);
+        return error;
+    }
+    for (int s=0; s<numSuccessors; s++) {
+        const char* sendError = DeliverToStage(from, successors[s], &views[s * count], count);
+        if (error == NULL) {
+            error = sendError;
+        }
+    }
+    free(views);
+    return error;
+}
+
+// What a plugin at a fan-out or before a fan-in is attached to, from is the
+// handle of the last stage that runs on its thread
+static const char* SendDownstream (plugin_instance_t* from, const message_t* messages, int count) {
+    plugin_handle_t* plugin = (plugin_handle_t*)(void*)from;
+    return SendToSuccessors((int)(plugin - plugins), plugin->successors, plugin->numSuccessors, messages, count);
+}
+
+// Step 2.5
+// Pick the plugins that run inline on the thread of the plugin before them:
+// every pure plugin that comes right after a plugin that can run others
+// (or after another fused one). The output is the same, but the line stays
+// on one thread instead of going through a queue for every stage.
+// A plugin with replicas keeps its own threads, but the plugins fused into it
+// run on all of them
+void PlanStageFusion () {
+    if (!fuseStages || poolWorkers != 0) {
+        return;
+    }
+
+    for (int i=1; i<numPlugins; i++) {
+
+        // Only the one plugin after a stage that sends only to it, the
+        // branches of a fan-out and the plugin after a fan-in need their own queue
+        int before = plugins[i].predecessor;
+        if (plugins[i].numPredecessors != 1 || before == InputReaderStage || plugins[before].numSuccessors != 1) {
+            continue;
+        }
+        int canRunNext = plugins[before].attach_fused != NULL || plugins[before].fused;
+        int canRunInline = plugins[i].pure && plugins[i].set_inline && plugins[i].process_message &&
+            plugins[i].replicas == 1;
+        if (canRunNext && canRunInline) {
+            plugins[i].fused = 1;
+
+            // Has to be before init, so no thread and queue are made for it
+            PluginSetInline(i);
+        }
+    }
+}
+
+// Step 2.5 (printing plugins): a plugin prints in order with the others if it
+// says it can (plugin_ordered_output) and has the function to be told how
+static int CanPrintInOrder (int index) {
+    if (!plugins[index].orderedOutput) {
+        return 0;
+    }
+    return plugins[index].instance != NULL ? plugins[index].api.set_print_order != NULL
+        : plugins[index].set_print_order != NULL;
+}
+
+// Step 2.5 (printing plugins)
+// A stretch starts at every stage that doesnt get its lines from exactly one
+// stage that sends only to it, and goes on as long as that holds. Its printers
+// get one print order together (one printer alone needs none)
+void PlanPrintOrder () {
+    printOrders = calloc(numPlugins, sizeof(print_order_t));
+    if (printOrders == NULL) {
+        fprintf(stderr, "Error, couldnt allocate the print order ");
+
+        // Print usage
+        PrintUsageMessage();
+
+        // Exit code 1
+        exit(1);
+    }
+
+    int printers[numPlugins];
+    for (int start=0; start<numPlugins; start++) {
+        int before = plugins[start].predecessor;
+        if (plugins[start].numPredecessors == 1 && before != InputReaderStage && plugins[before].numSuccessors == 1) {
+            continue;
+        }
+
+        int printerCount = 0;
+        for (int i=start; ; i=plugins[i].successors[0]) {
+            if (CanPrintInOrder(i)) {
+                printers[printerCount++] = i;
+            }
+            if (plugins[i].numSuccessors != 1 || plugins[plugins[i].successors[0]].numPredecessors != 1) {
+                break;
+            }
+        }
+        if (printerCount < 2) {
+            continue;
+        }
+
+        print_order_t* order = &printOrders[numPrintOrders];
+        if (print_order_init(order, printerCount) != 0) {
+            fprintf(stderr, "Error, couldnt allocate the print order ");
+
+            // Print usage
+            PrintUsageMessage();
+
+            // Exit code 1
+            exit(1);
+        }
+        numPrintOrders++;
+
+        // Has to be before init, the plugins take it from there
+        for (int position=0; position<printerCount; position++) {
+            PluginSetPrintOrder(printers[position], order, position);
+            plugins[printers[position]].printsInOrder = 1;
+        }
+    }
+}
+
+// Step 2.5 (pool mode)
+// Every plugin runs inline (no thread of its own), the pool calls it.
+// Needs plugin_process_message, so old plugins cant run in the pool,
+// and only a plain chain (the stages run one after the other)
+void PreparePoolStages () {
+    if (poolWorkers == 0) {
+        return;
+    }
+
+    // The pool runs the stages one after the other
+    if (IsTopologyBranched()) {
+        fprintf(stderr, "Error, the pool only runs a plain chain of plugins (no { , } or --shards) ");
+
+        // Print usage
+        PrintUsageMessage();
+
+        // Exit code 1
+        exit(1);
+    }
+
+    for (int i=0; i<numPlugins; i++) {
+        if (!plugins[i].set_inline || !plugins[i].process_message || plugins[i].replicas > 1) {
+            fprintf(stderr, "Error, %s plugin cant run in the pool (old plugin or replicas) ", plugins[i].name);
+
+            // Print usage
+            PrintUsageMessage();
+
+            // Exit code 1
+            exit(1);
+        }
+
+        // Has to be before init, so no thread and queue are made for it
+        PluginSetInline(i);
+    }
+}
+
+// Step 2.6 (--cpus): add the allowed CPUs of a sysfs CPU list file to the placement order
+static void AddNodeCpus (const char* path, const cpu_set_t* allowed, cpu_set_t* added) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return;
+    }
+    char line[4096];
+    int cpus[CPU_SETSIZE];
+    int count = fgets(line, sizeof(line), file) != NULL ? ParseCpuList(line, cpus, CPU_SETSIZE) : -1;
+    fclose(file);
+
+    for (int i=0; i<count; i++) {
+        if (CPU_ISSET(cpus[i], allowed) && !CPU_ISSET(cpus[i], added)) {
+            CPU_SET(cpus[i], added);
+            placementCpus[numPlacementCpus++] = cpus[i];
+        }
+    }
+}
+
+// Step 2.6 (--cpus)
+// Make the list of CPUs the threads are pinned to, in the order they are handed out
+void PlanPlacement () {
+    if (placementSpec == NULL) {
+        return;
+    }
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        fprintf(stderr, "Error, couldnt get the CPUs we may run on: %s\n", strerror(errno));
+
+        // Exit code 1
+        exit(1);
+    }
+    placementCpus = malloc(sizeof(int) * CPU_SETSIZE);
+    if (placementCpus == NULL) {
+        fprintf(stderr, "Error: couldnt allocate the CPU list\n");
+
+        // Exit code 1
+        exit(1);
+    }
+
+    if (strcmp(placementSpec, "auto") == 0) {
+
+        // Node after node, so the stages next to each other share a node and
+        // the chain crosses to the other socket as few times as possible.
+        // Without NUMA information in sysfs every allowed CPU is one node
+        cpu_set_t added;
+        CPU_ZERO(&added);
+        int nodes[CPU_SETSIZE];
+        char path[128];
+        FILE* file = fopen("/sys/devices/system/node/online", "r");
+        char line[4096];
+        int numNodes = file != NULL && fgets(line, sizeof(line), file) != NULL ? ParseCpuList(line, nodes, CPU_SETSIZE) : -1;
+        if (file != NULL) {
+            fclose(file);
+        }
+        for (int i=0; i<numNodes; i++) {
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodes[i]);
+            AddNodeCpus(path, &allowed, &added);
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &added)) {
+                placementCpus[numPlacementCpus++] = cpu;
+            }
+        }
+    }
+    else {
+        numPlacementCpus = ParseCpuList(placementSpec, placementCpus, CPU_SETSIZE);
+        if (numPlacementCpus <= 0) {
+            fprintf(stderr, "Error, invalid CPU list %s\n", placementSpec);
+
+            // Exit code 1
+            exit(1);
+        }
+        for (int i=0; i<numPlacementCpus; i++) {
+            if (!CPU_ISSET(placementCpus[i], &allowed)) {
+                fprintf(stderr, "Error, CPU %d is not one we may run on\n", placementCpus[i]);
+
+                // Exit code 1
+                exit(1);
+            }
+        }
+    }
+
+    // The input reader keeps the first CPU for itself, if there is more than one
+    nextPlacementCpu = numPlacementCpus > 1 ? 1 : 0;
+}
+
+// Pin the calling thread to count CPUs of the placement list, starting at first
+// (wrapping around when the threads outnumber the CPUs)
+static void PinToPlacementCpus (int first, int count) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int i=0; i<count; i++) {
+        CPU_SET(placementCpus[(first + i) % numPlacementCpus], &cpus);
+    }
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (error != 0) {
+        fprintf(stderr, "Error, couldnt pin a thread to CPU %d: %s\n", placementCpus[first % numPlacementCpus], strerror(error));
+    }
+}
+
+// Step 3
+void InitializePlugins () {
+
+    // Iterate over all the plugins and initialize them
+    for (int i=0; i<numPlugins; i++) {
+
+        // Has to be before init, that is when the threads are started
+        if (plugins[i].replicas > 1) {
+            PluginSetReplicas(i, plugins[i].replicas);
+        }
+        if (flushPolicyGiven && plugins[i].set_flush_policy) {
+            plugins[i].set_flush_policy(flushMaxBytes, flushMaxLines, flushMaxDelayMs);
+        }
+
+        // Old plugins cant size their queue themselves, theirs stays fixed
+        if (adaptiveQueues && plugins[i].set_queue_budget) {
+            PluginSetQueueBudget(i, &queueBudget);
+        }
+
+        // --cpus: init on the plugin's own CPUs (one per replica), so its memory
+        // is first touched there and the threads it starts are pinned there too.
+        // Inline plugins run on someone else's thread, they dont get a CPU
+        int placed = placementCpus != NULL && poolWorkers == 0 && !plugins[i].fused;
+        if (placed) {
+            PinToPlacementCpus(nextPlacementCpu, plugins[i].replicas);
+            nextPlacementCpu += plugins[i].replicas;
+        }
+
+        const char* error = PluginInit(i, plugins[i].queueSize);
+        if (error != NULL) {
+            
+            fprintf(stderr, "Error: cant initialize plugin %s: %s\n", plugins[i].name, error);
+
+            // Exit code 2
+            exit(2);
+        }
+    }
+
+    // Back to the reader's CPU, the threads started from here on (the input
+    // reader, the stats thread) stay there. In pool mode the workers get all of them
+    if (placementCpus != NULL) {
+        if (poolWorkers != 0) {
+            PinToPlacementCpus(0, numPlacementCpus);
+        }
+        else {
+            PinToPlacementCpus(0, 1);
+        }
+    }
+}
+
+// Step 4
+void AttachPluginsTogether () {
+
+    // Attach all plugins except the ends of the chain (and of its branches)
+    // Fused plugins are skipped, the plugin before them runs them itself
+    for (int i=0; i<numPlugins; i++) {
+        if (plugins[i].fused) {
+            continue;
+        }
+
+        // The fused plugins right after this one, last is the one whose output leaves the thread
+        int fused[numPlugins];
+        int numFused = 0;
+        int last = i;
+        while (plugins[last].numSuccessors == 1 && plugins[plugins[last].successors[0]].fused) {
+            last = plugins[last].successors[0];
+            fused[numFused++] = last;
+        }
+        if (numFused > 0) {
+            const char* error;
+            if (plugins[i].instance != NULL) {
+                plugin_fused_stage_t fusedStages[numFused];
+                for (int j=0; j<numFused; j++) {
+                    if (plugins[fused[j]].instance != NULL) {
+                        fusedStages[j].process_message = plugins[fused[j]].api.process_message;
+                        fusedStages[j].instance = plugins[fused[j]].instance;
+                    }
+                    else {
+                        fusedStages[j].process_message = OldPluginProcessMessage;
+                        fusedStages[j].instance = (plugin_instance_t*)(void*)&plugins[fused[j]];
+                    }
+                }
+                error = plugins[i].api.attach_fused(plugins[i].instance, fusedStages, numFused);
+            }
+            else {
+                // An old plugin only takes plain functions, the plugins after it
+                // were loaded so that those work on the right instance
+                plugin_process_message_func_t fusedStages[numFused];
+                for (int j=0; j<numFused; j++) {
+                    fusedStages[j] = plugins[fused[j]].process_message;
+                }
+                error = plugins[i].attach_fused(fusedStages, numFused);
+            }
+            if (error != NULL) {
+                fprintf(stderr, "Error: cant fuse plugins into %s: %s\n", plugins[i].name, error);
+
+                // Exit code 2
+                exit(2);
+            }
+        }
+
+        // Nothing after the fused ones, this is the last thread of the chain (or branch)
+        if (plugins[last].numSuccessors == 0) {
+            continue;
+        }
+
+        // A fan-out, or a fan-in after it: the messages go through SendDownstream,
+        // which only an instance can be attached to
+        int next = plugins[last].successors[0];
+        if (plugins[last].numSuccessors > 1 || plugins[next].numPredecessors > 1) {
+            if (plugins[i].instance == NULL) {
+                fprintf(stderr, "Error: %s plugin cant start or end a branch (old plugin)\n", plugins[i].name);
+
+                // Exit code 2
+                exit(2);
+            }
+            plugins[i].api.attach_batch(plugins[i].instance, SendDownstream, (plugin_instance_t*)(void*)&plugins[last]);
+            continue;
+        }
+
+        // An instance passes whole batches on, to the next instance or to an old plugin
+        if (plugins[i].instance != NULL) {
+            if (plugins[next].instance != NULL) {
+                plugins[i].api.attach_batch(plugins[i].instance, plugins[next].api.place_work_batch, plugins[next].instance);
+            }
+            else {
+                plugins[i].api.attach_batch(plugins[i].instance, OldPluginPlaceWorkBatch, (plugin_instance_t*)(void*)&plugins[next]);
+            }
+            continue;
+        }
+        plugins[i].attach(plugins[next].place_work);
+
+        // If both sides support batches, let them pass whole batches
+        if (plugins[i].attach_batch && plugins[next].place_work_batch) {
+            plugins[i].attach_batch(plugins[next].place_work_batch);
+        }
+    }
+}
+
+// Pool mode: messages left the chain (passed the last stage or were dropped)
+static void PoolMessagesDone (int count) {
+    __atomic_sub_fetch(&inFlight, count, __ATOMIC_SEQ_CST);
+    monitor_signal(&inFlightMonitor);
+}
+
+// Pool mode: add messages to a stage's inbox, and submit its task if it is not submitted yet
+static void PoolInboxPut (PipelineStage* stage, const message_t* messages, int count) {
+    if (count == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&stage->inboxLock);
+
+    // Grow the ring (unwrapped into the new one) if they dont fit
+    if (stage->inboxCount + count > stage->inboxSize) {
+        size_t newSize = stage->inboxSize * 2;
+        while (newSize < stage->inboxCount + count) {
+            newSize *= 2;
+        }
+        message_t* newInbox = malloc(newSize * sizeof(message_t));
+        if (newInbox == NULL) {
+            pthread_mutex_unlock(&stage->inboxLock);
+            fprintf(stderr, "Error: couldnt grow the inbox of %s, dropping messages\n", plugins[stage->index].name);
+            for (int i=0; i<count; i++) {
+                message_release(&messages[i]);
+            }
+            PoolMessagesDone(count);
+            return;
+        }
+        for (size_t i=0; i<stage->inboxCount; i++) {
+            newInbox[i] = stage->inbox[(stage->inboxHead + i) % stage->inboxSize];
+        }
+        free(stage->inbox);
+        stage->inbox = newInbox;
+        stage->inboxSize = newSize;
+        stage->inboxHead = 0;
+    }
+
+    uint64_t now = message_clock_ns();
+    for (int i=0; i<count; i++) {
+        message_t* slot = &stage->inbox[(stage->inboxHead + stage->inboxCount) % stage->inboxSize];
+        *slot = messages[i];
+        slot->enqueue_ns = now;
+        stage->inboxCount++;
+    }
+    if (stage->inboxCount > stage->inboxHighWater) {
+        stage->inboxHighWater = stage->inboxCount;
+    }
+
+    // A stage only runs once at a time, that keeps its messages in order
+    int submit = !stage->scheduled;
+    stage->scheduled = 1;
+    pthread_mutex_unlock(&stage->inboxLock);
+
+    if (submit) {
+        scheduler_submit(&scheduler, &stage->task);
+    }
+}
+
+// Pool mode: results of a stage go to the next stage's inbox, or leave the chain after the last one
+static void PoolPassOn (PipelineStage* stage, message_t* messages, int count) {
+    if (count == 0) {
+        return;
+    }
+    if (stage->index + 1 < numPlugins) {
+        PoolInboxPut(&stages[stage->index + 1], messages, count);
+        return;
+    }
+
+    // The last stage, the messages leave the chain here
+    int reachedEnd = 0;
+    uint64_t now = message_clock_ns();
+    for (int i=0; i<count; i++) {
+        if (message_is_end(&messages[i])) {
+            reachedEnd = 1;
+        }
+        else if (messages[i].ingress_ns != 0 && !message_is_control(&messages[i])) {
+            latency_histogram_record(&poolEndToEnd, now - messages[i].ingress_ns);
+        }
+        message_release(&messages[i]);
+    }
+    PoolMessagesDone(count);
+    if (reachedEnd) {
+        monitor_signal(&pipelineDoneMonitor);
+    }
+}
+
+// Pool mode: the task of a stage. Runs the plugin on a batch from the inbox
+// and passes the results to the next stage
+static void PoolRunStage (scheduler_task_t* task) {
+    PipelineStage* stage = (PipelineStage*)task;
+    plugin_handle_t* plugin = &plugins[stage->index];
+
+    message_t batch[StageBatchSize];
+    int batchCount = 0;
+    pthread_mutex_lock(&stage->inboxLock);
+    while (batchCount < StageBatchSize && stage->inboxCount > 0) {
+        batch[batchCount++] = stage->inbox[stage->inboxHead];
+        stage->inboxHead = (stage->inboxHead + 1) % stage->inboxSize;
+        stage->inboxCount--;
+    }
+    pthread_mutex_unlock(&stage->inboxLock);
+
+    uint64_t takenNs = message_clock_ns();
+    for (int i=0; i<batchCount; i++) {
+        if (!message_is_control(&batch[i])) {
+            latency_histogram_record(&stage->queueWait, takenNs - batch[i].enqueue_ns);
+        }
+    }
+
+    // The results replace the inputs in the same array
+    // (a printer in a print order passes every line on right away, the
+    // printers after it may have to print it before its next turn comes)
+    int processedCount = 0;
+    int passedCount = 0;
+    for (int i=0; i<batchCount; i++) {
+
+        // <END> is passed on as is, after everything before it
+        if (message_is_end(&batch[i])) {
+            batch[processedCount++] = batch[i];
+            continue;
+        }
+
+        message_t processedMessage;
+        const char* error = PluginProcessMessage(stage->index, &batch[i], &processedMessage);
+        if (error != NULL) {
+            fprintf(stderr, "[ERROR][%s] - %s\n", plugin->name, error);
+            PoolMessagesDone(1);
+            continue;
+        }
+        batch[processedCount++] = processedMessage;
+        if (plugin->printsInOrder) {
+            PoolPassOn(stage, batch + passedCount, processedCount - passedCount);
+            passedCount = processedCount;
+        }
+    }
 
-    // Create a buffer to store each line
-    char line[MaximalLineLength];
-    
-    // Keep reading lines until end of file (End signal check comes later)
-    while (fgets(line, sizeof(line), stdin)) {
-        
-        // Make sure theres no trailing \n by removing it (replace with null terminator)
-        size_t currLineLength = strlen(line);
-        if (currLineLength > 0 && line[currLineLength - 1] == '\n') {
-            line[currLineLength - 1] = '\0';
+    // Pass the results on before this stage can run again, so the next
+    // stage gets them in order
+    PoolPassOn(stage, batch + passedCount, processedCount - passedCount);
+
+    // Run again later if more came in meanwhile
+    pthread_mutex_lock(&stage->inboxLock);
+    int runAgain = stage->inboxCount > 0;
+    stage->scheduled = runAgain;
+    pthread_mutex_unlock(&stage->inboxLock);
+    if (runAgain) {
+        scheduler_submit(&scheduler, &stage->task);
+    }
+}
+
+// Step 4 (pool mode)
+// Make a stage for every plugin and start the worker threads
+void StartPool () {
+    stages = calloc(numPlugins, sizeof(PipelineStage));
+    if (!stages) {
+        fprintf(stderr, "Error: couldnt allocate the pool stages\n");
+
+        // Exit code 2
+        exit(2);
+    }
+
+    for (int i=0; i<numPlugins; i++) {
+        stages[i].task.run = PoolRunStage;
+        stages[i].index = i;
+        stages[i].inboxSize = StageBatchSize;
+        stages[i].inbox = malloc(stages[i].inboxSize * sizeof(message_t));
+        pthread_mutex_init(&stages[i].inboxLock, NULL);
+        if (!stages[i].inbox) {
+            fprintf(stderr, "Error: couldnt allocate the pool stages\n");
+
+            // Exit code 2
+            exit(2);
+        }
+    }
+
+    // Every inbox may hold up to its queue size on average
+    // (the inboxes grow as needed anyway, so --adaptive-queues changes nothing here)
+    inFlightLimit = 0;
+    for (int i=0; i<numPlugins; i++) {
+        inFlightLimit = plugins[i].queueSize < INT_MAX - inFlightLimit ? inFlightLimit + plugins[i].queueSize : INT_MAX;
+    }
+    monitor_init(&inFlightMonitor);
+    monitor_init(&pipelineDoneMonitor);
+
+    // A printer waiting for its turn in a print order holds a worker meanwhile,
+    // so there is always at least one more worker than such printers
+    int workers = poolWorkers > 0 ? poolWorkers : 0;
+    int orderedPrinters = 0;
+    for (int i=0; i<numPlugins; i++) {
+        orderedPrinters += plugins[i].printsInOrder;
+    }
+    if (orderedPrinters > 0) {
+        int available = workers > 0 ? workers : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (available <= orderedPrinters) {
+            workers = orderedPrinters + 1;
+        }
+    }
+
+    // Every stage is submitted at most once at a time, so numPlugins tasks at most
+    const char* error = scheduler_init(&scheduler, workers, numPlugins);
+    if (error != NULL) {
+        fprintf(stderr, "Error: couldnt start the pool: %s\n", error);
+
+        // Exit code 2
+        exit(2);
+    }
+}
+
+// Pool mode: hand lines to the first stage, waits while too many are in the chain
+static const char* PoolPlaceWork (const message_t* messages, int count) {
+    while (__atomic_load_n(&inFlight, __ATOMIC_SEQ_CST) >= inFlightLimit) {
+
+        // Reset first and look again, so a signal in between is not lost
+        monitor_reset(&inFlightMonitor);
+        if (__atomic_load_n(&inFlight, __ATOMIC_SEQ_CST) < inFlightLimit) {
+            break;
+        }
+        if (monitor_wait(&inFlightMonitor) != 0) {
+            for (int i=0; i<count; i++) {
+                message_release(&messages[i]);
+            }
+            return "failed to wait for the chain";
+        }
+    }
+
+    __atomic_add_fetch(&inFlight, count, __ATOMIC_SEQ_CST);
+    PoolInboxPut(&stages[0], messages, count);
+    return NULL;
+}
+
+// Stats: the counters of one plugin. In pool mode the plugins run inline and
+// have no queue, their stage's inbox is the queue then
+static int GetStageStats (int index, plugin_stats_t* stats) {
+    if (plugins[index].get_stats == NULL || PluginGetStats(index, stats) != NULL) {
+        return -1;
+    }
+    if (stages != NULL) {
+        pthread_mutex_lock(&stages[index].inboxLock);
+        stats->queue_depth = stages[index].inboxCount;
+        stats->queue_high_water = stages[index].inboxHighWater;
+        pthread_mutex_unlock(&stages[index].inboxLock);
+    }
+    return 0;
+}
+
+// Where a plugin runs, for the table
+static const char* StageThreadName (int index) {
+    if (poolWorkers != 0) {
+        return "pool";
+    }
+    if (plugins[index].fused) {
+        return "fused";
+    }
+    return plugins[index].replicas > 1 ? "replicas" : "own";
+}
+
+// Stats: the counters as a table for people
+static void PrintStatsTable (FILE* out, const char* reason) {
+    fprintf(out, "Pipeline stats (%s):\n", reason);
+    fprintf(out, "%-5s %-12s %-8s %12s %12s %14s %14s %8s %10s %10s %14s\n",
+        "stage", "plugin", "thread", "msgs_in", "msgs_out", "bytes_in", "bytes_out",
+        "queue", "high", "capacity", "transform_ms");
+    for (int i=0; i<numPlugins; i++) {
+        plugin_stats_t stats;
+        if (GetStageStats(i, &stats) != 0) {
+            fprintf(out, "%-5d %-12s %-8s (no stats, old plugin)\n", i, plugins[i].name, StageThreadName(i));
+            continue;
+        }
+        fprintf(out, "%-5d %-12s %-8s %12llu %12llu %14llu %14llu %8zu %10zu %10zu %14.3f\n",
+            i, plugins[i].name, StageThreadName(i),
+            (unsigned long long)stats.messages_in, (unsigned long long)stats.messages_out,
+            (unsigned long long)stats.bytes_in, (unsigned long long)stats.bytes_out,
+            stats.queue_depth, stats.queue_high_water, stats.queue_capacity,
+            stats.transform_ns / 1e6);
+    }
+}
+
+// Stats: one Prometheus metric, a line for every plugin that has stats
+static void PrintPrometheusMetric (FILE* out, const plugin_stats_t* allStats, const int* haveStats,
+        const char* name, const char* type, const char* help, size_t offset, int nanoseconds) {
+    fprintf(out, "# HELP %s %s\n", name, help);
+    fprintf(out, "# TYPE %s %s\n", name, type);
+    for (int i=0; i<numPlugins; i++) {
+        if (!haveStats[i]) {
+            continue;
+        }
+        const char* field = (const char*)&allStats[i] + offset;
+        fprintf(out, "%s{stage=\"%d\",plugin=\"%s\"} ", name, i, plugins[i].name);
+        if (nanoseconds) {
+            fprintf(out, "%.9f\n", *(const uint64_t*)field / 1e9);
+        }
+        else if (offset >= offsetof(plugin_stats_t, queue_depth)) {
+            fprintf(out, "%zu\n", *(const size_t*)field);
+        }
+        else {
+            fprintf(out, "%llu\n", (unsigned long long)*(const uint64_t*)field);
+        }
+    }
+}
+
+// Stats: the counters in the Prometheus text format (for the node exporter's textfile collector)
+static void PrintStatsPrometheus (FILE* out) {
+    plugin_stats_t allStats[numPlugins];
+    int haveStats[numPlugins];
+    for (int i=0; i<numPlugins; i++) {
+        haveStats[i] = GetStageStats(i, &allStats[i]) == 0;
+    }
+
+    PrintPrometheusMetric(out, allStats, haveStats, "pipeline_stage_messages_in_total", "counter",
+        "Messages the stage took to process", offsetof(plugin_stats_t, messages_in), 0);
+    PrintPrometheusMetric(out, allStats, haveStats, "pipeline_stage_messages_out_total", "counter",
+        "Messages the stage passed on", offsetof(plugin_stats_t, messages_out), 0);
+    PrintPrometheusMetric(out, allStats, haveStats, "pipeline_stage_bytes_in_total", "counter",
+        "Payload bytes the stage took to process", offsetof(plugin_stats_t, bytes_in), 0);
+    PrintPrometheusMetric(out, allStats, haveStats, "pipeline_stage_bytes_out_total", "counter",
+        "Payload bytes the stage passed on", offsetof(plugin_stats_t, bytes_out), 0);
+    PrintPrometheusMetric(out, allStats, haveStats, "pipeline_stage_transform_seconds_total", "counter",
+        "Time spent in the stage's processing function", offsetof(plugin_stats_t, transform_ns), 1);
+    PrintPrometheusMetric(out, allStats, haveStats, "pipeline_stage_queue_depth", "gauge",
+        "Messages waiting in the stage's queue", offsetof(plugin_stats_t, queue_depth), 0);
+    PrintPrometheusMetric(out, allStats, haveStats, "pipeline_stage_queue_high_water", "gauge",
+        "Most messages that ever waited in the stage's queue", offsetof(plugin_stats_t, queue_high_water), 0);
+    PrintPrometheusMetric(out, allStats, haveStats, "pipeline_stage_queue_capacity", "gauge",
+        "Size of the stage's queue", offsetof(plugin_stats_t, queue_capacity), 0);
+}
+
+// Stats: the latency histograms of one plugin (pool mode: the queue wait is the
+// stage's inbox, and the end to end latency is measured here)
+static int GetStageLatency (int index, latency_histogram_t* queueWait, latency_histogram_t* service,
+        latency_histogram_t* endToEnd) {
+    if (plugins[index].get_latency == NULL || PluginGetLatency(index, queueWait, service, endToEnd) != NULL) {
+        return -1;
+    }
+    if (stages != NULL) {
+        latency_histogram_copy(queueWait, &stages[index].queueWait);
+    }
+    return 0;
+}
+
+// Stats: one histogram as a line of the latency table, in microseconds
+static void PrintLatencyRow (FILE* out, const char* stage, const char* name, const char* kind,
+        const latency_histogram_t* histogram) {
+    fprintf(out, "%-5s %-12s %-10s %12llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", stage, name, kind,
+        (unsigned long long)latency_histogram_count(histogram),
+        latency_histogram_percentile(histogram, 50) / 1e3, latency_histogram_percentile(histogram, 90) / 1e3,
+        latency_histogram_percentile(histogram, 99) / 1e3, latency_histogram_percentile(histogram, 99.9) / 1e3,
+        histogram->max / 1e3);
+}
+
+// Stats: one histogram as a Prometheus summary (the quantiles in seconds, and the count)
+static const double LatencyQuantiles[] = { 50, 90, 99, 99.9 };
+static void PrintLatencySummary (FILE* out, const char* name, const char* labels, const latency_histogram_t* histogram) {
+    const char* separator = labels[0] != '\0' ? "," : "";
+    for (size_t q=0; q<sizeof(LatencyQuantiles) / sizeof(LatencyQuantiles[0]); q++) {
+        fprintf(out, "%s{%s%squantile=\"%g\"} %.9f\n", name, labels, separator, LatencyQuantiles[q] / 100,
+            latency_histogram_percentile(histogram, LatencyQuantiles[q]) / 1e9);
+    }
+    fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long)latency_histogram_count(histogram));
+}
+
+// Stats: the latency percentiles of every stage, and of the whole pipeline.
+// The end to end latency is merged from all the plugins, only the ones at the
+// end of the chain have any
+static void PrintLatency (FILE* out, int format) {
+
+    // Three per plugin (queue wait, service, end to end) and the merged end to end
+    latency_histogram_t* histograms = calloc(3 * numPlugins + 1, sizeof(latency_histogram_t));
+    int* haveLatency = calloc(numPlugins, sizeof(int));
+    if (histograms == NULL || haveLatency == NULL) {
+        free(histograms);
+        free(haveLatency);
+        return;
+    }
+    latency_histogram_t* endToEnd = &histograms[3 * numPlugins];
+    if (stages != NULL) {
+        latency_histogram_merge(endToEnd, &poolEndToEnd);
+    }
+    for (int i=0; i<numPlugins; i++) {
+        haveLatency[i] = GetStageLatency(i, &histograms[3 * i], &histograms[3 * i + 1], &histograms[3 * i + 2]) == 0;
+        if (haveLatency[i]) {
+            latency_histogram_merge(endToEnd, &histograms[3 * i + 2]);
+        }
+    }
+
+    if (format == StatsFormatPrometheus) {
+        // Every metric family has to be in one piece
+        const char* names[2] = { "pipeline_stage_queue_wait_seconds", "pipeline_stage_service_seconds" };
+        const char* helps[2] = { "Time messages waited in the stage's queue",
+                                 "Time the stage's processing function took per message" };
+        for (int kind=0; kind<2; kind++) {
+            fprintf(out, "# HELP %s %s\n", names[kind], helps[kind]);
+            fprintf(out, "# TYPE %s summary\n", names[kind]);
+            for (int i=0; i<numPlugins; i++) {
+                if (haveLatency[i]) {
+                    char labels[300];
+                    snprintf(labels, sizeof(labels), "stage=\"%d\",plugin=\"%s\"", i, plugins[i].name);
+                    PrintLatencySummary(out, names[kind], labels, &histograms[3 * i + kind]);
+                }
+            }
+        }
+        fprintf(out, "# HELP pipeline_end_to_end_seconds Time from reading a line to the end of the chain\n");
+        fprintf(out, "# TYPE pipeline_end_to_end_seconds summary\n");
+        PrintLatencySummary(out, "pipeline_end_to_end_seconds", "", endToEnd);
+    }
+    else {
+        fprintf(out, "Latency (us), tracking costs about %.0fns per message and stage:\n", latency_histogram_overhead_ns());
+        fprintf(out, "%-5s %-12s %-10s %12s %10s %10s %10s %10s %10s\n",
+            "stage", "plugin", "kind", "count", "p50", "p90", "p99", "p99.9", "max");
+        for (int i=0; i<numPlugins; i++) {
+            if (haveLatency[i]) {
+                char stage[16];
+                snprintf(stage, sizeof(stage), "%d", i);
+                PrintLatencyRow(out, stage, plugins[i].name, "queue_wait", &histograms[3 * i]);
+                PrintLatencyRow(out, stage, plugins[i].name, "service", &histograms[3 * i + 1]);
+            }
+        }
+        PrintLatencyRow(out, "-", "pipeline", "end_to_end", endToEnd);
+    }
+
+    free(histograms);
+    free(haveLatency);
+}
+
+// Stats: print the report in the chosen format, to stderr or the stats file
+static void ReportStats (const char* reason) {
+    if (statsFileName == NULL) {
+        if (statsFormat == StatsFormatPrometheus) {
+            PrintStatsPrometheus(stderr);
+        }
+        else {
+            PrintStatsTable(stderr, reason);
+        }
+        PrintLatency(stderr, statsFormat);
+        fflush(stderr);
+        return;
+    }
+
+    char tempName[4096];
+    snprintf(tempName, sizeof(tempName), "%s.tmp", statsFileName);
+    FILE* out = fopen(tempName, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error: couldnt write the stats file %s: %s\n", tempName, strerror(errno));
+        return;
+    }
+    if (statsFormat == StatsFormatPrometheus) {
+        PrintStatsPrometheus(out);
+    }
+    else {
+        PrintStatsTable(out, reason);
+    }
+    PrintLatency(out, statsFormat);
+    if (fclose(out) != 0 || rename(tempName, statsFileName) != 0) {
+        fprintf(stderr, "Error: couldnt write the stats file %s: %s\n", statsFileName, strerror(errno));
+    }
+}
+
+// Stats: the thread that waits for SIGUSR1. Every other thread has it blocked,
+// so it is only delivered here, and the report is printed outside of a signal handler
+static void* StatsSignalThread (void* arg) {
+    (void)arg;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+
+    while (1) {
+        int signal;
+        if (sigwait(&signals, &signal) != 0) {
+            continue;
+        }
+        if (__atomic_load_n(&statsStopping, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        // SIGUSR2: the reader sends the flush, only it puts messages into the first queue
+        if (signal == SIGUSR2) {
+            __atomic_store_n(&flushRequested, 1, __ATOMIC_RELEASE);
+            if (readerWake[1] >= 0) {
+                ssize_t written = write(readerWake[1], "", 1);
+                (void)written;
+            }
+            continue;
+        }
+        ReportStats("SIGUSR1");
+    }
+    return NULL;
+}
+
+// Step 1 (stats): block SIGUSR1 and SIGUSR2 before any thread is started, so
+// every thread (also the plugins' ones) inherits the blocked mask
+void BlockStatsSignal () {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+}
+
+// Step 4.5: start the SIGUSR1 (and SIGUSR2) thread, once the plugins are up
+void StartStatsThread () {
+
+    // The pipe the signal thread wakes the reader with. Without it SIGUSR2
+    // still works, but only once the next input came
+    if (pipe2(readerWake, O_NONBLOCK | O_CLOEXEC) != 0) {
+        readerWake[0] = -1;
+        readerWake[1] = -1;
+    }
+    if (pthread_create(&statsThread, NULL, StatsSignalThread, NULL) != 0) {
+        fprintf(stderr, "Error: couldnt start the stats thread, SIGUSR1 is ignored\n");
+        return;
+    }
+    statsThreadStarted = 1;
+}
+
+// Step 6.5: stop the SIGUSR1 thread before the plugins go away, and print the
+// shutdown report if it was asked for
+void StopStatsThread () {
+    if (statsThreadStarted) {
+        __atomic_store_n(&statsStopping, 1, __ATOMIC_RELEASE);
+        pthread_kill(statsThread, SIGUSR1);
+        pthread_join(statsThread, NULL);
+        statsThreadStarted = 0;
+    }
+    if (statsAtShutdown) {
+        ReportStats("shutdown");
+    }
+}
+
+// Step 5: the thread that reads the input
+static pthread_t inputReaderThread;
+static int inputReaderStarted = 0;
+
+// Release function of the lines that point into the input itself (the read
+// buffer or the mapped file), there is nothing to free
+static void KeepInput (void* data) {
+    (void)data;
+}
+
+// Add one line to the batch
+// A plugin that takes whole messages gets the read only views into the mapped
+// file as they are (it copies one only if it has to write it). Lines from the
+// read buffer are copied into a buffer from our pool if the plugin takes
+// ownership (it goes back there once the plugin is done, so the buffers are
+// reused for the next lines). Otherwise the line (NUL terminated in the read
+// buffer) is passed as it is, the plugin copies it before we read over it
+static const char* AddLine (message_t* batch, int* batchCount, char* line, size_t length, int readOnly) {
+    message_t message = { .data = line, .length = length, .release = KeepInput, .read_only = readOnly };
+    int takesMessages = poolWorkers != 0 || numReaderSuccessors > 1 || plugins[0].place_work_batch;
+    int takesOwnership = takesMessages || plugins[0].place_work_owned;
+    if (readOnly ? !takesMessages : takesOwnership) {
+        message.data = pool_alloc(length + 1);
+        if (message.data == NULL) {
+            return "failed to copy the line";
+        }
+        memcpy(message.data, line, length);
+        message.data[length] = '\0';
+        message.release = pool_free;
+        message.read_only = 0;
+    }
+    batch[(*batchCount)++] = message;
+    return NULL;
+}
+
+// The line is the end of the input (<END>, unless --no-end-line)
+static int IsEndLine (const char* line, size_t length) {
+    return endLineEnds && length == MESSAGE_END_SIGNAL_LENGTH && memcmp(line, MESSAGE_END_SIGNAL, length) == 0;
+}
+
+// --shards: the shard a line goes to, from the FNV-1a hash of its key
+// (a line without the field has an empty key)
+static int ShardOfLine (const char* line, size_t length) {
+    const char* key = line;
+    size_t keyLength = length;
+    if (shardKeyKind == ShardKeyPrefix && keyLength > shardKeyArg) {
+        keyLength = shardKeyArg;
+    }
+    else if (shardKeyKind == ShardKeyField) {
+        keyLength = 0;
+        size_t start = 0;
+        for (size_t field=1; start <= length; field++) {
+
+            // Spaces and tabs: any number of them between fields, like awk
+            if (shardKeySeparator == '\0') {
+                while (start < length && (line[start] == ' ' || line[start] == '\t')) {
+                    start++;
+                }
+            }
+            size_t end = start;
+            while (end < length && (shardKeySeparator == '\0'
+                ? line[end] != ' ' && line[end] != '\t' : line[end] != shardKeySeparator)) {
+                end++;
+            }
+            if (field == shardKeyArg) {
+                key = line + start;
+                keyLength = end - start;
+                break;
+            }
+            start = end + 1;
+        }
+    }
+
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i=0; i<keyLength; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ull;
+    }
+    return (int)(hash % (uint64_t)shardCount);
+}
+
+// --shards: every line goes to the first plugin of its shard, the lines of a
+// shard in one batch (in the order they came). Control messages go to all of them
+// The lines are not ours anymore after this, also when it fails
+static const char* SendShardedLines (const message_t* batch, int count) {
+    message_t sorted[count];
+    int shardOf[count];
+    int shardStart[shardCount + 1];
+    int shardNext[shardCount];
+    const char* error = NULL;
+
+    for (int first=0; first<count; ) {
+
+        // The lines up to the next control message
+        int last = first;
+        while (last < count && !message_is_control(&batch[last])) {
+            last++;
+        }
+
+        // Sorted by shard, without changing the order inside a shard
+        memset(shardStart, 0, sizeof(shardStart));
+        for (int i=first; i<last; i++) {
+            shardOf[i] = ShardOfLine(batch[i].data, batch[i].length);
+            shardStart[shardOf[i] + 1]++;
+        }
+        for (int shard=0; shard<shardCount; shard++) {
+            shardStart[shard + 1] += shardStart[shard];
+            shardNext[shard] = shardStart[shard];
+        }
+        for (int i=first; i<last; i++) {
+            sorted[shardNext[shardOf[i]]++] = batch[i];
+        }
+        for (int shard=0; shard<shardCount; shard++) {
+            int shardLines = shardStart[shard + 1] - shardStart[shard];
+            if (shardLines > 0) {
+                const char* sendError = DeliverToStage(InputReaderStage, readerSuccessors[shard], &sorted[shardStart[shard]],
+                    shardLines);
+                if (error == NULL) {
+                    error = sendError;
+                }
+            }
+        }
+
+        if (last < count) {
+            const char* sendError = SendToSuccessors(InputReaderStage, readerSuccessors, numReaderSuccessors, &batch[last], 1);
+            if (error == NULL) {
+                error = sendError;
+            }
+        }
+        first = last + 1;
+    }
+    return error;
+}
+
+// Hand a batch of lines to the first plugin (or to all of them, a fan-out right after
+// the reader, or each to its shard), the whole batch at once if it can take it
+// The lines are not ours anymore after this, also when it fails
+// They are stamped with the time they entered the pipeline (one clock read for the batch)
+static const char* SendBatch (message_t* batch, int count) {
+    if (count == 0) {
+        return NULL;
+    }
+    uint64_t now = message_clock_ns();
+    for (int i=0; i<count; i++) {
+        batch[i].ingress_ns = now;
+    }
+    if (poolWorkers != 0) {
+        return PoolPlaceWork(batch, count);
+    }
+    if (shardCount > 1) {
+        return SendShardedLines(batch, count);
+    }
+    if (numReaderSuccessors > 1) {
+        return SendToSuccessors(InputReaderStage, readerSuccessors, numReaderSuccessors, batch, count);
+    }
+    if (plugins[0].place_work_batch) {
+        return PluginPlaceWorkBatch(0, batch, count);
+    }
+    for (int i=0; i<count; i++) {
+
+        // A string has no kind, so only the end of the stream (as <END>) goes to a plugin without batches
+        if (message_is_control(&batch[i]) && !message_is_end(&batch[i])) {
+            message_release(&batch[i]);
+            continue;
+        }
+        const char* error;
+        if (plugins[0].place_work_owned) {
+            error = plugins[0].place_work_owned(batch[i].data, batch[i].length, batch[i].release);
+        }
+        else {
+            // The plugin makes its own copy
+            error = plugins[0].place_work(batch[i].data);
+            message_release(&batch[i]);
+        }
+        if (error != NULL) {
+            // Give back the ones that were not sent
+            for (int j=i + 1; j<count; j++) {
+                message_release(&batch[j]);
+            }
+            return error;
+        }
+    }
+    return NULL;
+}
+
+// SendBatch, with a barrier after every barrierEvery lines (--barrier-every)
+// The lines are not ours anymore after this, also when it fails
+static const char* SendLines (message_t* batch, int count) {
+    if (barrierEvery == 0) {
+        return SendBatch(batch, count);
+    }
+
+    int first = 0;
+    for (int i=0; i<count; i++) {
+        if (message_is_control(&batch[i]) || ++linesSinceBarrier < barrierEvery) {
+            continue;
+        }
+        linesSinceBarrier = 0;
+        const char* error = SendBatch(batch + first, i + 1 - first);
+        first = i + 1;
+        if (error == NULL) {
+            message_t barrier = message_control(MESSAGE_BARRIER);
+            error = SendBatch(&barrier, 1);
+        }
+        if (error != NULL) {
+            // Give back the ones that were not sent
+            for (int j=first; j<count; j++) {
+                message_release(&batch[j]);
+            }
+            return error;
+        }
+    }
+    return SendBatch(batch + first, count - first);
+}
+
+// SIGUSR2 asked for a flush: send one right after the lines sent so far
+static const char* SendRequestedFlush (void) {
+    if (!__atomic_exchange_n(&flushRequested, 0, __ATOMIC_ACQ_REL)) {
+        return NULL;
+    }
+    message_t flush = message_control(MESSAGE_FLUSH);
+    return SendLines(&flush, 1);
+}
+
+// --input: splits the mapped file into lines and hands them to the first
+// plugin in batches, until <END> or the end of the file (which then sends the end of stream)
+static void* MappedInputReaderThread (void* arg) {
+    (void)arg;
+    const text_kernels_t* kernels = text_kernels();
+
+    message_t batch[InputBatchSize];
+    size_t newlines[InputBatchSize];
+    int batchCount = 0;
+    size_t lineStart = 0;
+    const char* error = NULL;
+    int reachedEnd = 0;
+
+    while (error == NULL && !reachedEnd && lineStart < inputMappingSize) {
+        size_t room = InputBatchSize - batchCount;
+        size_t found = kernels->find_newlines(inputMapping + lineStart, inputMappingSize - lineStart, newlines, room);
+        size_t scanStart = lineStart;
+        for (size_t i=0; i<found && error == NULL; i++) {
+            size_t lineEnd = scanStart + newlines[i];
+            size_t length = lineEnd - lineStart;
+            reachedEnd = IsEndLine(inputMapping + lineStart, length);
+            if (reachedEnd) {
+                batch[batchCount++] = message_control(MESSAGE_END);
+            }
+            else {
+                error = AddLine(batch, &batchCount, inputMapping + lineStart, length, 1);
+            }
+            lineStart = lineEnd + 1;
+            if (reachedEnd) {
+                break;
+            }
+        }
+
+        // The last line may have no newline
+        if (error == NULL && !reachedEnd && found < room && lineStart < inputMappingSize) {
+            size_t length = inputMappingSize - lineStart;
+            reachedEnd = IsEndLine(inputMapping + lineStart, length);
+            if (reachedEnd) {
+                batch[batchCount++] = message_control(MESSAGE_END);
+            }
+            else {
+                error = AddLine(batch, &batchCount, inputMapping + lineStart, length, 1);
+            }
+            lineStart = inputMappingSize;
+        }
+        if (error == NULL) {
+            error = SendLines(batch, batchCount);
+            batchCount = 0;
+        }
+        if (error == NULL && !reachedEnd) {
+            error = SendRequestedFlush();
+        }
+    }
+
+    // A file without <END> ends with the file
+    if (error == NULL && !reachedEnd) {
+        message_t end = message_control(MESSAGE_END);
+        error = SendLines(&end, 1);
+    }
+
+    if (error != NULL) {
+        fprintf(stderr, "Error: couldnt send the input to the first plugin. error: %s\n", error);
+    }
+    for (int i=0; i<batchCount; i++) {
+        message_release(&batch[i]);
+    }
+    return NULL;
+}
+
+// Reads stdin with big read calls, splits it into lines and hands them to the
+// first plugin in batches, until <END> or the end of the input (which then sends the end of stream)
+static void* InputReaderThread (void* arg) {
+    (void)arg;
+    const text_kernels_t* kernels = text_kernels();
+
+    size_t bufferSize = InputChunkSize;
+    char* buffer = malloc(bufferSize);
+    if (buffer == NULL) {
+        fprintf(stderr, "Error: couldnt allocate the input buffer\n");
+        return NULL;
+    }
+
+    // The buffer holds [lineStart, filled): the line being read and whatever
+    // came after it. Everything before scanned has no newline
+    size_t lineStart = 0;
+    size_t scanned = 0;
+    size_t filled = 0;
+
+    message_t batch[InputBatchSize];
+    size_t newlines[InputBatchSize];
+    int batchCount = 0;
+    const char* error = NULL;
+
+    while (error == NULL) {
+
+        // Find the next lines in what we have (at most what still fits in the batch)
+        size_t room = InputBatchSize - batchCount;
+        size_t found = kernels->find_newlines(buffer + scanned, filled - scanned, newlines, room);
+        int reachedEnd = 0;
+        for (size_t i=0; i<found && error == NULL; i++) {
+
+            // Replace the newline with a null terminator
+            size_t lineEnd = scanned + newlines[i];
+            buffer[lineEnd] = '\0';
+            size_t length = lineEnd - lineStart;
+
+            // Compare the line to <END> to see if this is the end of the input,
+            // it goes on as an end of stream message (not as a line)
+            if (IsEndLine(buffer + lineStart, length)) {
+                batch[batchCount++] = message_control(MESSAGE_END);
+                reachedEnd = 1;
+                break;
+            }
+            error = AddLine(batch, &batchCount, buffer + lineStart, length, 0);
+            lineStart = lineEnd + 1;
         }
-        
-        // Now start off by sending it to the first plugin in the order
-        // In case there is any error, break out of the loop
-        const char* error = plugins[0].place_work(line);
         if (error != NULL) {
-            fprintf(stderr, "Error: couldnt send the line to the first plugin. error: %s\n", error);
             break;
         }
-        
-        // Compare the line to <END> to see if this is the end signal
-        if (strcmp(line, "<END>") == 0) {
+        if (reachedEnd) {
+            error = SendLines(batch, batchCount);
+            batchCount = 0;
+            break;
+        }
+        if (found == room) {
+            // The batch is full, there can be more lines after it
+            scanned = lineStart;
+            error = SendLines(batch, batchCount);
+            batchCount = 0;
+            continue;
+        }
+        scanned = filled;
+
+        // Everything we have was split, send it before waiting for more input
+        // (the lines in it can point into the buffer), and the flush if one was asked for
+        error = SendLines(batch, batchCount);
+        batchCount = 0;
+        if (error == NULL) {
+            error = SendRequestedFlush();
+        }
+        if (error != NULL) {
+            break;
+        }
+
+        // Move the unfinished line to the front, and make room if it fills the
+        // whole buffer (one byte is always kept for a null terminator)
+        if (lineStart > 0) {
+            memmove(buffer, buffer + lineStart, filled - lineStart);
+            filled -= lineStart;
+            scanned = filled;
+            lineStart = 0;
+        }
+        if (filled + 1 >= bufferSize) {
+            char* biggerBuffer = realloc(buffer, bufferSize * 2);
+            if (biggerBuffer == NULL) {
+                error = "failed to grow the input buffer";
+                break;
+            }
+            buffer = biggerBuffer;
+            bufferSize *= 2;
+        }
+
+        // Wait for more input, or for SIGUSR2 to ask for a flush
+        struct pollfd waitFor[2] = { { STDIN_FILENO, POLLIN, 0 }, { readerWake[0], POLLIN, 0 } };
+        if (poll(waitFor, 2, -1) < 0 && errno != EINTR) {
+            error = strerror(errno);
+            break;
+        }
+        if (waitFor[1].revents & POLLIN) {
+            char wakeUps[64];
+            while (read(readerWake[0], wakeUps, sizeof(wakeUps)) > 0) {
+            }
+            continue;
+        }
+
+        ssize_t bytesRead = read(STDIN_FILENO, buffer + filled, bufferSize - filled - 1);
+        if (bytesRead < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error = strerror(errno);
+            break;
+        }
+        if (bytesRead == 0) {
+
+            // End of the input, the last line may have no newline, and the
+            // end of stream is sent if there was no <END>
+            if (filled > 0 && IsEndLine(buffer, filled)) {
+                batch[batchCount++] = message_control(MESSAGE_END);
+            }
+            else {
+                if (filled > 0) {
+                    buffer[filled] = '\0';
+                    error = AddLine(batch, &batchCount, buffer, filled, 0);
+                }
+                if (error == NULL) {
+                    batch[batchCount++] = message_control(MESSAGE_END);
+                }
+            }
+            if (error == NULL) {
+                error = SendLines(batch, batchCount);
+                batchCount = 0;
+            }
             break;
         }
+        filled += bytesRead;
     }
+
+    if (error != NULL) {
+        fprintf(stderr, "Error: couldnt send the input to the first plugin. error: %s\n", error);
+    }
+
+    // Lines that were split but never sent
+    for (int i=0; i<batchCount; i++) {
+        message_release(&batch[i]);
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Step 5
+// Reading the input gets its own thread, the main thread goes on to step 6 and waits there
+void ReadInputFromSTDIn () {
+    void* (*reader)(void*) = inputFileName != NULL ? MappedInputReaderThread : InputReaderThread;
+
+    if (pthread_create(&inputReaderThread, NULL, reader, NULL) != 0) {
+        // No thread, read it here then
+        reader(NULL);
+        return;
+    }
+    inputReaderStarted = 1;
 }
 
 // Step 6
 void WaitForPluginsToFinish () {
 
+    // The reader is done once it sent <END> (or the input ended)
+    if (inputReaderStarted) {
+        pthread_join(inputReaderThread, NULL);
+        inputReaderStarted = 0;
+    }
+
+    // In pool mode the plugins have no threads, wait for <END> to leave the chain
+    // and then for the workers
+    if (poolWorkers != 0 && stages != NULL) {
+        monitor_wait(&pipelineDoneMonitor);
+        scheduler_destroy(&scheduler);
+    }
+
     // Go over all the plugins and call their wait_finished
     for (int i=0; i<numPlugins; i++) {
-        const char* error = plugins[i].wait_finished();
+        const char* error = PluginWaitFinished(i);
         if (error != NULL) {
             fprintf(stderr, "Error: the plugin - %s couldnt finish. error: %s\n", plugins[i].name, error);
         }
@@ -284,7 +2759,12 @@ void Cleanup () {
         // Call each plugin its fini function
         // Do it within an if statment so that in case the function was not loaded
         // we will avoid a sgementation fault
-        if (plugins[i].fini) {
+        // A plugin that runs as an instance gets it freed too
+        if (plugins[i].instance != NULL) {
+            plugins[i].api.fini(plugins[i].instance);
+            plugins[i].api.destroy(plugins[i].instance);
+        }
+        else if (plugins[i].fini) {
             plugins[i].fini();
         }
 
@@ -298,12 +2778,64 @@ void Cleanup () {
         if (plugins[i].name) {
             free(plugins[i].name);
         }
+
+        // And where its output went
+        free(plugins[i].successors);
+        free(plugins[i].predecessors);
+        if (plugins[i].numPredecessors > 1) {
+            free(plugins[i].mergeBarriers);
+            pthread_mutex_destroy(&plugins[i].mergeLock);
+        }
+    }
+    free(readerSuccessors);
+    readerSuccessors = NULL;
+    numReaderSuccessors = 0;
+
+    // The printers are done with their print orders
+    for (int i=0; i<numPrintOrders; i++) {
+        print_order_destroy(&printOrders[i]);
+    }
+    free(printOrders);
+    printOrders = NULL;
+    numPrintOrders = 0;
+
+    // And the reader's wake up pipe
+    for (int i=0; i<2; i++) {
+        if (readerWake[i] >= 0) {
+            close(readerWake[i]);
+            readerWake[i] = -1;
+        }
     }
     
+    // All the lines we read were consumed, free our buffer pool
+    pool_destroy();
+
+    // Nobody holds a view into the input file anymore
+    if (inputMapping != NULL) {
+        munmap(inputMapping, inputMappingSize);
+        inputMapping = NULL;
+    }
+
+    // And the pool stages, if we ran in the pool
+    if (stages != NULL) {
+        for (int i=0; i<numPlugins; i++) {
+            pthread_mutex_destroy(&stages[i].inboxLock);
+            free(stages[i].inbox);
+        }
+        free(stages);
+        stages = NULL;
+        monitor_destroy(&inFlightMonitor);
+        monitor_destroy(&pipelineDoneMonitor);
+    }
+
     // Free the entire plugin array
     free(plugins);
     plugins = NULL;
     numPlugins = 0;
+
+    // And the CPU list of --cpus
+    free(placementCpus);
+    placementCpus = NULL;
 }
 
 // Step 8
@@ -316,21 +2848,34 @@ int main (int argc, char* argv[]) {
     
     // Step 1
     ParseCommandLineArgs(argc, argv);
+    MapInputFile();
+    BlockStatsSignal();
 
     // Step 2
     LoadPlugins();
+    PlanStageFusion();
+    PlanPrintOrder();
+    PreparePoolStages();
+    PlanPlacement();
 
     // Step 3
     InitializePlugins();
 
     // Step 4
-    AttachPluginsTogether();
+    if (poolWorkers != 0) {
+        StartPool();
+    }
+    else {
+        AttachPluginsTogether();
+    }
+    StartStatsThread();
 
     // Step 5
     ReadInputFromSTDIn();
     
     // Step 6
     WaitForPluginsToFinish();
+    StopStatsThread();
     
     // Step 7
     Cleanup();
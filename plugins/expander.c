@@ -1,55 +1,46 @@
 #include "plugin_common.h"
 #include <string.h>
 #include <stdlib.h>
+#include "text/text_kernels.h"
 
 // From the assignment, this plugin should:
 // "Inserts a single white space between each character in the string."
 
+// The output is n (original) + n-1 (sapces) long
+size_t plugin_max_output_size (size_t inputLength) {
+    return inputLength == 0 ? 0 : inputLength + (inputLength - 1);
+}
+
 // Implemntatoin of own transformation logic:
-const char* plugin_transform (const char* input) {
+// The string grows, so we cant work in place, but we write into the buffer
+// the common code gives us instead of allocating our own
+const char* plugin_transform_into (const message_t* input, char* output, size_t outputCapacity, size_t* outputLength) {
     
     // Safety check for null input to avoid seg faults
-    if (input == NULL) { return NULL; }
+    if (input == NULL || output == NULL || outputLength == NULL) { return "Error, got a NULL message"; }
     
     // Save the length of the input string for memory operations
-    size_t originalLength = strlen(input);
-
-    // Empty string doesnt need transformation, return it as it is
-    if (originalLength == 0) {
-        return strdup(input);
+    size_t originalLength = input->length;
+    size_t newLength = plugin_max_output_size(originalLength);
+    if (outputCapacity < newLength) {
+        return "Error, the output buffer is too small";
     }
     
-    // Now we calculate the length of the new string, which is 
-    // n (original) + n-1 (sapces) 
-    size_t newLength = originalLength + (originalLength - 1);
-    
-    // Allocate memory for the new string (+1 is for null terminator)
-    char* newString = malloc(newLength + 1);
-
-    // Malloc will return null if we are out of memory
-    // This way we check for failures of memory allocation
-    if (newString == NULL) { return NULL; }
-    
-    // Insert spaces between each character
-    // We use indexInString to follow the position in the string we 
-    // return, meaning, after the teansformation
-    size_t indexInString = 0;
-    for (size_t i=0; i<originalLength; i++) {
-        newString[indexInString++] = input[i];
-        
-        // Add space after each character except the last one
-        if (i < originalLength- 1) {
-            newString[indexInString++] = ' ';
-        }
-    }
+    // Insert spaces between each character (SIMD when the CPU has it)
+    text_kernels()->expand(input->data, originalLength, output);
 
-    // Null terminate the string
-    newString[newLength] = '\0';
-    
-    return newString;
+    *outputLength = newLength;
+    return NULL;
 }
 
+// Prints nothing and keeps no state, so it can run on another plugin's thread
+PLUGIN_PURE_TRANSFORM
+
 // Required init function
 const char* plugin_init (int queue_size) {
-    return common_plugin_init(plugin_transform, "expander", queue_size);
-}
\ No newline at end of file
+    plugin_transforms_t transforms = {
+        .max_output_size = plugin_max_output_size,
+        .transform_into = plugin_transform_into
+    };
+    return common_plugin_init_transforms(&transforms, "expander", queue_size);
+}
@@ -1,43 +1,29 @@
 #include "plugin_common.h"
 #include <string.h>
 #include <stdlib.h>
+#include "text/text_kernels.h"
 
 // From the assignment, this plugin should:
 // "Reverses the order of characters in the string."
 
 // Implemntatoin of own transformation logic:
-const char* plugin_transform (const char* input) {
+// The length doesnt change, so we reverse the message in place (no allocation at all)
+const char* plugin_transform_in_place (message_t* message) {
 
     // Safety check for null input to avoid seg faults
-    if (input == NULL) { return NULL; }
+    if (message == NULL) { return "Error, got a NULL message"; }
     
-    // Save the length of the input string for memory operations
-    size_t originalLength = strlen(input);
-
-    // Empty string doesnt need transformation, return it as it is
-    if (originalLength == 0) {
-        return strdup(input);
-    }
-    
-    // Allocate memory for the new string (reverse string is of length n and + 1 for null terminator)
-    char* newString = malloc(originalLength +1);
-
-    // Malloc will return null if we are out of memory
-    // This way we check for failures of memory allocation
-    if (newString == NULL) { return NULL; }
+    // Here we reverse the string (SIMD when the CPU has it)
+    text_kernels()->reverse(message->data, message->length);
     
-    // Here we reverse the string
-    for (size_t i=0; i<originalLength; i++) {
-        newString[i] = input[originalLength - 1 -i];
-    }
-
-    // Add a null terminator
-    newString[originalLength] = '\0';
-    
-    return newString;
+    return NULL;
 }
 
+// Prints nothing and keeps no state, so it can run on another plugin's thread
+PLUGIN_PURE_TRANSFORM
+
 // Required init function
 const char* plugin_init (int queue_size) {
-    return common_plugin_init(plugin_transform, "flipper", queue_size);
-}
\ No newline at end of file
+    plugin_transforms_t transforms = { .transform_in_place = plugin_transform_in_place };
+    return common_plugin_init_transforms(&transforms, "flipper", queue_size);
+}
@@ -1,36 +1,125 @@
 #include "plugin_common.h"
+#include "sync/output_sink.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 
 // From the assignment, this plugin should:
 // "Logs all strings that pass through to standard output."
 
+// The lines are not printed one by one (a write call each), they are collected
+// by an output sink and written in big batches by its own thread
+// Everything an instance has is in its LoggerState, so one loaded copy can
+// log for several stages of the chain
+PLUGIN_INSTANCE_STATE
+
+// With other plugins that print in the chain, a line is logged only after the
+// ones before us printed it, and is written out before anyone after us may
+// print it (through the print order)
+PLUGIN_ORDERED_OUTPUT
+
+typedef struct {
+    output_sink_t sink;
+    int sinkRunning;
+    print_order_t* printOrder; // NULL when we are the only one in the chain that prints
+    int printPosition;
+} LoggerState;
+
+// Set by the host before plugin_init, every instance of this copy uses it
+static output_sink_policy_t g_flushPolicy = {
+    OUTPUT_SINK_DEFAULT_BYTES, OUTPUT_SINK_DEFAULT_LINES, OUTPUT_SINK_DEFAULT_DELAY_MS
+};
+
+// Write everything, stop the writer thread and free the state
+static const char* DestroyLogger (LoggerState* state) {
+    const char* error = NULL;
+    if (state->sinkRunning) {
+        state->sinkRunning = 0;
+        error = output_sink_destroy(&state->sink);
+    }
+    free(state);
+    return error;
+}
+
 // Implemntatoin of own transformation logic:
-const char* plugin_transform (const char* input) {
+// Nothing is changed, the message only gets read and passes on as it is
+// (so a read only view of the input file is never copied here)
+const char* plugin_transform (const message_t* input, message_t* output) {
     
     // Safety check for null input to avoid seg faults    
-    if (input == NULL) { return NULL; }
+    if (input == NULL) { return "Error, got a NULL message"; }
     
     // Logger should print this prefix
-    printf("[logger] %s\n", input);
-    fflush(stdout);
-    
-    // Now we need to pass ad duplication of the original string to the next plugin
-    // So we duplicate it using stduup
-    // strdup allocates memory (behind the scenes) and duplicates the strin
-    char* newString = strdup(input);
+    // The payload is written by its length (it may contain NULs), and the
+    // whole line is one record of the sink, so it is never split between writes
+    struct iovec parts[3] = {
+        { (void*)"[logger] ", 9 },
+        { input->data, input->length },
+        { (void*)"\n", 1 }
+    };
+    LoggerState* state = plugin_state();
+    const char* error;
+    if (state->printOrder == NULL) {
+        error = output_sink_write(&state->sink, parts, 3);
+    }
+    else {
+
+        // Our turn comes after the printers before us, and the line is on stdout before it is
+        // passed on. It is written right here, a handoff to the sink's writer costs more than the write
+        print_order_begin(state->printOrder, state->printPosition, 0);
+        error = output_sink_write_now(&state->sink, parts, 3);
+        print_order_end(state->printOrder, state->printPosition);
+    }
+    if (error != NULL) {
+        return error;
+    }
     
-    // Malloc will return null if we are out of memory
-    // This way we check for failures of memory allocation
-    if (newString == NULL) {
+    // The string goes on to the next plugin unchanged, without a copy
+    *output = *input;
+    return NULL;
+}
+
+// After the last line: write everything and stop the writer thread
+const char* plugin_finish (void) {
+    return DestroyLogger(plugin_state());
+}
+
+// A flush or barrier came: everything logged so far goes out now
+const char* plugin_flush (void) {
+    LoggerState* state = plugin_state();
+    if (!state->sinkRunning) {
         return NULL;
     }
-    
-    return newString;
+    return output_sink_flush(&state->sink);
+}
+
+void plugin_set_flush_policy (size_t max_bytes, size_t max_lines, long max_delay_ms) {
+    g_flushPolicy.max_bytes = max_bytes;
+    g_flushPolicy.max_lines = max_lines;
+    g_flushPolicy.max_delay_ms = max_delay_ms;
 }
 
 // Required init function
 const char* plugin_init (int queue_size) {
-    return common_plugin_init(plugin_transform, "logger", queue_size);
-}
\ No newline at end of file
+    LoggerState* state = calloc(1, sizeof(LoggerState));
+    if (state == NULL) {
+        return "Error, failed to allocate the logger";
+    }
+    const char* error = output_sink_init(&state->sink, STDOUT_FILENO, &g_flushPolicy);
+    if (error != NULL) {
+        free(state);
+        return error;
+    }
+    state->sinkRunning = 1;
+    state->printOrder = plugin_print_order(&state->printPosition);
+
+    plugin_transforms_t transforms = {
+        .transform = plugin_transform, .finish = plugin_finish, .flush = plugin_flush, .state = state
+    };
+    error = common_plugin_init_transforms(&transforms, "logger", queue_size);
+    if (error != NULL) {
+        DestroyLogger(state);
+    }
+    return error;
+}
@@ -0,0 +1,147 @@
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Function that gives a message's data back to whoever allocated it.
+ * Every plugin .so is dlopen'ed once in the main namespace, only a plugin that
+ * cant run as several instances gets extra copies with dlmopen, each with its
+ * own libc. The data may come from a module's own slab pool, or from the
+ * malloc of such a dlmopen'ed copy, and only that allocator can take it back.
+ * That is why the release function travels together with the data
+ */
+typedef void (*message_release_t)(void*);
+
+/**
+ * One buffer owned by several messages at once (a stage that sends every
+ * message to more than one stage after it, fan-out). Each of them is a read
+ * only view of the same data, and the last one to be released gives the
+ * buffer back through release. Whoever shares a message makes this, usually
+ * as the first member of a struct that also keeps the original message
+ */
+typedef struct message_shared
+{
+ int references; /* Messages that still point at the buffer */
+ void (*release)(struct message_shared* shared); /* Called once, by the last of them */
+} message_shared_t;
+
+/**
+ * What a message is. Everything but MESSAGE_DATA is a control message: it is
+ * not a line, no plugin processes it, every stage passes it on in order after
+ * everything that came before it
+ */
+typedef enum
+{
+ MESSAGE_DATA = 0, /* A line */
+ MESSAGE_END, /* End of the stream, nothing comes after it */
+ MESSAGE_FLUSH, /* Write out the buffered output of everything before it */
+ MESSAGE_BARRIER /* Like flush, and a stage with several inputs passes it on only once it came from all of them */
+} message_kind_t;
+
+/**
+ * A message moving between plugins. Whoever holds it owns data and must
+ * either pass the message on or call message_release when done with it.
+ * length is the size of the payload, so nobody has to run strlen on it and
+ * the payload may contain NUL bytes. data[length] is always a NUL, so old
+ * style plugins can still treat data as a C string.
+ * sequence lets a stage with several worker threads put its results back in
+ * the order the messages arrived.
+ * A read_only message is a view into memory nobody may write (the mapped input
+ * file): it has no NUL after the payload and must be copied before it is
+ * changed in place or used as a C string (plugin_message_make_writable)
+ * ingress_ns is when the input reader handed the line to the pipeline and
+ * stays with the line through every stage, enqueue_ns is when it was put into
+ * the queue it is in now (both message_clock_ns, 0 when unknown)
+ * A shared message is one of several views of the same buffer (always
+ * read_only), message_release only gives the buffer back with the last one
+ * kind tells a line from a control message with one compare, so no line is
+ * ever taken for one (control messages are made by message_control)
+ */
+typedef struct
+{
+ char* data; /* Payload, followed by a NUL terminator */
+ size_t length; /* Number of bytes in data (not counting the terminator) */
+ message_release_t release; /* How to free data */
+ size_t sequence; /* Position in the stream, stamped by the last queue it went through */
+ int read_only; /* data is a view that must not be written, and has no NUL terminator */
+ uint64_t ingress_ns; /* When the line entered the pipeline, for the end to end latency */
+ uint64_t enqueue_ns; /* When the message was put into its current queue, for the queue wait */
+ message_shared_t* shared; /* NULL unless the buffer is shared with other messages */
+ message_kind_t kind; /* MESSAGE_DATA for a line, otherwise a control message */
+} message_t;
+
+/**
+ * Give a message's data back: release(data), or for a shared message drop
+ * its reference (the buffer goes back when it was the last one)
+ * @param message The message, not usable anymore afterwards
+ */
+static inline void message_release (const message_t* message) {
+    message_shared_t* shared = message->shared;
+    if (shared == NULL) {
+        message->release(message->data);
+        return;
+    }
+    if (__atomic_sub_fetch(&shared->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        shared->release(shared);
+    }
+}
+
+/**
+ * The clock of ingress_ns and enqueue_ns (monotonic, in nanoseconds)
+ * @return The time now
+ */
+static inline uint64_t message_clock_ns (void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+// What an end of stream message carries, so a plugin that only sees strings
+// (and the input, unless --no-end-line) still knows it as <END>
+#define MESSAGE_END_SIGNAL "<END>"
+#define MESSAGE_END_SIGNAL_LENGTH (sizeof(MESSAGE_END_SIGNAL) - 1)
+
+/**
+ * Check if a message is the end of stream (its kind, the payload is never looked at)
+ * @param message The message to check
+ * @return 1 if it is the end, 0 otherwise
+ */
+static inline int message_is_end (const message_t* message) {
+    return message->kind == MESSAGE_END;
+}
+
+/**
+ * Check if a message is a control message (anything but a line)
+ * @param message The message to check
+ * @return 1 if it is a control message, 0 for a line
+ */
+static inline int message_is_control (const message_t* message) {
+    return message->kind != MESSAGE_DATA;
+}
+
+// Release function of control messages, their data is a constant
+static inline void message_keep_control (void* data) {
+    (void)data;
+}
+
+/**
+ * Make a control message. Its data is a constant (<END> for the end of the
+ * stream, empty for the others) that needs no release
+ * @param kind What the message is (not MESSAGE_DATA)
+ * @return The message
+ */
+static inline message_t message_control (message_kind_t kind) {
+    message_t message = { 0 };
+    message.data = (char*)(kind == MESSAGE_END ? MESSAGE_END_SIGNAL : "");
+    message.length = kind == MESSAGE_END ? MESSAGE_END_SIGNAL_LENGTH : 0;
+    message.release = message_keep_control;
+    message.read_only = 1;
+    message.kind = kind;
+    return message;
+}
+
+#endif
@@ -0,0 +1,121 @@
+#include "latency_histogram.h"
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Bucket of a value: below 2*SUB_COUNT the value itself, above that the top
+// SUB_BITS+1 bits of the value (which always start with a 1) plus how far
+// they had to be shifted down
+static size_t BucketOf (uint64_t ns) {
+    if (ns > LATENCY_HISTOGRAM_MAX_NS) {
+        ns = LATENCY_HISTOGRAM_MAX_NS;
+    }
+    if (ns < 2 * LATENCY_HISTOGRAM_SUB_COUNT) {
+        return (size_t)ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    int shift = exponent - LATENCY_HISTOGRAM_SUB_BITS;
+    return (size_t)shift * LATENCY_HISTOGRAM_SUB_COUNT + (size_t)(ns >> shift);
+}
+
+// Largest value that falls into a bucket
+static uint64_t BucketTop (size_t bucket) {
+    if (bucket < 2 * LATENCY_HISTOGRAM_SUB_COUNT) {
+        return bucket;
+    }
+    size_t shift = bucket / LATENCY_HISTOGRAM_SUB_COUNT - 1;
+    uint64_t mantissa = bucket - shift * LATENCY_HISTOGRAM_SUB_COUNT;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void latency_histogram_record (latency_histogram_t* histogram, uint64_t ns) {
+    __atomic_fetch_add(&histogram->counts[BucketOf(ns)], 1, __ATOMIC_RELAXED);
+
+    // A new max is rare, so this loop almost never runs
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (ns > max &&
+           !__atomic_compare_exchange_n(&histogram->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void latency_histogram_copy (latency_histogram_t* dest, const latency_histogram_t* src) {
+    for (size_t i=0; i<LATENCY_HISTOGRAM_BUCKETS; i++) {
+        dest->counts[i] = __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+    }
+    dest->max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+}
+
+void latency_histogram_merge (latency_histogram_t* dest, const latency_histogram_t* src) {
+    for (size_t i=0; i<LATENCY_HISTOGRAM_BUCKETS; i++) {
+        dest->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+    }
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (max > dest->max) {
+        dest->max = max;
+    }
+}
+
+uint64_t latency_histogram_count (const latency_histogram_t* histogram) {
+    uint64_t count = 0;
+    for (size_t i=0; i<LATENCY_HISTOGRAM_BUCKETS; i++) {
+        count += histogram->counts[i];
+    }
+    return count;
+}
+
+uint64_t latency_histogram_percentile (const latency_histogram_t* histogram, double percentile) {
+    uint64_t count = latency_histogram_count(histogram);
+    if (count == 0) {
+        return 0;
+    }
+
+    // The rank of the value we look for (at least the first one)
+    double wanted = percentile / 100.0 * (double)count;
+    uint64_t rank = (uint64_t)wanted;
+    if ((double)rank < wanted || rank == 0) {
+        rank++;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i=0; i<LATENCY_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+
+            // The last bucket also holds everything above the range
+            if (i == LATENCY_HISTOGRAM_BUCKETS - 1) {
+                return histogram->max;
+            }
+            uint64_t top = BucketTop(i);
+            return top < histogram->max ? top : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+static uint64_t NowNs (void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+double latency_histogram_overhead_ns (void) {
+    latency_histogram_t* scratch = calloc(1, sizeof(latency_histogram_t));
+    if (scratch == NULL) {
+        return 0;
+    }
+
+    // Values spread over a few buckets, like real latencies would be
+    const int rounds = 20000;
+    uint64_t start = NowNs();
+    uint64_t previous = start;
+    for (int i=0; i<rounds; i++) {
+        uint64_t now = NowNs();
+        latency_histogram_record(scratch, now - previous + (uint64_t)(i & 1023));
+        latency_histogram_record(scratch, now - start);
+        previous = now;
+    }
+    double overhead = (double)(NowNs() - start) / rounds;
+
+    free(scratch);
+    return overhead;
+}
@@ -0,0 +1,72 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Log-linear (HDR style) histogram of latencies in nanoseconds
+ * Values below 64ns have a bucket each, above that every power of 2 is split
+ * into 32 buckets, so a percentile is off by at most 1/32 (about 3%) of its
+ * value, whatever the scale. Values above LATENCY_HISTOGRAM_MAX_NS all land in
+ * the last bucket (max is still exact).
+ * Recording is a couple of relaxed atomic adds, so several threads can record
+ * into the same histogram and the host can read it while they do
+ */
+
+// Sub buckets per power of 2 (2^5 = 32)
+#define LATENCY_HISTOGRAM_SUB_BITS 5
+#define LATENCY_HISTOGRAM_SUB_COUNT (1 << LATENCY_HISTOGRAM_SUB_BITS)
+
+// Largest power of 2 that still gets its own buckets (2^40ns is about 18 minutes)
+#define LATENCY_HISTOGRAM_MAX_EXPONENT 40
+#define LATENCY_HISTOGRAM_MAX_NS ((1ull << (LATENCY_HISTOGRAM_MAX_EXPONENT + 1)) - 1)
+#define LATENCY_HISTOGRAM_BUCKETS \
+    ((LATENCY_HISTOGRAM_MAX_EXPONENT - LATENCY_HISTOGRAM_SUB_BITS + 1) * LATENCY_HISTOGRAM_SUB_COUNT + LATENCY_HISTOGRAM_SUB_COUNT)
+
+typedef struct
+{
+ uint64_t counts[LATENCY_HISTOGRAM_BUCKETS]; /* Number of values in every bucket */
+ uint64_t max; /* Largest value recorded (exact) */
+} latency_histogram_t;
+
+/**
+ * Add one value to the histogram, can be called from any thread
+ * @param histogram The histogram (zeroed memory is an empty histogram)
+ * @param ns The value in nanoseconds
+ */
+void latency_histogram_record(latency_histogram_t* histogram, uint64_t ns);
+/**
+ * Copy a histogram that other threads may still record into
+ * @param dest Receives the copy
+ * @param src The histogram to copy
+ */
+void latency_histogram_copy(latency_histogram_t* dest, const latency_histogram_t* src);
+/**
+ * Add all the values of src to dest (dest must not be recorded into meanwhile)
+ * @param dest The histogram to add to
+ * @param src The histogram to add
+ */
+void latency_histogram_merge(latency_histogram_t* dest, const latency_histogram_t* src);
+/**
+ * Number of values in the histogram
+ * @param histogram The histogram
+ * @return The number of values
+ */
+uint64_t latency_histogram_count(const latency_histogram_t* histogram);
+/**
+ * The value that percentile percent of the values are at or below (the top of
+ * its bucket, but never above max)
+ * @param histogram The histogram
+ * @param percentile Between 0 and 100, e.g. 99.9
+ * @return The value in nanoseconds, 0 for an empty histogram
+ */
+uint64_t latency_histogram_percentile(const latency_histogram_t* histogram, double percentile);
+/**
+ * Measure what the latency tracking costs per message and stage here: one
+ * clock read and two histogram records (queue wait and service time)
+ * @return Nanoseconds per message
+ */
+double latency_histogram_overhead_ns(void);
+
+#endif
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include "latency_histogram.h"
+
+// Configuration
+#define NumThreads 4
+#define ValuesPerThread 100000
+
+static latency_histogram_t sharedHistogram;
+
+// The percentile is the top of its bucket, so it may be up to 1/32 above the real value
+void checkClose (uint64_t actual, uint64_t expected) {
+    assert(actual >= expected);
+    assert(actual - expected <= expected / LATENCY_HISTOGRAM_SUB_COUNT + 1);
+}
+
+// Test 1: Small values are exact, an empty histogram says 0
+void testSmallValues () {
+    printf("Test 1: Small values: ");
+    latency_histogram_t* histogram = calloc(1, sizeof(latency_histogram_t));
+    assert(histogram != NULL);
+
+    assert(latency_histogram_percentile(histogram, 50) == 0);
+    for (uint64_t i=1; i<=50; i++) {
+        latency_histogram_record(histogram, i);
+    }
+    assert(latency_histogram_count(histogram) == 50);
+    assert(latency_histogram_percentile(histogram, 50) == 25);
+    assert(latency_histogram_percentile(histogram, 90) == 45);
+    assert(latency_histogram_percentile(histogram, 100) == 50);
+    assert(latency_histogram_percentile(histogram, 0) == 1);
+
+    free(histogram);
+    printf("pass\n");
+}
+
+// Test 2: Values over many scales stay within the precision, and max is exact
+void testScales () {
+    printf("Test 2: Log-linear precision: ");
+    latency_histogram_t* histogram = calloc(1, sizeof(latency_histogram_t));
+    assert(histogram != NULL);
+
+    // 1000 values: 1us .. 1000us
+    for (uint64_t i=1; i<=1000; i++) {
+        latency_histogram_record(histogram, i * 1000);
+    }
+    checkClose(latency_histogram_percentile(histogram, 50), 500000);
+    checkClose(latency_histogram_percentile(histogram, 99), 990000);
+    checkClose(latency_histogram_percentile(histogram, 99.9), 999000);
+    assert(latency_histogram_percentile(histogram, 100) == 1000000);
+    assert(histogram->max == 1000000);
+
+    // Way above the range, still counted, and the max stays exact
+    latency_histogram_record(histogram, LATENCY_HISTOGRAM_MAX_NS * 4);
+    assert(latency_histogram_count(histogram) == 1001);
+    assert(latency_histogram_percentile(histogram, 100) == LATENCY_HISTOGRAM_MAX_NS * 4);
+
+    free(histogram);
+    printf("pass\n");
+}
+
+// Test 3: Copy and merge
+void testCopyMerge () {
+    printf("Test 3: Copy and merge: ");
+    latency_histogram_t* first = calloc(1, sizeof(latency_histogram_t));
+    latency_histogram_t* second = calloc(1, sizeof(latency_histogram_t));
+    latency_histogram_t* total = calloc(1, sizeof(latency_histogram_t));
+    assert(first != NULL && second != NULL && total != NULL);
+
+    for (uint64_t i=0; i<100; i++) {
+        latency_histogram_record(first, 100);
+        latency_histogram_record(second, 10000);
+    }
+    latency_histogram_copy(total, first);
+    latency_histogram_merge(total, second);
+    assert(latency_histogram_count(total) == 200);
+    checkClose(latency_histogram_percentile(total, 50), 100);
+    checkClose(latency_histogram_percentile(total, 51), 10000);
+    assert(total->max == 10000);
+
+    free(first);
+    free(second);
+    free(total);
+    printf("pass\n");
+}
+
+void* recorder (void* arg) {
+    uint64_t value = (uint64_t)(size_t)arg;
+    for (int i=0; i<ValuesPerThread; i++) {
+        latency_histogram_record(&sharedHistogram, value);
+    }
+    return NULL;
+}
+
+// Test 4: Several threads recording into one histogram lose nothing
+void testThreads () {
+    printf("Test 4: Concurrent recording: ");
+    pthread_t threads[NumThreads];
+    for (int i=0; i<NumThreads; i++) {
+        pthread_create(&threads[i], NULL, recorder, (void*)(size_t)(1000 * (i + 1)));
+    }
+    for (int i=0; i<NumThreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    assert(latency_histogram_count(&sharedHistogram) == (uint64_t)NumThreads * ValuesPerThread);
+    assert(sharedHistogram.max == 1000 * NumThreads);
+    printf("pass\n");
+}
+
+int main () {
+    printf("Latency Histogram Unit Test\n\n");
+
+    testSmallValues();
+    testScales();
+    testCopyMerge();
+    testThreads();
+
+    printf("Recording overhead: %.1f ns per message\n", latency_histogram_overhead_ns());
+    printf("\nAll the tests passed\n");
+    return 0;
+}
@@ -1,83 +1,630 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <pthread.h>
 #include "plugin_common.h"
+#include "sync/pool.h"
 
-// Global plugin context
-// each plugin shared object will have its own instance
-// Initailized with all struct members to 0
-static plugin_context_t g_plugin_context = {0};
+// One instance of the plugin: its context, and what the host asked for before
+// init (kept outside the context since init clears the context)
+struct plugin_instance {
+    plugin_context_t context;
+    int inlined; // Set by set_inline
+    int replicas; // Set by set_replicas
+    consumer_producer_budget_t* queueBudget; // Set by set_queue_budget, NULL keeps the queue size fixed
+    print_order_t* printOrder; // Set by set_print_order, NULL when the plugin prints on its own
+    int printPosition; // The instance's position in printOrder
+};
+
+// Global plugin instance, the one the version 1 functions (plugin_init, ...) work on
+// each plugin shared object (each load of it) will have its own
+// Initailized with all struct members to 0, except for the single replica
+static plugin_instance_t g_plugin = { .replicas = 1 };
+
+// g_plugin was handed out by plugin_create
+static int g_pluginCreated = 0;
+
+// The instance being initialized. The plugin's own plugin_init doesnt know
+// about instances, so common_plugin_init* takes the instance from here
+// (plugin_instance_init sets it, holding the lock while plugin_init runs)
+static plugin_instance_t* g_initializing = &g_plugin;
+static pthread_mutex_t g_instanceLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Initialized instances, they all share our buffer pool so it goes with the last one
+static int g_liveInstances = 0;
+
+// Defined by PLUGIN_PURE_TRANSFORM, weak so it is NULL in the other plugins
+extern const int plugin_pure_transform __attribute__((weak));
+
+// Defined by PLUGIN_INSTANCE_STATE, the same way
+extern const int plugin_instance_state __attribute__((weak));
+
+// The instance whose plugin function (transform, finish, flush) runs on this
+// thread right now, plugin_state gives its state
+static __thread plugin_context_t* g_runningContext = NULL;
+
+// A stage fused into this plugin, either a version 1 process_message or one of another instance
+typedef struct PluginFusedStage {
+    const char* (*process_message)(message_t*, message_t*);
+    plugin_fused_stage_t instanceStage;
+} PluginFusedStage;
+
+// One consumer thread of a replicated stage
+typedef struct {
+    plugin_context_t* context;
+    monitor_t windowMonitor; // Signaled whenever the reorder window moves
+} PluginReplica;
+
+// The replicas take messages from the queue in order, but finish them in any
+// order. Their results wait here (by sequence number) until everything before
+// them was passed on, so the next plugin sees the original order
+typedef struct PluginReorder {
+    pthread_mutex_t lock; // Held while inserting and while passing messages on
+    message_t slots[PLUGIN_REORDER_WINDOW]; // Waiting results, at sequence % PLUGIN_REORDER_WINDOW
+    char filled[PLUGIN_REORDER_WINDOW]; // Which slots hold a result
+    size_t nextSequence; // The next message to pass on
+    int ended; // <END> was passed on, anything after it is dropped
+    PluginReplica* replicas; // All the replicas, to wake the ones waiting for the window
+} PluginReorder;
+
+// Once a replica takes <END> it sends this to each of the other replicas so
+// they stop too. It is an end of stream message, but only this exact buffer counts as a stop
+static char g_replicaStop[] = MESSAGE_END_SIGNAL;
+
+// The stop for one of the other replicas (g_replicaStop is never freed)
+static message_t ReplicaStop (void) {
+    message_t stop = message_control(MESSAGE_END);
+    stop.data = g_replicaStop;
+    return stop;
+}
+
+// Counters of a batch, collected in locals on the consumer thread and added to
+// the plugin's stats once per batch, so the shared counters are touched rarely
+typedef struct {
+    uint64_t messagesIn;
+    uint64_t messagesOut;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    uint64_t transformNs;
+} PluginStatsDelta;
+
+// Add a batch's counters to the plugin's stats. Relaxed is enough, the
+// counters dont order anything, they are only read for the report
+static void StatsAdd (plugin_context_t* pluginContext, const PluginStatsDelta* delta) {
+    if (delta->messagesIn == 0) {
+        return;
+    }
+    plugin_stats_t* stats = &pluginContext->stats;
+    __atomic_fetch_add(&stats->messages_in, delta->messagesIn, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->messages_out, delta->messagesOut, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->bytes_in, delta->bytesIn, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->bytes_out, delta->bytesOut, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->transform_ns, delta->transformNs, __ATOMIC_RELAXED);
+}
+
+// How long the messages we just took waited in our queue (one clock read for the batch)
+// Control messages (and the replicas' stop) are not lines, so they are not counted
+static void RecordQueueWait (plugin_context_t* pluginContext, const message_t* messages, int count) {
+    uint64_t now = message_clock_ns();
+    for (int i=0; i<count; i++) {
+        if (messages[i].enqueue_ns != 0 && !message_is_control(&messages[i])) {
+            latency_histogram_record(&pluginContext->queue_wait, now - messages[i].enqueue_ns);
+        }
+    }
+}
+
+// Run the plugin's finish function once, after its last message
+// (on the consumer thread after <END>, and for inline plugins when the host waits for them)
+static void FinishPlugin (plugin_context_t* pluginContext) {
+    if (pluginContext->transforms.finish == NULL ||
+            __atomic_exchange_n(&pluginContext->finish_called, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    plugin_context_t* previous = g_runningContext;
+    g_runningContext = pluginContext;
+    const char* error = pluginContext->transforms.finish();
+    g_runningContext = previous;
+    if (error != NULL) {
+        log_error(pluginContext, error);
+    }
+}
+
+// A flush or barrier passed us: write out what the plugin buffered for the
+// messages before it (everything before it was processed already)
+static void FlushPlugin (plugin_context_t* pluginContext) {
+    if (pluginContext->transforms.flush == NULL) {
+        return;
+    }
+    plugin_context_t* previous = g_runningContext;
+    g_runningContext = pluginContext;
+    const char* error = pluginContext->transforms.flush();
+    g_runningContext = previous;
+    if (error != NULL) {
+        log_error(pluginContext, error);
+    }
+}
+
+// Send a batch of processed messages to the next plugin (if there is one)
+static void ForwardBatch (plugin_context_t* pluginContext, const message_t* processedBatch, int processedCount) {
+    
+    if (processedCount == 0) {
+        return;
+    }
+
+    // Prefer the batch entry point, the messages move on without a copy
+    // and with one queue round trip for all of them
+    if (pluginContext->next_instance_place_work_batch != NULL || pluginContext->next_place_work_batch != NULL) {
+        const char* error = pluginContext->next_instance_place_work_batch != NULL
+            ? pluginContext->next_instance_place_work_batch(pluginContext->next_instance, processedBatch, processedCount)
+            : pluginContext->next_place_work_batch(processedBatch, processedCount);
+        if (error != NULL) {
+            log_error(pluginContext, error);
+        }
+        return;
+    }
+
+    // Otherwise pass them one by one, the next plugin makes its own copy
+    // (of a C string, so read only views need a terminated copy first).
+    // A string has no kind, so only the end of the stream (as <END>) gets there
+    if (pluginContext->next_place_work != NULL) {
+        for (int i=0; i<processedCount; i++) {
+            message_t message = processedBatch[i];
+            if (message_is_control(&message) && !message_is_end(&message)) {
+                message_release(&message);
+                continue;
+            }
+            const char* error = plugin_message_make_writable(&message);
+            if (error == NULL) {
+                error = pluginContext->next_place_work(message.data);
+            }
+            message_release(&message);
+            if (error != NULL) {
+                log_error(pluginContext, error);
+            }
+        }
+        return;
+    }
+
+    // If there is no next plugin this is the last one, the lines leave the
+    // chain here (control messages are not lines, and lines that lost their stamp dont count)
+    uint64_t now = message_clock_ns();
+    for (int i=0; i<processedCount; i++) {
+        if (processedBatch[i].ingress_ns != 0 && !message_is_control(&processedBatch[i])) {
+            latency_histogram_record(&pluginContext->end_to_end, now - processedBatch[i].ingress_ns);
+        }
+        message_release(&processedBatch[i]);
+    }
+}
+
+// Run the plugin's processing function on one message (which we own)
+// Old style plugins get the payload as a C string, and their result is measured once here
+static const char* ProcessMessage (plugin_context_t* pluginContext, message_t* input, message_t* output) {
+    const plugin_transforms_t* transforms = &pluginContext->transforms;
+
+    // Best case, the plugin rewrites the buffer we already have
+    // (a read only view is copied first, the only case where we need one)
+    if (transforms->transform_in_place != NULL) {
+        const char* error = plugin_message_make_writable(input);
+        if (error != NULL) {
+            return error;
+        }
+        error = transforms->transform_in_place(input);
+        if (error == NULL) {
+            input->data[input->length] = '\0';
+            *output = *input;
+        }
+        return error;
+    }
+
+    // Next best, we give it a buffer from our pool of the size it asks for
+    if (transforms->transform_into != NULL) {
+        size_t outputCapacity = transforms->max_output_size(input->length);
+        char* buffer = plugin_message_alloc(output, outputCapacity);
+        if (buffer == NULL) {
+            return "Error, failed to allocate the output buffer";
+        }
+
+        size_t outputLength = 0;
+        const char* error = transforms->transform_into(input, buffer, outputCapacity, &outputLength);
+        if (error != NULL || outputLength > outputCapacity) {
+            output->release(buffer);
+            return error ? error : "Error, the plugin wrote more than it asked for";
+        }
+        buffer[outputLength] = '\0';
+        output->length = outputLength;
+        return NULL;
+    }
+
+    if (transforms->transform != NULL) {
+        return transforms->transform(input, output);
+    }
+
+    // Old style plugins need the NUL terminator
+    const char* error = plugin_message_make_writable(input);
+    if (error != NULL) {
+        return error;
+    }
+    const char* proccessedString = pluginContext->process_function(input->data);
+    if (proccessedString == NULL) {
+        return "Error, failed to process an item";
+    }
+
+    // Same buffer back means the string passes through unchanged
+    if (proccessedString == input->data) {
+        *output = *input;
+        return NULL;
+    }
+
+    // The new string was allocated here, so it goes with our free
+    output->data = (char*)proccessedString;
+    output->length = strlen(proccessedString);
+    output->release = free;
+    output->read_only = 0;
+    output->shared = NULL;
+    output->kind = MESSAGE_DATA;
+    return NULL;
+}
+
+// Process a message we own, then run the result through the fused stages (if any)
+// The input is always consumed: it either becomes the output or is released here
+// Only our own processing is counted in delta, the fused stages count themselves
+static const char* ProcessOwnedMessage (plugin_context_t* pluginContext, message_t* input, message_t* output, PluginStatsDelta* delta) {
+    size_t sequence = input->sequence;
+    uint64_t ingress = input->ingress_ns;
+    delta->messagesIn++;
+    delta->bytesIn += input->length;
+    uint64_t startNs = message_clock_ns();
+    plugin_context_t* previous = g_runningContext;
+    g_runningContext = pluginContext;
+    const char* error = ProcessMessage(pluginContext, input, output);
+    g_runningContext = previous;
+    uint64_t serviceNs = message_clock_ns() - startNs;
+    delta->transformNs += serviceNs;
+    latency_histogram_record(&pluginContext->service, serviceNs);
+    if (error == NULL) {
+        delta->messagesOut++;
+        delta->bytesOut += output->length;
+    }
+
+    // Plugins that dont change the string give us the same buffer back,
+    // so the message moves on untouched, without any allocation.
+    // Otherwise we are done with the original
+    if (error != NULL || output->data != input->data) {
+        message_release(input);
+    }
+    if (error != NULL) {
+        return error;
+    }
+
+    // The fused stages take the message from us one after the other,
+    // exactly like their own consumer threads would have
+    for (int i=0; i<pluginContext->fused_count; i++) {
+        const PluginFusedStage* stage = &pluginContext->fused_stages[i];
+        message_t nextOutput;
+        error = stage->process_message != NULL
+            ? stage->process_message(output, &nextOutput)
+            : stage->instanceStage.process_message(stage->instanceStage.instance, output, &nextOutput);
+        if (error != NULL) {
+            return error;
+        }
+        *output = nextOutput;
+    }
+
+    // The result takes the place of the input in the stream
+    output->sequence = sequence;
+    output->ingress_ns = ingress;
+    return NULL;
+}
 
 void* plugin_consumer_thread (void* arg) {
     plugin_context_t* pluginContext = (plugin_context_t*)arg;
+
+    // Messages we took from the queue and what we made of them
+    message_t itemsFromQueue[PLUGIN_BATCH_SIZE];
+    message_t processedBatch[PLUGIN_BATCH_SIZE];
+    int reachedEnd = 0;
     
     // Contine to procces items the queue unitl <END>
-    while (1) {
+    while (!reachedEnd) {
         
-        // Get item from the queue 
+        // Get everything that is waiting in the queue (up to PLUGIN_BATCH_SIZE)
         // blocks if empty
-        char* itemFromQueue = consumer_producer_get(pluginContext->queue);
+        int batchCount = consumer_producer_get_messages(pluginContext->queue, itemsFromQueue, PLUGIN_BATCH_SIZE);
         
         // This shouldnt happen so its a safety check
-        if (itemFromQueue == NULL) {
+        if (batchCount <= 0) {
             log_error(pluginContext, "Received NULL item from queue");
-            break;
+            return NULL;
         }
+
+        RecordQueueWait(pluginContext, itemsFromQueue, batchCount);
+
+        int processedCount = 0;
+        PluginStatsDelta delta = {0};
+        for (int i=0; i<batchCount; i++) {
+            message_t itemFromQueue = itemsFromQueue[i];
+
+            // Nothing should come after <END>, but if it does, drop it
+            if (reachedEnd) {
+                message_release(&itemFromQueue);
+                continue;
+            }
         
-        // Check if recieved <END>
-        if (strcmp(itemFromQueue, "<END>") == 0) {
-            
-            // Process the <END> signal first
-            if (pluginContext->next_place_work != NULL) {
-            
-                // Pass end signal (<END>) to the next plugin
-                const char* error = pluginContext->next_place_work(itemFromQueue);
-                if (error != NULL) {
-                    log_error(pluginContext, error);
+            // Check if recieved a control message (<END>, flush or barrier), one compare of its kind
+            // It is passed on as is to the next plugin after everything before it,
+            // and a flush or barrier first writes out what we buffered for those
+            if (message_is_control(&itemFromQueue)) {
+                reachedEnd = message_is_end(&itemFromQueue);
+                if (!reachedEnd) {
+                    FlushPlugin(pluginContext);
                 }
+                processedBatch[processedCount++] = itemFromQueue;
+                continue;
+            }
+        
+            // Now we reached here so its a line
+            // Process the message using the required plugin function
+            // (the original item is freed there once we are done with it)
+            message_t processedMessage;
+            const char* processError = ProcessOwnedMessage(pluginContext, &itemFromQueue, &processedMessage, &delta);
+            if (processError != NULL) {
+                log_error(pluginContext, processError);
+                continue;
             }
-            
-            // Free the <END> string
-            free(itemFromQueue);
-            
-            // Set the finished flag to 1
-            // Also signal completion
-            pluginContext->finished = 1;
-            consumer_producer_signal_finished(pluginContext->queue);
+            processedBatch[processedCount++] = processedMessage;
+
+            // A printer in a print order passes every line on before it prints
+            // the next one, the printers after it may have to print this one first
+            if (pluginContext->forward_each) {
+                ForwardBatch(pluginContext, processedBatch, processedCount);
+                processedCount = 0;
+            }
+        }
+        StatsAdd(pluginContext, &delta);
+
+        // Hand the whole batch to the next plugin
+        ForwardBatch(pluginContext, processedBatch, processedCount);
+    }
+
+    // Set the finished flag to 1
+    // Also signal completion
+    FinishPlugin(pluginContext);
+    pluginContext->finished = 1;
+    consumer_producer_signal_finished(pluginContext->queue);
+    
+    return NULL;
+}
+
+// Pass on everything in the reorder buffer that is now in order
+// Called with the reorder lock held, so only one replica passes messages on at a time
+static void ReorderDrain (plugin_context_t* pluginContext) {
+    PluginReorder* reorder = pluginContext->reorder;
+    size_t firstSequence = reorder->nextSequence;
+    message_t ready[PLUGIN_BATCH_SIZE];
+    int readyCount = 0;
+
+    while (reorder->filled[reorder->nextSequence % PLUGIN_REORDER_WINDOW]) {
+        size_t slot = reorder->nextSequence % PLUGIN_REORDER_WINDOW;
+        message_t message = reorder->slots[slot];
+        reorder->filled[slot] = 0;
+        reorder->nextSequence++;
+
+        // A message that failed to process leaves an empty slot, so the ones after it can go
+        if (message.data == NULL) {
+            continue;
+        }
+
+        // Nothing should come after <END>, but if it does, drop it
+        if (reorder->ended) {
+            message_release(&message);
+            continue;
+        }
+        if (message_is_end(&message)) {
+            reorder->ended = 1;
+        }
+
+        ready[readyCount++] = message;
+        if (readyCount == PLUGIN_BATCH_SIZE) {
+            ForwardBatch(pluginContext, ready, readyCount);
+            readyCount = 0;
+        }
+    }
+    ForwardBatch(pluginContext, ready, readyCount);
+
+    // The window moved, wake up the replicas that wait for it
+    if (reorder->nextSequence != firstSequence) {
+        for (int i=0; i<pluginContext->replica_count; i++) {
+            monitor_signal(&reorder->replicas[i].windowMonitor);
+        }
+    }
+}
+
+// Put a replica's results into the reorder buffer, and pass on whatever is in order
+static void ReorderInsert (plugin_context_t* pluginContext, PluginReplica* replica, const message_t* messages, int count) {
+    PluginReorder* reorder = pluginContext->reorder;
+
+    pthread_mutex_lock(&reorder->lock);
+    for (int i=0; i<count; i++) {
+
+        // Too far ahead, wait until the older messages were passed on.
+        // The replica with the oldest message never waits here, so this always ends
+        while (messages[i].sequence - reorder->nextSequence >= PLUGIN_REORDER_WINDOW) {
+            monitor_reset(&replica->windowMonitor);
+            pthread_mutex_unlock(&reorder->lock);
+            monitor_wait(&replica->windowMonitor);
+            pthread_mutex_lock(&reorder->lock);
+        }
+
+        size_t slot = messages[i].sequence % PLUGIN_REORDER_WINDOW;
+        reorder->slots[slot] = messages[i];
+        reorder->filled[slot] = 1;
+        ReorderDrain(pluginContext);
+    }
+    pthread_mutex_unlock(&reorder->lock);
+}
+
+// Consumer thread of a replicated stage, one of replica_count threads sharing the queue
+static void* PluginReplicaThread (void* arg) {
+    PluginReplica* replica = (PluginReplica*)arg;
+    plugin_context_t* pluginContext = replica->context;
+
+    // Take smaller batches than a single thread would, so the messages are
+    // spread over the replicas instead of one replica taking all of them
+    int batchLimit = PLUGIN_BATCH_SIZE / pluginContext->replica_count;
+    if (batchLimit < 1) {
+        batchLimit = 1;
+    }
+
+    message_t itemsFromQueue[PLUGIN_BATCH_SIZE];
+    message_t processedBatch[PLUGIN_BATCH_SIZE];
+    int stopped = 0;
+
+    while (!stopped) {
+        int batchCount = consumer_producer_get_messages(pluginContext->queue, itemsFromQueue, batchLimit);
+        if (batchCount <= 0) {
+            log_error(pluginContext, "Received NULL item from queue");
             break;
         }
-        
-        // Now we reached here so its not the end string
-        // Process the string using the required plugin function
-        const char* proccessedString = pluginContext->process_function(itemFromQueue);
-        
-        // Free the original item because we are done with it
-        free(itemFromQueue);
-        
-        // In case there is a next plugin we send it the string that we processed
-        if (pluginContext->next_place_work != NULL) {
-            const char* error = pluginContext->next_place_work(proccessedString);
-            if (error != NULL) {
-                log_error(pluginContext, error);
-                
-                // Free the processed string in case it was not able to be sent
-                if (proccessedString != NULL) {
-                    free((char*)proccessedString);
+
+        RecordQueueWait(pluginContext, itemsFromQueue, batchCount);
+
+        int processedCount = 0;
+        int tookEnd = 0;
+        PluginStatsDelta delta = {0};
+        for (int i=0; i<batchCount; i++) {
+            message_t itemFromQueue = itemsFromQueue[i];
+
+            // A stop from the replica that took <END>. Each replica has to get
+            // exactly one, so if we took another one, put it back for the others
+            if (itemFromQueue.data == g_replicaStop) {
+                if (stopped) {
+                    consumer_producer_put_messages(pluginContext->queue, &itemFromQueue, 1);
                 }
+                stopped = 1;
+                continue;
             }
 
-        } 
-        
-        else {
-            
-            // This is the lest plugin, we free it
-            if (proccessedString != NULL) {
-                free((char*)proccessedString);
+            // Nothing should come after <END>, but if it does, drop it
+            if (stopped) {
+                message_release(&itemFromQueue);
+                continue;
+            }
+
+            // Control messages go through the reorder buffer like the others, so
+            // they are passed on after everything before them (only pure plugins
+            // have replicas, so there is no output to flush)
+            if (message_is_control(&itemFromQueue)) {
+                processedBatch[processedCount++] = itemFromQueue;
+                if (message_is_end(&itemFromQueue)) {
+                    stopped = 1;
+                    tookEnd = 1;
+                }
+                continue;
+            }
+
+            // A failed message still takes up its sequence number (as an empty
+            // slot), otherwise the reorder buffer would wait for it forever
+            message_t processedMessage;
+            size_t sequence = itemFromQueue.sequence;
+            const char* processError = ProcessOwnedMessage(pluginContext, &itemFromQueue, &processedMessage, &delta);
+            if (processError != NULL) {
+                log_error(pluginContext, processError);
+                processedMessage.data = NULL;
+                processedMessage.sequence = sequence;
+            }
+            processedBatch[processedCount++] = processedMessage;
+        }
+        StatsAdd(pluginContext, &delta);
+
+        ReorderInsert(pluginContext, replica, processedBatch, processedCount);
+
+        // Tell all the other replicas to stop, nothing comes after <END>
+        if (tookEnd) {
+            message_t stop = ReplicaStop();
+            for (int i=1; i<pluginContext->replica_count; i++) {
+                consumer_producer_put_messages(pluginContext->queue, &stop, 1);
             }
         }
     }
-    
+
+    // The last replica to stop marks the plugin as finished (by then <END> was passed on)
+    if (__atomic_sub_fetch(&pluginContext->replicas_running, 1, __ATOMIC_ACQ_REL) == 0) {
+        FinishPlugin(pluginContext);
+        pluginContext->finished = 1;
+        consumer_producer_signal_finished(pluginContext->queue);
+    }
+    return NULL;
+}
+
+// Free the replicas and the reorder buffer (the threads must be done or never started)
+static void DestroyReplicas (plugin_context_t* pluginContext) {
+    PluginReorder* reorder = pluginContext->reorder;
+    if (reorder != NULL) {
+
+        // Results that never got passed on (only after an error)
+        for (size_t i=0; i<PLUGIN_REORDER_WINDOW; i++) {
+            if (reorder->filled[i] && reorder->slots[i].data != NULL) {
+                message_release(&reorder->slots[i]);
+            }
+        }
+        for (int i=0; i<pluginContext->replica_count; i++) {
+            monitor_destroy(&reorder->replicas[i].windowMonitor);
+        }
+        pthread_mutex_destroy(&reorder->lock);
+        free(reorder->replicas);
+        free(reorder);
+    }
+    free(pluginContext->replica_threads);
+    pluginContext->reorder = NULL;
+    pluginContext->replica_threads = NULL;
+}
+
+// Start replica_count consumer threads with a reorder buffer behind them
+static const char* StartReplicas (plugin_context_t* pluginContext) {
+    int replicaCount = pluginContext->replica_count;
+
+    pluginContext->replica_threads = calloc(replicaCount, sizeof(pthread_t));
+    pluginContext->reorder = calloc(1, sizeof(PluginReorder));
+    if (pluginContext->replica_threads == NULL || pluginContext->reorder == NULL) {
+        free(pluginContext->replica_threads);
+        free(pluginContext->reorder);
+        pluginContext->replica_threads = NULL;
+        pluginContext->reorder = NULL;
+        return "Error, couldnt allocate memory for the replicas";
+    }
+
+    PluginReorder* reorder = pluginContext->reorder;
+    reorder->replicas = calloc(replicaCount, sizeof(PluginReplica));
+    if (reorder->replicas == NULL) {
+        free(pluginContext->replica_threads);
+        free(reorder);
+        pluginContext->replica_threads = NULL;
+        pluginContext->reorder = NULL;
+        return "Error, couldnt allocate memory for the replicas";
+    }
+    pthread_mutex_init(&reorder->lock, NULL);
+    for (int i=0; i<replicaCount; i++) {
+        reorder->replicas[i].context = pluginContext;
+        monitor_init(&reorder->replicas[i].windowMonitor);
+    }
+
+    pluginContext->replicas_running = replicaCount;
+    for (int i=0; i<replicaCount; i++) {
+        if (pthread_create(&pluginContext->replica_threads[i], NULL, PluginReplicaThread, &reorder->replicas[i]) != 0) {
+
+            // Stop the ones that already run, each of them takes one stop
+            message_t stop = ReplicaStop();
+            for (int j=0; j<i; j++) {
+                consumer_producer_put_messages(pluginContext->queue, &stop, 1);
+            }
+            for (int j=0; j<i; j++) {
+                pthread_join(pluginContext->replica_threads[j], NULL);
+            }
+            DestroyReplicas(pluginContext);
+            return "Error, coludnt create consumer thread";
+        }
+    }
     return NULL;
 }
 
@@ -93,18 +640,82 @@ void log_info (plugin_context_t* context, const char* message) {
 
 // .h file states specifically not to modify or free plugin's name
 const char* plugin_get_name (void) {
-    if (g_plugin_context.initialized && g_plugin_context.name) {
-        return g_plugin_context.name;
+    if (g_plugin.context.initialized && g_plugin.context.name) {
+        return g_plugin.context.name;
     }
 
     // In case not initalized
     return "Unknown plugin";
 }
 
-const char* common_plugin_init (const char* (*process_function)(const char*), const char* name, int queueSize) {
+char* plugin_message_alloc (message_t* output, size_t length) {
+
+    // Safety check
+    if (output == NULL) {
+        return NULL;
+    }
+
+    // +1 for the null terminator every message has
+    // Allocated from our own pool, so it has to go back to our own pool
+    // (the next plugin frees it through the release function)
+    output->data = pool_alloc(length + 1);
+    if (output->data == NULL) {
+        return NULL;
+    }
+    output->data[length] = '\0';
+    output->length = length;
+    output->release = pool_free;
+    output->sequence = 0;
+    output->read_only = 0;
+    output->ingress_ns = 0;
+    output->enqueue_ns = 0;
+    output->shared = NULL;
+    output->kind = MESSAGE_DATA;
+    return output->data;
+}
+
+void* plugin_state (void) {
+    return g_runningContext != NULL ? g_runningContext->transforms.state : NULL;
+}
+
+print_order_t* plugin_print_order (int* position) {
+    if (position != NULL) {
+        *position = g_initializing->printPosition;
+    }
+    return g_initializing->printOrder;
+}
+
+const char* plugin_message_make_writable (message_t* message) {
+    if (message == NULL) {
+        return "Error, got a NULL message";
+    }
+    if (!message->read_only) {
+        return NULL;
+    }
+
+    // The view goes back to its owner, the copy takes its place in the stream
+    message_t copy;
+    if (plugin_message_alloc(&copy, message->length) == NULL) {
+        return "Error, failed to copy a read only message";
+    }
+    memcpy(copy.data, message->data, message->length);
+    copy.sequence = message->sequence;
+    copy.ingress_ns = message->ingress_ns;
+    copy.enqueue_ns = message->enqueue_ns;
+    copy.kind = message->kind;
+    message_release(message);
+    *message = copy;
+    return NULL;
+}
+
+// Shared by all the init functions, either process_function or transforms is set
+static const char* CommonPluginInit (const char* (*process_function)(const char*), const plugin_transforms_t* transforms, const char* name, int queueSize) {
     
+    plugin_instance_t* instance = g_initializing;
+    plugin_context_t* pluginContext = &instance->context;
+
     // Safety check (prevent double initializaiton)
-    if (g_plugin_context.initialized) {
+    if (pluginContext->initialized) {
         return "Already initialized plugin";
     }
     
@@ -119,124 +730,532 @@ const char* common_plugin_init (const char* (*process_function)(const char*), co
     }
     
     // And yet, another safety check
-    if (process_function == NULL) {
+    if (process_function == NULL && transforms == NULL) {
         return "The procces function cant be NULL";
     }
     
     // Initialize context struct
-    memset(&g_plugin_context, 0, sizeof(plugin_context_t));
-    g_plugin_context.name = name;
-    g_plugin_context.process_function = process_function;
-    g_plugin_context.next_place_work = NULL;
-    g_plugin_context.finished = 0;
+    memset(pluginContext, 0, sizeof(plugin_context_t));
+    pluginContext->name = name;
+    pluginContext->process_function = process_function;
+    if (transforms != NULL) {
+        pluginContext->transforms = *transforms;
+    }
+    pluginContext->next_place_work = NULL;
+    pluginContext->finished = 0;
+    pluginContext->forward_each = instance->printOrder != NULL;
+
+    // An inline plugin is only called through plugin_process_message, on
+    // another plugin's thread, so it needs no queue and no thread of its own
+    if (instance->inlined) {
+        pluginContext->initialized = 1;
+        __atomic_add_fetch(&g_liveInstances, 1, __ATOMIC_ACQ_REL);
+        return NULL;
+    }
     
     // Allocate memory and initialize the queue
-    g_plugin_context.queue = malloc(sizeof(consumer_producer_t));
-    if (g_plugin_context.queue == NULL) {
+    // Aligned to a cache line so the producer and consumer halves of the
+    // lock-free ring really sit on different lines
+    void* queueMemory = NULL;
+    if (posix_memalign(&queueMemory, CONSUMER_PRODUCER_CACHE_LINE, sizeof(consumer_producer_t)) != 0) {
         return "Error, couldnt allocate memory for the queue";
     }
+    pluginContext->queue = queueMemory;
     
-
-    const char* queueError = consumer_producer_init(g_plugin_context.queue, queueSize);
+    // Our queue is filled by exactly one thread (the previous plugin or main)
+    // and emptied by exactly one thread (our consumer), so use the lock-free backend
+    // Replicas all take from the same queue, so they need the locked one
+    pluginContext->replica_count = instance->replicas;
+    consumer_producer_mode_t queueMode = instance->replicas > 1 ? CONSUMER_PRODUCER_LOCKED : CONSUMER_PRODUCER_SPSC;
+    const char* queueError = consumer_producer_init_mode(pluginContext->queue, queueSize, queueMode);
     if (queueError != NULL) {
-        free(g_plugin_context.queue);
-        g_plugin_context.queue = NULL;
+        free(pluginContext->queue);
+        pluginContext->queue = NULL;
         return queueError;
     }
+
+    // The host may let the queue size itself, queueSize is then where it starts
+    if (instance->queueBudget != NULL) {
+        consumer_producer_set_adaptive(pluginContext->queue, instance->queueBudget);
+    }
     
     // Create a thread for the consumer
     // this thread will work and proccess items from the queue
-    int threadResult = pthread_create(&g_plugin_context.consumer_thread, NULL, plugin_consumer_thread, &g_plugin_context);
+    // (or several of them, for a replicated stage)
+    if (instance->replicas > 1) {
+        const char* replicaError = StartReplicas(pluginContext);
+        if (replicaError != NULL) {
+            consumer_producer_destroy(pluginContext->queue);
+            free(pluginContext->queue);
+            pluginContext->queue = NULL;
+            return replicaError;
+        }
+        pluginContext->initialized = 1;
+        __atomic_add_fetch(&g_liveInstances, 1, __ATOMIC_ACQ_REL);
+        return NULL;
+    }
+    int threadResult = pthread_create(&pluginContext->consumer_thread, NULL, plugin_consumer_thread, pluginContext);
     if (threadResult != 0) {
-        consumer_producer_destroy(g_plugin_context.queue);
-        free(g_plugin_context.queue);
-        g_plugin_context.queue = NULL;
+        consumer_producer_destroy(pluginContext->queue);
+        free(pluginContext->queue);
+        pluginContext->queue = NULL;
         return "Error, coludnt create consumer thread";
     }
     
     // Put a mark on the plugins, that they were intialized successfully
-    g_plugin_context.initialized = 1;
+    pluginContext->initialized = 1;
+    __atomic_add_fetch(&g_liveInstances, 1, __ATOMIC_ACQ_REL);
     
     // Upon success
     return NULL;
 }
 
-const char* plugin_fini (void) {
+const char* common_plugin_init (const char* (*process_function)(const char*), const char* name, int queueSize) {
+    if (process_function == NULL) {
+        return "The procces function cant be NULL";
+    }
+    return CommonPluginInit(process_function, NULL, name, queueSize);
+}
+
+const char* common_plugin_init_message (plugin_message_function_t message_function, const char* name, int queueSize) {
+    if (message_function == NULL) {
+        return "The procces function cant be NULL";
+    }
+    plugin_transforms_t transforms = { .transform = message_function };
+    return CommonPluginInit(NULL, &transforms, name, queueSize);
+}
+
+const char* common_plugin_init_transforms (const plugin_transforms_t* transforms, const char* name, int queueSize) {
+
+    // At least one usable way to process a message
+    if (transforms == NULL || (transforms->transform == NULL && transforms->transform_in_place == NULL &&
+        (transforms->transform_into == NULL || transforms->max_output_size == NULL))) {
+        return "The procces function cant be NULL";
+    }
+
+    // transform_into is useless without knowing how big the buffer must be
+    if (transforms->transform_into != NULL && transforms->max_output_size == NULL) {
+        return "transform_into needs max_output_size";
+    }
+    return CommonPluginInit(NULL, transforms, name, queueSize);
+}
+
+plugin_instance_t* plugin_create (void) {
+    plugin_instance_t* instance = NULL;
+    pthread_mutex_lock(&g_instanceLock);
+
+    // The first one is the instance of the version 1 functions. More of them
+    // only for a pure transform or a plugin that keeps its state per instance,
+    // any other plugin may keep state of its own (outside of the context)
+    // that its instances would share
+    if (!g_pluginCreated) {
+        g_pluginCreated = 1;
+        instance = &g_plugin;
+    }
+    else if (&plugin_pure_transform != NULL || &plugin_instance_state != NULL) {
+        instance = calloc(1, sizeof(plugin_instance_t));
+        if (instance != NULL) {
+            instance->replicas = 1;
+        }
+    }
+    pthread_mutex_unlock(&g_instanceLock);
+    return instance;
+}
+
+void plugin_destroy (plugin_instance_t* instance) {
+    if (instance == NULL) {
+        return;
+    }
+
+    // In case the host didnt call fini
+    if (instance->context.initialized) {
+        plugin_instance_fini(instance);
+    }
+
+    if (instance == &g_plugin) {
+        pthread_mutex_lock(&g_instanceLock);
+        g_pluginCreated = 0;
+        pthread_mutex_unlock(&g_instanceLock);
+        return;
+    }
+    free(instance);
+}
+
+const char* plugin_instance_init (plugin_instance_t* instance, int queue_size) {
 
     // Safety check
-    if (!g_plugin_context.initialized) {
+    if (instance == NULL) {
+        return "Error, the instance cant be NULL";
+    }
+
+    // The plugin's own init ends up in CommonPluginInit, which takes the instance from g_initializing
+    pthread_mutex_lock(&g_instanceLock);
+    g_initializing = instance;
+    const char* error = plugin_init(queue_size);
+    g_initializing = &g_plugin;
+    pthread_mutex_unlock(&g_instanceLock);
+    return error;
+}
+
+const char* plugin_instance_fini (plugin_instance_t* instance) {
+    plugin_context_t* pluginContext = &instance->context;
+
+    // Safety check
+    if (!pluginContext->initialized) {
         return "Error, the plugin was not initialized";
     }
     
     // Wait for the consumer thread to finish proccessing to ensure
     // that there is no work left that we might lose during shutdown
-    int joinResult = pthread_join(g_plugin_context.consumer_thread, NULL);
-    if (joinResult != 0) {
-        return "Error, failed to join the consumer thread";
+    // (inline plugins have no thread)
+    if (pluginContext->replica_count > 1) {
+        for (int i=0; i<pluginContext->replica_count; i++) {
+            if (pthread_join(pluginContext->replica_threads[i], NULL) != 0) {
+                return "Error, failed to join the consumer thread";
+            }
+        }
+        DestroyReplicas(pluginContext);
+    }
+    else if (!instance->inlined) {
+        int joinResult = pthread_join(pluginContext->consumer_thread, NULL);
+        if (joinResult != 0) {
+            return "Error, failed to join the consumer thread";
+        }
     }
     
+    // In case the plugin never got <END>
+    FinishPlugin(pluginContext);
+
     // Clean up the queue
-    if (g_plugin_context.queue != NULL) {
-        consumer_producer_destroy(g_plugin_context.queue);
-        free(g_plugin_context.queue);
-        g_plugin_context.queue = NULL;
+    if (pluginContext->queue != NULL) {
+        consumer_producer_destroy(pluginContext->queue);
+        free(pluginContext->queue);
+        pluginContext->queue = NULL;
     }
     
+    // Every message is consumed by now, so the buffers can go too
+    // (once no other instance of this plugin uses them anymore)
+    if (__atomic_sub_fetch(&g_liveInstances, 1, __ATOMIC_ACQ_REL) == 0) {
+        pool_destroy();
+    }
+    free(pluginContext->fused_stages);
+    
     // Reset context (for clean state as required)
-    memset(&g_plugin_context, 0, sizeof(plugin_context_t));
+    memset(pluginContext, 0, sizeof(plugin_context_t));
+    instance->inlined = 0;
+    instance->replicas = 1;
+    instance->queueBudget = NULL;
+    instance->printOrder = NULL;
+    instance->printPosition = 0;
     
     // Upon success
     return NULL;
 }
 
+const char* plugin_fini (void) {
+    return plugin_instance_fini(&g_plugin);
+}
+
+// A string from the version 1 functions has no kind, there <END> is the end of the stream
+static message_kind_t StringKind (const char* str, size_t length) {
+    return length == MESSAGE_END_SIGNAL_LENGTH && memcmp(str, MESSAGE_END_SIGNAL, length) == 0
+        ? MESSAGE_END : MESSAGE_DATA;
+}
+
 const char* plugin_place_work (const char* str) {
     
     // Safety check
-    if (!g_plugin_context.initialized) {
+    if (!g_plugin.context.initialized) {
         return "Error, the plugin was not initialized";
     }
     
     if (str == NULL) {
         return "Error, the input string cant be NULL";
     }
+
+    if (g_plugin.context.queue == NULL) {
+        return "Error, the plugin runs inline and has no queue";
+    }
     
     // Create a copy of the string for the queue operations
     // consumer thread should free this once done proccessing
-    char* strCopy = strdup(str);
-    if (strCopy == NULL) {
+    message_t message;
+    size_t length = strlen(str);
+    if (plugin_message_alloc(&message, length) == NULL) {
         return "Error, failed memory allocation for string copy";
     }
+    memcpy(message.data, str, length);
+    message.kind = StringKind(str, length);
     
-    // Put the string into the queue (should block if queue is a t full capacity)
-    const char* putError = consumer_producer_put(g_plugin_context.queue, strCopy);
-    if (putError != NULL) {
-        free(strCopy);
-        return putError;
+    // Move the copy into the queue (should block if queue is a t full capacity)
+    return consumer_producer_put_messages(g_plugin.context.queue, &message, 1);
+}
+
+const char* plugin_place_work_owned (char* str, size_t length, message_release_t release) {
+
+    // Safety check
+    if (str == NULL || release == NULL) {
+        return "Error, the input string cant be NULL";
     }
-    
-    // Upon success
-    return NULL;
+
+    // We own str even when we fail, so give it back on every error
+    if (!g_plugin.context.initialized || g_plugin.context.queue == NULL) {
+        release(str);
+        return "Error, the plugin was not initialized";
+    }
+
+    // No copy, the buffer itself goes into the queue
+    message_t message = { .data = str, .length = length, .release = release };
+    message.kind = StringKind(str, length);
+    return consumer_producer_put_messages(g_plugin.context.queue, &message, 1);
+}
+
+const char* plugin_instance_place_work_batch (plugin_instance_t* instance, const message_t* messages, int count) {
+
+    // Safety check
+    if (messages == NULL) {
+        return "Error, the input messages cant be NULL";
+    }
+
+    // We own the messages even when we fail, so give them back on every error
+    if (!instance->context.initialized || instance->context.queue == NULL) {
+        for (int i=0; i<count; i++) {
+            message_release(&messages[i]);
+        }
+        return "Error, the plugin was not initialized";
+    }
+
+    return consumer_producer_put_messages(instance->context.queue, messages, count);
+}
+
+const char* plugin_place_work_batch (const message_t* messages, int count) {
+    return plugin_instance_place_work_batch(&g_plugin, messages, count);
 }
 
 void plugin_attach (const char* (*next_place_work)(const char*)) {
-    if (g_plugin_context.initialized) {
-        g_plugin_context.next_place_work = next_place_work;
+    if (g_plugin.context.initialized) {
+        g_plugin.context.next_place_work = next_place_work;
     }
 }
 
-const char* plugin_wait_finished (void) {
+void plugin_attach_batch (const char* (*next_place_work_batch)(const message_t*, int)) {
+    if (g_plugin.context.initialized) {
+        g_plugin.context.next_place_work_batch = next_place_work_batch;
+    }
+}
+
+void plugin_instance_attach_batch (plugin_instance_t* instance, plugin_instance_place_work_batch_t next_place_work_batch, plugin_instance_t* next) {
+    if (instance->context.initialized) {
+        instance->context.next_instance_place_work_batch = next_place_work_batch;
+        instance->context.next_instance = next;
+    }
+}
+
+const char* plugin_instance_wait_finished (plugin_instance_t* instance) {
+    plugin_context_t* pluginContext = &instance->context;
     
     // Safety check
-    if (!g_plugin_context.initialized) {
+    if (!pluginContext->initialized) {
         return "Error, the plugin was not initialized";
     }
     
+    // An inline plugin has nothing of its own to wait for,
+    // the host only waits for it after its last message
+    if (pluginContext->queue == NULL) {
+        FinishPlugin(pluginContext);
+        return NULL;
+    }
+
     // Wait for the plugin to finish
-    int waitForResult = consumer_producer_wait_finished(g_plugin_context.queue);
+    int waitForResult = consumer_producer_wait_finished(pluginContext->queue);
     if (waitForResult != 0) {
         return "Failed to wait for plugin to finish";
     }
     
     // Upon success
     return NULL;
-}
\ No newline at end of file
+}
+
+const char* plugin_wait_finished (void) {
+    return plugin_instance_wait_finished(&g_plugin);
+}
+
+const char* plugin_instance_get_stats (plugin_instance_t* instance, plugin_stats_t* stats) {
+    plugin_context_t* pluginContext = &instance->context;
+
+    // Safety check
+    if (stats == NULL) {
+        return "Error, the stats cant be NULL";
+    }
+    if (!pluginContext->initialized) {
+        return "Error, the plugin was not initialized";
+    }
+
+    const plugin_stats_t* counters = &pluginContext->stats;
+    memset(stats, 0, sizeof(plugin_stats_t));
+    stats->messages_in = __atomic_load_n(&counters->messages_in, __ATOMIC_RELAXED);
+    stats->messages_out = __atomic_load_n(&counters->messages_out, __ATOMIC_RELAXED);
+    stats->bytes_in = __atomic_load_n(&counters->bytes_in, __ATOMIC_RELAXED);
+    stats->bytes_out = __atomic_load_n(&counters->bytes_out, __ATOMIC_RELAXED);
+    stats->transform_ns = __atomic_load_n(&counters->transform_ns, __ATOMIC_RELAXED);
+
+    // Inline plugins have no queue
+    if (pluginContext->queue != NULL) {
+        consumer_producer_get_depth(pluginContext->queue, &stats->queue_depth, &stats->queue_high_water);
+        stats->queue_capacity = (size_t)consumer_producer_get_capacity(pluginContext->queue);
+    }
+    return NULL;
+}
+
+const char* plugin_get_stats (plugin_stats_t* stats) {
+    return plugin_instance_get_stats(&g_plugin, stats);
+}
+
+const char* plugin_instance_get_latency (plugin_instance_t* instance, latency_histogram_t* queue_wait,
+        latency_histogram_t* service, latency_histogram_t* end_to_end) {
+    plugin_context_t* pluginContext = &instance->context;
+
+    // Safety check
+    if (!pluginContext->initialized) {
+        return "Error, the plugin was not initialized";
+    }
+
+    if (queue_wait != NULL) {
+        latency_histogram_copy(queue_wait, &pluginContext->queue_wait);
+    }
+    if (service != NULL) {
+        latency_histogram_copy(service, &pluginContext->service);
+    }
+    if (end_to_end != NULL) {
+        latency_histogram_copy(end_to_end, &pluginContext->end_to_end);
+    }
+    return NULL;
+}
+
+const char* plugin_get_latency (latency_histogram_t* queue_wait, latency_histogram_t* service, latency_histogram_t* end_to_end) {
+    return plugin_instance_get_latency(&g_plugin, queue_wait, service, end_to_end);
+}
+
+void plugin_instance_set_replicas (plugin_instance_t* instance, int count) {
+    if (!instance->context.initialized && count >= 1) {
+        instance->replicas = count;
+    }
+}
+
+void plugin_set_replicas (int count) {
+    plugin_instance_set_replicas(&g_plugin, count);
+}
+
+void plugin_instance_set_queue_budget (plugin_instance_t* instance, consumer_producer_budget_t* budget) {
+    if (!instance->context.initialized) {
+        instance->queueBudget = budget;
+    }
+}
+
+void plugin_set_queue_budget (consumer_producer_budget_t* budget) {
+    plugin_instance_set_queue_budget(&g_plugin, budget);
+}
+
+void plugin_instance_set_print_order (plugin_instance_t* instance, print_order_t* order, int position) {
+    if (!instance->context.initialized) {
+        instance->printOrder = order;
+        instance->printPosition = position;
+    }
+}
+
+void plugin_set_print_order (print_order_t* order, int position) {
+    plugin_instance_set_print_order(&g_plugin, order, position);
+}
+
+void plugin_instance_set_inline (plugin_instance_t* instance) {
+    if (!instance->context.initialized) {
+        instance->inlined = 1;
+    }
+}
+
+void plugin_set_inline (void) {
+    plugin_instance_set_inline(&g_plugin);
+}
+
+const char* plugin_instance_process_message (plugin_instance_t* instance, message_t* input, message_t* output) {
+
+    // Safety check
+    if (input == NULL || output == NULL) {
+        return "Error, the messages cant be NULL";
+    }
+
+    // We own the input even when we fail, so give it back on every error
+    if (!instance->context.initialized) {
+        message_release(input);
+        return "Error, the plugin was not initialized";
+    }
+
+    // A control message is not processed, it goes on as it is (a flush or
+    // barrier after writing out what we buffered, in the pool)
+    if (message_is_control(input)) {
+        if (!message_is_end(input)) {
+            FlushPlugin(&instance->context);
+        }
+        *output = *input;
+        return NULL;
+    }
+
+    // Called once per message (fused or in the pool), so the counters are added right away
+    PluginStatsDelta delta = {0};
+    const char* error = ProcessOwnedMessage(&instance->context, input, output, &delta);
+    StatsAdd(&instance->context, &delta);
+    return error;
+}
+
+const char* plugin_process_message (message_t* input, message_t* output) {
+    return plugin_instance_process_message(&g_plugin, input, output);
+}
+
+// Take over the fused stages (allocated by the caller), replacing any earlier ones
+static const char* AttachFused (plugin_context_t* pluginContext, PluginFusedStage* fusedStages, int count) {
+
+    // Safety check
+    if (!pluginContext->initialized) {
+        free(fusedStages);
+        return "Error, the plugin was not initialized";
+    }
+
+    // Set before the first message, the consumer thread only reads them
+    // after taking a message from the queue (which is a synchronization point)
+    free(pluginContext->fused_stages);
+    pluginContext->fused_stages = fusedStages;
+    pluginContext->fused_count = count;
+    return NULL;
+}
+
+const char* plugin_attach_fused (const char* (* const* stages)(message_t*, message_t*), int count) {
+    if (stages == NULL || count <= 0) {
+        return "Error, no stages to fuse";
+    }
+
+    // Our own copy, the caller's array doesnt have to stay around
+    PluginFusedStage* fusedStages = calloc(count, sizeof(PluginFusedStage));
+    if (fusedStages == NULL) {
+        return "Error, failed to allocate the fused stages";
+    }
+    for (int i=0; i<count; i++) {
+        fusedStages[i].process_message = stages[i];
+    }
+    return AttachFused(&g_plugin.context, fusedStages, count);
+}
+
+const char* plugin_instance_attach_fused (plugin_instance_t* instance, const plugin_fused_stage_t* stages, int count) {
+    if (stages == NULL || count <= 0) {
+        return "Error, no stages to fuse";
+    }
+
+    // Same, with the instance each of them is called with
+    PluginFusedStage* fusedStages = calloc(count, sizeof(PluginFusedStage));
+    if (fusedStages == NULL) {
+        return "Error, failed to allocate the fused stages";
+    }
+    for (int i=0; i<count; i++) {
+        fusedStages[i].instanceStage = stages[i];
+    }
+    return AttachFused(&instance->context, fusedStages, count);
+}
@@ -2,12 +2,76 @@
 #define PLUGIN_COMMON_H
 
 #include "sync/consumer_producer.h"
+#include "sync/print_order.h"
+#include "plugin_stats.h"
+#include "plugin_instance.h"
+#include "metrics/latency_histogram.h"
 #include <pthread.h>
 
 /**
  * Common SDK structures and functions for plugin implementation
  */
 
+// Most items the consumer thread takes from its queue in one go
+#define PLUGIN_BATCH_SIZE 64
+
+// How far the replicas of a stage can get ahead of the oldest message they
+// are still working on (results wait in the reorder buffer until it is done)
+#define PLUGIN_REORDER_WINDOW 1024
+
+/**
+ * Message based processing function (the preferred form for new plugins)
+ * The input is input->length bytes at input->data and may contain NULs.
+ * To pass the input on unchanged set *output = *input, otherwise fill
+ * output with a buffer from plugin_message_alloc
+ * @param input The message to process (still owned by the caller)
+ * @param output The result
+ * @return NULL on success, error message on failure
+ */
+typedef const char* (*plugin_message_function_t)(const message_t* input, message_t* output);
+
+/**
+ * All the ways a plugin can process a message. Every entry is optional, but
+ * at least one of transform, transform_in_place or transform_into (together
+ * with max_output_size) must be set. The consumer thread prefers in place,
+ * then into a buffer it provides, and only then the plain transform, so a
+ * length preserving plugin with transform_in_place never allocates anything
+ */
+typedef struct
+{
+ plugin_message_function_t transform; // Allocates its own output (see plugin_message_function_t)
+ const char* (*transform_in_place)(message_t* message); // Rewrites message->data, length may only shrink
+ size_t (*max_output_size)(size_t input_length); // Largest output transform_into can produce
+ const char* (*transform_into)(const message_t* input, char* output, size_t output_capacity,
+ size_t* output_length); // Writes the result into output (no NUL needed)
+ const char* (*finish)(void); // Called once after the last message (<END>), to flush buffered output
+ const char* (*flush)(void); // Called for a flush or barrier message, to write out the output buffered so far
+ void* state; // The plugin's own data for this instance, plugin_state() gives it back in the functions above
+} plugin_transforms_t;
+
+/**
+ * Put this line in a plugin that is a pure transform: it prints nothing and
+ * keeps no state between messages. The host may then run it on the thread of
+ * the plugin before it (stage fusion) instead of giving it its own thread
+ */
+#define PLUGIN_PURE_TRANSFORM __attribute__((visibility("default"))) const int plugin_pure_transform = 1;
+
+/**
+ * Put this line in a plugin that keeps all of its state in the state of
+ * plugin_transforms_t (made in its plugin_init, nothing in globals). The host
+ * can then run it as several stages from one loaded copy, like a pure transform,
+ * instead of loading a copy of the .so for every stage
+ */
+#define PLUGIN_INSTANCE_STATE __attribute__((visibility("default"))) const int plugin_instance_state = 1;
+
+/**
+ * Put this line in a plugin that prints, and write every record (one per line)
+ * between print_order_begin and print_order_end of the print order from
+ * plugin_print_order (when there is one). The host then keeps the output of
+ * all such plugins of a chain in order, see sync/print_order.h
+ */
+#define PLUGIN_ORDERED_OUTPUT __attribute__((visibility("default"))) const int plugin_ordered_output = 1;
+
 // Plugin context structure
 typedef struct
 {
@@ -15,7 +79,23 @@ typedef struct
  consumer_producer_t* queue; // Input queue
  pthread_t consumer_thread; // Consumer thread
  const char* (*next_place_work)(const char*); // Next plugin's place_work function
- const char* (*process_function)(const char*); // Plugin-specific processing function
+ const char* (*next_place_work_batch)(const message_t*, int); // Next plugin's place_work_batch (optional)
+ plugin_instance_place_work_batch_t next_instance_place_work_batch; // Or the next instance's (optional, preferred)
+ plugin_instance_t* next_instance; // The instance next_instance_place_work_batch is called with
+ const char* (*process_function)(const char*); // Old style processing function (may return its input)
+ plugin_transforms_t transforms; // Message based processing functions (all NULL for old style plugins)
+ struct PluginFusedStage* fused_stages; // Next plugins' process_message, run on our thread (optional)
+ int fused_count; // Number of fused_stages
+ int replica_count; // Number of consumer threads (1 unless the host asked for replicas)
+ pthread_t* replica_threads; // The consumer threads, when replica_count > 1
+ int replicas_running; // Replicas that didnt reach the end yet
+ struct PluginReorder* reorder; // Puts the replicas' results back in input order
+ int finish_called; // transforms.finish already ran
+ int forward_each; // Pass every message on right away instead of a batch at a time (a printer in a print order)
+ plugin_stats_t stats; // Runtime counters, added to with relaxed atomics (the queue fields are unused here)
+ latency_histogram_t queue_wait; // How long messages waited in our queue
+ latency_histogram_t service; // How long our processing function took per message
+ latency_histogram_t end_to_end; // From the input reader to the end of the chain (only when we are the end)
  int initialized; // Initialization flag
  int finished; // Finished processing flag
 } plugin_context_t;
@@ -49,6 +129,8 @@ const char* plugin_get_name(void);
 
 /**
  * Initialize the common plugin infrastructure with the specified queue size
+ * The processing function returns a newly allocated string, or its input
+ * itself when the plugin passes the string on unchanged (no copy is made then)
  * @param process_function Plugin-specific processing function
  * @param name Plugin name
  * @param queue_size Maximum number of items that can be queued
@@ -56,6 +138,54 @@ const char* plugin_get_name(void);
  */
 const char* common_plugin_init(const char* (*process_function)(const char*),
 const char* name, int queue_size);
+/**
+ * Initialize the common plugin infrastructure for a message based plugin
+ * Same as common_plugin_init, but the processing function gets the length
+ * of every message instead of having to strlen it
+ * @param message_function Plugin-specific message processing function
+ * @param name Plugin name
+ * @param queue_size Maximum number of items that can be queued
+ * @return NULL on success, error message on failure
+ */
+const char* common_plugin_init_message(plugin_message_function_t message_function,
+const char* name, int queue_size);
+/**
+ * Initialize the common plugin infrastructure with several ways to process
+ * a message (in place, into a given buffer, allocating), see plugin_transforms_t
+ * @param transforms The processing functions (copied, so it can live on the stack)
+ * @param name Plugin name
+ * @param queue_size Maximum number of items that can be queued
+ * @return NULL on success, error message on failure
+ */
+const char* common_plugin_init_transforms(const plugin_transforms_t* transforms,
+const char* name, int queue_size);
+/**
+ * Allocate the payload of an output message (length bytes + NUL terminator)
+ * The buffer is freed by whoever ends up owning the message
+ * @param output The message to fill (data, length and release are set)
+ * @param length Number of payload bytes
+ * @return The buffer to write the payload into, NULL on failure
+ */
+char* plugin_message_alloc(message_t* output, size_t length);
+/**
+ * Make sure a message can be written and has its NUL terminator: a read_only
+ * view is replaced by a copy in a buffer of our own (nothing to do otherwise)
+ * @param message The message, owned by the caller
+ * @return NULL on success, error message on failure (the message is unchanged then)
+ */
+const char* plugin_message_make_writable(message_t* message);
+/**
+ * The state of the instance whose transform, finish or flush is running
+ * (the state of its plugin_transforms_t)
+ * @return The state, NULL when called from anywhere else
+ */
+void* plugin_state(void);
+/**
+ * The print order the host gave the instance being initialized (call it from plugin_init)
+ * @param position Receives the instance's position in it
+ * @return The print order, NULL when the instance prints on its own
+ */
+print_order_t* plugin_print_order(int* position);
 /**
  * Initialize the plugin with the specified queue size - calls
 common_plugin_init
@@ -80,6 +210,76 @@ new memory)
  */
 __attribute__((visibility("default")))
 const char* plugin_place_work(const char* str);
+/**
+ * Hand an already allocated string to the plugin's queue without copying it
+ * The plugin owns str from now on, even on failure, and gives it back with release(str)
+ * @param str The string to process (str[length] must be a NUL)
+ * @param length Number of bytes in str
+ * @param release The free function of whoever allocated str
+ * @return NULL on success, error message on failure
+ */
+__attribute__((visibility("default")))
+const char* plugin_place_work_owned(char* str, size_t length, message_release_t release);
+/**
+ * Hand several messages to the plugin's queue at once, without copying them
+ * The plugin owns the messages from now on, even on failure
+ * @param messages Array of messages to process
+ * @param count Number of messages in the array
+ * @return NULL on success, error message on failure
+ */
+__attribute__((visibility("default")))
+const char* plugin_place_work_batch(const message_t* messages, int count);
+/**
+ * Ask the plugin to run inline: plugin_init then starts no thread and makes no
+ * queue, the plugin is only used through plugin_process_message.
+ * Must be called before plugin_init, plugin_fini undoes it
+ */
+__attribute__((visibility("default")))
+void plugin_set_inline(void);
+/**
+ * Ask the plugin to run several consumer threads on its queue (only for pure
+ * transforms). The results are put back in the input order before they are
+ * passed on, so the output is the same as with one thread.
+ * Must be called before plugin_init, plugin_fini undoes it
+ * @param count Number of consumer threads (1 is the normal single thread)
+ */
+__attribute__((visibility("default")))
+void plugin_set_replicas(int count);
+/**
+ * Let the plugin's queue grow and shrink on its own (see
+ * consumer_producer_set_adaptive), starting at the size given to plugin_init.
+ * Must be called before plugin_init, plugin_fini undoes it
+ * @param budget Memory budget shared with the other plugins' queues, owned by the host
+ */
+__attribute__((visibility("default")))
+void plugin_set_queue_budget(consumer_producer_budget_t* budget);
+/**
+ * Put the plugin's output in order with the other printers of its chain
+ * (only used for plugins with PLUGIN_ORDERED_OUTPUT)
+ * Must be called before plugin_init, plugin_fini undoes it
+ * @param order The print order of the chain, owned by the host
+ * @param position The plugin's position among the printers, from 0
+ */
+__attribute__((visibility("default")))
+void plugin_set_print_order(print_order_t* order, int position);
+/**
+ * Process one message right away on the calling thread, without the queue
+ * The result is the same as going through the queue and consumer thread
+ * @param input The message to process (the plugin owns it from now on, even on failure)
+ * @param output The result, owned by the caller (may be the input buffer itself)
+ * @return NULL on success, error message on failure
+ */
+__attribute__((visibility("default")))
+const char* plugin_process_message(message_t* input, message_t* output);
+/**
+ * Run the given plugins' process_message on our consumer thread, one after
+ * the other, right after our own processing (stage fusion)
+ * @param stages The process_message functions, in chain order (copied)
+ * @param count Number of stages
+ * @return NULL on success, error message on failure
+ */
+__attribute__((visibility("default")))
+const char* plugin_attach_fused(const char* (* const* stages)(message_t*, message_t*), int count);
 /**
  * Attach this plugin to the next plugin in the chain
  * @param next_place_work Function pointer to the next plugin's place_work
@@ -87,6 +287,35 @@ function
  */
 __attribute__((visibility("default")))
 void plugin_attach(const char* (*next_place_work)(const char*));
+/**
+ * Attach this plugin to the next plugin's batch entry point (optional).
+ * When set, processed items are forwarded as one batch instead of one by one
+ * @param next_place_work_batch Function pointer to the next plugin's
+place_work_batch function
+ */
+__attribute__((visibility("default")))
+void plugin_attach_batch(const char* (*next_place_work_batch)(const message_t*, int));
+/**
+ * Copy the plugin's runtime counters, see plugin_stats_t
+ * Can be called from any thread while the plugin runs
+ * @param stats Receives the counters
+ * @return NULL on success, error message on failure
+ */
+__attribute__((visibility("default")))
+const char* plugin_get_stats(plugin_stats_t* stats);
+/**
+ * Copy the plugin's latency histograms (queue wait and service time per
+ * message, and the end to end latency of the lines that left the chain here)
+ * Can be called from any thread while the plugin runs, any of them may be NULL
+ * @param queue_wait Receives how long messages waited in the queue
+ * @param service Receives how long the processing function took
+ * @param end_to_end Receives the time from the input reader to here, for the
+ * lines this plugin was the last stage of
+ * @return NULL on success, error message on failure
+ */
+__attribute__((visibility("default")))
+const char* plugin_get_latency(latency_histogram_t* queue_wait, latency_histogram_t* service,
+latency_histogram_t* end_to_end);
 /**
  * Wait until the plugin has finished processing all work and is ready to
 shutdown
@@ -97,4 +326,129 @@ shutdown
 __attribute__((visibility("default")))
 const char* plugin_wait_finished(void);
 
+/**
+ * Make an instance of the plugin (SDK version 2, see plugin_instance.h)
+ * The first one is the instance the functions above work on. Only a pure
+ * transform (PLUGIN_PURE_TRANSFORM) or a plugin that keeps its state per
+ * instance (PLUGIN_INSTANCE_STATE) can have more than one, any other plugin
+ * gives NULL then (the host loads another copy of it instead)
+ * @return The new instance, NULL if there cant be another one
+ */
+__attribute__((visibility("default")))
+plugin_instance_t* plugin_create(void);
+/**
+ * Free an instance made by plugin_create (calls plugin_instance_fini first if needed)
+ * @param instance The instance, not usable anymore afterwards
+ */
+__attribute__((visibility("default")))
+void plugin_destroy(plugin_instance_t* instance);
+/**
+ * plugin_init for one instance: runs the plugin's plugin_init, which sets up
+ * this instance instead of the first one
+ * @param instance The instance to initialize
+ * @param queue_size Maximum number of items that can be queued
+ * @return NULL on success, error message on failure
+ */
+__attribute__((visibility("default")))
+const char* plugin_instance_init(plugin_instance_t* instance, int queue_size);
+/**
+ * plugin_fini for one instance, the instance can be initialized again afterwards
+ * The buffer pool is freed with the last instance
+ * @param instance The instance to finalize
+ * @return NULL on success, error message on failure
+ */
+__attribute__((visibility("default")))
+const char* plugin_instance_fini(plugin_instance_t* instance);
+/**
+ * plugin_place_work_batch for one instance
+ * @param instance The instance that takes the messages
+ * @param messages Array of messages to process (owned by the instance from now on, even on failure)
+ * @param count Number of messages in the array
+ * @return NULL on success, error message on failure
+ */
+__attribute__((visibility("default")))
+const char* plugin_instance_place_work_batch(plugin_instance_t* instance, const message_t* messages, int count);
+/**
+ * plugin_attach_batch for one instance, the next stage is an entry point
+ * together with the instance to call it with
+ * @param instance The instance to attach
+ * @param next_place_work_batch The next stage's plugin_instance_place_work_batch
+ * @param next The next stage's instance
+ */
+__attribute__((visibility("default")))
+void plugin_instance_attach_batch(plugin_instance_t* instance, plugin_instance_place_work_batch_t next_place_work_batch,
+plugin_instance_t* next);
+/**
+ * plugin_attach_fused for one instance
+ * @param instance The instance that runs the stages on its thread
+ * @param stages The stages, in chain order (copied)
+ * @param count Number of stages
+ * @return NULL on success, error message on failure
+ */
+__attribute__((visibility("default")))
+const char* plugin_instance_attach_fused(plugin_instance_t* instance, const plugin_fused_stage_t* stages, int count);
+/**
+ * plugin_process_message for one instance
+ * @param instance The instance to run
+ * @param input The message to process (the instance owns it from now on, even on failure)
+ * @param output The result, owned by the caller
+ * @return NULL on success, error message on failure
+ */
+__attribute__((visibility("default")))
+const char* plugin_instance_process_message(plugin_instance_t* instance, message_t* input, message_t* output);
+/**
+ * plugin_wait_finished for one instance
+ * @param instance The instance to wait for
+ * @return NULL on success, error message on failure
+ */
+__attribute__((visibility("default")))
+const char* plugin_instance_wait_finished(plugin_instance_t* instance);
+/**
+ * plugin_set_inline for one instance (before plugin_instance_init)
+ * @param instance The instance
+ */
+__attribute__((visibility("default")))
+void plugin_instance_set_inline(plugin_instance_t* instance);
+/**
+ * plugin_set_replicas for one instance (before plugin_instance_init)
+ * @param instance The instance
+ * @param count Number of consumer threads
+ */
+__attribute__((visibility("default")))
+void plugin_instance_set_replicas(plugin_instance_t* instance, int count);
+/**
+ * plugin_set_queue_budget for one instance (before plugin_instance_init)
+ * @param instance The instance
+ * @param budget Memory budget shared with the other queues, owned by the host
+ */
+__attribute__((visibility("default")))
+void plugin_instance_set_queue_budget(plugin_instance_t* instance, consumer_producer_budget_t* budget);
+/**
+ * plugin_set_print_order for one instance (before plugin_instance_init)
+ * @param instance The instance
+ * @param order The print order of the chain, owned by the host
+ * @param position The instance's position among the printers, from 0
+ */
+__attribute__((visibility("default")))
+void plugin_instance_set_print_order(plugin_instance_t* instance, print_order_t* order, int position);
+/**
+ * plugin_get_stats for one instance
+ * @param instance The instance
+ * @param stats Receives the counters
+ * @return NULL on success, error message on failure
+ */
+__attribute__((visibility("default")))
+const char* plugin_instance_get_stats(plugin_instance_t* instance, plugin_stats_t* stats);
+/**
+ * plugin_get_latency for one instance, any of the histograms may be NULL
+ * @param instance The instance
+ * @param queue_wait Receives how long messages waited in the queue
+ * @param service Receives how long the processing function took
+ * @param end_to_end Receives the time from the input reader to here
+ * @return NULL on success, error message on failure
+ */
+__attribute__((visibility("default")))
+const char* plugin_instance_get_latency(plugin_instance_t* instance, latency_histogram_t* queue_wait,
+latency_histogram_t* service, latency_histogram_t* end_to_end);
+
 #endif
\ No newline at end of file
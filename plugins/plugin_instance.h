@@ -0,0 +1,39 @@
+#ifndef PLUGIN_INSTANCE_H
+#define PLUGIN_INSTANCE_H
+
+#include "message.h"
+
+/**
+ * SDK version 2: one loaded plugin .so can run as several stages of the chain.
+ * plugin_create makes an instance (the plugin's queue, threads and counters),
+ * and the plugin_instance_* functions work on the instance they are given.
+ * The first instance of a load is the one the version 1 functions
+ * (plugin_init, plugin_place_work_batch, ...) work on
+ */
+#define PLUGIN_SDK_VERSION 2
+
+/**
+ * One instance of a plugin, only the plugin knows what is inside
+ */
+typedef struct plugin_instance plugin_instance_t;
+
+/**
+ * Entry point of the next stage of the chain, together with the instance it is called with
+ * @param next The next stage's instance
+ * @param messages Array of messages (the next stage owns them from now on, even on failure)
+ * @param count Number of messages in the array
+ * @return NULL on success, error message on failure
+ */
+typedef const char* (*plugin_instance_place_work_batch_t)(plugin_instance_t* next, const message_t* messages, int count);
+
+/**
+ * A stage that runs on another plugin's thread (stage fusion): its
+ * plugin_instance_process_message and the instance to call it with
+ */
+typedef struct
+{
+ const char* (*process_message)(plugin_instance_t* instance, message_t* input, message_t* output);
+ plugin_instance_t* instance;
+} plugin_fused_stage_t;
+
+#endif
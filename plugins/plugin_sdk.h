@@ -1,3 +1,10 @@
+#include "message.h"
+#include "plugin_stats.h"
+#include "plugin_instance.h"
+#include "sync/consumer_producer.h"
+#include "sync/print_order.h"
+#include "metrics/latency_histogram.h"
+
 /**
  * Get the plugin's name
  * @return The plugin's name (should not be modified or freed)
@@ -22,16 +29,146 @@ new memory)
  */
 
 const char* plugin_place_work(const char* str);
+/**
+ * Hand an already allocated string to the plugin's queue without copying it (optional)
+ * @param str The string to process (the plugin owns it from now on, even on failure)
+ * @param length Number of bytes in str (str[length] must be a NUL)
+ * @param release The free function of whoever allocated str
+ * @return NULL on success, error message on failure
+ */
+const char* plugin_place_work_owned(char* str, size_t length, message_release_t release);
+/**
+ * Hand several messages to the plugin's queue at once, without copying them (optional)
+ * @param messages Array of messages to process (the plugin owns them from now on)
+ * @param count Number of messages in the array
+ * @return NULL on success, error message on failure
+ */
+const char* plugin_place_work_batch(const message_t* messages, int count);
+/**
+ * Ask the plugin not to start a thread or make a queue in plugin_init, it is
+ * then only used through plugin_process_message (optional)
+ * Must be called before plugin_init
+ */
+void plugin_set_inline(void);
+/**
+ * Ask the plugin to run count consumer threads instead of one, the output
+ * order stays the same (optional)
+ * Only used by the host for plugins that export plugin_pure_transform.
+ * Must be called before plugin_init
+ * @param count Number of consumer threads
+ */
+void plugin_set_replicas(int count);
+/**
+ * Let the plugin's queue grow when it keeps filling up and shrink when it
+ * stays mostly empty, starting at the queue_size given to plugin_init (optional)
+ * Must be called before plugin_init
+ * @param budget Slots all the queues may have together, shared by every
+ * plugin (the host owns it, it must outlive the plugins)
+ */
+void plugin_set_queue_budget(consumer_producer_budget_t* budget);
+/**
+ * Put the plugin's output in order with the other printers of the chain
+ * (optional, only used for plugins that export plugin_ordered_output)
+ * Must be called before plugin_init
+ * @param order The print order of the chain (the host owns it, it must outlive the plugins)
+ * @param position The plugin's position among the printers, from 0
+ */
+void plugin_set_print_order(print_order_t* order, int position);
+/**
+ * Set when the plugin's buffered output is written (optional, only plugins
+ * that print through an output sink have it, like logger)
+ * Must be called before plugin_init. 0 turns a limit off
+ * @param max_bytes Write once this many bytes wait
+ * @param max_lines Write once this many lines wait
+ * @param max_delay_ms Write at most this long after a line came in
+ */
+void plugin_set_flush_policy(size_t max_bytes, size_t max_lines, long max_delay_ms);
+/**
+ * Process one message right away on the calling thread (optional)
+ * Only used by the host for plugins that export plugin_pure_transform
+ * @param input The message to process (the plugin owns it from now on, even on failure)
+ * @param output The result, owned by the caller
+ * @return NULL on success, error message on failure
+ */
+const char* plugin_process_message(message_t* input, message_t* output);
+/**
+ * Run the given process_message functions on this plugin's thread right after
+ * its own processing, instead of sending the messages to those plugins (optional)
+ * @param stages The process_message functions of the next plugins, in order
+ * @param count Number of stages
+ * @return NULL on success, error message on failure
+ */
+const char* plugin_attach_fused(const char* (* const* stages)(message_t*, message_t*), int count);
 /**
  * Attach this plugin to the next plugin in the chain
  * @param next_place_work Function pointer to the next plugin's place_work
 function
  */
 void plugin_attach(const char* (*next_place_work)(const char*));
+/**
+ * Attach this plugin to the next plugin's batch entry point (optional)
+ * @param next_place_work_batch Function pointer to the next plugin's
+place_work_batch function
+ */
+void plugin_attach_batch(const char* (*next_place_work_batch)(const message_t*, int));
+/**
+ * Copy the plugin's runtime counters (optional)
+ * Can be called from any thread while the plugin runs
+ * @param stats Receives the counters
+ * @return NULL on success, error message on failure
+ */
+const char* plugin_get_stats(plugin_stats_t* stats);
+/**
+ * Copy the plugin's latency histograms (optional), any of them may be NULL
+ * Can be called from any thread while the plugin runs
+ * @param queue_wait Receives how long messages waited in the queue
+ * @param service Receives how long the processing function took
+ * @param end_to_end Receives the time from the input reader to the end of
+ * the chain, for the lines this plugin was the last stage of
+ * @return NULL on success, error message on failure
+ */
+const char* plugin_get_latency(latency_histogram_t* queue_wait, latency_histogram_t* service,
+latency_histogram_t* end_to_end);
 /**
  * Wait until the plugin has finished processing all work and is ready to
 shutdown
  * This is a blocking function used for graceful shutdown coordination
  * @return NULL on success, error message on failure
  */
-const char* plugin_wait_finished(void);
\ No newline at end of file
+const char* plugin_wait_finished(void);
+
+/**
+ * SDK version 2 (optional): one loaded copy of a plugin runs as several
+ * stages, each is an instance made by plugin_create. The plugin_instance_*
+ * functions are the ones above for the instance they are given (see
+ * plugins/plugin_instance.h). A plugin has all of them or none
+ * @return A new instance, NULL if this copy cant have another one (only pure
+ * transforms can have more than one, the host loads another copy otherwise)
+ */
+plugin_instance_t* plugin_create(void);
+/**
+ * Free an instance, after plugin_instance_fini
+ * @param instance The instance from plugin_create
+ */
+void plugin_destroy(plugin_instance_t* instance);
+const char* plugin_instance_init(plugin_instance_t* instance, int queue_size);
+const char* plugin_instance_fini(plugin_instance_t* instance);
+const char* plugin_instance_place_work_batch(plugin_instance_t* instance, const message_t* messages, int count);
+/**
+ * Attach an instance to the next stage
+ * @param instance The instance to attach
+ * @param next_place_work_batch Entry point of the next stage, called with next
+ * @param next The next stage's instance
+ */
+void plugin_instance_attach_batch(plugin_instance_t* instance, plugin_instance_place_work_batch_t next_place_work_batch,
+plugin_instance_t* next);
+const char* plugin_instance_attach_fused(plugin_instance_t* instance, const plugin_fused_stage_t* stages, int count);
+const char* plugin_instance_process_message(plugin_instance_t* instance, message_t* input, message_t* output);
+const char* plugin_instance_wait_finished(plugin_instance_t* instance);
+void plugin_instance_set_inline(plugin_instance_t* instance);
+void plugin_instance_set_replicas(plugin_instance_t* instance, int count);
+void plugin_instance_set_queue_budget(plugin_instance_t* instance, consumer_producer_budget_t* budget);
+void plugin_instance_set_print_order(plugin_instance_t* instance, print_order_t* order, int position);
+const char* plugin_instance_get_stats(plugin_instance_t* instance, plugin_stats_t* stats);
+const char* plugin_instance_get_latency(plugin_instance_t* instance, latency_histogram_t* queue_wait,
+latency_histogram_t* service, latency_histogram_t* end_to_end);
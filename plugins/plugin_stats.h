@@ -0,0 +1,26 @@
+#ifndef PLUGIN_STATS_H
+#define PLUGIN_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Runtime counters of one plugin (stage), as the host gets them from
+ * plugin_get_stats. The counters only grow, the queue numbers are a snapshot.
+ * <END> is not counted as a message.
+ * A plugin that runs inline (fused, or in the pool) has no queue of its own,
+ * so its queue numbers are 0
+ */
+typedef struct
+{
+ uint64_t messages_in; /* Messages the plugin took to process */
+ uint64_t messages_out; /* Messages the plugin passed on (the ones that failed are missing) */
+ uint64_t bytes_in; /* Payload bytes of messages_in */
+ uint64_t bytes_out; /* Payload bytes of messages_out */
+ uint64_t transform_ns; /* Time spent in the plugin's own processing function */
+ size_t queue_depth; /* Messages waiting in the plugin's queue right now */
+ size_t queue_high_water; /* Most messages that ever waited in the queue at once */
+ size_t queue_capacity; /* Size of the queue */
+} plugin_stats_t;
+
+#endif
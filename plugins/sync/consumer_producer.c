@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
 
 // After some testing I found a race condition that caused
 // consumer_producer_get() to be accesed by multiple threads 
@@ -10,8 +11,76 @@
 // Initially I used a global mutex that was shared within all queues
 // But I eventaully decided that each queue will have their own lock, so
 // The mutex was added to the queue struct
+//
+// Later on: every hop used to pay for queueLock plus the
+// monitor mutexes even though in a linear chain each queue has exactly one
+// producer and one consumer. So there is a second backend (SPSC) where the
+// producer only writes the tail and the consumer only writes the head, and
+// the monitors are touched only when one side actually has to go to sleep.
+//
+// And later: an adaptive queue changes its own capacity. The producer decides
+// (it is the one that sees the queue full or mostly empty) and moves the items
+// into a new ring. The LOCKED one does it holding queueLock. The SPSC consumer
+// may be reading the old ring at that moment, so the producer never frees it,
+// the new ring points at it and the consumer frees it once it uses the new one.
+
+// Adaptive queues grow after the producer found them full this many times,
+// and shrink after this many put rounds in a row left them a quarter full or less
+#define GrowAfterFullRounds 4
+#define ShrinkAfterQuietRounds 1024
+
+// Round the SPSC ring up to a power of 2 so that wrapping is a mask
+static size_t RingSizeFor (int capacity) {
+    size_t ringSize = 1;
+    while (ringSize < (size_t)capacity) {
+        ringSize <<= 1;
+    }
+    return ringSize;
+}
+
+// A ring with room for slots messages
+static consumer_producer_ring_t* AllocRing (size_t slots) {
+    consumer_producer_ring_t* ring = malloc(sizeof(consumer_producer_ring_t) + sizeof(message_t) * slots);
+    if (ring != NULL) {
+        ring->replaced = NULL;
+        ring->mask = slots - 1;
+
+        // Touch the slots now, so a big ring gets its pages from the NUMA node
+        // of the thread that makes the queue, not of whoever writes it first
+        memset(ring->slots, 0, sizeof(message_t) * slots);
+    }
+    return ring;
+}
+
+// Take slots from the budget, fails if they dont fit. force takes them anyway,
+// for a ring we already have or one that replaces a bigger ring
+static int BudgetReserve (consumer_producer_budget_t* budget, size_t slots, int force) {
+    size_t used = __atomic_load_n(&budget->used, __ATOMIC_RELAXED);
+    do {
+        if (!force && used + slots > budget->limit) {
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&budget->used, &used, used + slots, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+// Free a ring and every ring it replaced, and give their slots back to the budget
+static void FreeRings (consumer_producer_t* queue, consumer_producer_ring_t* ring) {
+    while (ring != NULL) {
+        consumer_producer_ring_t* replaced = ring->replaced;
+        if (queue->adaptive.budget != NULL) {
+            __atomic_fetch_sub(&queue->adaptive.budget->used, ring->mask + 1, __ATOMIC_RELAXED);
+        }
+        free(ring);
+        ring = replaced;
+    }
+}
 
 const char* consumer_producer_init (consumer_producer_t* queue, int capacity) {
+    return consumer_producer_init_mode(queue, capacity, CONSUMER_PRODUCER_LOCKED);
+}
+
+const char* consumer_producer_init_mode (consumer_producer_t* queue, int capacity, consumer_producer_mode_t mode) {
     
     // Safety check
     if (capacity <= 0) {
@@ -22,31 +91,51 @@ const char* consumer_producer_init (consumer_producer_t* queue, int capacity) {
     if (queue == NULL) {
         return "Error, the given queue ptr is null";
     }
+
+    // And another one, for the backend
+    if (mode != CONSUMER_PRODUCER_LOCKED && mode != CONSUMER_PRODUCER_SPSC) {
+        return "Error, unknown queue mode";
+    }
     
     // Initialize the parameters of the queue
     queue->capacity = capacity;
     queue->count = 0;
     queue->head = 0;
     queue->tail = 0;
+    queue->mode = mode;
+    queue->sequence = 0;
+    queue->highWater = 0;
+    queue->adaptive.budget = NULL;
+    queue->adaptive.minCapacity = capacity;
+    queue->adaptive.fullRounds = 0;
+    queue->adaptive.quietRounds = 0;
+    queue->consumer.head = 0;
+    queue->consumer.cachedTail = 0;
+    queue->producer.tail = 0;
+    queue->producer.cachedHead = 0;
+    queue->waiting.consumer = 0;
+    queue->waiting.producer = 0;
     
     // Allocate the memory for the items array within the queue struct
     // according to the capacity
-    queue->items = (char**)malloc(sizeof(char*) * capacity);
-    if (queue->items == NULL) {
+    // The SPSC positions only grow, the slot is (position & ring->mask)
+    size_t ringSize = (mode == CONSUMER_PRODUCER_SPSC) ? RingSizeFor(capacity) : (size_t)capacity;
+    queue->ring = AllocRing(ringSize);
+    if (queue->ring == NULL) {
         return "Error, failed to allocate memory for items array";
     }
     
     // Initialize all the monitors
     // Upon failure return error messages accordingly
     if (monitor_init(&queue->not_full_monitor) != 0) {
-        free(queue->items);
+        free(queue->ring);
         return "Error, couldnt initialize not_full_monitor";
     }
     
     // Here we also destroy the monitor that was already initialized
     if (monitor_init(&queue->not_empty_monitor) != 0) {
         monitor_destroy(&queue->not_full_monitor);
-        free(queue->items);
+        free(queue->ring);
         return "Error, couldnt initialize not_empty_monitor";
     }
 
@@ -54,7 +143,7 @@ const char* consumer_producer_init (consumer_producer_t* queue, int capacity) {
     if (monitor_init(&queue->finished_monitor) != 0) {
         monitor_destroy(&queue->not_full_monitor);
         monitor_destroy(&queue->not_empty_monitor);
-        free(queue->items);
+        free(queue->ring);
         return "Error, couldnt initialize finished_monitor";
     }
     
@@ -63,7 +152,7 @@ const char* consumer_producer_init (consumer_producer_t* queue, int capacity) {
         monitor_destroy(&queue->not_full_monitor);
         monitor_destroy(&queue->not_empty_monitor);
         monitor_destroy(&queue->finished_monitor);
-        free(queue->items);
+        free(queue->ring);
         return "Error, couldnt initialize the queue mutex";
     }
     
@@ -85,18 +174,30 @@ void consumer_producer_destroy (consumer_producer_t* queue) {
     }
     
     // Free all the remaining items that are in the queue
-    for (int i=0; i<queue->count; i++) {
-        int indexToCheck = (queue->head + i) % queue->capacity;
-        if (queue->items[indexToCheck] != NULL) {
-            free(queue->items[indexToCheck]);
-            queue->items[indexToCheck] = NULL;
+    // (each one with the release function of whoever allocated it)
+    // (the newest ring has all of them, even if older ones werent freed yet)
+    message_t* items = queue->ring->slots;
+    if (queue->mode == CONSUMER_PRODUCER_SPSC) {
+        for (size_t position = queue->consumer.head; position != queue->producer.tail; position++) {
+            size_t indexToCheck = position & queue->ring->mask;
+            message_release(&items[indexToCheck]);
+            items[indexToCheck].data = NULL;
+        }
+    }
+    else {
+        for (int i=0; i<queue->count; i++) {
+            int indexToCheck = (queue->head + i) % queue->capacity;
+            if (items[indexToCheck].data != NULL) {
+                message_release(&items[indexToCheck]);
+                items[indexToCheck].data = NULL;
+            }
         }
     }
     
-    // Free the items array (the array itself)
-    if (queue->items != NULL) {
-        free(queue->items);
-        queue->items = NULL;
+    // Free the items array (the array itself, and the ones it replaced)
+    if (queue->ring != NULL) {
+        FreeRings(queue, queue->ring);
+        queue->ring = NULL;
     }
     
     // Destroy all the monitors using the funciton from the monitor implementation
@@ -112,126 +213,592 @@ void consumer_producer_destroy (consumer_producer_t* queue) {
     queue->count = 0;
     queue->head = 0;
     queue->tail = 0;
+    queue->consumer.head = 0;
+    queue->producer.tail = 0;
+    queue->highWater = 0;
+    queue->adaptive.budget = NULL;
 }
 
-const char* consumer_producer_put (consumer_producer_t* queue, const char* item) {
-    
+const char* consumer_producer_set_adaptive (consumer_producer_t* queue, consumer_producer_budget_t* budget) {
+
     // Safety check
-    if (item == NULL) {
-        return "Passed a null item pointer";
+    if (queue == NULL || budget == NULL) {
+        return "Error, the queue and the budget cant be NULL";
+    }
+
+    // The ring we already have counts too, even if it doesnt fit
+    queue->adaptive.budget = budget;
+    queue->adaptive.minCapacity = queue->capacity;
+    BudgetReserve(budget, queue->ring->mask + 1, 1);
+    return NULL;
+}
+
+// Remember the most items the queue ever held. Only producers call this, and
+// each backend has a single writer here (the SPSC producer, or the LOCKED
+// producer holding queueLock), so a relaxed load and store is enough
+static void UpdateHighWater (consumer_producer_t* queue, size_t depth) {
+    if (depth > __atomic_load_n(&queue->highWater, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&queue->highWater, depth, __ATOMIC_RELAXED);
+    }
+}
+
+// Move the items into a ring for newCapacity (producer side, LOCKED: holding
+// queueLock). Returns 0, or -1 if the budget or malloc said no
+static int ResizeQueue (consumer_producer_t* queue, int newCapacity) {
+    consumer_producer_ring_t* oldRing = queue->ring;
+    int shrinking = newCapacity < queue->capacity;
+
+    if (queue->mode == CONSUMER_PRODUCER_SPSC) {
+
+        // Capacities that round up to the same power of 2 share a ring
+        size_t ringSize = RingSizeFor(newCapacity);
+        if (ringSize != oldRing->mask + 1) {
+            if (BudgetReserve(queue->adaptive.budget, ringSize, shrinking) != 0) {
+                return -1;
+            }
+            consumer_producer_ring_t* ring = AllocRing(ringSize);
+            if (ring == NULL) {
+                __atomic_fetch_sub(&queue->adaptive.budget->used, ringSize, __ATOMIC_RELAXED);
+                return -1;
+            }
+
+            // Copy everything the consumer didnt take yet. It may take some of
+            // it from the old ring meanwhile (it only reads the slots, see SpscTake),
+            // those copies are simply never read. The new ring is published before
+            // any item is put only there, so a consumer that sees such an item
+            // (tail first) also sees the ring
+            size_t head = __atomic_load_n(&queue->consumer.head, __ATOMIC_ACQUIRE);
+            for (size_t position = head; position != queue->producer.tail; position++) {
+                ring->slots[position & ring->mask] = oldRing->slots[position & oldRing->mask];
+            }
+            ring->replaced = oldRing;
+            __atomic_store_n(&queue->ring, ring, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&queue->capacity, newCapacity, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    // LOCKED: nobody else looks at the ring while we hold queueLock, so the
+    // items are moved to the start of the new ring and the old one goes right away
+    if (BudgetReserve(queue->adaptive.budget, (size_t)newCapacity, shrinking) != 0) {
+        return -1;
+    }
+    consumer_producer_ring_t* ring = AllocRing((size_t)newCapacity);
+    if (ring == NULL) {
+        __atomic_fetch_sub(&queue->adaptive.budget->used, (size_t)newCapacity, __ATOMIC_RELAXED);
+        return -1;
+    }
+    for (int i=0; i<queue->count; i++) {
+        ring->slots[i] = oldRing->slots[(queue->head + i) % queue->capacity];
+    }
+    queue->head = 0;
+    queue->tail = queue->count % newCapacity;
+    queue->ring = ring;
+    FreeRings(queue, oldRing);
+    __atomic_store_n(&queue->capacity, newCapacity, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Adaptive queues: the producer found the queue full. When that keeps
+// happening the capacity doubles (if the budget allows), returns 1 if it grew
+static int AdaptiveOnFull (consumer_producer_t* queue) {
+    if (queue->adaptive.budget == NULL) {
+        return 0;
+    }
+    queue->adaptive.quietRounds = 0;
+    if (++queue->adaptive.fullRounds < GrowAfterFullRounds || queue->capacity > INT_MAX / 2) {
+        return 0;
+    }
+    if (ResizeQueue(queue, queue->capacity * 2) != 0) {
+        return 0;
+    }
+    queue->adaptive.fullRounds = 0;
+    return 1;
+}
+
+// Adaptive queues: a put round left depth items in the queue. When it stays
+// a quarter full or less for long, the capacity halves (not below the start)
+static void AdaptiveAfterPut (consumer_producer_t* queue, size_t depth) {
+    if (queue->adaptive.budget == NULL || queue->capacity <= queue->adaptive.minCapacity) {
+        return;
+    }
+    if (depth * 4 > (size_t)queue->capacity) {
+        queue->adaptive.quietRounds = 0;
+        return;
+    }
+    if (++queue->adaptive.quietRounds < ShrinkAfterQuietRounds) {
+        return;
+    }
+
+    int newCapacity = queue->capacity / 2;
+    if (newCapacity < queue->adaptive.minCapacity) {
+        newCapacity = queue->adaptive.minCapacity;
+    }
+    ResizeQueue(queue, newCapacity);
+    queue->adaptive.quietRounds = 0;
+    queue->adaptive.fullRounds = 0;
+}
+
+// SPSC producer side: wait until there is at least one free slot.
+// Only the producer calls this so producer.* is ours to write
+static const char* SpscWaitNotFull (consumer_producer_t* queue) {
+    size_t tail = queue->producer.tail;
+
+    // Fast path, the cached head says there is room
+    if (tail - queue->producer.cachedHead < (size_t)queue->capacity) {
+        return NULL;
+    }
+
+    // Looks full, refresh the cached head from the consumer
+    queue->producer.cachedHead = __atomic_load_n(&queue->consumer.head, __ATOMIC_ACQUIRE);
+    while (tail - queue->producer.cachedHead >= (size_t)queue->capacity) {
+
+        // An adaptive queue that keeps filling up rather grows than sleeps
+        if (AdaptiveOnFull(queue)) {
+            continue;
+        }
+
+        // Really full, so we have to sleep.
+        // Announce that we are waiting and then look at the head again, the
+        // consumer does the mirror image (move head, fence, read the flag), so
+        // either we see its new head or it sees our flag and signals us.
+        // The monitor remembers the signal, so signaling before we wait is fine
+        monitor_reset(&queue->not_full_monitor);
+        __atomic_store_n(&queue->waiting.producer, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        queue->producer.cachedHead = __atomic_load_n(&queue->consumer.head, __ATOMIC_ACQUIRE);
+
+        if (tail - queue->producer.cachedHead >= (size_t)queue->capacity) {
+            if (monitor_wait(&queue->not_full_monitor) != 0) {
+                __atomic_store_n(&queue->waiting.producer, 0, __ATOMIC_RELAXED);
+                return "Error, failed to wait on not_full_monitor";
+            }
+        }
+        __atomic_store_n(&queue->waiting.producer, 0, __ATOMIC_RELAXED);
+        queue->producer.cachedHead = __atomic_load_n(&queue->consumer.head, __ATOMIC_ACQUIRE);
+    }
+
+    return NULL;
+}
+
+// SPSC producer side: how many slots are free right now (at least the
+// ones SpscWaitNotFull promised, maybe more if the consumer moved on)
+static size_t SpscFreeSlots (consumer_producer_t* queue) {
+    queue->producer.cachedHead = __atomic_load_n(&queue->consumer.head, __ATOMIC_ACQUIRE);
+    return (size_t)queue->capacity - (queue->producer.tail - queue->producer.cachedHead);
+}
+
+// SPSC producer side: publish count messages (that many slots must be free)
+// All of them become visible with a single tail update
+static void SpscPublish (consumer_producer_t* queue, const message_t* messages, size_t count) {
+    size_t tail = queue->producer.tail;
+    consumer_producer_ring_t* ring = queue->ring;
+    uint64_t now = message_clock_ns();
+    for (size_t i=0; i<count; i++) {
+        // The position never wraps, so it doubles as the sequence number
+        message_t* slot = &ring->slots[(tail + i) & ring->mask];
+        *slot = messages[i];
+        slot->sequence = tail + i;
+        slot->enqueue_ns = now;
+    }
+
+    // Release makes the slot contents visible before the new tail
+    __atomic_store_n(&queue->producer.tail, tail + count, __ATOMIC_RELEASE);
+
+    // Wake the consumer only if it said it is going to sleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue->waiting.consumer, __ATOMIC_RELAXED)) {
+        monitor_signal(&queue->not_empty_monitor);
+    }
+}
+
+// SPSC consumer side: wait until there is at least one item.
+// Only the consumer calls this so consumer.* is ours to write
+static int SpscWaitNotEmpty (consumer_producer_t* queue) {
+    size_t head = queue->consumer.head;
+
+    // Fast path, the cached tail says there are items
+    if (queue->consumer.cachedTail != head) {
+        return 0;
+    }
+
+    // Looks empty, refresh the cached tail from the producer
+    queue->consumer.cachedTail = __atomic_load_n(&queue->producer.tail, __ATOMIC_ACQUIRE);
+    while (queue->consumer.cachedTail == head) {
+
+        // Same handshake as SpscWaitNotFull, with the roles swapped
+        monitor_reset(&queue->not_empty_monitor);
+        __atomic_store_n(&queue->waiting.consumer, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        queue->consumer.cachedTail = __atomic_load_n(&queue->producer.tail, __ATOMIC_ACQUIRE);
+
+        if (queue->consumer.cachedTail == head) {
+            if (monitor_wait(&queue->not_empty_monitor) != 0) {
+                __atomic_store_n(&queue->waiting.consumer, 0, __ATOMIC_RELAXED);
+                return -1;
+            }
+        }
+        __atomic_store_n(&queue->waiting.consumer, 0, __ATOMIC_RELAXED);
+        queue->consumer.cachedTail = __atomic_load_n(&queue->producer.tail, __ATOMIC_ACQUIRE);
+    }
+
+    return 0;
+}
+
+// SPSC consumer side: take up to maxMessages messages (at least one must be available)
+// All of them are released back to the producer with a single head update
+static int SpscTake (consumer_producer_t* queue, message_t* messages, int maxMessages) {
+    size_t head = queue->consumer.head;
+
+    // Look at the real tail so we drain everything that is there by now
+    queue->consumer.cachedTail = __atomic_load_n(&queue->producer.tail, __ATOMIC_ACQUIRE);
+    size_t available = queue->consumer.cachedTail - head;
+    size_t count = available < (size_t)maxMessages ? available : (size_t)maxMessages;
+
+    // The ring after the tail, an item we just saw may only be in a new ring.
+    // Once we use a new ring nobody reads the ones it replaced anymore
+    consumer_producer_ring_t* ring = __atomic_load_n(&queue->ring, __ATOMIC_ACQUIRE);
+    if (ring->replaced != NULL) {
+        FreeRings(queue, ring->replaced);
+        ring->replaced = NULL;
+    }
+
+    // The slots are only read: a producer growing or shrinking the queue may be
+    // copying them at the same time, and nothing after head is looked at anyway
+    for (size_t i=0; i<count; i++) {
+        messages[i] = ring->slots[(head + i) & ring->mask];
+    }
+
+    // Release makes sure we are done reading the slots before the producer reuses them
+    __atomic_store_n(&queue->consumer.head, head + count, __ATOMIC_RELEASE);
+
+    // Wake the producer only if it said it is going to sleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue->waiting.producer, __ATOMIC_RELAXED)) {
+        monitor_signal(&queue->not_full_monitor);
+    }
+
+    return (int)count;
+}
+
+// Give back the messages we could not add to the queue
+static void ReleaseMessages (const message_t* messages, int count) {
+    for (int i=0; i<count; i++) {
+        message_release(&messages[i]);
+    }
+}
+
+// The string API hands out strings the caller frees with free(), so a message
+// that was allocated by someone else (another libc) is copied out first
+static char* TakeString (message_t message) {
+    if (message.release == free) {
+        return message.data;
+    }
+
+    char* copiedItem = malloc(message.length + 1);
+    if (copiedItem != NULL) {
+        memcpy(copiedItem, message.data, message.length + 1);
+    }
+    message_release(&message);
+    return copiedItem;
+}
+
+const char* consumer_producer_put_messages (consumer_producer_t* queue, const message_t* messages, int count) {
+
+    // Safety checks
+    if (messages == NULL || count < 0) {
+        return "Passed a bad batch";
     }
-    
-    // Yet another safety check
     if (queue == NULL) {
+        ReleaseMessages(messages, count);
         return "Passed a null queue pointer";
     }
+    for (int i=0; i<count; i++) {
+        if (messages[i].data == NULL || messages[i].release == NULL) {
+
+            // The batch is ours anyway, give back every message that can be
+            // released (a bad one has nothing we could call for it)
+            for (int j=0; j<count; j++) {
+                if (messages[j].data != NULL && messages[j].release != NULL) {
+                    message_release(&messages[j]);
+                }
+            }
+            return "Passed a null item pointer";
+        }
+    }
+
+    int placed = 0;
+
+    // Lock-free backend: every round fills all the free slots at once
+    if (queue->mode == CONSUMER_PRODUCER_SPSC) {
+        while (placed < count) {
+            const char* waitError = SpscWaitNotFull(queue);
+            if (waitError != NULL) {
+                ReleaseMessages(messages + placed, count - placed);
+                return waitError;
+            }
+
+            size_t freeSlots = SpscFreeSlots(queue);
+            size_t remaining = (size_t)(count - placed);
+            size_t roundSize = remaining < freeSlots ? remaining : freeSlots;
+            SpscPublish(queue, messages + placed, roundSize);
+            placed += (int)roundSize;
+
+            // The cached head was just refreshed, so this is the depth right after publishing
+            UpdateHighWater(queue, queue->producer.tail - queue->producer.cachedHead);
+            AdaptiveAfterPut(queue, queue->producer.tail - queue->producer.cachedHead);
+        }
+        return NULL;
+    }
 
     // Lock, so that no other thread will be able to modify queue
+    // One lock acquisition per round instead of per item
     pthread_mutex_lock(&queue->queueLock);
+    while (placed < count) {
 
-    
-    // Wait until queue is not full
-    while (queue->count >= queue->capacity) {
-        
-        // I unlock the mutex before access to monitor because consumer
-        // threads now need to access the queue in order to remove itms
-        pthread_mutex_unlock(&queue->queueLock);
+        // Wait until queue is not full
+        while (queue->count >= queue->capacity) {
+
+            // An adaptive queue that keeps filling up rather grows than waits
+            if (AdaptiveOnFull(queue)) {
+                continue;
+            }
+
+            // I unlock the mutex before access to monitor because consumer
+            // threads now need to access the queue in order to remove itms
+            pthread_mutex_unlock(&queue->queueLock);
+
+            // Upon failure return failure message
+            if (monitor_wait(&queue->not_full_monitor) != 0) {
+                ReleaseMessages(messages + placed, count - placed);
+                return "Error, failed to wait on not_full_monitor";
+            }
 
-        // Upon failure return failure message
-        if (monitor_wait(&queue->not_full_monitor) != 0) {
-            return "Error, failed to wait on not_full_monitor";
+            // After waking up from the monitor wait we reacquire the lock
+            pthread_mutex_lock(&queue->queueLock);
         }
 
-        // After waking up from the monitor wait we reacquire the lock
-        pthread_mutex_lock(&queue->queueLock);
+        // Add as many messages as fit to the queue
+        // (one clock read for the whole round, they all went in together)
+        uint64_t now = message_clock_ns();
+        while (placed < count && queue->count < queue->capacity) {
+            message_t* slot = &queue->ring->slots[queue->tail];
+            *slot = messages[placed++];
+            slot->sequence = queue->sequence++;
+            slot->enqueue_ns = now;
+            queue->tail = (queue->tail + 1) % queue->capacity;
+            queue->count++;
+        }
+        UpdateHighWater(queue, (size_t)queue->count);
+        AdaptiveAfterPut(queue, (size_t)queue->count);
 
-    }
-    
-    // Allocate memory and make a copy of the string
-    char* copiedItem = malloc(strlen(item) + 1);
-    if (copiedItem == NULL) {
-        
-        // Release the lock before leaving the function (because we have return)
-        pthread_mutex_unlock(&queue->queueLock);
-        return "Error, failed to allocate memory for th item copy";
-    }
-    strcpy(copiedItem, item);
-    
-    // Add the item to the queue
-    queue->items[queue->tail] = copiedItem;
-    queue->tail = (queue->tail + 1) % queue->capacity;
-    queue->count++;
-    
-    // Signal, using the not empty montiro, that queue is not empty 
-    monitor_signal(&queue->not_empty_monitor);
-    
-    // If the queue is now full, reset the not full monitor
-    if (queue->count >= queue->capacity) {
-        monitor_reset(&queue->not_full_monitor);
+        // Signal, using the not empty montiro, that queue is not empty
+        // (once for the whole round)
+        monitor_signal(&queue->not_empty_monitor);
+
+        // If the queue is now full, reset the not full monitor
+        if (queue->count >= queue->capacity) {
+            monitor_reset(&queue->not_full_monitor);
+        }
     }
 
     // Unlock. We are done with the queue so now other threads are free to use it
     pthread_mutex_unlock(&queue->queueLock);
-    
+
     // Upon succes we reach here and return null
     return NULL;
 }
 
-char* consumer_producer_get (consumer_producer_t* queue) {
-    
-    // Safety check
-    if (queue == NULL) {
-        return NULL;
+int consumer_producer_get_messages (consumer_producer_t* queue, message_t* messages, int maxMessages) {
+
+    // Safety checks
+    if (queue == NULL || messages == NULL || maxMessages <= 0) {
+        return -1;
+    }
+
+    // Lock-free backend
+    if (queue->mode == CONSUMER_PRODUCER_SPSC) {
+        if (SpscWaitNotEmpty(queue) != 0) {
+            return -1;
+        }
+        return SpscTake(queue, messages, maxMessages);
     }
 
     // Lock so no othe threads will be able to reach the queue and chagne it
     pthread_mutex_lock(&queue->queueLock);
-    
-    // Wait until the queue is not empty, using the 
+
+    // Wait until the queue is not empty, using the
     // not empty monitor
-    while (queue->count<=0) {
+    while (queue->count <= 0) {
 
         // Unlock to allow producers access to the queue
-        // and signal the not empty monitor 
+        // and signal the not empty monitor
         pthread_mutex_unlock(&queue->queueLock);
         if (monitor_wait(&queue->not_empty_monitor) != 0) {
-            return NULL;
+            return -1;
         }
 
         // Lock again so that no other threads will be able to reach the queue
         pthread_mutex_lock(&queue->queueLock);
     }
-    
-    // Get the item from the queue
-    char* item = queue->items[queue->head];
-    
-    // Clear the slot where the item was in the queue
-    // while maintianing the circular sturcture of the queue
-    queue->items[queue->head] = NULL;
 
-    // Update the head pointer
-    queue->head = (queue->head + 1) % queue->capacity;
+    // Take whatever is there (up to maxMessages) under this one acquisition,
+    // clearing each slot while maintianing the circular sturcture of the queue
+    int taken = 0;
+    while (taken < maxMessages && queue->count > 0) {
+        messages[taken++] = queue->ring->slots[queue->head];
+        queue->ring->slots[queue->head].data = NULL;
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+    }
 
-    // Decrease the amount of itemms in the queue
-    queue->count--;
-    
-    // Signal that queue is not full (we removed an item from it)
+    // Signal that queue is not full (we removed items from it)
     // this is for waiting producers
     monitor_signal(&queue->not_full_monitor);
-    
+
     // If the queue is now empty, reset the not_empty_monitor
     // so that consumers coming in the future will wait until
     // the queue has items
+    // Otherwise pass the wake up on, since a signal only wakes one of the
+    // consumers and the ones still parked could take the rest
     if (queue->count == 0) {
         monitor_reset(&queue->not_empty_monitor);
     }
+    else {
+        monitor_signal(&queue->not_empty_monitor);
+    }
 
     // We are done so we can now unlock and allow others to reach the queue
     pthread_mutex_unlock(&queue->queueLock);
+
+    return taken;
+}
+
+const char* consumer_producer_put (consumer_producer_t* queue, const char* item) {
+    
+    // Safety check
+    if (item == NULL) {
+        return "Passed a null item pointer";
+    }
     
+    // Yet another safety check
+    if (queue == NULL) {
+        return "Passed a null queue pointer";
+    }
+
+    // Allocate memory and make a copy of the string, the queue owns the copy
+    // (this is the only place the queue measures a string)
+    size_t itemLength = strlen(item);
+    message_t message = { .data = malloc(itemLength + 1), .length = itemLength, .release = free };
+    if (message.data == NULL) {
+        return "Error, failed to allocate memory for th item copy";
+    }
+    memcpy(message.data, item, itemLength + 1);
+
+    return consumer_producer_put_messages(queue, &message, 1);
+}
+
+char* consumer_producer_get (consumer_producer_t* queue) {
+
+    // Get a single message, blocks if empty
+    message_t message;
+    if (consumer_producer_get_messages(queue, &message, 1) != 1) {
+        return NULL;
+    }
+
     // Return the item to the caller
     // the caller must free it
-    return item;
+    return TakeString(message);
+}
+
+const char* consumer_producer_put_batch (consumer_producer_t* queue, const char** items, int count) {
+
+    // Safety checks
+    if (queue == NULL) {
+        return "Passed a null queue pointer";
+    }
+    if (items == NULL || count < 0) {
+        return "Passed a bad batch";
+    }
+    if (count == 0) {
+        return NULL;
+    }
+
+    // Make all the copies before touching the queue, so the time we
+    // hold the queue (or keep the consumer waiting) is only the pointer moves
+    // (zeroed, the copies are plain messages that share nothing)
+    message_t* messages = calloc(count, sizeof(message_t));
+    if (messages == NULL) {
+        return "Error, failed to allocate memory for the batch";
+    }
+    for (int i=0; i<count; i++) {
+        messages[i].length = items[i] ? strlen(items[i]) : 0;
+        messages[i].data = items[i] ? malloc(messages[i].length + 1) : NULL;
+        messages[i].release = free;
+        if (messages[i].data != NULL) {
+            memcpy(messages[i].data, items[i], messages[i].length + 1);
+        }
+        if (messages[i].data == NULL) {
+            ReleaseMessages(messages, i);
+            free(messages);
+            return items[i] ? "Error, failed to allocate memory for th item copy" : "Passed a null item pointer";
+        }
+    }
+
+    const char* putError = consumer_producer_put_messages(queue, messages, count);
+    free(messages);
+    return putError;
+}
+
+int consumer_producer_get_batch (consumer_producer_t* queue, char** items, int maxItems) {
+
+    // Safety checks
+    if (queue == NULL || items == NULL || maxItems <= 0) {
+        return -1;
+    }
+
+    // Take at most 64 at a time so the messages fit on the stack
+    message_t messages[64];
+    int taken = consumer_producer_get_messages(queue, messages, maxItems < 64 ? maxItems : 64);
+    for (int i=0; i<taken; i++) {
+        items[i] = TakeString(messages[i]);
+    }
+    return taken;
+}
+
+void consumer_producer_get_depth (consumer_producer_t* queue, size_t* current, size_t* highWater) {
+
+    // Safety check
+    if (queue == NULL) {
+        *current = 0;
+        *highWater = 0;
+        return;
+    }
+
+    // The head is read first, so a consumer moving on in between can only make
+    // the tail look further ahead (never behind the head)
+    size_t depth;
+    if (queue->mode == CONSUMER_PRODUCER_SPSC) {
+        size_t head = __atomic_load_n(&queue->consumer.head, __ATOMIC_ACQUIRE);
+        size_t tail = __atomic_load_n(&queue->producer.tail, __ATOMIC_ACQUIRE);
+        depth = tail - head;
+    }
+    else {
+        depth = (size_t)__atomic_load_n(&queue->count, __ATOMIC_RELAXED);
+    }
+    *current = depth;
+    *highWater = __atomic_load_n(&queue->highWater, __ATOMIC_RELAXED);
+}
+
+int consumer_producer_get_capacity (consumer_producer_t* queue) {
+
+    // Safety check
+    if (queue == NULL) {
+        return 0;
+    }
+
+    // Only adaptive queues change it, relaxed is fine for a number we report
+    return __atomic_load_n(&queue->capacity, __ATOMIC_RELAXED);
 }
 
 void consumer_producer_signal_finished (consumer_producer_t* queue) {
@@ -2,6 +2,46 @@
 #define CONSUMER_PRODUCER_H
 
 #include "monitor.h"
+#include "../message.h"
+#include <stddef.h>
+
+// Size of a cache line on the machines we run on, used to keep the
+// producer side and the consumer side of the lock-free ring apart
+#define CONSUMER_PRODUCER_CACHE_LINE 64
+
+/**
+ * Queue backends
+ * LOCKED works with any number of producers and consumers.
+ * SPSC is lock-free but only valid with exactly one producer thread
+ * and exactly one consumer thread (which is the case in a linear chain)
+ */
+typedef enum
+{
+ CONSUMER_PRODUCER_LOCKED = 0, /* Mutex protected ring */
+ CONSUMER_PRODUCER_SPSC = 1 /* Lock-free single producer / single consumer ring */
+} consumer_producer_mode_t;
+
+/**
+ * Memory budget shared by adaptive queues (see consumer_producer_set_adaptive).
+ * A queue only grows while all the queues together stay within limit slots
+ */
+typedef struct
+{
+ size_t limit; /* Most ring slots all the queues may have together */
+ size_t used; /* Ring slots the queues have right now (changed with atomics) */
+} consumer_producer_budget_t;
+
+/**
+ * The array the items live in. An adaptive SPSC queue swaps in a new ring
+ * while the consumer may still read the old one, so the old ring is kept
+ * (as replaced) until the consumer moved on and frees it
+ */
+typedef struct consumer_producer_ring
+{
+ struct consumer_producer_ring* replaced; /* SPSC: ring this one replaced, NULL once freed */
+ size_t mask; /* Number of slots minus 1 (SPSC: a power of 2, so it is the wrap mask) */
+ message_t slots[]; /* The messages (string + how to free it) */
+} consumer_producer_ring_t;
 
 /**
  * Consumer-Producer queue structure for thread-safe producer-consumer pattern
@@ -9,7 +49,7 @@
  */
 typedef struct
 {
- char** items; /* Array of string pointers */
+ consumer_producer_ring_t* ring; /* Array of messages */
  int capacity; /* Maximum number of items */
  int count; /* Current number of items */
  int head; /* Index of first item */
@@ -18,14 +58,64 @@ typedef struct
  monitor_t not_empty_monitor; /* Monitor for "not empty" state */
  monitor_t finished_monitor; /* Monitor for finished signal */
  pthread_mutex_t queueLock; /* Lock for thread safe queue operations */
+ consumer_producer_mode_t mode; /* Which backend this queue uses */
+ size_t sequence; /* LOCKED: number of items ever put, the next item's sequence number */
+ size_t highWater; /* Most items that were ever in the queue at once (written by producers only) */
+
+ /* Adaptive capacity, only touched by producers (LOCKED: holding queueLock) */
+ struct {
+  consumer_producer_budget_t* budget; /* NULL when the capacity is fixed */
+  int minCapacity; /* Never shrinks below this (the capacity it started with) */
+  int fullRounds; /* Times producers found the queue full since the last resize */
+  int quietRounds; /* Put rounds in a row that left the queue mostly empty */
+ } adaptive;
+
+ /* SPSC: written only by the consumer thread */
+ struct {
+  size_t head; /* Position of the next item to take (never wraps) */
+  size_t cachedTail; /* Last tail seen, refreshed only when it looks empty */
+ } consumer __attribute__((aligned(CONSUMER_PRODUCER_CACHE_LINE)));
+
+ /* SPSC: written only by the producer thread */
+ struct {
+  size_t tail; /* Position of the next free slot (never wraps) */
+  size_t cachedHead; /* Last head seen, refreshed only when it looks full */
+ } producer __attribute__((aligned(CONSUMER_PRODUCER_CACHE_LINE)));
+
+ /* SPSC: set only while a side is about to sleep, so rarely written */
+ struct {
+  int consumer; /* Consumer is (about to be) blocked on not_empty_monitor */
+  int producer; /* Producer is (about to be) blocked on not_full_monitor */
+ } waiting __attribute__((aligned(CONSUMER_PRODUCER_CACHE_LINE)));
 } consumer_producer_t;
 /**
- * Initialize a consumer-producer queue
+ * Initialize a consumer-producer queue (LOCKED backend)
  * @param queue Pointer to queue structure
  * @param capacity Maximum number of items
  * @return NULL on success, error message on failure
  */
 const char* consumer_producer_init(consumer_producer_t* queue, int capacity);
+/**
+ * Initialize a consumer-producer queue with a specific backend
+ * @param queue Pointer to queue structure
+ * @param capacity Maximum number of items
+ * @param mode CONSUMER_PRODUCER_LOCKED or CONSUMER_PRODUCER_SPSC
+ * @return NULL on success, error message on failure
+ */
+const char* consumer_producer_init_mode(consumer_producer_t* queue, int capacity,
+consumer_producer_mode_t mode);
+/**
+ * Let the queue size itself: it doubles its capacity when producers keep
+ * finding it full, and halves it (down to the capacity it was initialized
+ * with) when it stays mostly empty. The rings of all the queues that share
+ * budget never add up to more than budget->limit slots, a queue that cant
+ * get more simply blocks like a fixed one.
+ * Must be called right after init, before the queue is used
+ * @param queue Pointer to queue structure
+ * @param budget Budget shared by the adaptive queues (must outlive the queue)
+ * @return NULL on success, error message on failure
+ */
+const char* consumer_producer_set_adaptive(consumer_producer_t* queue, consumer_producer_budget_t* budget);
 /**
  * Destroy a consumer-producer queue and free its resources
  * @param queue Pointer to queue structure
@@ -47,6 +137,66 @@ item);
  * @return String item or NULL if queue is empty
  */
 char* consumer_producer_get(consumer_producer_t* queue);
+/**
+ * Add count items to the queue (producer), copying them like
+ * consumer_producer_put does. The items are moved in as few rounds as the
+ * capacity allows, each round is a single lock acquisition and a single wake up.
+ * Blocks while the queue is full.
+ * @param queue Pointer to queue structure
+ * @param items Array of count strings
+ * @param count Number of items in the array
+ * @return NULL on success, error message on failure (items not added yet are dropped)
+ */
+const char* consumer_producer_put_batch(consumer_producer_t* queue, const char** items,
+int count);
+/**
+ * Remove up to maxItems items from the queue (consumer) at once.
+ * Blocks only while the queue is empty, then takes whatever is there.
+ * @param queue Pointer to queue structure
+ * @param items Array to receive the items (the caller must free each of them)
+ * @param maxItems Size of the items array
+ * @return Number of items taken (at least 1), -1 on error
+ */
+int consumer_producer_get_batch(consumer_producer_t* queue, char** items, int maxItems);
+/**
+ * Move count messages into the queue (producer) without copying them.
+ * The queue owns the messages from now on, even if an error is returned
+ * (messages that could not be added are released). A batch with a message
+ * without data or release function is rejected as a whole, all its other
+ * messages are released.
+ * Blocks while the queue is full.
+ * @param queue Pointer to queue structure
+ * @param messages Array of count messages
+ * @param count Number of messages in the array
+ * @return NULL on success, error message on failure
+ */
+const char* consumer_producer_put_messages(consumer_producer_t* queue, const message_t* messages,
+int count);
+/**
+ * Move up to maxMessages messages out of the queue (consumer) without copying them.
+ * Blocks only while the queue is empty, then takes whatever is there.
+ * The caller owns the messages (pass them on or call their release)
+ * @param queue Pointer to queue structure
+ * @param messages Array to receive the messages
+ * @param maxMessages Size of the messages array
+ * @return Number of messages taken (at least 1), -1 on error
+ */
+int consumer_producer_get_messages(consumer_producer_t* queue, message_t* messages, int maxMessages);
+
+/**
+ * Look at how full the queue is, without locking it (for statistics, the
+ * numbers may be a little behind while producers and consumers run)
+ * @param queue Pointer to queue structure
+ * @param current Receives the number of items in the queue now
+ * @param highWater Receives the most items that were ever in the queue at once
+ */
+void consumer_producer_get_depth(consumer_producer_t* queue, size_t* current, size_t* highWater);
+/**
+ * The queue's capacity right now (it changes only for adaptive queues)
+ * @param queue Pointer to queue structure
+ * @return Maximum number of items, 0 for a NULL queue
+ */
+int consumer_producer_get_capacity(consumer_producer_t* queue);
 
 /**
  * Signal that processing is finished
@@ -60,4 +210,4 @@ void consumer_producer_signal_finished(consumer_producer_t* queue);
  */
 int consumer_producer_wait_finished(consumer_producer_t* queue);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include "consumer_producer.h"
+
+// Microbenchmarks of consumer_producer_t, the numbers any rewrite of the queue is held against.
+// Every line is: benchmark, ns per operation, futex syscalls per operation
+// (the queue only enters the kernel through its monitors)
+
+// Configuration
+#define PingPongRounds 100000
+#define StreamMessages 2000000
+#define StreamBatch 64
+
+static consumer_producer_t requests;
+static consumer_producer_t replies;
+static consumer_producer_t stream;
+
+// Every message points at this, nothing is allocated or freed while measuring
+static char payload[] = "x";
+
+static void KeepPayload (void* data) {
+    (void)data;
+}
+
+static uint64_t NowNs (void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static void PrintResult (const char* name, double nsPerOp, double syscallsPerOp) {
+    printf("%-40s %12.1f ns/op %10.3f syscalls/op\n", name, nsPerOp, syscallsPerOp);
+}
+
+// The other side of the ping-pong: every request is put back as a reply
+void* replier (void* unused) {
+    (void)unused;
+    message_t message;
+    for (int i=0; i<PingPongRounds; i++) {
+        consumer_producer_get_messages(&requests, &message, 1);
+        consumer_producer_put_messages(&replies, &message, 1);
+    }
+    return NULL;
+}
+
+// Benchmark 1: Ping-pong, one message there and back through two queues (one op is a round trip)
+void benchPingPong (consumer_producer_mode_t mode, const char* modeName) {
+    consumer_producer_init_mode(&requests, 1, mode);
+    consumer_producer_init_mode(&replies, 1, mode);
+    pthread_t thread;
+    pthread_create(&thread, NULL, replier, NULL);
+
+    message_t message = { .data = payload, .length = 1, .release = KeepPayload };
+    unsigned long syscalls = monitor_syscall_count();
+    uint64_t start = NowNs();
+    for (int i=0; i<PingPongRounds; i++) {
+        consumer_producer_put_messages(&requests, &message, 1);
+        consumer_producer_get_messages(&replies, &message, 1);
+    }
+    uint64_t elapsed = NowNs() - start;
+    syscalls = monitor_syscall_count() - syscalls;
+    pthread_join(thread, NULL);
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s ping-pong round trip", modeName);
+    PrintResult(name, (double)elapsed / PingPongRounds, (double)syscalls / PingPongRounds);
+    consumer_producer_destroy(&requests);
+    consumer_producer_destroy(&replies);
+}
+
+// Producer of the stream, one message per put like a stage that forwards as it goes
+void* streamProducer (void* unused) {
+    (void)unused;
+    message_t message = { .data = payload, .length = 1, .release = KeepPayload };
+    for (int i=0; i<StreamMessages; i++) {
+        consumer_producer_put_messages(&stream, &message, 1);
+    }
+    return NULL;
+}
+
+// Benchmark 2: Streaming, one producer and one consumer that takes batches (one op is a message)
+void benchStream (consumer_producer_mode_t mode, const char* modeName, int capacity) {
+    consumer_producer_init_mode(&stream, capacity, mode);
+
+    unsigned long syscalls = monitor_syscall_count();
+    uint64_t start = NowNs();
+    pthread_t thread;
+    pthread_create(&thread, NULL, streamProducer, NULL);
+
+    message_t messages[StreamBatch];
+    int received = 0;
+    while (received < StreamMessages) {
+        int count = consumer_producer_get_messages(&stream, messages, StreamBatch);
+        if (count <= 0) {
+            break;
+        }
+        received += count;
+    }
+    pthread_join(thread, NULL);
+    uint64_t elapsed = NowNs() - start;
+    syscalls = monitor_syscall_count() - syscalls;
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s stream, capacity %d", modeName, capacity);
+    PrintResult(name, (double)elapsed / StreamMessages, (double)syscalls / StreamMessages);
+    consumer_producer_destroy(&stream);
+}
+
+// Run all the benchmarks against one backend
+void runAllBenchmarks (consumer_producer_mode_t mode, const char* modeName) {
+    benchPingPong(mode, modeName);
+    benchStream(mode, modeName, 1);
+    benchStream(mode, modeName, 16);
+    benchStream(mode, modeName, 1024);
+}
+
+int main () {
+    printf("Consumer-Producer Microbenchmarks (%ld CPUs)\n\n", sysconf(_SC_NPROCESSORS_ONLN));
+
+    runAllBenchmarks(CONSUMER_PRODUCER_SPSC, "spsc");
+    runAllBenchmarks(CONSUMER_PRODUCER_LOCKED, "locked");
+    return 0;
+}
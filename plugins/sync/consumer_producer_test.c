@@ -13,6 +13,9 @@
 // Global queue
 consumer_producer_t* test_queue;
 
+// Backend the tests currently run against (every test runs once per backend)
+static consumer_producer_mode_t testMode = CONSUMER_PRODUCER_LOCKED;
+
 // Producer thread, should add items to the queue
 void* producer (void* arg) {
     int num = *(int*)arg;
@@ -25,6 +28,20 @@ void* producer (void* arg) {
     return NULL;
 }
 
+// Producer thread for the batch test, puts 10 items in one call
+void* batchProducer (void* unused) {
+    (void)unused;
+    char names[10][32];
+    const char* items[10];
+
+    for (int i=0; i<10; i++) {
+        snprintf(names[i], sizeof(names[i]), "batch-%d", i);
+        items[i] = names[i];
+    }
+    consumer_producer_put_batch(test_queue, items, 10);
+    return NULL;
+}
+
 // Consumer thread, should take items from the queue
 void* consumer (void* arg) {
     int num = *(int*)arg;
@@ -42,7 +59,7 @@ int testPutGet () {
     printf("Test 1: Put and get: ");
     
     consumer_producer_t queue;
-    if (consumer_producer_init(&queue, 3) != NULL) {
+    if (consumer_producer_init_mode(&queue, 3, testMode) != NULL) {
         printf("Failed to initialzie \n");
         return 0;
     }
@@ -75,7 +92,7 @@ int testFillQueue () {
     printf("Test 2: Full queue: ");
     
     consumer_producer_t queue;
-    if (consumer_producer_init(&queue, 2) != NULL) {
+    if (consumer_producer_init_mode(&queue, 2, testMode) != NULL) {
         printf("Failed to initialzie \n");
         return 0;
     }
@@ -100,6 +117,13 @@ int testFillQueue () {
     return toReturn;
 }
 
+// Release function of the bad batch in test 3, counts the messages it got back
+static int releasedCount = 0;
+static void CountRelease (void* data) {
+    (void)data;
+    releasedCount++;
+}
+
 // Test 3
 // Invalid parameters
 int testInvalidParams () {
@@ -108,12 +132,32 @@ int testInvalidParams () {
     consumer_producer_t queue;
     
     // This should fail
-    if (consumer_producer_init(NULL, 10) == NULL ||
-        consumer_producer_init(&queue, 0) == NULL ||
-        consumer_producer_init(&queue, -1) == NULL) {
+    if (consumer_producer_init_mode(NULL, 10, testMode) == NULL ||
+        consumer_producer_init_mode(&queue, 0, testMode) == NULL ||
+        consumer_producer_init_mode(&queue, -1, testMode) == NULL ||
+        consumer_producer_init_mode(&queue, 10, (consumer_producer_mode_t)42) == NULL) {
         printf("Fail: should reject non valid paramaters\n");
         return 0;
     }
+
+    // A batch with a bad message in the middle is rejected, the good ones on both sides are given back
+    if (consumer_producer_init_mode(&queue, 10, testMode) != NULL) {
+        printf("Failed to initialzie \n");
+        return 0;
+    }
+    char payload[] = "x";
+    message_t batch[4];
+    for (int i=0; i<4; i++) {
+        batch[i] = (message_t){ .data = payload, .length = 1, .release = CountRelease };
+    }
+    batch[1].data = NULL;
+    releasedCount = 0;
+    const char* error = consumer_producer_put_messages(&queue, batch, 4);
+    consumer_producer_destroy(&queue);
+    if (error == NULL || releasedCount != 3) {
+        printf("Fail: a bad batch should be given back\n");
+        return 0;
+    }
     
     printf("Pass\n");
     return 1;
@@ -125,7 +169,7 @@ int tstMuiltiThreads () {
     printf("Test 4: Multiple threads: ");
     
     consumer_producer_t queue;
-    if (consumer_producer_init(&queue, QueueSize) != NULL) {
+    if (consumer_producer_init_mode(&queue, QueueSize, testMode) != NULL) {
         printf("Failed to initialzie \n");
         return 0;
     }
@@ -134,8 +178,10 @@ int tstMuiltiThreads () {
     pthread_t threads[NumThreads];
     
     // Make sure total items produced is the same as total items consumed
-    int producers = NumThreads / 2;
-    int consumers = NumThreads - producers;
+    // The lock-free backend only allows one producer and one consumer
+    int producers = (testMode == CONSUMER_PRODUCER_SPSC) ? 1 : NumThreads / 2;
+    int consumers = (testMode == CONSUMER_PRODUCER_SPSC) ? 1 : NumThreads - producers;
+    int numThreads = producers + consumers;
     int itemsPerProducer = ItemCount / producers;
     int itemsPerConsumer = ItemCount / consumers;
     
@@ -145,12 +191,12 @@ int tstMuiltiThreads () {
     }
     
     // Then start the consumers
-    for (int i = producers; i < NumThreads; i++) {
+    for (int i = producers; i < numThreads; i++) {
         pthread_create(&threads[i], NULL, consumer, &itemsPerConsumer);
     }
     
     // Wait for all the threads
-    for (int i=0; i<NumThreads; i++) {
+    for (int i=0; i<numThreads; i++) {
         pthread_join(threads[i], NULL);
     }
     
@@ -165,7 +211,7 @@ int testFinishSignal () {
     printf("Test 5: Finish signal: ");
     
     consumer_producer_t queue;
-    if (consumer_producer_init(&queue, 3) != NULL) {
+    if (consumer_producer_init_mode(&queue, 3, testMode) != NULL) {
         printf("Failed to initialzie \n");
         return 0;
     }
@@ -184,18 +230,314 @@ int testFinishSignal () {
     return 1;
 }
 
-int main () {
-    printf("Consumer-Producer Unit Test \n");
-    printf("Configuration: queue=%d, threads=%d, items=%d\n\n", 
-           QueueSize, NumThreads, ItemCount);
-    
+// Test 6
+// Batches bigger than the queue go through in order
+int testBatch () {
+    printf("Test 6: Batch put and get: ");
+
+    consumer_producer_t queue;
+    if (consumer_producer_init_mode(&queue, 4, testMode) != NULL) {
+        printf("Failed to initialzie \n");
+        return 0;
+    }
+    test_queue = &queue;
+
+    // 10 items into a queue of 4, so the producer has to block in between
+    int itemsToGet = 10;
+    pthread_t thread;
+    pthread_create(&thread, NULL, batchProducer, NULL);
+
+    int toReturn = 1;
+    int received = 0;
+    char* items[3];
+    while (received < itemsToGet) {
+        int taken = consumer_producer_get_batch(&queue, items, 3);
+        if (taken <= 0 || taken > 3) {
+            toReturn = 0;
+            break;
+        }
+
+        // Check the order of the items
+        for (int i=0; i<taken; i++) {
+            char expected[32];
+            snprintf(expected, sizeof(expected), "batch-%d", received + i);
+            if (strcmp(items[i], expected) != 0) {
+                toReturn = 0;
+            }
+            free(items[i]);
+        }
+        received += taken;
+    }
+
+    pthread_join(thread, NULL);
+    consumer_producer_destroy(&queue);
+
+    printf(toReturn ? "Pass\n" : "Fail\n");
+    return toReturn;
+}
+
+// Test 7
+// Every message gets the next sequence number when it is put
+int testSequence () {
+    printf("Test 7: Sequence numbers: ");
+
+    consumer_producer_t queue;
+    if (consumer_producer_init_mode(&queue, 4, testMode) != NULL) {
+        printf("Failed to initialzie \n");
+        return 0;
+    }
+
+    // Three rounds, so the ring wraps around in between
+    int toReturn = 1;
+    size_t expected = 0;
+    for (int round=0; round<3; round++) {
+        message_t messages[3];
+        for (int i=0; i<3; i++) {
+            messages[i].data = strdup("seq");
+            messages[i].length = 3;
+            messages[i].release = free;
+            messages[i].sequence = 1000;
+        }
+        if (consumer_producer_put_messages(&queue, messages, 3) != NULL) {
+            toReturn = 0;
+            break;
+        }
+
+        message_t taken[3];
+        int count = consumer_producer_get_messages(&queue, taken, 3);
+        for (int i=0; i<count; i++) {
+            if (taken[i].sequence != expected++) {
+                toReturn = 0;
+            }
+            taken[i].release(taken[i].data);
+        }
+        if (count != 3) {
+            toReturn = 0;
+        }
+    }
+
+    consumer_producer_destroy(&queue);
+
+    printf(toReturn ? "Pass\n" : "Fail\n");
+    return toReturn;
+}
+
+// Test 8
+// The depth follows puts and gets, the high water mark stays at the most
+int testDepth () {
+    printf("Test 8: Depth and high water mark: ");
+
+    consumer_producer_t queue;
+    if (consumer_producer_init_mode(&queue, 4, testMode) != NULL) {
+        printf("Failed to initialzie \n");
+        return 0;
+    }
+
+    int toReturn = 1;
+    const char* items[3] = { "a", "b", "c" };
+    size_t current = 99;
+    size_t highWater = 99;
+
+    consumer_producer_get_depth(&queue, &current, &highWater);
+    if (current != 0 || highWater != 0) {
+        toReturn = 0;
+    }
+
+    consumer_producer_put_batch(&queue, items, 3);
+    consumer_producer_get_depth(&queue, &current, &highWater);
+    if (current != 3 || highWater != 3) {
+        toReturn = 0;
+    }
+
+    char* taken[2];
+    int count = consumer_producer_get_batch(&queue, taken, 2);
+    for (int i=0; i<count; i++) {
+        free(taken[i]);
+    }
+    consumer_producer_put(&queue, "d");
+    consumer_producer_get_depth(&queue, &current, &highWater);
+    if (count != 2 || current != 2 || highWater != 3) {
+        toReturn = 0;
+    }
+
+    consumer_producer_destroy(&queue);
+
+    printf(toReturn ? "Pass\n" : "Fail\n");
+    return toReturn;
+}
+
+// Producer thread for the adaptive test, puts the numbers 0..count-1 one by one
+static consumer_producer_t* adaptiveQueue;
+void* numberProducer (void* arg) {
+    int count = *(int*)arg;
+    char item[32];
+    for (int i=0; i<count; i++) {
+        snprintf(item, sizeof(item), "%d", i);
+        consumer_producer_put(adaptiveQueue, item);
+    }
+    return NULL;
+}
+
+// Test 9
+// An adaptive queue grows while the consumer is slow (within the budget),
+// keeps the order, and shrinks back once it stays empty
+int testAdaptive () {
+    printf("Test 9: Adaptive capacity: ");
+
+    consumer_producer_t queue;
+    if (consumer_producer_init_mode(&queue, 2, testMode) != NULL) {
+        printf("Failed to initialzie \n");
+        return 0;
+    }
+    consumer_producer_budget_t budget = { 100, 0 };
+    consumer_producer_set_adaptive(&queue, &budget);
+    adaptiveQueue = &queue;
+
+    // A slow consumer, so the producer keeps finding the queue full
+    int toReturn = 1;
+    int count = 300;
+    pthread_t thread;
+    pthread_create(&thread, NULL, numberProducer, &count);
+    for (int i=0; i<count; i++) {
+        char* item = consumer_producer_get(&queue);
+        if (item == NULL || atoi(item) != i) {
+            toReturn = 0;
+        }
+        free(item);
+        usleep(100);
+    }
+    pthread_join(thread, NULL);
+
+    // Old rings count until the consumer freed them, so 64 is the most that fits in 100
+    int grownCapacity = consumer_producer_get_capacity(&queue);
+    if (grownCapacity <= 2 || grownCapacity > 64 || budget.used > budget.limit) {
+        toReturn = 0;
+    }
+
+    // Now it never holds more than one item, so it shrinks back to where it started
+    for (int i=0; i<10000; i++) {
+        consumer_producer_put(&queue, "x");
+        free(consumer_producer_get(&queue));
+    }
+    if (consumer_producer_get_capacity(&queue) != 2) {
+        toReturn = 0;
+    }
+
+    consumer_producer_destroy(&queue);
+    if (budget.used != 0) {
+        toReturn = 0;
+    }
+
+    printf(toReturn ? "Pass\n" : "Fail\n");
+    return toReturn;
+}
+
+// Producer thread for the resize test, puts the numbers 0..count-1, every
+// other 2048 of them slowly (so the queue stays almost empty and shrinks)
+void* burstProducer (void* arg) {
+    int count = *(int*)arg;
+    char item[32];
+    for (int i=0; i<count; i++) {
+        snprintf(item, sizeof(item), "%d", i);
+        consumer_producer_put(adaptiveQueue, item);
+        if ((i / 2048) % 2 == 1) {
+            usleep(20);
+        }
+    }
+    return NULL;
+}
+
+// Test 10
+// The queue grows and shrinks while both sides keep going (the consumer
+// pauses now and then, so the producer finds it full, and the producer slows
+// down now and then, so it stays empty), nothing is lost or reordered
+int testResizeUnderLoad () {
+    printf("Test 10: Resize under load: ");
+
+    consumer_producer_t queue;
+    if (consumer_producer_init_mode(&queue, 2, testMode) != NULL) {
+        printf("Failed to initialzie \n");
+        return 0;
+    }
+    consumer_producer_budget_t budget = { 1024, 0 };
+    consumer_producer_set_adaptive(&queue, &budget);
+    adaptiveQueue = &queue;
+
+    int toReturn = 1;
+    int count = 16384;
+    int next = 0;
+    int largest = 2;
+    int shrank = 0;
+    pthread_t thread;
+    pthread_create(&thread, NULL, burstProducer, &count);
+    while (next < count) {
+        char* items[16];
+        int taken = consumer_producer_get_batch(&queue, items, 16);
+        for (int i=0; i<taken; i++) {
+            if (atoi(items[i]) != next) {
+                toReturn = 0;
+            }
+            free(items[i]);
+            next++;
+            if (next % 1024 == 0) {
+                usleep(2000);
+            }
+        }
+        if (taken <= 0) {
+            toReturn = 0;
+            break;
+        }
+
+        int capacity = consumer_producer_get_capacity(&queue);
+        if (capacity > largest) {
+            largest = capacity;
+        }
+        else if (capacity < largest) {
+            shrank = 1;
+        }
+    }
+    pthread_join(thread, NULL);
+    if (largest <= 2 || !shrank) {
+        toReturn = 0;
+    }
+
+    consumer_producer_destroy(&queue);
+    if (budget.used != 0) {
+        toReturn = 0;
+    }
+
+    printf(toReturn ? "Pass\n" : "Fail\n");
+    return toReturn;
+}
+
+// Run all the tests against one backend, returns how many passed
+int runAllTests (consumer_producer_mode_t mode, const char* modeName) {
+    printf("\nBackend: %s\n", modeName);
+    testMode = mode;
+
     int passed = 0;
     passed += testPutGet();
     passed += testFillQueue();
     passed += testInvalidParams();
     passed += tstMuiltiThreads();
     passed += testFinishSignal();
+    passed += testBatch();
+    passed += testSequence();
+    passed += testDepth();
+    passed += testAdaptive();
+    passed += testResizeUnderLoad();
+    return passed;
+}
+
+int main () {
+    printf("Consumer-Producer Unit Test \n");
+    printf("Configuration: queue=%d, threads=%d, items=%d\n", 
+           QueueSize, NumThreads, ItemCount);
+    
+    int passed = 0;
+    passed += runAllTests(CONSUMER_PRODUCER_LOCKED, "locked");
+    passed += runAllTests(CONSUMER_PRODUCER_SPSC, "lock-free spsc");
     
-    printf("\n%d/5 tests passed\n", passed);
-    return (passed == 5) ? 0 : 1;
+    printf("\n%d/20 tests passed\n", passed);
+    return (passed == 20) ? 0 : 1;
 }
\ No newline at end of file
@@ -1,26 +1,71 @@
 #include "monitor.h"
+#include <errno.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
 
 // All functions functionalities are described in detail 
 // in the header file
 
+// The first version used a mutex and a condition variable, which meant
+// every signal paid for a lock and a pthread_cond_signal even when nobody
+// was waiting. Now the signaled flag itself is a futex word:
+// - signal sets the flag and only calls the kernel if someone is parked
+// - wait spins for a little while first (a stage that is about to get work
+//   usually gets it within a few microseconds) and only then parks
+// The flag still stays set until reset, so the "remember the signal" behavior is the same
+
+// Spinning is bounded by this many checks of the flag
+#define MaxSpinCount 2000
+
+// Number of CPUs, spinning on a single CPU only delays the thread we wait for
+static int g_numCpus = 0;
+
+// Futex calls made by all the monitors of this module, for the benchmarks.
+// A relaxed add next to a syscall costs nothing we could measure
+static unsigned long g_syscalls = 0;
+
+// Pause between checks, lets the other hyperthread run and saves power
+static inline void CpuRelax (void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static long FutexWait (int* address, int expected) {
+    __atomic_add_fetch(&g_syscalls, 1, __ATOMIC_RELAXED);
+    return syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+// The timeout is relative (FUTEX_WAIT measures it on CLOCK_MONOTONIC)
+static long FutexWaitTimeout (int* address, int expected, const struct timespec* timeout) {
+    __atomic_add_fetch(&g_syscalls, 1, __ATOMIC_RELAXED);
+    return syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+}
+
+static long FutexWake (int* address, int count) {
+    __atomic_add_fetch(&g_syscalls, 1, __ATOMIC_RELAXED);
+    return syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
 int monitor_init (monitor_t* monitor) {
     
     // Avoid segmentation fault in case there is no monitor
     if (!monitor) { return -1; }
 
-    // Initialize the mutex lock
-    if (pthread_mutex_init(&monitor->mutex, NULL) != 0) {
-        return -1;
+    // Find out once how many CPUs we have (racing threads all write the same value)
+    if (__atomic_load_n(&g_numCpus, __ATOMIC_RELAXED) == 0) {
+        long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+        __atomic_store_n(&g_numCpus, numCpus > 0 ? (int)numCpus : 1, __ATOMIC_RELAXED);
     }
     
-    // Initialize the condition variable
-    if (pthread_cond_init(&monitor->condition, NULL) != 0) {
-        pthread_mutex_destroy(&monitor->mutex);
-        return -1;
-    }
-    
-    // Initialize the monitor's signaled state to be false
+    // Initialize the monitor's signaled state to be false, nobody waits yet
     monitor->signaled = 0;
+    monitor->waiters = 0;
+    monitor->spinEstimate = 0;
     
     // We reached here so nothing went wrong so we return 0
     return 0;
@@ -31,10 +76,9 @@ void monitor_destroy (monitor_t* monitor) {
     // Avoid segmentation fault in case there is no monitor
     if (!monitor) { return; }
     
-    // Free all the resources by destroing them using their own functions   
-    pthread_cond_destroy(&monitor->condition);
-    pthread_mutex_destroy(&monitor->mutex);
+    // There are no kernel resources to free, a futex only exists while someone waits on it
     monitor->signaled = 0;
+    monitor->waiters = 0;
 }
 
 void monitor_signal (monitor_t* monitor) {
@@ -44,12 +88,14 @@ void monitor_signal (monitor_t* monitor) {
         return;
     }
     
-    // Acquire the lock, Set the monitor signaled state to be 1 
-    // Wake up one blocked thread and then set the lock free
-    pthread_mutex_lock(&monitor->mutex);
-    monitor->signaled = 1;
-    pthread_cond_signal(&monitor->condition);
-    pthread_mutex_unlock(&monitor->mutex);
+    // Set the monitor signaled state to be 1 and wake up one parked thread.
+    // The waiter increments waiters before it looks at the flag and we set the
+    // flag before we look at waiters (both sequentially consistent), so either
+    // it sees the flag or we see it and wake it. No waiters, no syscall
+    __atomic_store_n(&monitor->signaled, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&monitor->waiters, __ATOMIC_SEQ_CST) > 0) {
+        FutexWake(&monitor->signaled, 1);
+    }
 }
 
 void monitor_reset (monitor_t* monitor) {
@@ -57,37 +103,107 @@ void monitor_reset (monitor_t* monitor) {
     // Avoid segmentation fault in case there is no monitor
     if (!monitor) { return; }
     
-    // Acquire the lock, set monitor signaled state to be 0 
-    // and release the lock.
-    pthread_mutex_lock(&monitor->mutex);
-    monitor->signaled = 0;
-    pthread_mutex_unlock(&monitor->mutex);
+    // Set monitor signaled state to be 0
+    __atomic_store_n(&monitor->signaled, 0, __ATOMIC_SEQ_CST);
 }
 
 int monitor_wait (monitor_t* monitor) {
 
     // Avoid segmentation fault in case there is no monitor
     if (!monitor) { return -1; }
-    
-    // Acqquire the lock
-    pthread_mutex_lock(&monitor->mutex);
-    
-    // Wait while not signaled (means that the condition hasnt been triggered yet)
-    // Loop is for spurious wake ups (cond_wait return wout a signal)
-    // or maybe if a different thread tries to consume the signal before
-    while (!monitor->signaled) {
-
-        // Release the lock and wait for the cond signal
-        // Lock is reacquired when cond_wait returns
-        if (pthread_cond_wait(&monitor->condition, &monitor->mutex) != 0) {
+
+    // Already signaled, nothing to wait for
+    if (__atomic_load_n(&monitor->signaled, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    // Spin for a while, adapting to how long it took the last times
+    // (same idea as glibc's adaptive mutex: aim for twice the usual time)
+    if (__atomic_load_n(&g_numCpus, __ATOMIC_RELAXED) > 1) {
+        int estimate = __atomic_load_n(&monitor->spinEstimate, __ATOMIC_RELAXED);
+        int spinLimit = estimate * 2 + 10;
+        if (spinLimit > MaxSpinCount) {
+            spinLimit = MaxSpinCount;
+        }
+
+        for (int spins = 0; spins < spinLimit; spins++) {
+            CpuRelax();
+            if (__atomic_load_n(&monitor->signaled, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&monitor->spinEstimate, estimate + (spins - estimate) / 8, __ATOMIC_RELAXED);
+                return 0;
+            }
+        }
+
+        // Spinning did not pay off this time, spin a bit less next time
+        __atomic_store_n(&monitor->spinEstimate, estimate - estimate / 8, __ATOMIC_RELAXED);
+    }
+
+    // Park. Wait while not signaled (means that the condition hasnt been triggered yet)
+    // Loop is for spurious wake ups, or maybe if a different thread reset the
+    // flag before we got to look at it
+    __atomic_add_fetch(&monitor->waiters, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&monitor->signaled, __ATOMIC_SEQ_CST)) {
+
+        // The kernel only puts us to sleep if the flag is still 0, so a
+        // signal between the check and the syscall is not lost
+        if (FutexWait(&monitor->signaled, 0) != 0 && errno != EAGAIN && errno != EINTR) {
             
-            // Upon fail, releas the lock and return -1
-            pthread_mutex_unlock(&monitor->mutex);
+            // Upon fail return -1
+            __atomic_sub_fetch(&monitor->waiters, 1, __ATOMIC_SEQ_CST);
             return -1;
         }
     }
+    __atomic_sub_fetch(&monitor->waiters, 1, __ATOMIC_SEQ_CST);
     
-    // Upon success, release the lock and return 0
-    pthread_mutex_unlock(&monitor->mutex);
+    // Upon success return 0
     return 0;
-}
\ No newline at end of file
+}
+
+int monitor_wait_timeout (monitor_t* monitor, long timeoutMs) {
+
+    // Avoid segmentation fault in case there is no monitor
+    if (!monitor) { return -1; }
+
+    // Already signaled, nothing to wait for
+    if (__atomic_load_n(&monitor->signaled, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    // No spinning here, whoever waits with a timeout expects to sleep.
+    // The deadline is fixed up front, so spurious wake ups dont extend the wait
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int result = 0;
+    __atomic_add_fetch(&monitor->waiters, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&monitor->signaled, __ATOMIC_SEQ_CST)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        struct timespec left = { deadline.tv_sec - now.tv_sec, deadline.tv_nsec - now.tv_nsec };
+        if (left.tv_nsec < 0) {
+            left.tv_sec--;
+            left.tv_nsec += 1000000000L;
+        }
+        if (left.tv_sec < 0) {
+            result = 1;
+            break;
+        }
+
+        if (FutexWaitTimeout(&monitor->signaled, 0, &left) != 0 && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+            result = -1;
+            break;
+        }
+    }
+    __atomic_sub_fetch(&monitor->waiters, 1, __ATOMIC_SEQ_CST);
+    return result;
+}
+
+unsigned long monitor_syscall_count (void) {
+    return __atomic_load_n(&g_syscalls, __ATOMIC_RELAXED);
+}
@@ -6,12 +6,16 @@
 /**
  * Monitor structure that can remember its state
  * This solves the race condition where signals sent before waiting are lost
+ *
+ * It used to be a mutex, a condition variable and a flag. Now the flag is
+ * a futex word: waiters spin on it for a short (adaptive) while and then
+ * park in the kernel, and signal only makes a syscall when someone is parked
  */
 typedef struct
 {
- pthread_mutex_t mutex; /* Mutex for thread safety */
- pthread_cond_t condition; /* Condition variable */
- int signaled; /* Flag to remember if monitor was signaled */
+ int signaled; /* Flag to remember if monitor was signaled (the futex word) */
+ int waiters; /* Number of threads parked (or about to park) on the flag */
+ int spinEstimate; /* How long spinning usually takes to see a signal */
 } monitor_t;
 /**
  * Initialize a monitor
@@ -27,6 +31,7 @@ int monitor_init(monitor_t* monitor);
 void monitor_destroy(monitor_t* monitor);
 /**
  * Signal a monitor (sets the monitor state)
+ * Wakes up one parked waiter, if there is one
  * @param monitor Pointer to monitor structure
  */
 void monitor_signal(monitor_t* monitor);
@@ -41,5 +46,18 @@ void monitor_reset(monitor_t* monitor);
  * @return 0 on success, -1 on error
  */
 int monitor_wait(monitor_t* monitor);
+/**
+ * Wait for a monitor to be signaled, but not longer than timeoutMs
+ * @param monitor Pointer to monitor structure
+ * @param timeoutMs How long to wait at most, in milliseconds
+ * @return 0 when signaled, 1 on timeout, -1 on error
+ */
+int monitor_wait_timeout(monitor_t* monitor, long timeoutMs);
+/**
+ * Number of futex syscalls all the monitors of this module made so far
+ * (signal, wait and wait_timeout), for measuring syscalls per operation
+ * @return The number of syscalls
+ */
+unsigned long monitor_syscall_count(void);
 
-#endif
\ No newline at end of file
+#endif
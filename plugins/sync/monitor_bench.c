@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include "monitor.h"
+
+// Microbenchmarks of monitor_t, the numbers any rewrite of the monitor is held against.
+// Every line is: benchmark, ns per operation, futex syscalls per operation
+
+// Configuration
+#define PingPongRounds 200000
+#define ParkRounds 200
+#define ParkDelayUs 2000
+#define SignalRounds 10000000
+
+static monitor_t ping;
+static monitor_t pong;
+static volatile uint64_t signalSentNs;
+
+static uint64_t NowNs (void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static void PrintResult (const char* name, double nsPerOp, double syscallsPerOp) {
+    printf("%-40s %12.1f ns/op %10.3f syscalls/op\n", name, nsPerOp, syscallsPerOp);
+}
+
+// The other side of the ping-pong: answer every ping with a pong
+void* ponger (void* unused) {
+    (void)unused;
+    for (int i=0; i<PingPongRounds; i++) {
+        monitor_wait(&ping);
+        monitor_reset(&ping);
+        monitor_signal(&pong);
+    }
+    return NULL;
+}
+
+// Benchmark 1: Ping-pong, a signal and a wait each way (one op is a round trip)
+void benchPingPong () {
+    monitor_init(&ping);
+    monitor_init(&pong);
+    pthread_t thread;
+    pthread_create(&thread, NULL, ponger, NULL);
+
+    unsigned long syscalls = monitor_syscall_count();
+    uint64_t start = NowNs();
+    for (int i=0; i<PingPongRounds; i++) {
+        monitor_signal(&ping);
+        monitor_wait(&pong);
+        monitor_reset(&pong);
+    }
+    uint64_t elapsed = NowNs() - start;
+    syscalls = monitor_syscall_count() - syscalls;
+    pthread_join(thread, NULL);
+
+    PrintResult("ping-pong round trip", (double)elapsed / PingPongRounds, (double)syscalls / PingPongRounds);
+    monitor_destroy(&ping);
+    monitor_destroy(&pong);
+}
+
+// Waits for every signal long after its spinning gave up, so it is always parked
+void* parkedWaiter (void* arg) {
+    uint64_t* latencies = arg;
+    for (int i=0; i<ParkRounds; i++) {
+        monitor_wait(&ping);
+        latencies[i] = NowNs() - signalSentNs;
+        monitor_reset(&ping);
+        monitor_signal(&pong);
+    }
+    return NULL;
+}
+
+static int CompareLatency (const void* a, const void* b) {
+    uint64_t first = *(const uint64_t*)a;
+    uint64_t second = *(const uint64_t*)b;
+    return first < second ? -1 : first > second;
+}
+
+// Benchmark 2: Wake-up latency, from monitor_signal to the parked waiter running again
+void benchWakeUp () {
+    monitor_init(&ping);
+    monitor_init(&pong);
+    uint64_t* latencies = calloc(ParkRounds, sizeof(uint64_t));
+    if (latencies == NULL) {
+        return;
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, parkedWaiter, latencies);
+
+    unsigned long syscalls = monitor_syscall_count();
+    for (int i=0; i<ParkRounds; i++) {
+        usleep(ParkDelayUs);
+        signalSentNs = NowNs();
+        monitor_signal(&ping);
+        monitor_wait(&pong);
+        monitor_reset(&pong);
+    }
+    syscalls = monitor_syscall_count() - syscalls;
+    pthread_join(thread, NULL);
+
+    // Our own waits for the pong are mostly spinning, but count them in anyway
+    uint64_t total = 0;
+    for (int i=0; i<ParkRounds; i++) {
+        total += latencies[i];
+    }
+    qsort(latencies, ParkRounds, sizeof(uint64_t), CompareLatency);
+    PrintResult("wake-up after park (mean)", (double)total / ParkRounds, (double)syscalls / ParkRounds);
+    PrintResult("wake-up after park (p50)", (double)latencies[ParkRounds / 2], (double)syscalls / ParkRounds);
+    PrintResult("wake-up after park (p99)", (double)latencies[ParkRounds * 99 / 100], (double)syscalls / ParkRounds);
+
+    free(latencies);
+    monitor_destroy(&ping);
+    monitor_destroy(&pong);
+}
+
+// Benchmark 3: Signal with nobody waiting, which should never enter the kernel
+void benchIdleSignal () {
+    monitor_init(&ping);
+
+    unsigned long syscalls = monitor_syscall_count();
+    uint64_t start = NowNs();
+    for (int i=0; i<SignalRounds; i++) {
+        monitor_signal(&ping);
+    }
+    uint64_t elapsed = NowNs() - start;
+    syscalls = monitor_syscall_count() - syscalls;
+
+    PrintResult("signal, nobody waiting", (double)elapsed / SignalRounds, (double)syscalls / SignalRounds);
+    monitor_destroy(&ping);
+}
+
+int main () {
+    printf("Monitor Microbenchmarks (%ld CPUs)\n\n", sysconf(_SC_NPROCESSORS_ONLN));
+
+    benchPingPong();
+    benchWakeUp();
+    benchIdleSignal();
+    return 0;
+}
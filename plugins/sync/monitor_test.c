@@ -206,6 +206,35 @@ void testTwoInit () {
     printf("pass\n");
 }
 
+// Test 7: Wait with a timeout
+// Times out when nobody signals, returns right away when signaled before,
+// and wakes up on a signal that comes before the timeout
+void testWaitTimeout () {
+    printf("Test 7: Wait with timeout: ");
+
+    monitor_t monitor;
+    assert(monitor_init(&monitor) == 0);
+    testMonitor = &monitor;
+
+    // Nobody signals
+    assert(monitor_wait_timeout(&monitor, 20) == 1);
+
+    // Signaled before
+    monitor_signal(&monitor);
+    assert(monitor_wait_timeout(&monitor, 20) == 0);
+
+    // Signaled after 50ms, well within the 5 seconds
+    monitor_reset(&monitor);
+    int delay = 50;
+    pthread_t thread;
+    pthread_create(&thread, NULL, signaler_thread, &delay);
+    assert(monitor_wait_timeout(&monitor, 5000) == 0);
+    pthread_join(thread, NULL);
+
+    monitor_destroy(&monitor);
+    printf("pass\n");
+}
+
 int main () {
     printf("Monitor Unit Test\n\n");
     
@@ -215,6 +244,7 @@ int main () {
     testMultiWaiters();
     testNullPtr();
     testTwoInit();
+    testWaitTimeout();
     
     printf("\nAll the tests passed\n");
     return 0;
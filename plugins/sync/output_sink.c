@@ -0,0 +1,416 @@
+#include "output_sink.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// All functions functionalities are described in detail
+// in the header file
+
+// Records are copied into chunks of this size (a bigger record gets a chunk of its own)
+// On a pipe they are PIPE_BUF instead
+#define SinkChunkSize (64 * 1024)
+
+// Written chunks kept for reuse, the rest go back to malloc
+#define SinkMaxFreeChunks 16
+
+// Whoever adds records waits while more than this waits for the writer
+// (or twice max_bytes, if that is more)
+#define SinkMaxWaitingBytes (16 * SinkChunkSize)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+typedef struct OutputSinkChunk {
+    struct OutputSinkChunk* next; // Next chunk in the ready or the free list
+    size_t used; // Bytes of records in data
+    size_t capacity; // Size of data
+    char data[]; // The records
+} OutputSinkChunk;
+
+// A chunk with room for at least size bytes, a reused one if possible
+// Called with the lock held
+static OutputSinkChunk* GetChunk (output_sink_t* sink, size_t size) {
+    if (size <= sink->chunkSize && sink->freeChunks != NULL) {
+        OutputSinkChunk* chunk = sink->freeChunks;
+        sink->freeChunks = chunk->next;
+        sink->freeCount--;
+        chunk->next = NULL;
+        chunk->used = 0;
+        return chunk;
+    }
+
+    size_t capacity = size > sink->chunkSize ? size : sink->chunkSize;
+    OutputSinkChunk* chunk = malloc(sizeof(OutputSinkChunk) + capacity);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->used = 0;
+    chunk->capacity = capacity;
+    return chunk;
+}
+
+// Done with a chunk: keep it for the next records, or free it
+// Called with the lock held
+static void PutChunk (output_sink_t* sink, OutputSinkChunk* chunk) {
+    if (chunk->capacity == sink->chunkSize && sink->freeCount < SinkMaxFreeChunks) {
+        chunk->next = sink->freeChunks;
+        sink->freeChunks = chunk;
+        sink->freeCount++;
+        return;
+    }
+    free(chunk);
+}
+
+// Move the current chunk to the end of the ready list (if it has anything)
+// Called with the lock held
+static void CloseCurrentChunk (output_sink_t* sink) {
+    OutputSinkChunk* chunk = sink->current;
+    if (chunk == NULL || chunk->used == 0) {
+        return;
+    }
+    sink->current = NULL;
+    if (sink->readyTail != NULL) {
+        sink->readyTail->next = chunk;
+    }
+    else {
+        sink->readyHead = chunk;
+    }
+    sink->readyTail = chunk;
+}
+
+// Milliseconds since a point in time (CLOCK_MONOTONIC)
+static long MillisecondsSince (const struct timespec* then) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) * 1000L + (now.tv_nsec - then->tv_nsec) / 1000000L;
+}
+
+// Write all the parts, writev can take only part of them (a pipe that is
+// almost full), then it goes on from there. The parts are changed meanwhile
+// Returns 0, or the errno of the failed write
+static int WriteParts (int fd, struct iovec* parts, int count) {
+    struct iovec* remaining = parts;
+    while (count > 0) {
+        ssize_t bytesWritten = writev(fd, remaining, count);
+        if (bytesWritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        while (count > 0 && (size_t)bytesWritten >= remaining->iov_len) {
+            bytesWritten -= remaining->iov_len;
+            remaining++;
+            count--;
+        }
+        if (count > 0) {
+            remaining->iov_base = (char*)remaining->iov_base + bytesWritten;
+            remaining->iov_len -= bytesWritten;
+        }
+    }
+    return 0;
+}
+
+// Write a list of chunks, as few writev calls as possible (or one per chunk
+// if every write has to be atomic)
+// Returns 0, or the errno of the failed write (the rest is dropped then)
+static int WriteChunks (int fd, OutputSinkChunk* chunks, int chunkPerWrite) {
+    struct iovec parts[IOV_MAX];
+    int maxParts = chunkPerWrite ? 1 : IOV_MAX;
+    OutputSinkChunk* next = chunks;
+
+    while (next != NULL) {
+        int count = 0;
+        for (; next != NULL && count < maxParts; next = next->next) {
+            parts[count].iov_base = next->data;
+            parts[count].iov_len = next->used;
+            count++;
+        }
+        int error = WriteParts(fd, parts, count);
+        if (error != 0) {
+            return error;
+        }
+    }
+    return 0;
+}
+
+static void* OutputSinkWriter (void* arg) {
+    output_sink_t* sink = (output_sink_t*)arg;
+
+    pthread_mutex_lock(&sink->lock);
+    while (1) {
+
+        // The oldest waiting record waited long enough
+        if (!sink->writeNow && sink->waitingLines > 0 && sink->policy.max_delay_ms > 0 &&
+                MillisecondsSince(&sink->oldestWaiting) >= sink->policy.max_delay_ms) {
+            sink->writeNow = 1;
+        }
+
+        if (sink->writeNow || sink->stopping) {
+            CloseCurrentChunk(sink);
+            OutputSinkChunk* chunks = sink->readyHead;
+            sink->readyHead = NULL;
+            sink->readyTail = NULL;
+            sink->waitingBytes = 0;
+            sink->waitingLines = 0;
+            sink->writeNow = 0;
+
+            if (chunks != NULL) {
+
+                // Write without the lock, so records can be added meanwhile
+                // (after an error the output is only dropped)
+                int error = sink->error;
+                pthread_mutex_unlock(&sink->lock);
+                if (error == 0) {
+                    error = WriteChunks(sink->fd, chunks, sink->chunkPerWrite);
+                }
+                pthread_mutex_lock(&sink->lock);
+
+                if (sink->error == 0) {
+                    sink->error = error;
+                }
+                while (chunks != NULL) {
+                    OutputSinkChunk* next = chunks->next;
+                    sink->writtenBytes += chunks->used;
+                    PutChunk(sink, chunks);
+                    chunks = next;
+                }
+                monitor_signal(&sink->written);
+                continue;
+            }
+            if (sink->stopping) {
+                break;
+            }
+            continue;
+        }
+
+        // Nothing to do yet. Wait until something is added, or until the
+        // oldest waiting record is due. Reset before unlocking, so a signal
+        // after it is not lost
+        long timeoutMs = -1;
+        if (sink->waitingLines > 0 && sink->policy.max_delay_ms > 0) {
+            timeoutMs = sink->policy.max_delay_ms - MillisecondsSince(&sink->oldestWaiting);
+            if (timeoutMs < 1) {
+                timeoutMs = 1;
+            }
+        }
+        monitor_reset(&sink->wakeWriter);
+        pthread_mutex_unlock(&sink->lock);
+        if (timeoutMs < 0) {
+            monitor_wait(&sink->wakeWriter);
+        }
+        else {
+            monitor_wait_timeout(&sink->wakeWriter, timeoutMs);
+        }
+        pthread_mutex_lock(&sink->lock);
+    }
+    pthread_mutex_unlock(&sink->lock);
+
+    return NULL;
+}
+
+const char* output_sink_init (output_sink_t* sink, int fd, const output_sink_policy_t* policy) {
+
+    // Safety check
+    if (sink == NULL || fd < 0) {
+        return "Error, invalid output sink arguments";
+    }
+
+    memset(sink, 0, sizeof(output_sink_t));
+    sink->fd = fd;
+
+    // A regular file takes a whole writev at once, anything else (a pipe,
+    // a terminal) only guarantees it for up to PIPE_BUF bytes
+    struct stat fdStat;
+    if (fstat(fd, &fdStat) == 0 && S_ISREG(fdStat.st_mode)) {
+        sink->chunkSize = SinkChunkSize;
+    }
+    else {
+        sink->chunkSize = PIPE_BUF;
+        sink->chunkPerWrite = 1;
+    }
+    if (policy != NULL) {
+        sink->policy = *policy;
+    }
+    else {
+        sink->policy.max_bytes = OUTPUT_SINK_DEFAULT_BYTES;
+        sink->policy.max_lines = OUTPUT_SINK_DEFAULT_LINES;
+        sink->policy.max_delay_ms = OUTPUT_SINK_DEFAULT_DELAY_MS;
+    }
+
+    if (pthread_mutex_init(&sink->lock, NULL) != 0) {
+        return "Error, failed to initialize the output sink lock";
+    }
+    monitor_init(&sink->wakeWriter);
+    monitor_init(&sink->written);
+
+    if (pthread_create(&sink->writer, NULL, OutputSinkWriter, sink) != 0) {
+        monitor_destroy(&sink->wakeWriter);
+        monitor_destroy(&sink->written);
+        pthread_mutex_destroy(&sink->lock);
+        return "Error, failed to create the output writer thread";
+    }
+    return NULL;
+}
+
+const char* output_sink_write (output_sink_t* sink, const struct iovec* parts, int count) {
+
+    // Safety check
+    if (sink == NULL || (parts == NULL && count > 0)) {
+        return "Error, invalid output sink arguments";
+    }
+
+    size_t size = 0;
+    for (int i=0; i<count; i++) {
+        size += parts[i].iov_len;
+    }
+
+    size_t maxWaiting = SinkMaxWaitingBytes;
+    if (maxWaiting < 2 * sink->policy.max_bytes) {
+        maxWaiting = 2 * sink->policy.max_bytes;
+    }
+
+    pthread_mutex_lock(&sink->lock);
+
+    // Too much waits already, have it written and wait for that
+    // (reset before unlocking, so the signal of that write is not lost)
+    while (sink->addedBytes - sink->writtenBytes > maxWaiting) {
+        sink->writeNow = 1;
+        monitor_reset(&sink->written);
+        pthread_mutex_unlock(&sink->lock);
+        monitor_signal(&sink->wakeWriter);
+        monitor_wait(&sink->written);
+        pthread_mutex_lock(&sink->lock);
+    }
+
+    // A record goes into one chunk as a whole
+    if (sink->current == NULL || sink->current->capacity - sink->current->used < size) {
+        CloseCurrentChunk(sink);
+        sink->current = GetChunk(sink, size);
+        if (sink->current == NULL) {
+            pthread_mutex_unlock(&sink->lock);
+            return "Error, failed to allocate output buffer";
+        }
+    }
+    char* destination = sink->current->data + sink->current->used;
+    for (int i=0; i<count; i++) {
+        memcpy(destination, parts[i].iov_base, parts[i].iov_len);
+        destination += parts[i].iov_len;
+    }
+    sink->current->used += size;
+    sink->addedBytes += size;
+
+    // The first waiting record starts the clock, so the writer has to know about it
+    int wake = 0;
+    if (sink->waitingLines == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &sink->oldestWaiting);
+        wake = sink->policy.max_delay_ms > 0;
+    }
+    sink->waitingBytes += size;
+    sink->waitingLines++;
+
+    if ((sink->policy.max_bytes > 0 && sink->waitingBytes >= sink->policy.max_bytes) ||
+            (sink->policy.max_lines > 0 && sink->waitingLines >= sink->policy.max_lines)) {
+        sink->writeNow = 1;
+        wake = 1;
+    }
+    pthread_mutex_unlock(&sink->lock);
+
+    if (wake) {
+        monitor_signal(&sink->wakeWriter);
+    }
+    return NULL;
+}
+
+const char* output_sink_flush (output_sink_t* sink) {
+
+    // Safety check
+    if (sink == NULL) {
+        return "Error, invalid output sink arguments";
+    }
+
+    pthread_mutex_lock(&sink->lock);
+    size_t target = sink->addedBytes;
+    while (sink->writtenBytes < target) {
+        sink->writeNow = 1;
+        monitor_reset(&sink->written);
+        pthread_mutex_unlock(&sink->lock);
+        monitor_signal(&sink->wakeWriter);
+        monitor_wait(&sink->written);
+        pthread_mutex_lock(&sink->lock);
+    }
+    int error = sink->error;
+    pthread_mutex_unlock(&sink->lock);
+
+    return error != 0 ? "Error, failed to write the output" : NULL;
+}
+
+const char* output_sink_write_now (output_sink_t* sink, const struct iovec* parts, int count) {
+
+    // Safety check
+    if (sink == NULL || (parts == NULL && count > 0) || count > IOV_MAX) {
+        return "Error, invalid output sink arguments";
+    }
+
+    // What was added before goes out first (nothing to wait for when it all was written)
+    const char* error = output_sink_flush(sink);
+    if (error != NULL) {
+        return error;
+    }
+
+    // The writer has nothing left, so this thread writes the record itself
+    // (writev changes the parts it was given, so it gets a copy)
+    struct iovec remaining[IOV_MAX];
+    size_t size = 0;
+    for (int i=0; i<count; i++) {
+        remaining[i] = parts[i];
+        size += parts[i].iov_len;
+    }
+    int writeError = WriteParts(sink->fd, remaining, count);
+
+    pthread_mutex_lock(&sink->lock);
+    sink->addedBytes += size;
+    sink->writtenBytes += size;
+    if (sink->error == 0) {
+        sink->error = writeError;
+    }
+    pthread_mutex_unlock(&sink->lock);
+
+    return writeError != 0 ? "Error, failed to write the output" : NULL;
+}
+
+const char* output_sink_destroy (output_sink_t* sink) {
+
+    // Safety check
+    if (sink == NULL) {
+        return "Error, invalid output sink arguments";
+    }
+
+    const char* error = output_sink_flush(sink);
+
+    // The writer ends once it sees stopping with nothing left to write
+    pthread_mutex_lock(&sink->lock);
+    sink->stopping = 1;
+    pthread_mutex_unlock(&sink->lock);
+    monitor_signal(&sink->wakeWriter);
+    pthread_join(sink->writer, NULL);
+
+    free(sink->current);
+    while (sink->freeChunks != NULL) {
+        OutputSinkChunk* next = sink->freeChunks->next;
+        free(sink->freeChunks);
+        sink->freeChunks = next;
+    }
+    sink->current = NULL;
+    sink->freeCount = 0;
+
+    monitor_destroy(&sink->wakeWriter);
+    monitor_destroy(&sink->written);
+    pthread_mutex_destroy(&sink->lock);
+    return error;
+}
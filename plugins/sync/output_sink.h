@@ -0,0 +1,106 @@
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+#include "monitor.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/uio.h>
+
+/**
+ * Buffered output with its own writer thread
+ * Every record (one output line) is copied into big chunks, and the writer
+ * thread writes all the chunks that wait with one writev. A record is never
+ * split between two chunks, so a line always goes out in one write call.
+ * Several sinks (or other printers) can share a pipe: only writes of up to
+ * PIPE_BUF bytes are atomic there, so on a pipe the chunks are that size and
+ * each one is a write of its own, and lines of different writers never mix.
+ * The flush policy says when the waiting records are written, so the latency
+ * stays bounded while most writes still carry many lines.
+ * Records are written in the order they came in, byte for byte.
+ */
+
+// When the waiting output is written (0 turns that limit off)
+typedef struct
+{
+ size_t max_bytes; /* Write once this many bytes wait */
+ size_t max_lines; /* Write once this many records wait */
+ long max_delay_ms; /* Write at most this long after the oldest waiting record came in */
+} output_sink_policy_t;
+
+// The default policy: up to 64KB or 10ms, whatever comes first
+#define OUTPUT_SINK_DEFAULT_BYTES (64 * 1024)
+#define OUTPUT_SINK_DEFAULT_LINES 0
+#define OUTPUT_SINK_DEFAULT_DELAY_MS 10
+
+struct OutputSinkChunk;
+
+// Output sink structure
+typedef struct
+{
+ int fd; /* Where the output goes */
+ size_t chunkSize; /* Size of the chunks (PIPE_BUF on a pipe) */
+ int chunkPerWrite; /* Write every chunk on its own, so each write is atomic (on a pipe) */
+ output_sink_policy_t policy; /* When to write */
+ pthread_mutex_t lock; /* Protects everything below */
+ struct OutputSinkChunk* current; /* Chunk the next records are copied into */
+ struct OutputSinkChunk* readyHead; /* Full chunks waiting for the writer, oldest first */
+ struct OutputSinkChunk* readyTail; /* Newest full chunk */
+ struct OutputSinkChunk* freeChunks; /* Written chunks, kept for reuse */
+ int freeCount; /* Number of freeChunks */
+ size_t waitingBytes; /* Bytes added since the last write started */
+ size_t waitingLines; /* Records added since the last write started */
+ struct timespec oldestWaiting; /* When the first of them came in */
+ size_t addedBytes; /* All the bytes ever added */
+ size_t writtenBytes; /* All the bytes the writer is done with */
+ int writeNow; /* The policy (or a flush) says write what waits */
+ int stopping; /* Destroy was called, the writer ends after the last write */
+ int error; /* errno of the first failed write, 0 if none (the output after it is dropped) */
+ monitor_t wakeWriter; /* Signaled when the writer has something to do */
+ monitor_t written; /* Signaled after every write */
+ pthread_t writer; /* The writer thread */
+} output_sink_t;
+
+/**
+ * Initialize a sink and start its writer thread
+ * @param sink Sink to initialize
+ * @param fd File descriptor to write to (it is not closed by the sink)
+ * @param policy When to write, NULL for the default policy
+ * @return NULL on success, error message on failure
+ */
+const char* output_sink_init(output_sink_t* sink, int fd, const output_sink_policy_t* policy);
+/**
+ * Add one record, made of parts that are copied one after the other.
+ * Blocks while too much output waits for the writer.
+ * Only one thread at a time may add records or flush
+ * @param sink The sink
+ * @param parts The pieces of the record
+ * @param count Number of parts
+ * @return NULL on success, error message on failure
+ */
+const char* output_sink_write(output_sink_t* sink, const struct iovec* parts, int count);
+/**
+ * Write everything that was added so far, and wait until it was written
+ * @param sink The sink
+ * @return NULL on success, error message if any write failed so far
+ */
+const char* output_sink_flush(output_sink_t* sink);
+/**
+ * Write one record right away on the calling thread, after everything that
+ * was added before it. It is on the fd when this returns, without a handoff
+ * to the writer thread (for a record someone else waits for).
+ * Only one thread at a time may add records or flush
+ * @param sink The sink
+ * @param parts The pieces of the record
+ * @param count Number of parts (at most IOV_MAX)
+ * @return NULL on success, error message if this or an earlier write failed
+ */
+const char* output_sink_write_now(output_sink_t* sink, const struct iovec* parts, int count);
+/**
+ * Flush, stop the writer thread and free everything
+ * @param sink The sink
+ * @return NULL on success, error message if any write failed
+ */
+const char* output_sink_destroy(output_sink_t* sink);
+
+#endif
@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include "output_sink.h"
+
+// Configuration
+#define RecordCount 50000
+#define BigRecordSize (200 * 1024)
+
+// Everything that came out of the read end of a pipe
+typedef struct {
+    int fd;
+    char* data;
+    size_t length;
+    size_t capacity;
+} PipeReader;
+
+// Reads the pipe until it is closed
+void* readerThread (void* arg) {
+    PipeReader* reader = (PipeReader*)arg;
+    char buffer[4096];
+    ssize_t bytesRead;
+    while ((bytesRead = read(reader->fd, buffer, sizeof(buffer))) > 0) {
+        if (reader->length + bytesRead > reader->capacity) {
+            reader->capacity = (reader->length + bytesRead) * 2;
+            reader->data = realloc(reader->data, reader->capacity);
+            assert(reader->data != NULL);
+        }
+        memcpy(reader->data + reader->length, buffer, bytesRead);
+        reader->length += bytesRead;
+    }
+    return NULL;
+}
+
+// Takes one byte out of a pipe without blocking, -1 if there is none yet
+int readByteNow (int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    char byte;
+    ssize_t bytesRead = read(fd, &byte, 1);
+    fcntl(fd, F_SETFL, flags);
+    return bytesRead == 1 ? byte : -1;
+}
+
+// Writes RecordCount numbered lines (made of 3 parts each) through a sink with
+// the given policy, and checks the other end of the pipe got exactly them
+void checkAllWritten (const output_sink_policy_t* policy) {
+    int fds[2];
+    assert(pipe(fds) == 0);
+    PipeReader reader = { fds[0], NULL, 0, 0 };
+    pthread_t thread;
+    pthread_create(&thread, NULL, readerThread, &reader);
+
+    output_sink_t sink;
+    assert(output_sink_init(&sink, fds[1], policy) == NULL);
+
+    char* expected = malloc(RecordCount * 32);
+    size_t expectedLength = 0;
+    for (int i=0; i<RecordCount; i++) {
+        char number[16];
+        int numberLength = snprintf(number, sizeof(number), "%d", i);
+        struct iovec parts[3] = { { "[line] ", 7 }, { number, numberLength }, { "\n", 1 } };
+        assert(output_sink_write(&sink, parts, 3) == NULL);
+        expectedLength += sprintf(expected + expectedLength, "[line] %d\n", i);
+    }
+
+    assert(output_sink_destroy(&sink) == NULL);
+    close(fds[1]);
+    pthread_join(thread, NULL);
+    close(fds[0]);
+
+    assert(reader.length == expectedLength);
+    assert(memcmp(reader.data, expected, expectedLength) == 0);
+    free(reader.data);
+    free(expected);
+}
+
+// Test 1: Every policy writes all the records, in order and unchanged
+void testPolicies () {
+    printf("Test 1: All records written in order: ");
+    output_sink_policy_t policies[] = {
+        { OUTPUT_SINK_DEFAULT_BYTES, OUTPUT_SINK_DEFAULT_LINES, OUTPUT_SINK_DEFAULT_DELAY_MS },
+        { 0, 1, 0 }, // Every line right away
+        { 0, 100, 0 },
+        { 100, 0, 0 },
+        { 0, 0, 0 }, // Only when full or on flush
+        { 0, 0, 1 }
+    };
+    for (size_t i=0; i<sizeof(policies) / sizeof(policies[0]); i++) {
+        checkAllWritten(&policies[i]);
+    }
+    checkAllWritten(NULL);
+    printf("pass\n");
+}
+
+// Test 2: The time limit writes a lone record without a flush, and the line
+// limit writes as soon as there are enough
+void testLimits () {
+    printf("Test 2: Time and line limits: ");
+    int fds[2];
+    assert(pipe(fds) == 0);
+    struct iovec record = { "x\n", 2 };
+
+    // Time: 20ms, the record shows up without any flush
+    output_sink_policy_t timePolicy = { 0, 0, 20 };
+    output_sink_t sink;
+    assert(output_sink_init(&sink, fds[1], &timePolicy) == NULL);
+    assert(output_sink_write(&sink, &record, 1) == NULL);
+    int seen = -1;
+    for (int i=0; i<500 && seen < 0; i++) {
+        usleep(2000);
+        seen = readByteNow(fds[0]);
+    }
+    assert(seen == 'x');
+    assert(output_sink_destroy(&sink) == NULL);
+
+    // Lines: nothing before the third record, then all three
+    assert(readByteNow(fds[0]) == '\n');
+    output_sink_policy_t linePolicy = { 0, 3, 0 };
+    assert(output_sink_init(&sink, fds[1], &linePolicy) == NULL);
+    assert(output_sink_write(&sink, &record, 1) == NULL);
+    assert(output_sink_write(&sink, &record, 1) == NULL);
+    usleep(50000);
+    assert(readByteNow(fds[0]) == -1);
+    assert(output_sink_write(&sink, &record, 1) == NULL);
+    seen = -1;
+    for (int i=0; i<500 && seen < 0; i++) {
+        usleep(2000);
+        seen = readByteNow(fds[0]);
+    }
+    assert(seen == 'x');
+    assert(output_sink_destroy(&sink) == NULL);
+
+    close(fds[0]);
+    close(fds[1]);
+    printf("pass\n");
+}
+
+// Test 3: Records bigger than a chunk go out whole
+void testBigRecords () {
+    printf("Test 3: Big records: ");
+    int fds[2];
+    assert(pipe(fds) == 0);
+    PipeReader reader = { fds[0], NULL, 0, 0 };
+    pthread_t thread;
+    pthread_create(&thread, NULL, readerThread, &reader);
+
+    char* big = malloc(BigRecordSize);
+    for (size_t i=0; i<BigRecordSize; i++) {
+        big[i] = 'a' + i % 26;
+    }
+
+    output_sink_t sink;
+    assert(output_sink_init(&sink, fds[1], NULL) == NULL);
+    for (int i=0; i<5; i++) {
+        struct iovec parts[2] = { { "s", 1 }, { big, BigRecordSize } };
+        assert(output_sink_write(&sink, parts, 2) == NULL);
+    }
+    assert(output_sink_destroy(&sink) == NULL);
+    close(fds[1]);
+    pthread_join(thread, NULL);
+    close(fds[0]);
+
+    assert(reader.length == 5 * (BigRecordSize + 1));
+    for (int i=0; i<5; i++) {
+        assert(reader.data[i * (BigRecordSize + 1)] == 's');
+        assert(memcmp(reader.data + i * (BigRecordSize + 1) + 1, big, BigRecordSize) == 0);
+    }
+    free(reader.data);
+    free(big);
+    printf("pass\n");
+}
+
+// Test 4: A failed write is reported by flush, and NULL arguments are errors
+void testErrors () {
+    printf("Test 4: Errors: ");
+    int fds[2];
+    assert(pipe(fds) == 0);
+    close(fds[1]);
+
+    // fds[0] is a read end, writing to it fails
+    output_sink_t sink;
+    assert(output_sink_init(&sink, fds[0], NULL) == NULL);
+    struct iovec record = { "x\n", 2 };
+    assert(output_sink_write(&sink, &record, 1) == NULL);
+    assert(output_sink_flush(&sink) != NULL);
+    assert(output_sink_destroy(&sink) != NULL);
+    close(fds[0]);
+
+    assert(output_sink_init(NULL, 1, NULL) != NULL);
+    assert(output_sink_init(&sink, -1, NULL) != NULL);
+    assert(output_sink_write(NULL, &record, 1) != NULL);
+    printf("pass\n");
+}
+
+// Test 5: A record written now is on the fd when the call returns, after
+// the ones that were waiting
+void testWriteNow () {
+    printf("Test 5: Write now: ");
+    int fds[2];
+    assert(pipe(fds) == 0);
+
+    // Nothing would be written without a flush
+    output_sink_policy_t policy = { 0, 0, 0 };
+    output_sink_t sink;
+    assert(output_sink_init(&sink, fds[1], &policy) == NULL);
+    struct iovec first = { "a", 1 };
+    struct iovec second[2] = { { "b", 1 }, { "c", 1 } };
+    assert(output_sink_write(&sink, &first, 1) == NULL);
+    assert(readByteNow(fds[0]) == -1);
+    assert(output_sink_write_now(&sink, second, 2) == NULL);
+    assert(readByteNow(fds[0]) == 'a');
+    assert(readByteNow(fds[0]) == 'b');
+    assert(readByteNow(fds[0]) == 'c');
+    assert(readByteNow(fds[0]) == -1);
+    assert(output_sink_write_now(&sink, &first, 1) == NULL);
+    assert(readByteNow(fds[0]) == 'a');
+    assert(output_sink_destroy(&sink) == NULL);
+    close(fds[1]);
+
+    // A failed write is reported, here and by the flush after it
+    assert(output_sink_init(&sink, fds[0], NULL) == NULL);
+    assert(output_sink_write_now(&sink, &first, 1) != NULL);
+    assert(output_sink_flush(&sink) != NULL);
+    assert(output_sink_destroy(&sink) != NULL);
+    close(fds[0]);
+    assert(output_sink_write_now(NULL, &first, 1) != NULL);
+    printf("pass\n");
+}
+
+int main () {
+    printf("Output Sink Unit Test\n\n");
+
+    testPolicies();
+    testLimits();
+    testBigRecords();
+    testErrors();
+    testWriteNow();
+
+    printf("\nAll the tests passed\n");
+    return 0;
+}
@@ -0,0 +1,202 @@
+#include "pool.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Before the pool, every message was malloc'd by one thread and freed by
+// another (the next plugin), which is the worst case for malloc: the freed
+// memory goes back to an arena the freeing thread doesnt use.
+// Here the freed buffers go back to the pool they came from and are handed
+// out again to the next line of the same size class.
+
+// Size classes are powers of 2 from 32 bytes to 64KB (header included),
+// bigger buffers go straight to malloc
+#define PoolMinClassShift 5
+#define PoolNumClasses 12
+#define PoolLargeClass PoolNumClasses
+
+// Every slab is at least this big and is split into blocks of one class
+#define PoolSlabSize (64 * 1024)
+
+// A thread keeps at most this many bytes of free blocks per class (a few slabs),
+// the rest go back to the shared list
+#define PoolMaxCachedBytes (4 * PoolSlabSize)
+
+// Sits in front of every buffer, 16 bytes so the buffer stays 16 byte aligned
+typedef struct PoolHeader {
+    size_t sizeClass; // Index of the size class, or PoolLargeClass
+    struct PoolHeader* next; // Next free block (only used while the block is free)
+} PoolHeader;
+
+// Sits in front of every slab, so the slabs can be freed at the end
+typedef struct PoolSlab {
+    struct PoolSlab* next;
+    size_t unused; // Keeps the blocks after it 16 byte aligned
+} PoolSlab;
+
+// The pool itself, one per module
+static struct {
+    pthread_mutex_t slabLock; // Only taken when a new slab is needed
+    PoolSlab* slabs; // All the slabs, for pool_destroy
+    PoolHeader* returned[PoolNumClasses]; // Blocks freed by threads with a full (or no) cache
+    unsigned int generation; // Bumped by pool_destroy, so stale thread caches are dropped
+} g_pool = { PTHREAD_MUTEX_INITIALIZER, NULL, { NULL }, 1 };
+
+// Per thread cache of free blocks
+typedef struct {
+    unsigned int generation; // g_pool.generation this cache belongs to (0 = never used)
+    int allocates; // This thread allocates from the pool, so caching frees here pays off
+    PoolHeader* blocks[PoolNumClasses];
+    int counts[PoolNumClasses];
+} PoolThreadCache;
+
+static __thread PoolThreadCache t_cache;
+
+// Cache of the calling thread, emptied if the pool was destroyed since it was filled
+static PoolThreadCache* CurrentCache (void) {
+    unsigned int generation = __atomic_load_n(&g_pool.generation, __ATOMIC_RELAXED);
+    if (t_cache.generation != generation) {
+        for (int i=0; i<PoolNumClasses; i++) {
+            t_cache.blocks[i] = NULL;
+            t_cache.counts[i] = 0;
+        }
+        t_cache.allocates = 0;
+        t_cache.generation = generation;
+    }
+    return &t_cache;
+}
+
+// Smallest class that fits size bytes plus the header, -1 if it doesnt fit any
+static int ClassFor (size_t size) {
+    size_t needed = size + sizeof(PoolHeader);
+    for (int sizeClass = 0; sizeClass < PoolNumClasses; sizeClass++) {
+        if (needed <= ((size_t)1 << (sizeClass + PoolMinClassShift))) {
+            return sizeClass;
+        }
+    }
+    return -1;
+}
+
+// Push a free block to the shared list of its class (any thread, lock-free)
+// Only pushes race with each other, the list is emptied with one exchange,
+// so the usual ABA problem of lock-free stacks cant happen
+static void PushReturned (PoolHeader* block) {
+    PoolHeader** list = &g_pool.returned[block->sizeClass];
+    block->next = __atomic_load_n(list, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(list, &block->next, block, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        // block->next was updated with the current head, try again
+    }
+}
+
+// Fill the thread cache for a class with a new slab
+static int RefillFromSlab (PoolThreadCache* cache, int sizeClass) {
+    size_t blockSize = (size_t)1 << (sizeClass + PoolMinClassShift);
+    size_t slabSize = sizeof(PoolSlab) + (blockSize > PoolSlabSize ? blockSize : PoolSlabSize);
+
+    PoolSlab* slab = malloc(slabSize);
+    if (slab == NULL) {
+        return -1;
+    }
+
+    // Remember the slab so pool_destroy can free it
+    pthread_mutex_lock(&g_pool.slabLock);
+    slab->next = g_pool.slabs;
+    g_pool.slabs = slab;
+    pthread_mutex_unlock(&g_pool.slabLock);
+
+    // Split it into blocks
+    char* position = (char*)(slab + 1);
+    char* end = (char*)slab + slabSize;
+    while (position + blockSize <= end) {
+        PoolHeader* block = (PoolHeader*)position;
+        block->sizeClass = (size_t)sizeClass;
+        block->next = cache->blocks[sizeClass];
+        cache->blocks[sizeClass] = block;
+        cache->counts[sizeClass]++;
+        position += blockSize;
+    }
+    return 0;
+}
+
+void* pool_alloc (size_t size) {
+    int sizeClass = ClassFor(size);
+
+    // Too big for the classes, use malloc (still with a header so pool_free knows)
+    if (sizeClass < 0) {
+        PoolHeader* block = malloc(sizeof(PoolHeader) + size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->sizeClass = PoolLargeClass;
+        return block + 1;
+    }
+
+    PoolThreadCache* cache = CurrentCache();
+    cache->allocates = 1;
+
+    // Our cache is empty, take everything other threads gave back
+    if (cache->blocks[sizeClass] == NULL) {
+        cache->blocks[sizeClass] = __atomic_exchange_n(&g_pool.returned[sizeClass], NULL, __ATOMIC_ACQUIRE);
+        for (PoolHeader* block = cache->blocks[sizeClass]; block != NULL; block = block->next) {
+            cache->counts[sizeClass]++;
+        }
+    }
+
+    // Nothing was given back either, carve a new slab
+    if (cache->blocks[sizeClass] == NULL && RefillFromSlab(cache, sizeClass) != 0) {
+        return NULL;
+    }
+
+    PoolHeader* block = cache->blocks[sizeClass];
+    cache->blocks[sizeClass] = block->next;
+    cache->counts[sizeClass]--;
+    return block + 1;
+}
+
+void pool_free (void* buffer) {
+
+    // Like free, NULL is fine
+    if (buffer == NULL) {
+        return;
+    }
+
+    PoolHeader* block = (PoolHeader*)buffer - 1;
+    if (block->sizeClass == PoolLargeClass) {
+        free(block);
+        return;
+    }
+
+    // Keep it in our own cache if this thread allocates from the pool too
+    // and the cache is not full, otherwise give it back to everyone
+    PoolThreadCache* cache = CurrentCache();
+    int sizeClass = (int)block->sizeClass;
+    int maxCachedBlocks = (int)(PoolMaxCachedBytes >> (sizeClass + PoolMinClassShift));
+    if (cache->allocates && cache->counts[sizeClass] < maxCachedBlocks) {
+        block->next = cache->blocks[sizeClass];
+        cache->blocks[sizeClass] = block;
+        cache->counts[sizeClass]++;
+        return;
+    }
+
+    PushReturned(block);
+}
+
+void pool_destroy (void) {
+
+    // Free all the slabs, every block lives in one of them
+    pthread_mutex_lock(&g_pool.slabLock);
+    PoolSlab* slab = g_pool.slabs;
+    while (slab != NULL) {
+        PoolSlab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    g_pool.slabs = NULL;
+
+    // Forget the lists, and make every thread cache stale
+    for (int i=0; i<PoolNumClasses; i++) {
+        g_pool.returned[i] = NULL;
+    }
+    __atomic_add_fetch(&g_pool.generation, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g_pool.slabLock);
+}
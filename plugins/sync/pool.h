@@ -0,0 +1,36 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/**
+ * Size class slab pool for message buffers
+ * Buffers are carved out of big slabs, and freed buffers are kept for the
+ * next message of the same size class instead of going back to malloc.
+ * Every thread has its own cache of free buffers, and buffers freed by
+ * another thread (the next plugin in the chain) come back through a
+ * lock-free list, so allocation and free never take a lock.
+ *
+ * There is one pool per loaded module: every plugin is loaded into its own
+ * namespace, so a buffer always goes back to the pool that made it
+ * (pool_free has the message_release_t signature for that reason)
+ */
+
+/**
+ * Allocate a buffer of at least size bytes (16 byte aligned)
+ * @param size Number of bytes needed
+ * @return The buffer, NULL on failure
+ */
+void* pool_alloc(size_t size);
+/**
+ * Give a buffer back to the pool, can be called from any thread
+ * @param buffer A buffer from pool_alloc of this module (NULL is ignored)
+ */
+void pool_free(void* buffer);
+/**
+ * Free all the slabs of the pool. Only call this once no buffer is in use
+ * anymore and no other thread uses the pool
+ */
+void pool_destroy(void);
+
+#endif
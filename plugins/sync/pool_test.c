@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include "pool.h"
+
+// Configuration
+#define NumThreads 4
+#define ItemCount 10000
+
+// Buffers passed from the producer thread to the freeing thread
+static void* handedOver[ItemCount];
+
+// Allocates buffers, like a plugin making its output messages
+void* allocator_thread (void* unused) {
+    (void)unused;
+    for (int i=0; i<ItemCount; i++) {
+        handedOver[i] = pool_alloc(1 + i % 3000);
+        assert(handedOver[i] != NULL);
+        memset(handedOver[i], 'x', 1 + i % 3000);
+    }
+    return NULL;
+}
+
+// Frees buffers it did not allocate, like the next plugin in the chain
+void* freeing_thread (void* unused) {
+    (void)unused;
+    for (int i=0; i<ItemCount; i++) {
+        pool_free(handedOver[i]);
+    }
+    return NULL;
+}
+
+// Allocates one buffer with an empty thread cache and returns it
+void* fresh_thread (void* unused) {
+    (void)unused;
+    return pool_alloc(1);
+}
+
+// Allocates and frees on its own, many threads at once
+void* churn_thread (void* unused) {
+    (void)unused;
+    void* buffers[64];
+    for (int round=0; round<200; round++) {
+        for (int i=0; i<64; i++) {
+            buffers[i] = pool_alloc(16 + (round * 64 + i) % 5000);
+            assert(buffers[i] != NULL);
+            memset(buffers[i], round, 16);
+        }
+        for (int i=0; i<64; i++) {
+            pool_free(buffers[i]);
+        }
+    }
+    return NULL;
+}
+
+// Test 1: A freed buffer is reused for the next one of the same size
+void testReuse () {
+    printf("Test 1: Reuse freed buffer: ");
+
+    void* first = pool_alloc(100);
+    assert(first != NULL);
+    pool_free(first);
+
+    void* second = pool_alloc(100);
+    assert(second == first);
+    pool_free(second);
+
+    printf("pass\n");
+}
+
+// Test 2: Sizes across all the classes, and bigger than all of them
+void testSizes () {
+    printf("Test 2: Different sizes: ");
+
+    size_t sizes[] = { 0, 1, 15, 16, 17, 1000, 4096, 65000, 70000, 1 << 20 };
+    void* buffers[10];
+    for (int i=0; i<10; i++) {
+        buffers[i] = pool_alloc(sizes[i]);
+        assert(buffers[i] != NULL);
+
+        // 16 byte aligned and fully writable
+        assert(((unsigned long)buffers[i] % 16) == 0);
+        memset(buffers[i], 'a' + i, sizes[i]);
+    }
+
+    // Nothing overlaps
+    for (int i=0; i<10; i++) {
+        for (size_t j=0; j<sizes[i]; j++) {
+            assert(((char*)buffers[i])[j] == 'a' + i);
+        }
+        pool_free(buffers[i]);
+    }
+
+    // NULL is ignored like free
+    pool_free(NULL);
+
+    printf("pass\n");
+}
+
+// Test 3: Buffers freed by another thread come back to the allocating thread
+void testCrossThreadFree () {
+    printf("Test 3: Free from another thread: ");
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, allocator_thread, NULL);
+    pthread_join(thread, NULL);
+    pthread_create(&thread, NULL, freeing_thread, NULL);
+    pthread_join(thread, NULL);
+
+    // A thread with an empty cache gets one of the returned buffers instead of a new one
+    void* buffer = NULL;
+    pthread_create(&thread, NULL, fresh_thread, NULL);
+    pthread_join(thread, &buffer);
+    int reused = 0;
+    for (int i=0; i<ItemCount; i++) {
+        if (handedOver[i] == buffer) {
+            reused = 1;
+        }
+    }
+    assert(reused);
+    pool_free(buffer);
+
+    printf("pass\n");
+}
+
+// Test 4: Many threads at once
+void testThreads () {
+    printf("Test 4: Multiple threads: ");
+
+    pthread_t threads[NumThreads];
+    for (int i=0; i<NumThreads; i++) {
+        pthread_create(&threads[i], NULL, churn_thread, NULL);
+    }
+    for (int i=0; i<NumThreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("pass\n");
+}
+
+// Test 5: The pool can be used again after it was destroyed
+void testDestroy () {
+    printf("Test 5: Destroy and use again: ");
+
+    pool_destroy();
+    void* buffer = pool_alloc(200);
+    assert(buffer != NULL);
+    memset(buffer, 0, 200);
+    pool_free(buffer);
+    pool_destroy();
+
+    printf("pass\n");
+}
+
+int main () {
+    printf("Pool Unit Test\n\n");
+
+    testReuse();
+    testSizes();
+    testCrossThreadFree();
+    testThreads();
+    testDestroy();
+
+    printf("\nAll the tests passed\n");
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include "print_order.h"
+#include <stdlib.h>
+
+// All functions functionalities are described in detail
+// in the header file
+
+// The printer may write its next record now (everything but the writing flag)
+static int IsTurn (print_order_t* order, int position, int lockstep) {
+    size_t line = __atomic_load_n(&order->printed[position], __ATOMIC_ACQUIRE);
+
+    // The printers before it wrote this line, it is enough to look at the one right before
+    if (position > 0 && __atomic_load_n(&order->printed[position - 1], __ATOMIC_ACQUIRE) <= line) {
+        return 0;
+    }
+
+    // The printers after it wrote the line before, the same with the last one
+    int last = order->printers - 1;
+    if (lockstep && position < last && __atomic_load_n(&order->printed[last], __ATOMIC_ACQUIRE) < line) {
+        return 0;
+    }
+    return 1;
+}
+
+int print_order_init (print_order_t* order, int printers) {
+
+    // Safety check
+    if (order == NULL || printers < 1) {
+        return -1;
+    }
+
+    order->printers = printers;
+    order->writing = 0;
+    order->printed = calloc(printers, sizeof(size_t));
+    order->changed = calloc(printers, sizeof(monitor_t));
+    if (order->printed == NULL || order->changed == NULL) {
+        free(order->printed);
+        free(order->changed);
+        order->printed = NULL;
+        order->changed = NULL;
+        return -1;
+    }
+    for (int i=0; i<printers; i++) {
+        monitor_init(&order->changed[i]);
+    }
+    return 0;
+}
+
+void print_order_destroy (print_order_t* order) {
+    if (order == NULL || order->changed == NULL) {
+        return;
+    }
+    for (int i=0; i<order->printers; i++) {
+        monitor_destroy(&order->changed[i]);
+    }
+    free(order->printed);
+    free(order->changed);
+    order->printed = NULL;
+    order->changed = NULL;
+}
+
+void print_order_begin (print_order_t* order, int position, int lockstep) {
+
+    // Reset before looking, so a change after the look is not missed
+    while (1) {
+        monitor_reset(&order->changed[position]);
+        int expected = 0;
+        if (IsTurn(order, position, lockstep) &&
+                __atomic_compare_exchange_n(&order->writing, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        monitor_wait(&order->changed[position]);
+    }
+}
+
+void print_order_end (print_order_t* order, int position) {
+    __atomic_add_fetch(&order->printed[position], 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&order->writing, 0, __ATOMIC_RELEASE);
+
+    // Any of the others may have waited for this record (or for the writing flag)
+    for (int i=0; i<order->printers; i++) {
+        if (i != position) {
+            monitor_signal(&order->changed[i]);
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef PRINT_ORDER_H
+#define PRINT_ORDER_H
+
+#include "monitor.h"
+#include <stddef.h>
+
+/**
+ * The order in which the stages of a chain that print (logger, typewriter)
+ * write their output, so it reads like every stage printed a line before it
+ * passed the line on, even for a stage that passes it on right away and
+ * prints it later on a thread of its own.
+ * The printers are numbered in chain order (their position) and each one
+ * writes one record per line:
+ * - A printer writes its record of a line only after the printers before it
+ *   wrote theirs
+ * - No record is written while another printer is in the middle of one
+ * - A lockstep printer (one that passed the line on before printing it)
+ *   also waits until the printers after it wrote their records of the line
+ *   before, so it doesnt start the next line before them
+ * The host owns it and gives it to the printers of one chain, they must
+ * all see the same lines in the same order
+ */
+typedef struct
+{
+ int printers; /* Number of printers */
+ size_t* printed; /* Records every printer wrote so far */
+ int writing; /* One of the printers is writing a record right now */
+ monitor_t* changed; /* One per printer, signaled when it may be able to go on */
+} print_order_t;
+
+/**
+ * Initialize a print order
+ * @param order Print order to initialize
+ * @param printers Number of printers (at least 1)
+ * @return 0 on success, -1 on failure
+ */
+int print_order_init(print_order_t* order, int printers);
+/**
+ * Destroy a print order and free its resources
+ * @param order The print order
+ */
+void print_order_destroy(print_order_t* order);
+/**
+ * Wait until the printer may write its record of its next line
+ * Every begin must be followed by an end, also when the record cant be written
+ * @param order The print order
+ * @param position The printer, from 0
+ * @param lockstep Also wait for the printers after it to finish the line before
+ */
+void print_order_begin(print_order_t* order, int position, int lockstep);
+/**
+ * The printer is done with its record, the others may go on
+ * @param order The print order
+ * @param position The printer, from 0
+ */
+void print_order_end(print_order_t* order, int position);
+
+#endif
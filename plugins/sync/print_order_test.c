@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <assert.h>
+#include "print_order.h"
+
+// Configuration
+#define LineCount 2000
+#define MaxPrinters 4
+
+// One record of the "output": which printer wrote which of its lines
+typedef struct {
+    int position;
+    int line;
+} Record;
+
+static print_order_t order;
+static Record records[LineCount * MaxPrinters];
+static int recordCount = 0;
+static int inside = 0; // Printers between begin and end right now
+static int lockstepOf[MaxPrinters];
+
+// A printer: writes a record for each of its lines, in its turn
+void* printerThread (void* arg) {
+    int position = (int)(long)arg;
+    for (int line=0; line<LineCount; line++) {
+        print_order_begin(&order, position, lockstepOf[position]);
+
+        // Nobody else is in the middle of a record
+        assert(__atomic_add_fetch(&inside, 1, __ATOMIC_SEQ_CST) == 1);
+        records[recordCount].position = position;
+        records[recordCount].line = line;
+        recordCount++;
+        __atomic_sub_fetch(&inside, 1, __ATOMIC_SEQ_CST);
+
+        print_order_end(&order, position);
+    }
+    return NULL;
+}
+
+// Runs the printers (lockstep as given) and collects their records
+void runPrinters (int printers) {
+    recordCount = 0;
+    assert(print_order_init(&order, printers) == 0);
+    pthread_t threads[MaxPrinters];
+
+    // Started last first, so the later printers really have to wait
+    for (int i=printers-1; i>=0; i--) {
+        pthread_create(&threads[i], NULL, printerThread, (void*)(long)i);
+    }
+    for (int i=0; i<printers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    print_order_destroy(&order);
+    assert(recordCount == LineCount * printers);
+}
+
+// Test 1: All of them in lockstep, the output is line by line, printer by printer
+void testLockstep () {
+    printf("Test 1: Lockstep: ");
+    for (int i=0; i<MaxPrinters; i++) {
+        lockstepOf[i] = 1;
+    }
+    runPrinters(MaxPrinters);
+    for (int i=0; i<recordCount; i++) {
+        assert(records[i].line == i / MaxPrinters);
+        assert(records[i].position == i % MaxPrinters);
+    }
+    printf("pass\n");
+}
+
+// Test 2: None in lockstep, a line is still written by the printers in their order
+void testEarlierFirst () {
+    printf("Test 2: Earlier printers first: ");
+    for (int i=0; i<MaxPrinters; i++) {
+        lockstepOf[i] = 0;
+    }
+    runPrinters(MaxPrinters);
+
+    int written[MaxPrinters] = {0};
+    for (int i=0; i<recordCount; i++) {
+        int position = records[i].position;
+        assert(records[i].line == written[position]);
+        if (position > 0) {
+            assert(written[position - 1] > records[i].line);
+        }
+        written[position]++;
+    }
+    printf("pass\n");
+}
+
+// Test 3: Only the first in lockstep (typewriter logger logger), it starts a
+// line only after the last printer wrote the one before
+void testFirstInLockstep () {
+    printf("Test 3: First printer in lockstep: ");
+    lockstepOf[0] = 1;
+    for (int i=1; i<MaxPrinters; i++) {
+        lockstepOf[i] = 0;
+    }
+    runPrinters(MaxPrinters);
+
+    int written[MaxPrinters] = {0};
+    for (int i=0; i<recordCount; i++) {
+        int position = records[i].position;
+        if (position == 0) {
+            assert(written[MaxPrinters - 1] == records[i].line);
+        }
+        written[position]++;
+    }
+    printf("pass\n");
+}
+
+// Test 4: A single printer never waits, and bad arguments are errors
+void testSingleAndErrors () {
+    printf("Test 4: Single printer and errors: ");
+    lockstepOf[0] = 1;
+    runPrinters(1);
+    assert(print_order_init(NULL, 1) == -1);
+    assert(print_order_init(&order, 0) == -1);
+    printf("pass\n");
+}
+
+int main () {
+    printf("Print Order Unit Test\n\n");
+
+    testLockstep();
+    testEarlierFirst();
+    testFirstInLockstep();
+    testSingleAndErrors();
+
+    printf("\nAll the tests passed\n");
+    return 0;
+}
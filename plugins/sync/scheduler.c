@@ -0,0 +1,328 @@
+#include "scheduler.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+// All functions functionalities are described in detail
+// in the header file
+
+// The worker the calling thread is (NULL outside of the pool)
+static __thread scheduler_worker_t* t_worker = NULL;
+
+// Smallest power of 2 that is at least count
+static long DequeSizeFor (int count) {
+    long size = 2;
+    while (size < count) {
+        size *= 2;
+    }
+    return size;
+}
+
+// ----- Chase-Lev deque -----
+// (Le, Pop, Cohen, Zappa Nardelli: "Correct and efficient work-stealing for
+// weak memory models", with the same fences)
+
+// Owner only: add a task at the bottom, 0 if the deque is full
+static int DequePush (scheduler_worker_t* worker, scheduler_task_t* task) {
+    long bottom = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+    if (bottom - top > worker->taskMask) {
+        return 0;
+    }
+    __atomic_store_n(&worker->tasks[bottom & worker->taskMask], task, __ATOMIC_RELAXED);
+
+    // The task must be in the slot before a thief can see the new bottom
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Owner only: take the newest task, NULL if empty
+static scheduler_task_t* DequeTake (scheduler_worker_t* worker) {
+    long bottom = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&worker->bottom, bottom, __ATOMIC_RELAXED);
+
+    // Claim the slot before looking at top, so a thief and the owner never both get the last task
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&worker->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        // Was empty, put bottom back
+        __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    scheduler_task_t* task = __atomic_load_n(&worker->tasks[bottom & worker->taskMask], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // The last task, race the thieves for it
+        if (!__atomic_compare_exchange_n(&worker->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            task = NULL;
+        }
+        __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+// Any thread: take the oldest task, NULL if empty or another thread got it first
+static scheduler_task_t* DequeSteal (scheduler_worker_t* worker) {
+    long top = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&worker->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    scheduler_task_t* task = __atomic_load_n(&worker->tasks[top & worker->taskMask], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&worker->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return task;
+}
+
+static int DequeLooksEmpty (scheduler_worker_t* worker) {
+    return __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE) >= __atomic_load_n(&worker->bottom, __ATOMIC_ACQUIRE);
+}
+
+// ----- Injection list (tasks from outside the pool) -----
+
+static void InjectTask (scheduler_t* scheduler, scheduler_task_t* task) {
+    task->next = NULL;
+    pthread_mutex_lock(&scheduler->injectLock);
+    if (scheduler->injectTail != NULL) {
+        scheduler->injectTail->next = task;
+    }
+    else {
+        scheduler->injectHead = task;
+    }
+    scheduler->injectTail = task;
+    __atomic_store_n(&scheduler->injectCount, scheduler->injectCount + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&scheduler->injectLock);
+}
+
+static scheduler_task_t* TakeInjected (scheduler_t* scheduler) {
+
+    // Dont take the lock just to find out it is empty
+    if (__atomic_load_n(&scheduler->injectCount, __ATOMIC_RELAXED) == 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&scheduler->injectLock);
+    scheduler_task_t* task = scheduler->injectHead;
+    if (task != NULL) {
+        scheduler->injectHead = task->next;
+        if (scheduler->injectHead == NULL) {
+            scheduler->injectTail = NULL;
+        }
+        __atomic_store_n(&scheduler->injectCount, scheduler->injectCount - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&scheduler->injectLock);
+    return task;
+}
+
+// ----- Workers -----
+
+// Wake up one parked worker (other than the caller), if there is one
+static void WakeIdleWorker (scheduler_t* scheduler) {
+
+    // Pairs with the fence in WorkerPark: either the parking worker sees the
+    // new task, or we see its idle flag
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (int i=0; i<scheduler->numWorkers; i++) {
+        scheduler_worker_t* worker = &scheduler->workers[i];
+        int idle = 1;
+        if (worker != t_worker && __atomic_load_n(&worker->idle, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&worker->idle, &idle, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            monitor_signal(&worker->wakeup);
+            return;
+        }
+    }
+}
+
+// Find a task for this worker: own deque, then the injection list, then steal
+static scheduler_task_t* FindTask (scheduler_worker_t* self) {
+    scheduler_t* scheduler = self->scheduler;
+
+    scheduler_task_t* task = DequeTake(self);
+    if (task != NULL) {
+        return task;
+    }
+    task = TakeInjected(scheduler);
+    if (task != NULL) {
+        return task;
+    }
+
+    // Start with the next worker, so the thieves dont all go after the same one
+    for (int i=1; i<scheduler->numWorkers; i++) {
+        scheduler_worker_t* victim = &scheduler->workers[(self->index + i) % scheduler->numWorkers];
+        task = DequeSteal(victim);
+        if (task != NULL) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+// Is there anything to do anywhere (may be wrong by the time it returns)
+static int HasWork (scheduler_t* scheduler) {
+    if (__atomic_load_n(&scheduler->injectCount, __ATOMIC_RELAXED) > 0) {
+        return 1;
+    }
+    for (int i=0; i<scheduler->numWorkers; i++) {
+        if (!DequeLooksEmpty(&scheduler->workers[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Park until there may be work. Returns 0 when the pool is stopping and there is no work left
+static int WorkerPark (scheduler_worker_t* self) {
+    scheduler_t* scheduler = self->scheduler;
+
+    // Reset first, so a signal that comes after this is not lost
+    monitor_reset(&self->wakeup);
+    __atomic_store_n(&self->idle, 1, __ATOMIC_SEQ_CST);
+
+    // Look once more now that we are marked idle (submitters check idle after pushing)
+    if (HasWork(scheduler)) {
+        __atomic_store_n(&self->idle, 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (__atomic_load_n(&scheduler->stopping, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&self->idle, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    // The monitor spins for a while before it really parks
+    monitor_wait(&self->wakeup);
+    __atomic_store_n(&self->idle, 0, __ATOMIC_RELAXED);
+    return 1;
+}
+
+static void* WorkerThread (void* arg) {
+    scheduler_worker_t* self = (scheduler_worker_t*)arg;
+    t_worker = self;
+
+    for (;;) {
+        scheduler_task_t* task = FindTask(self);
+        if (task != NULL) {
+            task->run(task);
+            continue;
+        }
+        if (!WorkerPark(self)) {
+            break;
+        }
+    }
+
+    t_worker = NULL;
+    return NULL;
+}
+
+const char* scheduler_init (scheduler_t* scheduler, int numWorkers, int maxTasks) {
+
+    // Safety checks
+    if (scheduler == NULL) {
+        return "Error, the given scheduler ptr is null";
+    }
+    if (numWorkers < 0 || maxTasks <= 0) {
+        return "Error, the number of workers and tasks cant be negative";
+    }
+
+    // One worker per CPU
+    if (numWorkers == 0) {
+        long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+        numWorkers = numCpus > 0 ? (int)numCpus : 1;
+    }
+
+    scheduler->numWorkers = numWorkers;
+    scheduler->injectHead = NULL;
+    scheduler->injectTail = NULL;
+    scheduler->injectCount = 0;
+    scheduler->stopping = 0;
+    if (pthread_mutex_init(&scheduler->injectLock, NULL) != 0) {
+        return "Error, failed to initialize the injection lock";
+    }
+
+    // Aligned so the workers' deques dont share cache lines
+    void* workersMemory = NULL;
+    if (posix_memalign(&workersMemory, SCHEDULER_CACHE_LINE, numWorkers * sizeof(scheduler_worker_t)) != 0) {
+        pthread_mutex_destroy(&scheduler->injectLock);
+        return "Error, failed to allocate the workers";
+    }
+    scheduler->workers = workersMemory;
+
+    long dequeSize = DequeSizeFor(maxTasks);
+    for (int i=0; i<numWorkers; i++) {
+        scheduler_worker_t* worker = &scheduler->workers[i];
+        worker->top = 0;
+        worker->bottom = 0;
+        worker->taskMask = dequeSize - 1;
+        worker->idle = 0;
+        worker->scheduler = scheduler;
+        worker->index = i;
+        worker->tasks = calloc(dequeSize, sizeof(scheduler_task_t*));
+        monitor_init(&worker->wakeup);
+        if (worker->tasks == NULL) {
+            for (int j=0; j<i; j++) {
+                free(scheduler->workers[j].tasks);
+            }
+            free(scheduler->workers);
+            pthread_mutex_destroy(&scheduler->injectLock);
+            return "Error, failed to allocate the deques";
+        }
+    }
+
+    for (int i=0; i<numWorkers; i++) {
+        if (pthread_create(&scheduler->workers[i].thread, NULL, WorkerThread, &scheduler->workers[i]) != 0) {
+
+            // Let the ones that started leave again
+            for (int j=i; j<numWorkers; j++) {
+                free(scheduler->workers[j].tasks);
+            }
+            scheduler->numWorkers = i;
+            scheduler_destroy(scheduler);
+            return "Error, failed to create a worker thread";
+        }
+    }
+    return NULL;
+}
+
+void scheduler_submit (scheduler_t* scheduler, scheduler_task_t* task) {
+
+    // Safety check
+    if (scheduler == NULL || task == NULL) {
+        return;
+    }
+
+    // From one of our workers: its own deque, no lock
+    // (if the deque is full it goes to the injection list instead)
+    if (t_worker == NULL || t_worker->scheduler != scheduler || !DequePush(t_worker, task)) {
+        InjectTask(scheduler, task);
+    }
+
+    WakeIdleWorker(scheduler);
+}
+
+void scheduler_destroy (scheduler_t* scheduler) {
+
+    // Safety check
+    if (scheduler == NULL || scheduler->workers == NULL) {
+        return;
+    }
+
+    // Every worker leaves once it finds no work, wake the parked ones so they notice
+    __atomic_store_n(&scheduler->stopping, 1, __ATOMIC_RELEASE);
+    for (int i=0; i<scheduler->numWorkers; i++) {
+        monitor_signal(&scheduler->workers[i].wakeup);
+    }
+    for (int i=0; i<scheduler->numWorkers; i++) {
+        pthread_join(scheduler->workers[i].thread, NULL);
+    }
+
+    for (int i=0; i<scheduler->numWorkers; i++) {
+        monitor_destroy(&scheduler->workers[i].wakeup);
+        free(scheduler->workers[i].tasks);
+    }
+    free(scheduler->workers);
+    scheduler->workers = NULL;
+    pthread_mutex_destroy(&scheduler->injectLock);
+}
@@ -0,0 +1,82 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "monitor.h"
+#include <pthread.h>
+
+/**
+ * Work stealing thread pool
+ * A fixed number of worker threads run tasks. Every worker has its own deque:
+ * tasks submitted by a worker go to the bottom of its own deque and it takes
+ * them back from the bottom (the newest first, its data is still in the cache),
+ * while idle workers steal from the top of the others' deques (the oldest).
+ * Tasks submitted from outside the pool go to a shared injection list.
+ * Workers with nothing to do park on their own monitor.
+ *
+ * A task is a struct the caller owns (no allocation per task). The same task
+ * may be submitted again once it started running, but not while it is still
+ * waiting to run
+ */
+
+// Size of a cache line, the workers' hot fields are kept apart
+#define SCHEDULER_CACHE_LINE 64
+
+typedef struct scheduler_task
+{
+ void (*run)(struct scheduler_task* task); /* What to do, gets the task itself */
+ struct scheduler_task* next; /* Used by the injection list only */
+} scheduler_task_t;
+
+struct scheduler;
+
+/**
+ * One worker thread and its deque (Chase-Lev: the owner pushes and takes at
+ * the bottom without a lock, thieves take from the top with a CAS)
+ */
+typedef struct
+{
+ long top; /* Next task to steal (only grows) */
+ long bottom; /* Next free slot of the owner (only the owner writes it) */
+ scheduler_task_t** tasks; /* Ring of tasks, slot is position & taskMask */
+ long taskMask; /* Ring size minus 1 (the size is a power of 2) */
+ int idle; /* The worker is (about to be) parked on wakeup */
+ monitor_t wakeup; /* Signaled to unpark the worker */
+ pthread_t thread;
+ struct scheduler* scheduler;
+ int index; /* Position in the workers array */
+} __attribute__((aligned(SCHEDULER_CACHE_LINE))) scheduler_worker_t;
+
+typedef struct scheduler
+{
+ scheduler_worker_t* workers; /* The worker threads */
+ int numWorkers; /* Number of worker threads */
+ pthread_mutex_t injectLock; /* Protects the injection list */
+ scheduler_task_t* injectHead; /* Tasks submitted from outside the pool (FIFO) */
+ scheduler_task_t* injectTail;
+ int injectCount; /* Number of tasks in the injection list */
+ int stopping; /* Set by scheduler_destroy, workers leave once there is no work */
+} scheduler_t;
+
+/**
+ * Initialize the pool and start its worker threads
+ * @param scheduler Pointer to the scheduler structure
+ * @param numWorkers Number of worker threads (0 means one per CPU)
+ * @param maxTasks Most tasks that can be waiting at once (deque size, more go to the injection list)
+ * @return NULL on success, error message on failure
+ */
+const char* scheduler_init(scheduler_t* scheduler, int numWorkers, int maxTasks);
+/**
+ * Run a task on one of the workers, can be called from any thread
+ * From a worker thread the task goes to that worker's own deque
+ * @param scheduler Pointer to the scheduler structure
+ * @param task The task (must stay alive until it ran)
+ */
+void scheduler_submit(scheduler_t* scheduler, scheduler_task_t* task);
+/**
+ * Stop the workers once every submitted task ran, and free the pool
+ * Must not be called from a worker thread
+ * @param scheduler Pointer to the scheduler structure
+ */
+void scheduler_destroy(scheduler_t* scheduler);
+
+#endif
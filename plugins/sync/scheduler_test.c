@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include "scheduler.h"
+
+// Configuration
+#define NumWorkers 4
+#define TaskCount 10000
+#define ChainLength 2000
+#define TreeDepth 12
+
+// Counts the tasks that ran
+static int ranCount = 0;
+
+// A task that only counts itself
+void countTask (scheduler_task_t* task) {
+    (void)task;
+    __atomic_add_fetch(&ranCount, 1, __ATOMIC_RELAXED);
+}
+
+// A task that submits itself again until it ran ChainLength times.
+// It is never waiting twice at once, so its steps must run one after the other
+typedef struct {
+    scheduler_task_t task; // First, so the task pointer is the chain pointer
+    scheduler_t* scheduler;
+    int steps;
+    int running; // Set while a step runs, two steps at once would see it
+    int overlapped;
+} ChainTask;
+
+void chainStep (scheduler_task_t* task) {
+    ChainTask* chain = (ChainTask*)task;
+    if (__atomic_exchange_n(&chain->running, 1, __ATOMIC_ACQ_REL)) {
+        chain->overlapped = 1;
+    }
+    chain->steps++;
+    int again = chain->steps < ChainLength;
+    __atomic_store_n(&chain->running, 0, __ATOMIC_RELEASE);
+
+    // Resubmitting is the last thing we touch, the next step may start right away
+    if (again) {
+        scheduler_submit(chain->scheduler, task);
+    }
+}
+
+// A task that submits two children from inside the pool, down to TreeDepth
+typedef struct {
+    scheduler_task_t task;
+    scheduler_t* scheduler;
+    int depth;
+} TreeTask;
+
+static TreeTask* treeTasks;
+static int treeNext = 0;
+
+void treeStep (scheduler_task_t* task) {
+    TreeTask* node = (TreeTask*)task;
+    __atomic_add_fetch(&ranCount, 1, __ATOMIC_RELAXED);
+    if (node->depth == TreeDepth) {
+        return;
+    }
+    for (int i=0; i<2; i++) {
+        TreeTask* child = &treeTasks[__atomic_fetch_add(&treeNext, 1, __ATOMIC_RELAXED)];
+        child->task.run = treeStep;
+        child->scheduler = node->scheduler;
+        child->depth = node->depth + 1;
+        scheduler_submit(node->scheduler, &child->task);
+    }
+}
+
+// Test 1: Tasks submitted from outside the pool all run
+void testInjected () {
+    printf("Test 1: Tasks from outside the pool: ");
+    scheduler_t scheduler;
+    assert(scheduler_init(&scheduler, NumWorkers, 64) == NULL);
+
+    scheduler_task_t* tasks = calloc(TaskCount, sizeof(scheduler_task_t));
+    assert(tasks != NULL);
+    ranCount = 0;
+    for (int i=0; i<TaskCount; i++) {
+        tasks[i].run = countTask;
+        scheduler_submit(&scheduler, &tasks[i]);
+    }
+
+    // Destroy waits until everything ran
+    scheduler_destroy(&scheduler);
+    assert(ranCount == TaskCount);
+    free(tasks);
+    printf("pass\n");
+}
+
+// Test 2: Tasks submitted from inside the pool (own deques, stealing) all run,
+// also more of them than fit in a deque
+void testNested () {
+    printf("Test 2: Tasks from inside the pool: ");
+    scheduler_t scheduler;
+    assert(scheduler_init(&scheduler, NumWorkers, 16) == NULL);
+
+    int nodes = (1 << (TreeDepth + 1)) - 1;
+    treeTasks = calloc(nodes, sizeof(TreeTask));
+    assert(treeTasks != NULL);
+    ranCount = 0;
+    treeNext = 1;
+    treeTasks[0].task.run = treeStep;
+    treeTasks[0].scheduler = &scheduler;
+    treeTasks[0].depth = 0;
+    scheduler_submit(&scheduler, &treeTasks[0].task);
+
+    scheduler_destroy(&scheduler);
+    assert(ranCount == nodes);
+    free(treeTasks);
+    printf("pass\n");
+}
+
+// Test 3: A task that resubmits itself never runs twice at once,
+// even with several of them and several workers
+void testSelfResubmit () {
+    printf("Test 3: Resubmitted tasks run one step at a time: ");
+    scheduler_t scheduler;
+    assert(scheduler_init(&scheduler, NumWorkers, 8) == NULL);
+
+    ChainTask chains[8];
+    memset(chains, 0, sizeof(chains));
+    for (int i=0; i<8; i++) {
+        chains[i].task.run = chainStep;
+        chains[i].scheduler = &scheduler;
+        scheduler_submit(&scheduler, &chains[i].task);
+    }
+
+    scheduler_destroy(&scheduler);
+    for (int i=0; i<8; i++) {
+        assert(chains[i].steps == ChainLength);
+        assert(!chains[i].overlapped);
+    }
+    printf("pass\n");
+}
+
+// Test 4: One worker per CPU by default, and a pool with nothing to do stops
+void testDefaults () {
+    printf("Test 4: Default size and empty pool: ");
+    scheduler_t scheduler;
+    assert(scheduler_init(&scheduler, 0, 4) == NULL);
+    assert(scheduler.numWorkers >= 1);
+    scheduler_destroy(&scheduler);
+
+    assert(scheduler_init(NULL, 1, 4) != NULL);
+    assert(scheduler_init(&scheduler, 1, 0) != NULL);
+    printf("pass\n");
+}
+
+int main () {
+    printf("Scheduler Unit Test\n\n");
+
+    testInjected();
+    testNested();
+    testSelfResubmit();
+    testDefaults();
+
+    printf("\nAll the tests passed\n");
+    return 0;
+}
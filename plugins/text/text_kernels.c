@@ -0,0 +1,455 @@
+#include "text_kernels.h"
+#include <stdint.h>
+
+// The SIMD versions are only built for x86, everywhere else the scalar ones are used.
+// Every SIMD function has a target attribute instead of a compile flag, so the
+// module is still built with plain gcc and only runs those functions if CPUID says so.
+#if defined(__x86_64__) || defined(__i386__)
+#define TEXT_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+// ----- Scalar versions (the fallback, and what the SIMD versions are tested against) -----
+
+// Same as toupper in the C locale (every plugin namespace has its own libc
+// that never calls setlocale, so that is the locale the plugins always ran in)
+static void UppercaseScalar (char* data, size_t length) {
+    for (size_t i=0; i<length; i++) {
+        if (data[i] >= 'a' && data[i] <= 'z') {
+            data[i] = data[i] - ('a' - 'A');
+        }
+    }
+}
+
+static void ReverseScalar (char* data, size_t length) {
+    if (length < 2) {
+        return;
+    }
+    // Swap from both ends towards the middle
+    for (size_t i=0, j=length - 1; i<j; i++, j--) {
+        char temp = data[i];
+        data[i] = data[j];
+        data[j] = temp;
+    }
+}
+
+// Move count bytes one position right (data[count] is overwritten)
+// Goes backwards so nothing is overwritten before it moved
+static void ShiftRightScalar (char* data, size_t count) {
+    for (size_t i=count; i>0; i--) {
+        data[i] = data[i - 1];
+    }
+}
+
+static void RotateRightScalar (char* data, size_t length) {
+    if (length < 2) {
+        return;
+    }
+    char lastCharacter = data[length - 1];
+    ShiftRightScalar(data, length - 1);
+    data[0] = lastCharacter;
+}
+
+static void ExpandScalar (const char* input, size_t length, char* output) {
+    size_t indexInString = 0;
+    for (size_t i=0; i<length; i++) {
+        output[indexInString++] = input[i];
+        // Add space after each character except the last one
+        if (i < length - 1) {
+            output[indexInString++] = ' ';
+        }
+    }
+}
+
+static size_t FindNewlinesScalar (const char* data, size_t length, size_t* positions, size_t maxPositions) {
+    size_t found = 0;
+    for (size_t i=0; i<length && found<maxPositions; i++) {
+        if (data[i] == '\n') {
+            positions[found++] = i;
+        }
+    }
+    return found;
+}
+
+static const text_kernels_t g_scalarKernels = {
+    "scalar", UppercaseScalar, ReverseScalar, RotateRightScalar, ExpandScalar, FindNewlinesScalar
+};
+
+#ifdef TEXT_KERNELS_X86
+
+// Write the set bits of a compare mask (one bit per byte, from offset) as positions
+static inline size_t MaskToPositions (uint64_t mask, size_t offset, size_t* positions, size_t found, size_t maxPositions) {
+    while (mask != 0 && found < maxPositions) {
+        positions[found++] = offset + (size_t)__builtin_ctzll(mask);
+        mask &= mask - 1;
+    }
+    return found;
+}
+
+// The tail of a newline scan goes to the smaller version, its positions are
+// relative to where it started
+static inline size_t FindNewlinesTail (size_t (*smaller)(const char*, size_t, size_t*, size_t),
+        const char* data, size_t length, size_t offset, size_t* positions, size_t found, size_t maxPositions) {
+    size_t more = smaller(data + offset, length - offset, positions + found, maxPositions - found);
+    for (size_t i=found; i<found + more; i++) {
+        positions[i] += offset;
+    }
+    return found + more;
+}
+
+// All the SIMD versions work the same way: whole vectors in the loop, and
+// whatever is left (less than a vector) goes to the next smaller version.
+// Loads and stores are unaligned, the messages can start anywhere.
+
+// ----- SSE2, 16 bytes per step -----
+
+__attribute__((target("sse2")))
+static void UppercaseSse2 (char* data, size_t length) {
+    const __m128i beforeA = _mm_set1_epi8('a' - 1);
+    const __m128i afterZ = _mm_set1_epi8('z' + 1);
+    const __m128i caseBit = _mm_set1_epi8('a' - 'A');
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        // The compare is signed, so bytes >= 0x80 are negative and never count as lowercase
+        __m128i isLower = _mm_and_si128(_mm_cmpgt_epi8(v, beforeA), _mm_cmplt_epi8(v, afterZ));
+        v = _mm_sub_epi8(v, _mm_and_si128(isLower, caseBit));
+        _mm_storeu_si128((__m128i*)(data + i), v);
+    }
+    UppercaseScalar(data + i, length - i);
+}
+
+// SSE2 has no byte shuffle, so reverse the dwords, then the words in every
+// dword, then the bytes in every word
+__attribute__((target("sse2")))
+static inline __m128i ReverseVectorSse2 (__m128i v) {
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+// Take a vector from each end, reverse both and store them swapped,
+// until less than two vectors are left in the middle
+__attribute__((target("sse2")))
+static void ReverseSse2 (char* data, size_t length) {
+    size_t front = 0;
+    size_t back = length;
+    while (back - front >= 32) {
+        __m128i head = _mm_loadu_si128((const __m128i*)(data + front));
+        __m128i tail = _mm_loadu_si128((const __m128i*)(data + back - 16));
+        _mm_storeu_si128((__m128i*)(data + front), ReverseVectorSse2(tail));
+        _mm_storeu_si128((__m128i*)(data + back - 16), ReverseVectorSse2(head));
+        front += 16;
+        back -= 16;
+    }
+    ReverseScalar(data + front, back - front);
+}
+
+// Backwards, every vector is loaded before the store of the vector after it
+// can overwrite it (the stores are one byte to the right of the loads)
+__attribute__((target("sse2")))
+static void ShiftRightSse2 (char* data, size_t count) {
+    while (count >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + count - 16));
+        _mm_storeu_si128((__m128i*)(data + count - 15), v);
+        count -= 16;
+    }
+    ShiftRightScalar(data, count);
+}
+
+__attribute__((target("sse2")))
+static void RotateRightSse2 (char* data, size_t length) {
+    if (length < 2) {
+        return;
+    }
+    char lastCharacter = data[length - 1];
+    ShiftRightSse2(data, length - 1);
+    data[0] = lastCharacter;
+}
+
+// Interleave the input bytes with spaces, 16 input bytes give 32 output bytes.
+// The output has no space after the last byte, so the last input byte is
+// always left for the smaller version (the vectors never write past the end)
+__attribute__((target("sse2")))
+static void ExpandSse2 (const char* input, size_t length, char* output) {
+    const __m128i spaces = _mm_set1_epi8(' ');
+    size_t i = 0;
+    for (; i + 16 < length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(input + i));
+        _mm_storeu_si128((__m128i*)(output + 2 * i), _mm_unpacklo_epi8(v, spaces));
+        _mm_storeu_si128((__m128i*)(output + 2 * i + 16), _mm_unpackhi_epi8(v, spaces));
+    }
+    ExpandScalar(input + i, length - i, output + 2 * i);
+}
+
+// Compare 16 bytes with '\n' and turn the result into a bit mask
+__attribute__((target("sse2")))
+static size_t FindNewlinesSse2 (const char* data, size_t length, size_t* positions, size_t maxPositions) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t found = 0;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        uint64_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+        found = MaskToPositions(mask, i, positions, found, maxPositions);
+        if (found == maxPositions) {
+            return found;
+        }
+    }
+    return FindNewlinesTail(FindNewlinesScalar, data, length, i, positions, found, maxPositions);
+}
+
+static const text_kernels_t g_sse2Kernels = {
+    "sse2", UppercaseSse2, ReverseSse2, RotateRightSse2, ExpandSse2, FindNewlinesSse2
+};
+
+// ----- AVX2, 32 bytes per step -----
+
+__attribute__((target("avx2")))
+static void UppercaseAvx2 (char* data, size_t length) {
+    const __m256i beforeA = _mm256_set1_epi8('a' - 1);
+    const __m256i afterZ = _mm256_set1_epi8('z' + 1);
+    const __m256i caseBit = _mm256_set1_epi8('a' - 'A');
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i isLower = _mm256_and_si256(_mm256_cmpgt_epi8(v, beforeA), _mm256_cmpgt_epi8(afterZ, v));
+        v = _mm256_sub_epi8(v, _mm256_and_si256(isLower, caseBit));
+        _mm256_storeu_si256((__m256i*)(data + i), v);
+    }
+    UppercaseSse2(data + i, length - i);
+}
+
+// The byte shuffle only works inside each 16 byte half, so reverse both
+// halves and then swap them
+__attribute__((target("avx2")))
+static inline __m256i ReverseVectorAvx2 (__m256i v) {
+    const __m256i reverseBytes = _mm256_setr_epi8(
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    v = _mm256_shuffle_epi8(v, reverseBytes);
+    return _mm256_permute2x128_si256(v, v, 1);
+}
+
+__attribute__((target("avx2")))
+static void ReverseAvx2 (char* data, size_t length) {
+    size_t front = 0;
+    size_t back = length;
+    while (back - front >= 64) {
+        __m256i head = _mm256_loadu_si256((const __m256i*)(data + front));
+        __m256i tail = _mm256_loadu_si256((const __m256i*)(data + back - 32));
+        _mm256_storeu_si256((__m256i*)(data + front), ReverseVectorAvx2(tail));
+        _mm256_storeu_si256((__m256i*)(data + back - 32), ReverseVectorAvx2(head));
+        front += 32;
+        back -= 32;
+    }
+    ReverseSse2(data + front, back - front);
+}
+
+__attribute__((target("avx2")))
+static void ShiftRightAvx2 (char* data, size_t count) {
+    while (count >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + count - 32));
+        _mm256_storeu_si256((__m256i*)(data + count - 31), v);
+        count -= 32;
+    }
+    ShiftRightSse2(data, count);
+}
+
+__attribute__((target("avx2")))
+static void RotateRightAvx2 (char* data, size_t length) {
+    if (length < 2) {
+        return;
+    }
+    char lastCharacter = data[length - 1];
+    ShiftRightAvx2(data, length - 1);
+    data[0] = lastCharacter;
+}
+
+// The unpack also works per 16 byte half, so first put the input qwords in
+// the order 0 2 1 3: then the low unpack gives input bytes 0..15 and the high
+// unpack gives 16..31
+__attribute__((target("avx2")))
+static void ExpandAvx2 (const char* input, size_t length, char* output) {
+    const __m256i spaces = _mm256_set1_epi8(' ');
+    size_t i = 0;
+    for (; i + 32 < length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(input + i));
+        v = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i*)(output + 2 * i), _mm256_unpacklo_epi8(v, spaces));
+        _mm256_storeu_si256((__m256i*)(output + 2 * i + 32), _mm256_unpackhi_epi8(v, spaces));
+    }
+    ExpandSse2(input + i, length - i, output + 2 * i);
+}
+
+__attribute__((target("avx2")))
+static size_t FindNewlinesAvx2 (const char* data, size_t length, size_t* positions, size_t maxPositions) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t found = 0;
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline));
+        found = MaskToPositions(mask, i, positions, found, maxPositions);
+        if (found == maxPositions) {
+            return found;
+        }
+    }
+    return FindNewlinesTail(FindNewlinesSse2, data, length, i, positions, found, maxPositions);
+}
+
+static const text_kernels_t g_avx2Kernels = {
+    "avx2", UppercaseAvx2, ReverseAvx2, RotateRightAvx2, ExpandAvx2, FindNewlinesAvx2
+};
+
+// ----- AVX-512 (F + BW), 64 bytes per step -----
+
+#define TEXT_KERNELS_AVX512_TARGET __attribute__((target("avx512f,avx512bw,avx2")))
+
+// With mask registers the tail is done with masked loads and stores
+// (the masked out bytes are never touched, so this cant fault)
+TEXT_KERNELS_AVX512_TARGET
+static void UppercaseAvx512 (char* data, size_t length) {
+    const __m512i beforeA = _mm512_set1_epi8('a' - 1);
+    const __m512i afterZ = _mm512_set1_epi8('z' + 1);
+    const __m512i caseBit = _mm512_set1_epi8('a' - 'A');
+    size_t i = 0;
+    while (i < length) {
+        size_t left = length - i;
+        __mmask64 inRange = left >= 64 ? ~(__mmask64)0 : (((__mmask64)1 << left) - 1);
+        __m512i v = _mm512_maskz_loadu_epi8(inRange, data + i);
+        __mmask64 isLower = _mm512_cmpgt_epi8_mask(v, beforeA) & _mm512_cmplt_epi8_mask(v, afterZ);
+        v = _mm512_mask_sub_epi8(v, isLower, v, caseBit);
+        _mm512_mask_storeu_epi8(data + i, inRange, v);
+        i += 64;
+    }
+}
+
+// Reverse the bytes in every 16 byte lane, then the order of the 4 lanes
+TEXT_KERNELS_AVX512_TARGET
+static inline __m512i ReverseVectorAvx512 (__m512i v) {
+    const __m512i reverseBytes = _mm512_broadcast_i32x4(_mm_setr_epi8(
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+    v = _mm512_shuffle_epi8(v, reverseBytes);
+    return _mm512_shuffle_i64x2(v, v, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+TEXT_KERNELS_AVX512_TARGET
+static void ReverseAvx512 (char* data, size_t length) {
+    size_t front = 0;
+    size_t back = length;
+    while (back - front >= 128) {
+        __m512i head = _mm512_loadu_si512(data + front);
+        __m512i tail = _mm512_loadu_si512(data + back - 64);
+        _mm512_storeu_si512(data + front, ReverseVectorAvx512(tail));
+        _mm512_storeu_si512(data + back - 64, ReverseVectorAvx512(head));
+        front += 64;
+        back -= 64;
+    }
+    ReverseAvx2(data + front, back - front);
+}
+
+TEXT_KERNELS_AVX512_TARGET
+static void ShiftRightAvx512 (char* data, size_t count) {
+    while (count >= 64) {
+        __m512i v = _mm512_loadu_si512(data + count - 64);
+        _mm512_storeu_si512(data + count - 63, v);
+        count -= 64;
+    }
+    ShiftRightAvx2(data, count);
+}
+
+TEXT_KERNELS_AVX512_TARGET
+static void RotateRightAvx512 (char* data, size_t length) {
+    if (length < 2) {
+        return;
+    }
+    char lastCharacter = data[length - 1];
+    ShiftRightAvx512(data, length - 1);
+    data[0] = lastCharacter;
+}
+
+// Same idea as AVX2 but with 4 lanes: qword order 0 4 1 5 2 6 3 7 puts input
+// bytes 0..31 in the low halves of the lanes and 32..63 in the high halves
+TEXT_KERNELS_AVX512_TARGET
+static void ExpandAvx512 (const char* input, size_t length, char* output) {
+    const __m512i spaces = _mm512_set1_epi8(' ');
+    const __m512i qwordOrder = _mm512_setr_epi64(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+    for (; i + 64 < length; i += 64) {
+        __m512i v = _mm512_loadu_si512(input + i);
+        v = _mm512_permutexvar_epi64(qwordOrder, v);
+        _mm512_storeu_si512(output + 2 * i, _mm512_unpacklo_epi8(v, spaces));
+        _mm512_storeu_si512(output + 2 * i + 64, _mm512_unpackhi_epi8(v, spaces));
+    }
+    ExpandAvx2(input + i, length - i, output + 2 * i);
+}
+
+// The compare gives the 64 bit mask directly, the tail is a masked load
+TEXT_KERNELS_AVX512_TARGET
+static size_t FindNewlinesAvx512 (const char* data, size_t length, size_t* positions, size_t maxPositions) {
+    const __m512i newline = _mm512_set1_epi8('\n');
+    size_t found = 0;
+    for (size_t i=0; i<length; i += 64) {
+        size_t left = length - i;
+        __mmask64 inRange = left >= 64 ? ~(__mmask64)0 : (((__mmask64)1 << left) - 1);
+        __m512i v = _mm512_maskz_loadu_epi8(inRange, data + i);
+        uint64_t mask = _mm512_mask_cmpeq_epi8_mask(inRange, v, newline);
+        found = MaskToPositions(mask, i, positions, found, maxPositions);
+        if (found == maxPositions) {
+            return found;
+        }
+    }
+    return found;
+}
+
+static const text_kernels_t g_avx512Kernels = {
+    "avx512", UppercaseAvx512, ReverseAvx512, RotateRightAvx512, ExpandAvx512, FindNewlinesAvx512
+};
+
+#endif
+
+// ----- Picking the implementation -----
+
+// Picked once when the module is loaded, before any plugin thread runs
+static const text_kernels_t* g_bestKernels = &g_scalarKernels;
+
+const text_kernels_t* text_kernels_for (text_kernels_level_t level) {
+#ifdef TEXT_KERNELS_X86
+    // Needed before __builtin_cpu_supports when called from a constructor
+    __builtin_cpu_init();
+    switch (level) {
+        case TEXT_KERNELS_SCALAR:
+            return &g_scalarKernels;
+        case TEXT_KERNELS_SSE2:
+            return __builtin_cpu_supports("sse2") ? &g_sse2Kernels : NULL;
+        case TEXT_KERNELS_AVX2:
+            // The AVX2 versions finish their tail with the SSE2 ones
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse2") ? &g_avx2Kernels : NULL;
+        case TEXT_KERNELS_AVX512:
+            // And the AVX-512 ones with the AVX2 ones
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+                && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse2") ? &g_avx512Kernels : NULL;
+        default:
+            return NULL;
+    }
+#else
+    return level == TEXT_KERNELS_SCALAR ? &g_scalarKernels : NULL;
+#endif
+}
+
+__attribute__((constructor))
+static void PickTextKernels (void) {
+    for (int level=TEXT_KERNELS_LEVELS - 1; level>=TEXT_KERNELS_SCALAR; level--) {
+        const text_kernels_t* kernels = text_kernels_for((text_kernels_level_t)level);
+        if (kernels != NULL) {
+            g_bestKernels = kernels;
+            return;
+        }
+    }
+}
+
+const text_kernels_t* text_kernels (void) {
+    return g_bestKernels;
+}
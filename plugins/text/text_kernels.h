@@ -0,0 +1,52 @@
+#ifndef TEXT_KERNELS_H
+#define TEXT_KERNELS_H
+
+#include <stddef.h>
+
+/**
+ * The byte loops of the built-in plugins (uppercaser, flipper, rotator, expander)
+ * and of the input reader (splitting the input into lines)
+ * There is a scalar version of every kernel, and SSE2 / AVX2 / AVX-512 versions
+ * that do 16 / 32 / 64 bytes per step. The best one the CPU supports is picked
+ * once when the module is loaded (CPUID), all of them give exactly the same bytes.
+ */
+
+// Implementation levels, from slowest to fastest
+typedef enum {
+    TEXT_KERNELS_SCALAR = 0,
+    TEXT_KERNELS_SSE2,
+    TEXT_KERNELS_AVX2,
+    TEXT_KERNELS_AVX512,
+    TEXT_KERNELS_LEVELS
+} text_kernels_level_t;
+
+// One set of kernels
+typedef struct {
+ const char* name;
+ // Convert 'a'..'z' to 'A'..'Z' (same as toupper in the C locale), in place
+ void (*uppercase)(char* data, size_t length);
+ // Reverse the order of the bytes, in place
+ void (*reverse)(char* data, size_t length);
+ // Move every byte one position right, the last one wraps around to the front, in place
+ void (*rotate_right)(char* data, size_t length);
+ // Write the input with a space between every two bytes (2*length-1 bytes, nothing for length 0)
+ void (*expand)(const char* input, size_t length, char* output);
+ // Write the offsets of the '\n' bytes into positions, stops once maxPositions were found.
+ // Returns how many were written (when that is maxPositions there can be more after the last one)
+ size_t (*find_newlines)(const char* data, size_t length, size_t* positions, size_t maxPositions);
+} text_kernels_t;
+
+/**
+ * The fastest kernels this CPU supports, picked when the module was loaded
+ * @return The kernels (never NULL)
+ */
+const text_kernels_t* text_kernels(void);
+
+/**
+ * The kernels of one specific level (used by the tests to compare them)
+ * @param level Which implementation
+ * @return The kernels, NULL if the CPU (or the compiler) doesnt support that level
+ */
+const text_kernels_t* text_kernels_for(text_kernels_level_t level);
+
+#endif
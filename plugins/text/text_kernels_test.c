@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include "text_kernels.h"
+
+// Configuration
+#define MaxLength 700
+#define GuardSize 80
+#define GuardByte ((char)0x5A)
+
+// Lengths above MaxLength, to go through many vector steps
+static const size_t bigLengths[] = { 4095, 4096, 4097, 65537 };
+
+// Buffers with guard bytes on both sides, to catch writes outside of the message
+static char* inputBuffer;
+static char* expectedBuffer;
+static char* actualBuffer;
+
+// Random bytes, also the ones >= 0x80 and NUL
+void fillRandom (char* data, size_t length) {
+    for (size_t i=0; i<length; i++) {
+        data[i] = (char)(rand() & 0xFF);
+    }
+}
+
+// Fill the guards around [offset, offset + length) of a buffer
+void setGuards (char* buffer, size_t offset, size_t length) {
+    memset(buffer, GuardByte, GuardSize + offset);
+    memset(buffer + GuardSize + offset + length, GuardByte, GuardSize);
+}
+
+void checkGuards (const char* buffer, size_t offset, size_t length) {
+    for (size_t i=0; i<GuardSize + offset; i++) {
+        assert(buffer[i] == GuardByte);
+    }
+    for (size_t i=0; i<GuardSize; i++) {
+        assert(buffer[GuardSize + offset + length + i] == GuardByte);
+    }
+}
+
+// Runs one in place kernel against the scalar one, for one length at one offset
+void checkInPlace (void (*kernel)(char*, size_t), void (*scalar)(char*, size_t), size_t length, size_t offset) {
+    char* expected = expectedBuffer + GuardSize + offset;
+    char* actual = actualBuffer + GuardSize + offset;
+    fillRandom(expected, length);
+    memcpy(actual, expected, length);
+    setGuards(actualBuffer, offset, length);
+
+    scalar(expected, length);
+    kernel(actual, length);
+
+    assert(memcmp(expected, actual, length) == 0);
+    checkGuards(actualBuffer, offset, length);
+}
+
+void checkExpand (const text_kernels_t* kernels, const text_kernels_t* scalar, size_t length, size_t offset) {
+    char* input = inputBuffer + GuardSize + offset;
+    char* expected = expectedBuffer + GuardSize + offset;
+    char* actual = actualBuffer + GuardSize + offset;
+    size_t outputLength = length == 0 ? 0 : 2 * length - 1;
+    fillRandom(input, length);
+    setGuards(actualBuffer, offset, outputLength);
+
+    scalar->expand(input, length, expected);
+    kernels->expand(input, length, actual);
+
+    assert(memcmp(expected, actual, outputLength) == 0);
+    checkGuards(actualBuffer, offset, outputLength);
+}
+
+// Runs all the kernels of one level for one length, at a few alignments
+void checkLength (const text_kernels_t* kernels, const text_kernels_t* scalar, size_t length) {
+    for (size_t offset=0; offset<4; offset++) {
+        checkInPlace(kernels->uppercase, scalar->uppercase, length, offset);
+        checkInPlace(kernels->reverse, scalar->reverse, length, offset);
+        checkInPlace(kernels->rotate_right, scalar->rotate_right, length, offset);
+        checkExpand(kernels, scalar, length, offset);
+    }
+}
+
+// Test 1: The scalar kernels do what the plugins did before
+void testScalar () {
+    printf("Test 1: Scalar kernels: ");
+    const text_kernels_t* scalar = text_kernels_for(TEXT_KERNELS_SCALAR);
+    assert(scalar != NULL);
+
+    char text[64];
+    strcpy(text, "hello World 123 \xE9z");
+    scalar->uppercase(text, strlen(text));
+    for (size_t i=0; i<strlen(text); i++) {
+        // toupper in the C locale
+        const char* source = "hello World 123 \xE9z";
+        assert(text[i] == (char)toupper((unsigned char)source[i]));
+    }
+
+    strcpy(text, "abcde");
+    scalar->reverse(text, 5);
+    assert(strcmp(text, "edcba") == 0);
+
+    strcpy(text, "abcde");
+    scalar->rotate_right(text, 5);
+    assert(strcmp(text, "eabcd") == 0);
+
+    memset(text, 0, sizeof(text));
+    scalar->expand("abc", 3, text);
+    assert(strcmp(text, "a b c") == 0);
+
+    printf("pass\n");
+}
+
+// Test 2: Every SIMD level the CPU supports gives exactly the scalar bytes
+void testLevels () {
+    printf("Test 2: SIMD kernels match scalar:\n");
+    const text_kernels_t* scalar = text_kernels_for(TEXT_KERNELS_SCALAR);
+
+    for (int level=TEXT_KERNELS_SSE2; level<TEXT_KERNELS_LEVELS; level++) {
+        const text_kernels_t* kernels = text_kernels_for((text_kernels_level_t)level);
+        if (kernels == NULL) {
+            printf("  level %d: not supported by this CPU, skipped\n", level);
+            continue;
+        }
+        for (size_t length=0; length<=MaxLength; length++) {
+            checkLength(kernels, scalar, length);
+        }
+        for (size_t i=0; i<sizeof(bigLengths) / sizeof(bigLengths[0]); i++) {
+            checkLength(kernels, scalar, bigLengths[i]);
+        }
+        printf("  %s: pass\n", kernels->name);
+    }
+}
+
+// Test 3: The picked kernels are one of the supported levels
+void testPicked () {
+    printf("Test 3: Picked kernels: ");
+    const text_kernels_t* best = text_kernels();
+    assert(best != NULL);
+
+    int found = 0;
+    for (int level=TEXT_KERNELS_SCALAR; level<TEXT_KERNELS_LEVELS; level++) {
+        if (text_kernels_for((text_kernels_level_t)level) == best) {
+            found = 1;
+            // Nothing faster is supported
+            for (int higher=level + 1; higher<TEXT_KERNELS_LEVELS; higher++) {
+                assert(text_kernels_for((text_kernels_level_t)higher) == NULL);
+            }
+        }
+    }
+    assert(found);
+
+    printf("%s, pass\n", best->name);
+}
+
+// Runs the newline scan of one level against the scalar one, with every
+// limit on the positions from 0 to past the number of newlines
+void checkNewlines (const text_kernels_t* kernels, const text_kernels_t* scalar, size_t length, int everyNth) {
+    char* input = inputBuffer + GuardSize;
+    fillRandom(input, length);
+    for (size_t i=0; i<length; i++) {
+        if (rand() % everyNth == 0) {
+            input[i] = '\n';
+        }
+    }
+
+    size_t newlines = scalar->find_newlines(input, length, (size_t*)expectedBuffer, length);
+    for (size_t limit=0; limit<=newlines + 1; limit++) {
+        size_t found = kernels->find_newlines(input, length, (size_t*)actualBuffer, limit);
+        assert(found == (limit < newlines ? limit : newlines));
+        assert(memcmp(expectedBuffer, actualBuffer, found * sizeof(size_t)) == 0);
+    }
+}
+
+// Test 4: The newline scan of every level finds the same newlines as the scalar one
+void testNewlines () {
+    printf("Test 4: Newline scan:\n");
+    const text_kernels_t* scalar = text_kernels_for(TEXT_KERNELS_SCALAR);
+
+    // The scalar scan itself
+    size_t positions[4];
+    assert(scalar->find_newlines("a\nbc\n\nd", 7, positions, 4) == 3);
+    assert(positions[0] == 1 && positions[1] == 4 && positions[2] == 5);
+    assert(scalar->find_newlines("a\nbc\n\nd", 7, positions, 2) == 2);
+
+    for (int level=TEXT_KERNELS_SSE2; level<TEXT_KERNELS_LEVELS; level++) {
+        const text_kernels_t* kernels = text_kernels_for((text_kernels_level_t)level);
+        if (kernels == NULL) {
+            printf("  level %d: not supported by this CPU, skipped\n", level);
+            continue;
+        }
+        for (size_t length=0; length<=200; length++) {
+            checkNewlines(kernels, scalar, length, 1);
+            checkNewlines(kernels, scalar, length, 7);
+            checkNewlines(kernels, scalar, length, 300);
+        }
+        checkNewlines(kernels, scalar, 4097, 50);
+        printf("  %s: pass\n", kernels->name);
+    }
+}
+
+int main () {
+    printf("Text Kernels Unit Test\n\n");
+
+    // Big enough for the expanded output of the biggest length, plus guards and offset
+    size_t bufferSize = 2 * 65537 + 2 * GuardSize + 8;
+    inputBuffer = malloc(bufferSize);
+    expectedBuffer = malloc(bufferSize);
+    actualBuffer = malloc(bufferSize);
+    assert(inputBuffer != NULL && expectedBuffer != NULL && actualBuffer != NULL);
+
+    testScalar();
+    testLevels();
+    testPicked();
+    testNewlines();
+
+    free(inputBuffer);
+    free(expectedBuffer);
+    free(actualBuffer);
+
+    printf("\nAll the tests passed\n");
+    return 0;
+}
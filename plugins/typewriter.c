@@ -2,52 +2,233 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
 #include <unistd.h>
+#include <sys/timerfd.h>
 
 // From the assignment, this plugin should:
 // "Simulates a typewriter effect by printing each character with a 100ms
 // delay (you can use the usleep function). Notice, this can cause a “traffic jam”."
 
-// Implemntatoin of own transformation logic:
-const char* plugin_transform (const char* input) {
-    
-    // Safety check for null input to avoid seg faults
-    if (input == NULL) { return NULL; }
-    
+// The traffic jam is gone: the plugin passes every string on right away and
+// only hands a copy to its printer thread, which types the strings one after
+// the other at the same pace, driven by a timerfd instead of usleep.
+// A printing plugin after us gets the string before it was typed, so with
+// others that print in the chain we type in lockstep with them through the
+// print order: they wait until we typed a line, we wait until they printed
+// the line before, and the output is the same as if we typed before passing on
+
+// Time between two characters
+#define TypewriterDelayNs 100000000L
+
+// A string waiting to be typed
+typedef struct TypewriterLine {
+    struct TypewriterLine* next;
+    size_t length;
+    char data[];
+} TypewriterLine;
+
+// Everything an instance has, so one loaded copy can type for several stages of the chain
+PLUGIN_INSTANCE_STATE
+PLUGIN_ORDERED_OUTPUT
+
+// Strings waiting for the printer thread, oldest first
+typedef struct {
+    pthread_mutex_t linesLock;
+    TypewriterLine* linesHead;
+    TypewriterLine* linesTail;
+    int stopping; // No more strings will come, stop once all are typed
+    monitor_t linesMonitor; // Signaled when a string is added (or stopping is set)
+    int typing; // The printer took a string and didnt finish typing it yet
+    monitor_t typedMonitor; // Signaled after every typed string
+    pthread_t printerThread;
+    int printerRunning;
+    int timer;
+    print_order_t* printOrder; // NULL when we are the only one in the chain that prints
+    int printPosition;
+} TypewriterState;
+
+// Wait until the timer fires (the next character is due)
+static void WaitForTick (TypewriterState* state) {
+    uint64_t expirations;
+    while (read(state->timer, &expirations, sizeof(expirations)) < 0 && errno == EINTR) {
+    }
+}
+
+// Type one string: the prefix and the first character right away, then one
+// more character every tick, and the newline one tick after the last one
+static void TypeLine (TypewriterState* state, const TypewriterLine* line) {
+
+    // Start the ticks from now, so they dont pile up while we had nothing to type
+    struct itimerspec ticks = { { 0, TypewriterDelayNs }, { 0, TypewriterDelayNs } };
+    timerfd_settime(state->timer, 0, &ticks, NULL);
+
     // Typewriter should print this prefix
     printf("[typewriter] ");
     fflush(stdout);
 
-    // Save the length of the input string for the for loop
-    size_t originalLength = strlen(input);
-
     // Prints each char from the string with 100ms delay
-    for (size_t i=0; i<originalLength; i++) {
-        printf("%c", input[i]);
+    for (size_t i=0; i<line->length; i++) {
+        putchar(line->data[i]);
         fflush(stdout);
-        
-        // 100ms delay (100000ms)
-        usleep(100000);
+        WaitForTick(state);
     }
 
     printf("\n");
     fflush(stdout);
-    
-    // Now we need to pass ad duplication of the original string to the next plugin
-    // So we duplicate it using stduup
-    // strdup allocates memory (behind the scenes) and duplicates the strin
-    char* newString = strdup(input);
+}
+
+static void* PrinterThread (void* arg) {
+    TypewriterState* state = (TypewriterState*)arg;
+
+    while (1) {
+        pthread_mutex_lock(&state->linesLock);
+        TypewriterLine* line = state->linesHead;
+        if (line != NULL) {
+            state->linesHead = line->next;
+            if (state->linesHead == NULL) {
+                state->linesTail = NULL;
+            }
+            state->typing = 1;
+        }
+        int stopping = state->stopping;
+
+        // Nothing to type: reset before unlocking, so an add after it is not missed
+        if (line == NULL && !stopping) {
+            monitor_reset(&state->linesMonitor);
+        }
+        pthread_mutex_unlock(&state->linesLock);
+
+        if (line != NULL) {
+            if (state->printOrder != NULL) {
+                print_order_begin(state->printOrder, state->printPosition, 1);
+            }
+            TypeLine(state, line);
+            if (state->printOrder != NULL) {
+                print_order_end(state->printOrder, state->printPosition);
+            }
+            free(line);
+
+            pthread_mutex_lock(&state->linesLock);
+            state->typing = 0;
+            pthread_mutex_unlock(&state->linesLock);
+            monitor_signal(&state->typedMonitor);
+        }
+        else if (stopping) {
+            break;
+        }
+        else {
+            monitor_wait(&state->linesMonitor);
+        }
+    }
+    return NULL;
+}
+
+// Wait until everything is typed, stop the printer and free the state
+static void DestroyTypewriter (TypewriterState* state) {
+    if (state->printerRunning) {
+        pthread_mutex_lock(&state->linesLock);
+        state->stopping = 1;
+        pthread_mutex_unlock(&state->linesLock);
+        monitor_signal(&state->linesMonitor);
+        pthread_join(state->printerThread, NULL);
+        state->printerRunning = 0;
+    }
 
-    // Malloc will return null if we are out of memory
-    // This way we check for failures of memory allocation
-    if (newString == NULL) {
-        return NULL;
+    if (state->timer >= 0) {
+        close(state->timer);
     }
-    
-    return newString;
+    monitor_destroy(&state->linesMonitor);
+    monitor_destroy(&state->typedMonitor);
+    pthread_mutex_destroy(&state->linesLock);
+    free(state);
+}
+
+// Implemntatoin of own transformation logic:
+// Nothing is changed, the message only gets read and passes on as it is
+// (so a read only view of the input file is never copied here)
+const char* plugin_transform (const message_t* input, message_t* output) {
+
+    // Safety check for null input to avoid seg faults
+    if (input == NULL) { return "Error, got a NULL message"; }
+
+    // The printer types it later, so it needs its own copy
+    TypewriterLine* line = malloc(sizeof(TypewriterLine) + input->length);
+    if (line == NULL) {
+        return "Error, failed to allocate the line for the typewriter";
+    }
+    line->next = NULL;
+    line->length = input->length;
+    memcpy(line->data, input->data, input->length);
+
+    TypewriterState* state = plugin_state();
+    pthread_mutex_lock(&state->linesLock);
+    if (state->linesTail != NULL) {
+        state->linesTail->next = line;
+    }
+    else {
+        state->linesHead = line;
+    }
+    state->linesTail = line;
+    pthread_mutex_unlock(&state->linesLock);
+    monitor_signal(&state->linesMonitor);
+
+    // The string goes on to the next plugin unchanged, without a copy
+    *output = *input;
+    return NULL;
+}
+
+// After the last string: wait until everything is typed and stop the printer
+const char* plugin_finish (void) {
+    DestroyTypewriter(plugin_state());
+    return NULL;
+}
+
+// A flush or barrier came: wait until every string before it was typed
+// (like plugin_finish, but the printer keeps running)
+const char* plugin_flush (void) {
+    TypewriterState* state = plugin_state();
+    pthread_mutex_lock(&state->linesLock);
+    while (state->linesHead != NULL || state->typing) {
+
+        // Reset before unlocking, so the signal of the string being typed is not missed
+        monitor_reset(&state->typedMonitor);
+        pthread_mutex_unlock(&state->linesLock);
+        monitor_wait(&state->typedMonitor);
+        pthread_mutex_lock(&state->linesLock);
+    }
+    pthread_mutex_unlock(&state->linesLock);
+    return NULL;
 }
 
 // Required init function
 const char* plugin_init(int queue_size) {
-    return common_plugin_init (plugin_transform, "typewriter", queue_size);
-}
\ No newline at end of file
+    TypewriterState* state = calloc(1, sizeof(TypewriterState));
+    if (state == NULL) {
+        return "Error, failed to allocate the typewriter";
+    }
+    pthread_mutex_init(&state->linesLock, NULL);
+    monitor_init(&state->linesMonitor);
+    monitor_init(&state->typedMonitor);
+    state->printOrder = plugin_print_order(&state->printPosition);
+    state->timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (state->timer < 0) {
+        DestroyTypewriter(state);
+        return "Error, failed to create the typewriter timer";
+    }
+    if (pthread_create(&state->printerThread, NULL, PrinterThread, state) != 0) {
+        DestroyTypewriter(state);
+        return "Error, failed to create the typewriter thread";
+    }
+    state->printerRunning = 1;
+
+    plugin_transforms_t transforms = {
+        .transform = plugin_transform, .finish = plugin_finish, .flush = plugin_flush, .state = state
+    };
+    const char* error = common_plugin_init_transforms (&transforms, "typewriter", queue_size);
+    if (error != NULL) {
+        DestroyTypewriter(state);
+    }
+    return error;
+}
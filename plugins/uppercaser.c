@@ -1,37 +1,29 @@
 #include "plugin_common.h"
 #include <string.h>
 #include <stdlib.h>
-#include <ctype.h>
+#include "text/text_kernels.h"
 
 // From the assignment, this plugin should:
 // "Converts all alphabetic characters in the string to uppercase."
 
 // Implemntatoin of own transformation logic:
-const char* plugin_transform (const char* input) {
+// The length doesnt change, so we convert the message in place (no allocation at all)
+const char* plugin_transform_in_place (message_t* message) {
 
     // Safety check for null input to avoid seg faults
-    if (input == NULL) { return NULL; }
+    if (message == NULL) { return "Error, got a NULL message"; }
 
-    // Duplicate the new string
-    // strdup allocates memory (behind the scenes) and duplicates the string
-    char* newString = strdup(input);
-
-    // Malloc will return null if we are out of memory
-    // This way we check for failures of memory allocation
-    if (newString == NULL) { return NULL; }
-    
-    // Save the length of the input string for the for loop
-    size_t originalLength = strlen(input);
-
-    // Convert the duplicated string to uppercase
-    for (size_t i=0; i<originalLength; i++) {
-        newString[i] = toupper(newString[i]);
-    }
+    // Convert the string to uppercase (SIMD when the CPU has it)
+    text_kernels()->uppercase(message->data, message->length);
     
-    return newString;
+    return NULL;
 }
 
+// Prints nothing and keeps no state, so it can run on another plugin's thread
+PLUGIN_PURE_TRANSFORM
+
 // Required init function
 const char* plugin_init(int queue_size) {
-    return common_plugin_init (plugin_transform, "uppercaser", queue_size);
-}
\ No newline at end of file
+    plugin_transforms_t transforms = { .transform_in_place = plugin_transform_in_place };
+    return common_plugin_init_transforms (&transforms, "uppercaser", queue_size);
+}
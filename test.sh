@@ -23,11 +23,49 @@ print_error()
     echo -e "${RED}[ERROR]${NC} $1"
 }
 
-usageMessage="Usage: ./analyzer <queue_size> <plugin1> <plugin2> ... <pluginN>
+usageMessage="Usage: ./analyzer \[--no-fuse\] \[--pool\[=N\]\] \[--input FILE\] \[--no-end-line\] \[--flush=SPEC\] \[--barrier-every=N\] \[--stats\[=FMT\]\] \[--stats-file=PATH\] \[--adaptive-queues\[=N\]\] \[--cpus=auto|LIST\] \[--shards=K\] \[--shard-key=SPEC\] <queue_size> <plugin1> <plugin2> ... <pluginN>
 
 Arguments:
+  --no-fuse     Give every plugin its own thread (by default consecutive
+                pure plugins run together on one thread)
+  --pool\[=N\]    Run the plugins as tasks on N worker threads (default: one
+                per CPU) instead of a thread per plugin
+  --input FILE  Read the lines from FILE (mapped into memory, the lines are
+                not copied) instead of stdin. The end of the file ends the input
+  --no-end-line A line that reads <END> is a line like any other, only the end
+                of the input ends it
+  --flush=SPEC  When logger writes its buffered output: a comma separated list
+                of bytes:N, lines:N and ms:N (0 turns one off). The default is
+                bytes:65536,ms:10, lines:1 writes every line right away.
+                SIGUSR2 writes out everything up to the last line read
+  --barrier-every=N
+                Send a barrier after every N lines: like a flush, but a plugin
+                after a } passes it on only once it came from every branch
+  --stats\[=FMT\] Print the counters of every plugin at shutdown (they are always
+                printed on SIGUSR1). FMT is table (default) or prom (Prometheus)
+  --stats-file=PATH
+                Write the counters to PATH instead of stderr
+  --adaptive-queues\[=N\]
+                Let every queue grow while it keeps filling up and shrink back
+                when it stays mostly empty, all of them together hold at most
+                N items (default 65536)
+  --cpus=auto|LIST
+                Pin the input reader and then every plugin thread, in chain
+                order, to the CPUs in LIST (like 0-3,8) or picked one NUMA node
+                after the other (auto). With --pool the workers use those CPUs
+  --shards=K    Run K copies of the chain, all but the last plugin, side by side
+                and every line in the copy its key hashes to (the last plugin
+                gets the lines of all of them). Lines with the same key keep
+                their order
+  --shard-key=SPEC
+                The key of a line: line (default), prefix:N (the first N bytes)
+                or field:N (the Nth field, split at spaces or at C with field:N:C)
   queue_size    Maximum number of items in each plugin's queue
   plugin1..N    Names of plugins to load (without .so extension)
+                add @N to run N threads of a pure plugin (e.g. expander@4)
+                add :N to give the plugin a queue of size N (e.g. logger:256)
+                { A , B } sends every line to both branches A and B, the plugin
+                after the } gets the lines of all of them (e.g. { rotator , flipper } logger)
 
 Available plugins:
   logger        - Logs all strings that pass through
@@ -391,6 +429,220 @@ runStressTest "Queue size 1 stress (forces tight synchronization)" \
 Pipeline shutdown complete" \
     "10"
 
+# Test 26: Same pipeline with every plugin on its own thread (no stage fusion)
+runTest "Complex pipeline without fusion" \
+    "hello\n<END>" \
+    "./output/analyzer --no-fuse 10 expander uppercaser rotator logger" \
+    "\[logger\] OH E L L 
+Pipeline shutdown complete" \
+    "true"
+
+# Test 27: Replicated stages give the lines back in the input order
+runTest "Replicated stages keep the order" \
+    "one\ntwo\nthree\nfour\nfive\nsix\n<END>" \
+    "./output/analyzer 2 expander@3 uppercaser flipper@2 logger" \
+    "\[logger\] E N O
+\[logger\] O W T
+\[logger\] E E R H T
+\[logger\] R U O F
+\[logger\] E V I F
+\[logger\] X I S
+Pipeline shutdown complete" \
+    "true"
+
+# Test 28: Only pure plugins can have replicas
+runTest "Replicas of a plugin that prints" \
+    "hello\n<END>" \
+    "./output/analyzer 5 logger@2" \
+    "Error, logger plugin cant run replicas (only pure plugins can)$usageMessage" \
+    "false"
+
+# Test 29: The same pipeline with the plugins as tasks on a pool of workers
+runTest "Pool scheduler" \
+    "one\ntwo\nthree\n<END>" \
+    "./output/analyzer --pool=3 2 expander uppercaser flipper logger" \
+    "\[logger\] E N O
+\[logger\] O W T
+\[logger\] E E R H T
+Pipeline shutdown complete" \
+    "true"
+
+# Test 30: Lines longer than 1024 characters are not split
+longLine=$(printf 'ab%.0s' {1..1500})
+runTest "Long lines" \
+    "$longLine\nshort\n<END>" \
+    "./output/analyzer 2 uppercaser logger" \
+    "\[logger\] ${longLine^^}
+\[logger\] SHORT
+Pipeline shutdown complete" \
+    "true"
+
+# Test 31: Input from a mapped file, the end of the file ends the input
+inputFile=$(mktemp)
+printf 'hello\nworld' > "$inputFile"
+runTest "Input file" \
+    "" \
+    "./output/analyzer --input $inputFile 2 uppercaser flipper logger" \
+    "\[logger\] OLLEH
+\[logger\] DLROW
+Pipeline shutdown complete" \
+    "true"
+rm -f "$inputFile"
+
+# Test 32: The per stage counters are printed to stderr at shutdown
+runTest "Stats at shutdown" \
+    "hello\nworld\n<END>" \
+    "./output/analyzer --stats 5 uppercaser logger" \
+    "Pipeline stats (shutdown):*uppercaser*own*2*2*10*10*logger*own*2*2*10*10*\[logger\] HELLO
+\[logger\] WORLD
+Pipeline shutdown complete" \
+    "true"
+
+# Test 33: name:N gives a plugin its own queue size (the capacity column of the stats)
+runTest "Per plugin queue sizes" \
+    "hello\nworld\n<END>" \
+    "./output/analyzer --no-fuse --stats 5 uppercaser:4 flipper logger:2" \
+    "Pipeline stats (shutdown):*uppercaser*own*2*2*10*10*0*4*flipper*own*2*2*10*10*0*5*logger*own*2*2*10*10*0*2*\[logger\] OLLEH
+\[logger\] DLROW
+Pipeline shutdown complete" \
+    "true"
+
+# Test 34: Adaptive queues change their size, but not the output
+runTest "Adaptive queues" \
+    "hello\nworld\nagain\n<END>" \
+    "./output/analyzer --adaptive-queues=64 1 uppercaser expander:2 flipper logger" \
+    "\[logger\] O L L E H
+\[logger\] D L R O W
+\[logger\] N I A G A
+Pipeline shutdown complete" \
+    "true"
+
+# Test 35: Pinned threads give the same output
+runTest "Automatic CPU placement" \
+    "hello\nworld\n<END>" \
+    "./output/analyzer --cpus=auto --no-fuse 2 uppercaser@2 flipper logger" \
+    "\[logger\] OLLEH
+\[logger\] DLROW
+Pipeline shutdown complete" \
+    "true"
+
+# Test 36: A CPU list that cant be parsed
+runTest "Invalid CPU list" \
+    "hello\n<END>" \
+    "./output/analyzer --cpus=1-x 2 logger" \
+    "Error, invalid CPU list 1-x" \
+    "false"
+
+# Test 37: More copies of one plugin than dlmopen has namespaces, they are all instances of one load
+runTest "Long chain of one plugin" \
+    "hello\nworld\n<END>" \
+    "./output/analyzer 2 rotator rotator rotator rotator rotator rotator rotator rotator rotator rotator rotator rotator rotator rotator rotator rotator rotator rotator rotator rotator uppercaser logger" \
+    "\[logger\] HELLO
+\[logger\] WORLD
+Pipeline shutdown complete" \
+    "true"
+
+# Test 38: A fan-out, the lines go to both branches (only one of them logs)
+runTest "Fan-out to two branches" \
+    "hello\nworld\n<END>" \
+    "./output/analyzer 2 uppercaser { flipper logger , rotator }" \
+    "\[logger\] OLLEH
+\[logger\] DLROW
+Pipeline shutdown complete" \
+    "true"
+
+# Test 39: A fan-in, logger gets the lines of both branches (in any order) and ends after both
+runTest "Fan-in of two branches" \
+    "hello\nworld\n<END>" \
+    "./output/analyzer --stats 2 { uppercaser , flipper } logger" \
+    "*logger*own*4*4*20*20*\[logger\] *\[logger\] *\[logger\] *\[logger\] *
+Pipeline shutdown complete" \
+    "true"
+
+# Test 40: A { without its }
+runTest "Unclosed branch" \
+    "hello\n<END>" \
+    "./output/analyzer 2 uppercaser { flipper , rotator logger" \
+    "Error, a { in the plugin list has no } $usageMessage" \
+    "false"
+
+# Test 41: Lines with the same key go through the same shard, so they keep their order
+runTest "Sharded chain keeps the order of a key" \
+    "key one\nkey two\nkey three\n<END>" \
+    "./output/analyzer --shards=4 --shard-key=field:1 2 uppercaser flipper logger" \
+    "\[logger\] ENO YEK
+\[logger\] OWT YEK
+\[logger\] EERHT YEK
+Pipeline shutdown complete" \
+    "true"
+
+# Test 42: Nothing to shard, the only plugin is the one that merges the shards
+runTest "Sharding a single plugin" \
+    "hello\n<END>" \
+    "./output/analyzer --shards=2 2 logger" \
+    "Error, --shards needs at least two plugins (the last one merges the shards) $usageMessage" \
+    "false"
+
+# Test 43: The end of the stream is a control message, a line that only turns into <END> is still a line
+runTest "A line that becomes <END>" \
+    "hello\n>DNE<\nworld\n<END>" \
+    "./output/analyzer 2 flipper logger" \
+    "\[logger\] olleh
+\[logger\] <END>
+\[logger\] dlrow
+Pipeline shutdown complete" \
+    "true"
+
+# Test 44: With --no-end-line <END> in the input is a line too, the end of the input ends it
+runTest "End of input without <END>" \
+    "hello\n<END>\nworld" \
+    "./output/analyzer --no-end-line 2 uppercaser logger" \
+    "\[logger\] HELLO
+\[logger\] <END>
+\[logger\] WORLD
+Pipeline shutdown complete" \
+    "true"
+
+# Test 45: Many shards of a plugin with state, every one of them is an instance of one load
+# (the line and its uppercased copy come from two loggers, in either order)
+runTest "Shards of a plugin with state" \
+    "hello\n<END>" \
+    "./output/analyzer --shards=16 2 logger uppercaser logger" \
+    "\[logger\] [hH][eE][lL][lL][oO]
+\[logger\] [hH][eE][lL][lL][oO]
+Pipeline shutdown complete" \
+    "true"
+
+# Test 46: typewriter passes a line on before typing it, logger still prints it after it was typed
+runTest "Typewriter + logger keep the print order" \
+    "hello\nab\n<END>" \
+    "./output/analyzer 10 typewriter logger" \
+    "\[typewriter\] hello
+\[logger\] hello
+\[typewriter\] ab
+\[logger\] ab
+Pipeline shutdown complete" \
+    "true" \
+    "30"
+
+# Test 47: logger's line is written out before typewriter after it types the same line
+runTest "Logger + typewriter keep the print order" \
+    "hello\n<END>" \
+    "./output/analyzer 10 logger typewriter" \
+    "\[logger\] hello
+\[typewriter\] hello
+Pipeline shutdown complete" \
+    "true" \
+    "30"
+
+# Test 48: Barriers through a fan-in, logger gets one for every two lines once both branches sent it
+runTest "Barriers merged at a fan-in" \
+    "hello\nworld\nagain\n<END>" \
+    "./output/analyzer --barrier-every=2 --flush=bytes:0,ms:0 --stats 2 { uppercaser , flipper } logger" \
+    "*logger*own*6*6*30*30*\[logger\] *\[logger\] *\[logger\] *\[logger\] *\[logger\] *\[logger\] *
+Pipeline shutdown complete" \
+    "true"
+
 print_status "Test Breakdown:"
 print_status "Total tests run: $NumOfTotalTests"
 print_status "Tests passed: $NumOfPassedTests"